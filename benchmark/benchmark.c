@@ -12,9 +12,10 @@
 #include <sddf/serial/queue.h>
 #include <sddf/util/fence.h>
 #include <sddf/util/util.h>
+#include <sddf/util/string.h>
 #include <sddf/util/printf.h>
 #include <serial_config.h>
-#include <ethernet_config.h>
+#include <benchmark_config.h>
 
 #define LOG_BUFFER_CAP 7
 
@@ -24,14 +25,8 @@
 #define INIT 3
 
 #define PD_TOTAL        0
-#define PD_ETH_ID       1
-#define PD_VIRT_RX_ID    2
-#define PD_VIRT_TX_ID    3
-#define PD_COPY_ID      4
-#define PD_COPY1_ID     5
-#define PD_LWIP_ID      6
-#define PD_LWIP1_ID     7
-#define PD_TIMER_ID     8
+
+#define BENCHMARK_NUM_PDS ARRAY_SIZE(benchmark_pds)
 
 uintptr_t uart_base;
 uintptr_t cyclecounters_vaddr;
@@ -49,6 +44,34 @@ serial_queue_handle_t serial_tx_queue_handle;
 benchmark_track_kernel_entry_t *log_buffer;
 #endif
 
+#if BENCHMARK_NET_STATS
+/* Network stats region, and a snapshot of it taken when the benchmark starts */
+net_stats_t *net_stats;
+net_stats_t net_stats_start[NET_STATS_NUM_SLOTS];
+#endif
+
+#if BENCHMARK_NET_TRACE
+/* Network trace region, and a snapshot of the histograms of each client taken when the benchmark starts */
+uintptr_t net_trace;
+net_trace_hist_t net_trace_start[NUM_NETWORK_CLIENTS][NET_TRACE_NUM_HISTS];
+/* Histogram of the benchmark period, merged across clients */
+net_trace_hist_t net_trace_delta;
+
+static const char *net_trace_hist_names[NET_TRACE_NUM_HISTS] = {
+    "driver_to_virt_rx",
+    "virt_rx_to_copy",
+    "copy_to_client",
+    "total",
+};
+#endif
+
+typedef struct benchmark_util {
+    uint64_t total;
+    uint64_t number_schedules;
+    uint64_t kernel;
+    uint64_t entries;
+} benchmark_util_t;
+
 char *counter_names[] = {
     "L1 i-cache misses",
     "L1 d-cache misses",
@@ -58,6 +81,9 @@ char *counter_names[] = {
     "Branch mispredictions",
 };
 
+/* Index of the L1 d-cache miss counter in benchmarking_events */
+#define PMU_L1D_MISS 1
+
 event_id_t benchmarking_events[] = {
     SEL4BENCH_EVENT_CACHE_L1I_MISS,
     SEL4BENCH_EVENT_CACHE_L1D_MISS,
@@ -67,93 +93,165 @@ event_id_t benchmarking_events[] = {
     SEL4BENCH_EVENT_BRANCH_MISPREDICT,
 };
 
-static void print_pdid_name(uint64_t pd_id)
+static const char *pd_name(uint64_t pd_id)
 {
-    switch (pd_id) {
-    case PD_ETH_ID:
-        sddf_printf(NET_DRIVER_NAME);
-        break;
-    case PD_VIRT_RX_ID:
-        sddf_printf(NET_VIRT_RX_NAME);
-        break;
-    case PD_VIRT_TX_ID:
-        sddf_printf(NET_VIRT_TX_NAME);
-        break;
-    case PD_COPY_ID:
-        sddf_printf(NET_COPY0_NAME);
-        break;
-    case PD_COPY1_ID:
-        sddf_printf(NET_COPY1_NAME);
-        break;
-    case PD_LWIP_ID:
-        sddf_printf(NET_CLI0_NAME);
-        break;
-    case PD_LWIP1_ID:
-        sddf_printf(NET_CLI1_NAME);
-        break;
-    case PD_TIMER_ID:
-        sddf_printf(NET_TIMER_NAME);
-        break;
-    default:
-        sddf_printf("unknown");
-        break;
+    if (pd_id == PD_TOTAL) {
+        return "total";
     }
+    for (int i = 0; i < BENCHMARK_NUM_PDS; i++) {
+        if (benchmark_pds[i].id == pd_id) {
+            return benchmark_pds[i].name;
+        }
+    }
+    return "unknown";
 }
 
 #ifdef CONFIG_BENCHMARK_TRACK_UTILISATION
 static void microkit_benchmark_start(void)
 {
     seL4_BenchmarkResetThreadUtilisation(TCB_CAP);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_ETH_ID);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_VIRT_RX_ID);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_VIRT_TX_ID);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_COPY_ID);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_COPY1_ID);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_LWIP_ID);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_LWIP1_ID);
-    seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + PD_TIMER_ID);
+    for (int i = 0; i < BENCHMARK_NUM_PDS; i++) {
+        seL4_BenchmarkResetThreadUtilisation(BASE_TCB_CAP + benchmark_pds[i].id);
+    }
     seL4_BenchmarkResetLog();
 }
 
-static void microkit_benchmark_stop(uint64_t *total, uint64_t *number_schedules, uint64_t *kernel, uint64_t *entries)
+static void microkit_benchmark_stop(benchmark_util_t *util)
 {
     seL4_BenchmarkFinalizeLog();
     seL4_BenchmarkGetThreadUtilisation(TCB_CAP);
     uint64_t *buffer = (uint64_t *)&seL4_GetIPCBuffer()->msg[0];
 
-    *total = buffer[BENCHMARK_TOTAL_UTILISATION];
-    *number_schedules = buffer[BENCHMARK_TOTAL_NUMBER_SCHEDULES];
-    *kernel = buffer[BENCHMARK_TOTAL_KERNEL_UTILISATION];
-    *entries = buffer[BENCHMARK_TOTAL_NUMBER_KERNEL_ENTRIES];
+    util->total = buffer[BENCHMARK_TOTAL_UTILISATION];
+    util->number_schedules = buffer[BENCHMARK_TOTAL_NUMBER_SCHEDULES];
+    util->kernel = buffer[BENCHMARK_TOTAL_KERNEL_UTILISATION];
+    util->entries = buffer[BENCHMARK_TOTAL_NUMBER_KERNEL_ENTRIES];
 }
 
-static void microkit_benchmark_stop_tcb(uint64_t pd_id, uint64_t *total, uint64_t *number_schedules, uint64_t *kernel,
-                                        uint64_t *entries)
+static void microkit_benchmark_stop_tcb(uint64_t pd_id, benchmark_util_t *util)
 {
     seL4_BenchmarkGetThreadUtilisation(BASE_TCB_CAP + pd_id);
     uint64_t *buffer = (uint64_t *)&seL4_GetIPCBuffer()->msg[0];
 
-    *total = buffer[BENCHMARK_TCB_UTILISATION];
-    *number_schedules = buffer[BENCHMARK_TCB_NUMBER_SCHEDULES];
-    *kernel = buffer[BENCHMARK_TCB_KERNEL_UTILISATION];
-    *entries = buffer[BENCHMARK_TCB_NUMBER_KERNEL_ENTRIES];
+    util->total = buffer[BENCHMARK_TCB_UTILISATION];
+    util->number_schedules = buffer[BENCHMARK_TCB_NUMBER_SCHEDULES];
+    util->kernel = buffer[BENCHMARK_TCB_KERNEL_UTILISATION];
+    util->entries = buffer[BENCHMARK_TCB_NUMBER_KERNEL_ENTRIES];
+}
+#endif
+
+/* Print a ratio as a percentage with two decimal places */
+static void print_percentage(const char *key, uint64_t num, uint64_t denom)
+{
+    uint64_t hundredths = denom ? (num * 10000) / denom : 0;
+    sddf_printf(",\"%s\":%lu.%02lu", key, hundredths / 100, hundredths % 100);
+}
+
+#if BENCHMARK_NET_STATS
+/* Packets that passed through the virtualisers during the benchmark */
+static uint64_t net_packets(void)
+{
+    return net_stats[NET_STATS_VIRT_RX].packets - net_stats_start[NET_STATS_VIRT_RX].packets
+           + net_stats[NET_STATS_VIRT_TX].packets - net_stats_start[NET_STATS_VIRT_TX].packets;
+}
+
+static void print_net_stats(net_stats_t *start, net_stats_t *end)
+{
+    sddf_printf(",\"packets\":%lu,\"bytes\":%lu", end->packets - start->packets, end->bytes - start->bytes);
+    sddf_printf(",\"drop_bad_offset\":%u,\"drop_no_match\":%u,\"drop_no_buffer\":%u,\"drop_too_large\":%u",
+                end->drops[NET_STATS_DROP_BAD_OFFSET] - start->drops[NET_STATS_DROP_BAD_OFFSET],
+                end->drops[NET_STATS_DROP_NO_MATCH] - start->drops[NET_STATS_DROP_NO_MATCH],
+                end->drops[NET_STATS_DROP_NO_BUFFER] - start->drops[NET_STATS_DROP_NO_BUFFER],
+                end->drops[NET_STATS_DROP_TOO_LARGE] - start->drops[NET_STATS_DROP_TOO_LARGE]);
+    sddf_printf(",\"drop_overload\":%u",
+                end->drops[NET_STATS_DROP_OVERLOAD] - start->drops[NET_STATS_DROP_OVERLOAD]);
+    sddf_printf(",\"notify_sent\":%lu,\"notify_recv\":%lu,\"queue_hwm\":%u",
+                end->notifications_sent - start->notifications_sent,
+                end->notifications_received - start->notifications_received, end->queue_hwm);
+}
+#endif
+
+#if BENCHMARK_NET_STATS && NET_VLAN
+/* Print the tagged traffic of each client, with its VLAN ID, as one JSON object per line */
+static void print_net_client_stats(void)
+{
+    uint16_t vlans[NUM_NETWORK_CLIENTS];
+    net_virt_vlan_init_sys(NET_VIRT_RX_NAME, vlans);
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        net_stats_t *rx = &net_stats[NET_STATS_CLIENT_RX + client];
+        net_stats_t *rx_start = &net_stats_start[NET_STATS_CLIENT_RX + client];
+        net_stats_t *tx = &net_stats[NET_STATS_CLIENT_TX + client];
+        net_stats_t *tx_start = &net_stats_start[NET_STATS_CLIENT_TX + client];
+        sddf_printf("{\"vlan\":%u,\"client\":%d,\"rx_packets\":%lu,\"rx_bytes\":%lu,\"tx_packets\":%lu,\"tx_bytes\":%lu}\n",
+                    vlans[client], client, rx->packets - rx_start->packets, rx->bytes - rx_start->bytes,
+                    tx->packets - tx_start->packets, tx->bytes - tx_start->bytes);
+    }
+}
+#endif
+
+#if BENCHMARK_NET_TRACE
+static void net_trace_snapshot(void)
+{
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        sddf_memcpy(net_trace_start[client], net_trace_client(net_trace, client)->hists, sizeof(net_trace_start[client]));
+    }
 }
 
-static void print_benchmark_details(uint64_t pd_id, uint64_t kernel_util, uint64_t kernel_entries,
-                                    uint64_t number_schedules, uint64_t total_util)
+/* Print the latency percentiles of each hop, in cycles, as one JSON object per line */
+static void print_net_trace(void)
 {
+    for (int hist = 0; hist < NET_TRACE_NUM_HISTS; hist++) {
+        sddf_memset(&net_trace_delta, 0, sizeof(net_trace_delta));
+        for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+            net_trace_hist_t *start = &net_trace_start[client][hist];
+            net_trace_hist_t *end = &net_trace_client(net_trace, client)->hists[hist];
+            net_trace_delta.count += end->count - start->count;
+            for (int bucket = 0; bucket < NET_TRACE_BUCKETS; bucket++) {
+                net_trace_delta.buckets[bucket] += end->buckets[bucket] - start->buckets[bucket];
+            }
+        }
+
+        sddf_printf("{\"trace_hop\":\"%s\",\"count\":%lu,\"p50_cycles\":%lu,\"p99_cycles\":%lu,\"p999_cycles\":%lu}\n",
+                    net_trace_hist_names[hist], net_trace_delta.count, net_trace_percentile(&net_trace_delta, 500),
+                    net_trace_percentile(&net_trace_delta, 990), net_trace_percentile(&net_trace_delta, 999));
+    }
+}
+#endif
+
+/*
+ * Print the results for a PD as a single JSON object on one line. Per packet
+ * metrics are relative to the packets that passed through the whole system,
+ * so they can be compared between PDs.
+ */
+static void print_pd_record(uint64_t pd_id, benchmark_util_t *util, benchmark_util_t *system)
+{
+    sddf_printf("{\"pd\":\"%s\",\"id\":%lu", pd_name(pd_id), pd_id);
+
+    if (util) {
+        sddf_printf(",\"total_util\":%lu,\"kernel_util\":%lu,\"kernel_entries\":%lu,\"schedules\":%lu",
+                    util->total, util->kernel, util->entries, util->number_schedules);
+        print_percentage("util_share", util->total, system->total);
+        print_percentage("kernel_share", util->kernel, util->total);
+    }
+
+#if BENCHMARK_NET_STATS
+    uint64_t packets = net_packets();
     if (pd_id == PD_TOTAL) {
-        sddf_printf("Total utilisation details: \n");
+        sddf_printf(",\"packets\":%lu", packets);
     } else {
-        sddf_printf("Utilisation details for PD: ");
-        print_pdid_name(pd_id);
-        sddf_printf(" (%lx)\n", pd_id);
+        net_stats_t *end = net_stats_init_sys((char *)pd_name(pd_id), net_stats);
+        if (end) {
+            print_net_stats(&net_stats_start[end - net_stats], end);
+        }
+    }
+    if (util && packets) {
+        sddf_printf(",\"cycles_per_packet\":%lu", util->total / packets);
     }
-    sddf_printf("{\nKernelUtilisation:  %lx\nKernelEntries:  %lx\nNumberSchedules:  %lx\nTotalUtilisation:  %lx\n}\n",
-                kernel_util, kernel_entries, number_schedules, total_util);
-}
 #endif
 
+    sddf_printf("}\n");
+}
+
 #ifdef CONFIG_BENCHMARK_TRACK_KERNEL_ENTRIES
 static inline void seL4_BenchmarkTrackDumpSummary(benchmark_track_kernel_entry_t *logBuffer, uint64_t logSize)
 {
@@ -201,6 +299,13 @@ void notified(microkit_channel ch)
 {
     switch (ch) {
     case START:
+#if BENCHMARK_NET_STATS
+        sddf_memcpy(net_stats_start, net_stats, sizeof(net_stats_start));
+#endif
+#if BENCHMARK_NET_TRACE
+        net_trace_snapshot();
+#endif
+
 #ifdef MICROKIT_CONFIG_benchmark
         sel4bench_reset_counters();
         THREAD_MEMORY_RELEASE();
@@ -221,48 +326,48 @@ void notified(microkit_channel ch)
         sel4bench_get_counters(benchmark_bf, &counter_values[0]);
         sel4bench_stop_counters(benchmark_bf);
 
-        sddf_printf("{\n");
+        sddf_printf("{\"pmu\":{");
         for (int i = 0; i < ARRAY_SIZE(benchmarking_events); i++) {
-            sddf_printf("%s: %lX\n", counter_names[i], counter_values[i]);
+            sddf_printf("%s\"%s\":%lu", i ? "," : "", counter_names[i], counter_values[i]);
+        }
+        sddf_printf("}");
+#if BENCHMARK_NET_STATS
+        /* Normalised by traffic, so that runs with and without NET_RX_RECYCLE can be compared */
+        uint64_t packets = net_packets();
+        if (packets && (benchmark_bf & BIT(PMU_L1D_MISS))) {
+            sddf_printf(",\"l1d_misses_per_kpacket\":%lu", counter_values[PMU_L1D_MISS] * 1000 / packets);
         }
-        sddf_printf("}\n");
+#endif
+        sddf_printf(",\"rx_recycle\":%u}\n", NET_RX_RECYCLE);
 #endif
 
 #ifdef CONFIG_BENCHMARK_TRACK_UTILISATION
-        uint64_t total;
-        uint64_t kernel;
-        uint64_t entries;
-        uint64_t number_schedules;
-        microkit_benchmark_stop(&total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_TOTAL, kernel, entries, number_schedules, total);
-
-        microkit_benchmark_stop_tcb(PD_ETH_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_ETH_ID, kernel, entries, number_schedules, total);
-
-        microkit_benchmark_stop_tcb(PD_VIRT_RX_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_VIRT_RX_ID, kernel, entries, number_schedules, total);
-
-        microkit_benchmark_stop_tcb(PD_VIRT_TX_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_VIRT_TX_ID, kernel, entries, number_schedules, total);
-
-        microkit_benchmark_stop_tcb(PD_COPY_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_COPY_ID, kernel, entries, number_schedules, total);
-
-        microkit_benchmark_stop_tcb(PD_COPY1_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_COPY1_ID, kernel, entries, number_schedules, total);
-
-        microkit_benchmark_stop_tcb(PD_LWIP_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_LWIP_ID, kernel, entries, number_schedules, total);
+        benchmark_util_t system;
+        microkit_benchmark_stop(&system);
+        print_pd_record(PD_TOTAL, &system, &system);
+
+        for (int i = 0; i < BENCHMARK_NUM_PDS; i++) {
+            benchmark_util_t util;
+            microkit_benchmark_stop_tcb(benchmark_pds[i].id, &util);
+            print_pd_record(benchmark_pds[i].id, &util, &system);
+        }
+#else
+        print_pd_record(PD_TOTAL, NULL, NULL);
+        for (int i = 0; i < BENCHMARK_NUM_PDS; i++) {
+            print_pd_record(benchmark_pds[i].id, NULL, NULL);
+        }
+#endif
 
-        microkit_benchmark_stop_tcb(PD_LWIP1_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_LWIP1_ID, kernel, entries, number_schedules, total);
+#if BENCHMARK_NET_STATS && NET_VLAN
+        print_net_client_stats();
+#endif
 
-        microkit_benchmark_stop_tcb(PD_TIMER_ID, &total, &number_schedules, &kernel, &entries);
-        print_benchmark_details(PD_TIMER_ID, kernel, entries, number_schedules, total);
+#if BENCHMARK_NET_TRACE
+        print_net_trace();
 #endif
 
 #ifdef CONFIG_BENCHMARK_TRACK_KERNEL_ENTRIES
-        entries = seL4_BenchmarkFinalizeLog();
+        uint64_t entries = seL4_BenchmarkFinalizeLog();
         sddf_printf("KernelEntries:  %llx\n", entries);
         seL4_BenchmarkTrackDumpSummary(log_buffer, entries);
 #endif
@@ -313,9 +418,7 @@ void init(void)
 
 seL4_Bool fault(microkit_child id, microkit_msginfo msginfo, microkit_msginfo *reply_msginfo)
 {
-    sddf_printf("BENCH|LOG: Faulting PD ");
-    print_pdid_name(id);
-    sddf_printf(" (%x)\n", id);
+    sddf_printf("BENCH|LOG: Faulting PD %s (%x)\n", pd_name(id), id);
 
     seL4_UserContext regs;
     seL4_TCB_ReadRegisters(BASE_TCB_CAP + id, false, 0, sizeof(seL4_UserContext) / sizeof(seL4_Word), &regs);
@@ -6,6 +6,12 @@
 # Include this snippet in your project Makefile to build
 # the benchmark.elf and idle.elf programs.
 #
+# NOTES:
+# Requires CFLAGS to contain the directory of the system's benchmark_config.h,
+# which lists the PDs to track in benchmark_pds and sets BENCHMARK_NET_STATS
+# and BENCHMARK_NET_TRACE, and of the serial_config.h and ethernet_config.h
+# it relies on. See examples/echo_server/include/benchmark_config.
+#
 BENCH_OBJS := benchmark/benchmark.o
 IDLE_OBJS := benchmark/idle.o
 LIBUTIL_DBG := libsddf_util_debug.a
@@ -7,7 +7,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sddf/blk/queue.h>
+#include <sddf/blk/block_cache.h>
 #include <sddf/blk/msdos_mbr.h>
+#include <sddf/blk/sched.h>
 #include <sddf/util/cache.h>
 #include <sddf/util/fsmalloc.h>
 #include <sddf/util/ialloc.h>
@@ -16,6 +18,10 @@
 #include <sddf/util/util.h>
 #include <blk_config.h>
 
+#if BLK_CACHE_TIMING
+#include <sddf/timer/client.h>
+#endif
+
 /* Uncomment this to enable debug logging */
 // #define DEBUG_BLK_VIRT
 
@@ -29,16 +35,25 @@
 
 #define DRIVER_CH 0
 #define CLI_CH_OFFSET 1
+#define TIMER_CH (CLI_CH_OFFSET + BLK_NUM_CLIENTS)
 
 #define BLK_NUM_BUFFERS_DRIV (BLK_DATA_REGION_SIZE_DRIV / BLK_TRANSFER_SIZE)
 
 #define REQBK_SIZE BLK_QUEUE_SIZE_DRIV
+/* Marks the end of a chain of merged requests */
+#define REQBK_NONE REQBK_SIZE
 
 /*
  * Convert a virtual address within the block data region into a physical
  * address for the driver to give to the device for DMA.
  */
 #define BLK_DRIV_TO_PADDR(addr) ((addr) - blk_data_driver + blk_data_driver_paddr)
+#define BLK_CACHE_TO_PADDR(addr) ((addr) - blk_cache_data + blk_cache_data_paddr)
+
+#define BLK_CACHE_ENTRIES (BLK_CACHE_REGION_SIZE / BLK_TRANSFER_SIZE)
+
+/* Requests that write back the cache have this in place of a client ID */
+#define CACHE_ID BLK_NUM_CLIENTS
 
 blk_storage_info_t *blk_config_driver;
 blk_req_queue_t *blk_req_queue_driver;
@@ -51,6 +66,12 @@ blk_req_queue_t *blk_req_queue;
 blk_resp_queue_t *blk_resp_queue;
 /* The start of client data regions. */
 uintptr_t blk_client_data_start;
+/* Physical address of the start of client data regions, for zero-copy clients. */
+uintptr_t blk_client_data_paddr;
+
+/* Data region of the block cache */
+uintptr_t blk_cache_data;
+uintptr_t blk_cache_data_paddr;
 
 blk_queue_handle_t drv_h;
 
@@ -60,26 +81,108 @@ typedef struct client {
     microkit_channel ch;
     uint32_t start_sector;
     uint32_t sectors;
+    /* Whether responses have been enqueued since the client was last notified */
+    bool notify;
+    /* Number of requests submitted to the driver that have not completed, including reads ahead */
+    uint32_t inflight;
+#if BLK_READAHEAD
+    /* Block after the client's last read, where a sequential read would start */
+    uint32_t ra_next_read;
+    /* Block after those read ahead for the client */
+    uint32_t ra_end;
+    /* Number of blocks to read ahead of the client's reads, 0 while they are not sequential */
+    uint32_t ra_window;
+    /* Largest window, adapted to how many of the blocks read ahead the client reads */
+    uint32_t ra_max;
+    /* Number of blocks read ahead since the window was last adapted, and how many the client read */
+    uint32_t ra_issued;
+    uint32_t ra_used;
+#endif
 } client_t;
 client_t clients[BLK_NUM_CLIENTS];
 
+/* Scheduler of client requests */
+static blk_sched_t sched;
+static blk_sched_client_t sched_clients[BLK_NUM_CLIENTS];
+
 
 /* Fixed size memory allocator */
 static fsmalloc_t fsmalloc;
-static bitarray_t fsmalloc_avail_bitarr;
-static word_t fsmalloc_avail_bitarr_words[roundup_bits2words64(BLK_NUM_BUFFERS_DRIV)];
+static fsmalloc_cell_t fsmalloc_cells[BLK_NUM_BUFFERS_DRIV];
 
 /* Bookkeeping struct per request */
 typedef struct reqbk {
     uint32_t cli_id;
+    /* Client whose limit of requests at the driver the request counts against, CACHE_ID for none */
+    uint32_t sched_id;
     uint32_t cli_req_id;
     uintptr_t cli_addr;
+    /* Address of the driver data buffers, 0 for requests that were not copied */
     uintptr_t drv_addr;
     uint16_t count;
     blk_req_code_t code;
+    uint32_t block_number;
+    /* Next request merged into the same driver request, REQBK_NONE if last */
+    uint32_t next;
+#if BLK_CACHE_TIMING
+    /* Time the request was taken from the client queue */
+    uint64_t start;
+#endif
 } reqbk_t;
 static reqbk_t reqbk[REQBK_SIZE];
 
+/*
+ * Read or write that has not been enqueued to the driver yet, so that
+ * following requests for the next blocks with the next driver buffers can be
+ * merged into it. It is enqueued before the driver is notified, so requests
+ * are only merged with others taken from the client queues in the same pass.
+ * The driver request takes the request ID of the first client request, and
+ * the client requests are chained through reqbk.
+ */
+typedef struct merge {
+    bool pending;
+    blk_req_code_t code;
+    uintptr_t drv_io;
+    uint32_t block_number;
+    uint16_t count;
+    /* IDs of the first and last client requests merged */
+    uint32_t first;
+    uint32_t last;
+} merge_t;
+static merge_t merge;
+
+/* Number of client requests and driver requests they were merged into */
+static uint64_t merge_cli_requests;
+static uint64_t merge_drv_requests;
+
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+static blk_cache_t cache;
+static blk_cache_entry_t cache_entries[BLK_CACHE_ENTRIES];
+static uint32_t cache_buckets[BLK_CACHE_ENTRIES];
+/* Number of writebacks submitted to the driver that have not completed */
+static uint32_t cache_writebacks_inflight;
+
+typedef struct cache_stats {
+    /* Blocks read that were and were not all cached */
+    uint64_t read_hits;
+    uint64_t read_misses;
+    /* Blocks written to the cache to be written back later */
+    uint64_t writes_deferred;
+    /* Blocks written back from the cache */
+    uint64_t writebacks;
+    /* Blocks read ahead into the cache */
+    uint64_t readaheads;
+#if BLK_CACHE_TIMING
+    /* Number of reads and total time in nanoseconds to respond to them, from the cache and from the device */
+    uint64_t hit_reads;
+    uint64_t hit_time;
+    uint64_t miss_reads;
+    uint64_t miss_time;
+#endif
+} cache_stats_t;
+static cache_stats_t cache_stats;
+#endif
+
 /* Index allocator for request bookkeep */
 static ialloc_t ialloc;
 static uint32_t ialloc_idxlist[REQBK_SIZE];
@@ -147,7 +250,7 @@ static void request_mbr()
     assert(!err);
 
     uint32_t mbr_req_id = 0;
-    reqbk_t mbr_req_data = {0, 0, 0, mbr_addr, 1, 0};
+    reqbk_t mbr_req_data = {0, CACHE_ID, 0, 0, mbr_addr, 1, 0, 0, REQBK_NONE};
     err = ialloc_alloc(&ialloc, &mbr_req_id);
     assert(!err);
     reqbk[mbr_req_id] = mbr_req_data;
@@ -204,94 +307,597 @@ void init(void)
         blk_queue_init(&clients[i].queue_h, curr_req, curr_resp, queue_size);
 
         clients[i].ch = CLI_CH_OFFSET + i;
+#if BLK_READAHEAD
+        clients[i].ra_max = BLK_READAHEAD_MAX;
+#endif
     }
 
+    blk_sched_init(&sched, sched_clients, BLK_NUM_CLIENTS, BLK_SCHED_QUANTUM, blk_sched_weight, blk_sched_deadline);
+
     // Initialise driver queue
     blk_queue_init(&drv_h, blk_req_queue_driver, blk_resp_queue_driver, BLK_QUEUE_SIZE_DRIV);
 
     // Initialise fixed size memory allocator and ialloc
     ialloc_init(&ialloc, ialloc_idxlist, REQBK_SIZE);
-    fsmalloc_init(&fsmalloc, blk_data_driver, BLK_TRANSFER_SIZE, BLK_NUM_BUFFERS_DRIV, &fsmalloc_avail_bitarr,
-                  fsmalloc_avail_bitarr_words, roundup_bits2words64(BLK_NUM_BUFFERS_DRIV));
+    fsmalloc_init(&fsmalloc, blk_data_driver, BLK_TRANSFER_SIZE, BLK_NUM_BUFFERS_DRIV, fsmalloc_cells);
+
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+    blk_cache_init(&cache, cache_entries, BLK_CACHE_ENTRIES, cache_buckets, BLK_CACHE_ENTRIES, blk_cache_data);
+#endif
 
     request_mbr();
 }
 
-static void handle_driver()
+/*
+ * Whether the driver request queue is full, counting the request that is
+ * pending merges as already enqueued.
+ */
+static bool drv_queue_full()
 {
-    blk_resp_status_t drv_status;
-    uint16_t drv_success_count;
-    uint32_t drv_resp_id;
+    return (uint32_t)blk_queue_length_req(&drv_h) + merge.pending + 1 >= drv_h.capacity;
+}
 
-    int err = 0;
-    while (!blk_queue_empty_resp(&drv_h)) {
-        err = blk_dequeue_resp(&drv_h, &drv_status, &drv_success_count, &drv_resp_id);
-        assert(!err);
+static void merge_flush()
+{
+    if (!merge.pending) {
+        return;
+    }
+
+    int err = blk_enqueue_req(&drv_h, merge.code, merge.drv_io, merge.block_number, merge.count, merge.first);
+    assert(!err);
+    merge.pending = false;
+
+    merge_drv_requests++;
+    if (merge.first != merge.last) {
+        LOG_BLK_VIRT("Merged requests into %u blocks at block %u, %lu client requests in %lu driver requests\n",
+                     merge.count, merge.block_number, merge_cli_requests, merge_drv_requests);
+    }
+}
+
+/*
+ * Submit a client request to the driver, merging reads and writes into the
+ * pending request if they continue it on both the disk and in the driver's
+ * address space.
+ */
+static void submit_request(blk_req_code_t code, uintptr_t drv_io, uint32_t block_number, uint16_t count, uint32_t id)
+{
+    merge_cli_requests++;
 
-        reqbk_t cli_data = reqbk[drv_resp_id];
-        err = ialloc_free(&ialloc, drv_resp_id);
+    if (code != BLK_REQ_READ && code != BLK_REQ_WRITE) {
+        // Requests enqueued earlier must not be reordered around flushes and barriers
+        merge_flush();
+        int err = blk_enqueue_req(&drv_h, code, drv_io, block_number, count, id);
         assert(!err);
+        merge_drv_requests++;
+        return;
+    }
 
-        // Free bookkeeping data structures regardless of success or failure
-        switch (cli_data.code) {
-        case BLK_REQ_WRITE:
-            fsmalloc_free(&fsmalloc, cli_data.drv_addr, cli_data.count);
-            break;
-        case BLK_REQ_READ:
-            fsmalloc_free(&fsmalloc, cli_data.drv_addr, cli_data.count);
+    if (merge.pending && code == merge.code && block_number == merge.block_number + merge.count
+        && drv_io == merge.drv_io + (BLK_TRANSFER_SIZE * merge.count) && merge.count + count <= BLK_MERGE_MAX_COUNT) {
+        reqbk[merge.last].next = id;
+        merge.last = id;
+        merge.count += count;
+        return;
+    }
+
+    merge_flush();
+    merge = (merge_t) {
+        .pending = true,
+        .code = code,
+        .drv_io = drv_io,
+        .block_number = block_number,
+        .count = count,
+        .first = id,
+        .last = id,
+    };
+}
+
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+
+/*
+ * Write back dirty entries of the cache, from the least recently used, until
+ * limit entries have been written back or the driver cannot take more
+ * requests. The entries are busy until the driver responds.
+ */
+static void cache_writeback(uint32_t limit)
+{
+    uint32_t idx = cache.lru_tail;
+    while (idx != BLK_CACHE_NONE && limit > 0) {
+        blk_cache_entry_t *entry = &cache.entries[idx];
+        if (entry->dirty && !entry->busy) {
+            if (drv_queue_full() || ialloc_full(&ialloc)) {
+                return;
+            }
+
+            uintptr_t data = blk_cache_entry_data(&cache, idx);
+            cache_clean(data, data + BLK_TRANSFER_SIZE);
+
+            uint32_t drv_req_id;
+            int err = ialloc_alloc(&ialloc, &drv_req_id);
+            assert(!err);
+            reqbk_t cache_data = {CACHE_ID, CACHE_ID, idx, data, 0, 1, BLK_REQ_WRITE, entry->block_number, REQBK_NONE};
+            reqbk[drv_req_id] = cache_data;
+
+            blk_cache_set_dirty(&cache, idx, false);
+            entry->busy = true;
+            submit_request(BLK_REQ_WRITE, BLK_CACHE_TO_PADDR(data), entry->block_number, 1, drv_req_id);
+            cache_writebacks_inflight++;
+            cache_stats.writebacks++;
+            limit--;
+        }
+        idx = entry->lru_prev;
+    }
+}
+
+static void cache_complete(reqbk_t *cache_data, blk_resp_status_t status)
+{
+    uint32_t idx = cache_data->cli_req_id;
+    blk_cache_entry_t *entry = &cache.entries[idx];
+    entry->busy = false;
+
+    switch (cache_data->code) {
+    case BLK_REQ_READ:
+        entry->pending = false;
+        if (status != BLK_RESP_OK) {
+            blk_cache_invalidate(&cache, idx);
             break;
-        case BLK_REQ_FLUSH:
+        }
+        /* TODO: This is a raw seL4 system call because Microkit does not (currently)
+         * include a corresponding libmicrokit API. */
+        seL4_ARM_VSpace_Invalidate_Data(3, cache_data->cli_addr, cache_data->cli_addr + BLK_TRANSFER_SIZE);
+        break;
+    case BLK_REQ_WRITE:
+        cache_writebacks_inflight--;
+        if (status != BLK_RESP_OK) {
+            // Write the block back again, flushes and barriers wait until it has been written
+            LOG_BLK_VIRT_ERR("Failed to write back block %u from the cache\n", cache_data->block_number);
+            blk_cache_set_dirty(&cache, idx, true);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Reserve entries for the blocks of a client read submitted to the driver
+ * that are not cached. The entries are busy and pending until the read
+ * completes, so that a write of the same blocks waits for the read rather
+ * than being overtaken by the stale data it returns. Blocks for which no
+ * entry is free are not cached.
+ */
+static void cache_reserve(uint32_t drv_req_id, uint32_t block_number, uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++) {
+        if (blk_cache_lookup(&cache, block_number + i) != BLK_CACHE_NONE) {
+            continue;
+        }
+        uint32_t idx = blk_cache_alloc(&cache, block_number + i);
+        if (idx == BLK_CACHE_NONE) {
+            return;
+        }
+        blk_cache_entry_t *entry = &cache.entries[idx];
+        entry->busy = true;
+        entry->pending = true;
+        entry->reader = drv_req_id;
+    }
+}
+
+/*
+ * Fill the entries a completed read reserved, or drop them if the read
+ * failed. Blocks that were already cached are copied to the client instead,
+ * as the cache holds their latest data, which may not have been written to
+ * the device yet.
+ */
+static void cache_fill(reqbk_t *cli_data, uint32_t drv_req_id, bool success)
+{
+    for (uint16_t i = 0; i < cli_data->count; i++) {
+        void *cli_block = (void *)(cli_data->cli_addr + (uintptr_t)i * BLK_TRANSFER_SIZE);
+        uint32_t idx = blk_cache_lookup(&cache, cli_data->block_number + i);
+        if (idx == BLK_CACHE_NONE) {
+            continue;
+        }
+
+        blk_cache_entry_t *entry = &cache.entries[idx];
+        if (!entry->pending) {
+            if (success) {
+                sddf_memcpy(cli_block, (void *)blk_cache_entry_data(&cache, idx), BLK_TRANSFER_SIZE);
+            }
+            continue;
+        }
+        // Only the read that reserved an entry is known not to have been overtaken by a write of its block
+        if (entry->reader != drv_req_id) {
+            continue;
+        }
+
+        entry->busy = false;
+        entry->pending = false;
+        if (!success) {
+            blk_cache_invalidate(&cache, idx);
+            continue;
+        }
+        sddf_memcpy((void *)blk_cache_entry_data(&cache, idx), cli_block, BLK_TRANSFER_SIZE);
+    }
+}
+
+/* Report the cache statistics, on each flush or barrier */
+static void cache_report(void)
+{
+    LOG_BLK_VIRT("Cache read hits %lu misses %lu (%lu%% hit), writes deferred %lu, writebacks %lu, read ahead %lu\n",
+                 cache_stats.read_hits, cache_stats.read_misses,
+                 cache_stats.read_hits * 100 / MAX(cache_stats.read_hits + cache_stats.read_misses, 1),
+                 cache_stats.writes_deferred, cache_stats.writebacks, cache_stats.readaheads);
+#if BLK_CACHE_TIMING
+    // Timing is only enabled to be reported, so it is reported without DEBUG_BLK_VIRT
+    sddf_dprintf("BLK_VIRT|INFO: Reads from cache %lu averaging %lu ns, from device %lu averaging %lu ns\n",
+                 cache_stats.hit_reads, cache_stats.hit_time / MAX(cache_stats.hit_reads, 1), cache_stats.miss_reads,
+                 cache_stats.miss_time / MAX(cache_stats.miss_reads, 1));
+#endif
+}
+
+/*
+ * Serve a client request from the cache where possible, and keep the cache
+ * consistent with requests that go to the device.
+ *
+ * @return 1 when the cache completed the request, 0 when it must be submitted
+ * to the driver and -1 when it must wait for the driver to complete requests.
+ */
+static int cache_request(int cli_id, blk_req_code_t code, uintptr_t cli_addr, uint32_t block_number, uint16_t count)
+{
+    uint32_t idx;
+    bool pending = false;
+
+    switch (code) {
+    case BLK_REQ_READ:
+        for (uint16_t i = 0; i < count; i++) {
+            idx = blk_cache_lookup(&cache, block_number + i);
+            if (idx == BLK_CACHE_NONE) {
+                cache_stats.read_misses += count;
+                return 0;
+            }
+            pending |= cache.entries[idx].pending;
+        }
+        // Wait for blocks being read ahead rather than read them again
+        if (pending) {
+            return -1;
+        }
+        for (uint16_t i = 0; i < count; i++) {
+            idx = blk_cache_lookup(&cache, block_number + i);
+            blk_cache_touch(&cache, idx);
+#if BLK_READAHEAD
+            if (cache.entries[idx].prefetched) {
+                cache.entries[idx].prefetched = false;
+                clients[cli_id].ra_used++;
+            }
+#endif
+            sddf_memcpy((void *)(cli_addr + (uintptr_t)i * BLK_TRANSFER_SIZE), (void *)blk_cache_entry_data(&cache, idx),
+                        BLK_TRANSFER_SIZE);
+        }
+        cache_stats.read_hits += count;
+        return 1;
+    case BLK_REQ_WRITE:
+        // The device may still be reading the data of busy entries
+        for (uint16_t i = 0; i < count; i++) {
+            idx = blk_cache_lookup(&cache, block_number + i);
+            if (idx != BLK_CACHE_NONE && cache.entries[idx].busy) {
+                return -1;
+            }
+        }
+#if BLK_CACHE_MODE == BLK_CACHE_WRITE_BACK
+        // Writes too large to leave room in the cache for others are written through
+        if (count <= BLK_CACHE_ENTRIES / 2) {
+            for (uint16_t i = 0; i < count; i++) {
+                idx = blk_cache_lookup(&cache, block_number + i);
+                if (idx == BLK_CACHE_NONE) {
+                    idx = blk_cache_alloc(&cache, block_number + i);
+                }
+                if (idx == BLK_CACHE_NONE) {
+                    // Every entry is dirty or busy, retry once some have been written back. The blocks
+                    // already written into the cache are written again then.
+                    cache_writeback(count);
+                    return -1;
+                }
+                blk_cache_touch(&cache, idx);
+                sddf_memcpy((void *)blk_cache_entry_data(&cache, idx), (void *)(cli_addr + (uintptr_t)i * BLK_TRANSFER_SIZE),
+                            BLK_TRANSFER_SIZE);
+                blk_cache_set_dirty(&cache, idx, true);
+            }
+            cache_stats.writes_deferred += count;
+            return 1;
+        }
+#endif
+        // Keep the cached blocks up to date, the device is given the same data
+        for (uint16_t i = 0; i < count; i++) {
+            idx = blk_cache_lookup(&cache, block_number + i);
+            if (idx != BLK_CACHE_NONE) {
+                blk_cache_touch(&cache, idx);
+                sddf_memcpy((void *)blk_cache_entry_data(&cache, idx), (void *)(cli_addr + (uintptr_t)i * BLK_TRANSFER_SIZE),
+                            BLK_TRANSFER_SIZE);
+                blk_cache_set_dirty(&cache, idx, false);
+            }
+        }
+        return 0;
+    case BLK_REQ_FLUSH:
+    case BLK_REQ_BARRIER:
+        // Write back everything written before the flush or barrier, and only submit it once the
+        // writebacks have succeeded. Failed writebacks leave their blocks dirty to be written again.
+        cache_writeback(UINT32_MAX);
+        if (cache.num_dirty != 0 || cache_writebacks_inflight != 0) {
+            return -1;
+        }
+        cache_report();
+        return 0;
+    }
+
+    return 0;
+}
+
+#endif
+
+#if BLK_READAHEAD
+
+/*
+ * Read ahead of a client's sequential reads into the cache. The window of
+ * blocks read ahead starts at BLK_READAHEAD_MIN and doubles with each
+ * sequential read up to the client's maximum, and is dropped as soon as a read
+ * is not sequential. The maximum itself is halved when the client reads less
+ * than half of the blocks read ahead for it and doubled, up to
+ * BLK_READAHEAD_MAX, when it reads most of them.
+ */
+static void readahead(int cli_id, uint32_t block_number, uint16_t count)
+{
+    client_t *client = &clients[cli_id];
+
+    if (client->ra_issued >= BLK_READAHEAD_MAX) {
+        if (client->ra_used * 2 < client->ra_issued) {
+            client->ra_max = MAX(client->ra_max / 2, BLK_READAHEAD_MIN);
+        } else if (client->ra_used * 4 >= client->ra_issued * 3) {
+            client->ra_max = MIN(client->ra_max * 2, BLK_READAHEAD_MAX);
+        }
+        client->ra_issued = 0;
+        client->ra_used = 0;
+    }
+
+    if (block_number == client->ra_next_read) {
+        client->ra_window = MAX(MIN(client->ra_window * 2, client->ra_max), BLK_READAHEAD_MIN);
+    } else {
+        client->ra_window = 0;
+        client->ra_end = 0;
+    }
+    client->ra_next_read = block_number + count;
+    if (client->ra_window == 0) {
+        return;
+    }
+
+    uint32_t blocks_per_transfer = BLK_TRANSFER_SIZE / MSDOS_MBR_SECTOR_SIZE;
+    uint32_t client_end = (client->start_sector + client->sectors) / blocks_per_transfer;
+    uint32_t end = MIN(block_number + count + client->ra_window, client_end);
+    uint32_t block = MAX(client->ra_end, block_number + count);
+    for (; block < end; block++) {
+        if (blk_cache_lookup(&cache, block) != BLK_CACHE_NONE) {
+            continue;
+        }
+        // Reads ahead count against the client's limit of requests at the driver
+        if (drv_queue_full() || ialloc_full(&ialloc) || client->inflight >= blk_sched_inflight_limit[cli_id]) {
             break;
-        case BLK_REQ_BARRIER:
+        }
+        uint32_t idx = blk_cache_alloc(&cache, block);
+        if (idx == BLK_CACHE_NONE) {
             break;
         }
 
-        // Get the corresponding client queue handle
-        blk_queue_handle_t h = clients[cli_data.cli_id].queue_h;
+        blk_cache_entry_t *entry = &cache.entries[idx];
+        entry->busy = true;
+        entry->pending = true;
+        entry->prefetched = true;
 
-        // Drop response if client resp queue is full
-        if (blk_queue_full_resp(&h)) {
-            continue;
+        // Write back and drop the entry's previous data from the cache, so that none is evicted over the transfer
+        uintptr_t data = blk_cache_entry_data(&cache, idx);
+        cache_clean_and_invalidate(data, data + BLK_TRANSFER_SIZE);
+
+        uint32_t drv_req_id;
+        int err = ialloc_alloc(&ialloc, &drv_req_id);
+        assert(!err);
+        entry->reader = drv_req_id;
+        reqbk_t cache_data = {CACHE_ID, cli_id, idx, data, 0, 1, BLK_REQ_READ, block, REQBK_NONE};
+        reqbk[drv_req_id] = cache_data;
+
+        submit_request(BLK_REQ_READ, BLK_CACHE_TO_PADDR(data), block, 1, drv_req_id);
+        client->inflight++;
+        client->ra_issued++;
+        cache_stats.readaheads++;
+    }
+    client->ra_end = block;
+}
+
+#endif
+
+static void complete_request(reqbk_t *cli_data, uint32_t drv_req_id, blk_resp_status_t status, uint16_t success_count)
+{
+    int err = 0;
+
+    // Free bookkeeping data structures regardless of success or failure
+    switch (cli_data->code) {
+    case BLK_REQ_WRITE:
+    case BLK_REQ_READ:
+        if (cli_data->drv_addr != 0) {
+            fsmalloc_free(&fsmalloc, cli_data->drv_addr, cli_data->count);
         }
+        break;
+    case BLK_REQ_FLUSH:
+        break;
+    case BLK_REQ_BARRIER:
+        break;
+    }
+
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+    if (cli_data->cli_id == CACHE_ID) {
+        cache_complete(cli_data, status);
+        return;
+    }
+#endif
+
+    // Get the corresponding client queue handle
+    blk_queue_handle_t h = clients[cli_data->cli_id].queue_h;
 
-        if (drv_status == BLK_RESP_OK) {
-            switch (cli_data.code) {
-            case BLK_REQ_READ:
+    // Drop response if client resp queue is full
+    if (blk_queue_full_resp(&h)) {
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+        if (cli_data->code == BLK_REQ_READ) {
+            cache_fill(cli_data, drv_req_id, false);
+        }
+#endif
+        return;
+    }
+
+    if (status == BLK_RESP_OK) {
+        switch (cli_data->code) {
+        case BLK_REQ_READ:
+            if (cli_data->drv_addr == 0) {
+                // Data was transferred straight into the client's region, only invalidate it in the cache
+                seL4_ARM_VSpace_Invalidate_Data(3, cli_data->cli_addr,
+                                                cli_data->cli_addr + (BLK_TRANSFER_SIZE * cli_data->count));
+            } else {
                 // Invalidate cache
                 /* TODO: This is a raw seL4 system call because Microkit does not (currently)
                  * include a corresponding libmicrokit API. */
-                seL4_ARM_VSpace_Invalidate_Data(3, cli_data.drv_addr, cli_data.drv_addr + (BLK_TRANSFER_SIZE * cli_data.count));
+                seL4_ARM_VSpace_Invalidate_Data(3, cli_data->drv_addr,
+                                                cli_data->drv_addr + (BLK_TRANSFER_SIZE * cli_data->count));
                 // Copy data buffers from driver to client
-                sddf_memcpy((void *)cli_data.cli_addr, (void *)cli_data.drv_addr, BLK_TRANSFER_SIZE * cli_data.count);
-                err = blk_enqueue_resp(&h, BLK_RESP_OK, drv_success_count, cli_data.cli_req_id);
-                assert(!err);
-                break;
-            case BLK_REQ_WRITE:
-                err = blk_enqueue_resp(&h, BLK_RESP_OK, drv_success_count, cli_data.cli_req_id);
-                assert(!err);
-                break;
-            case BLK_REQ_FLUSH:
-            case BLK_REQ_BARRIER:
-                err = blk_enqueue_resp(&h, BLK_RESP_OK, drv_success_count, cli_data.cli_req_id);
-                assert(!err);
-                break;
+                sddf_memcpy((void *)cli_data->cli_addr, (void *)cli_data->drv_addr, BLK_TRANSFER_SIZE * cli_data->count);
             }
-        } else {
-            // When more error conditions are added, this will need to be updated to a switch statement
-            err = blk_enqueue_resp(&h, drv_status, drv_success_count, cli_data.cli_req_id);
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+            cache_fill(cli_data, drv_req_id, true);
+#endif
+#if BLK_CACHE_TIMING
+            cache_stats.miss_reads++;
+            cache_stats.miss_time += sddf_timer_time_now(TIMER_CH) - cli_data->start;
+#endif
+            err = blk_enqueue_resp(&h, BLK_RESP_OK, success_count, cli_data->cli_req_id);
             assert(!err);
+            break;
+        case BLK_REQ_WRITE:
+            err = blk_enqueue_resp(&h, BLK_RESP_OK, success_count, cli_data->cli_req_id);
+            assert(!err);
+            break;
+        case BLK_REQ_FLUSH:
+        case BLK_REQ_BARRIER:
+            err = blk_enqueue_resp(&h, BLK_RESP_OK, success_count, cli_data->cli_req_id);
+            assert(!err);
+            break;
         }
+    } else {
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+        if (cli_data->code == BLK_REQ_READ) {
+            cache_fill(cli_data, drv_req_id, false);
+        }
+#endif
+        // When more error conditions are added, this will need to be updated to a switch statement
+        err = blk_enqueue_resp(&h, status, success_count, cli_data->cli_req_id);
+        assert(!err);
+    }
+
+    clients[cli_data->cli_id].notify = true;
+}
+
+static void notify_clients()
+{
+    for (int i = 0; i < BLK_NUM_CLIENTS; i++) {
+        if (clients[i].notify) {
+            clients[i].notify = false;
+            microkit_notify(clients[i].ch);
+        }
+    }
+}
+
+static void handle_driver()
+{
+    blk_resp_status_t drv_status;
+    uint16_t drv_success_count;
+    uint32_t drv_resp_id;
 
-        // Notify corresponding client
-        microkit_notify(clients[cli_data.cli_id].ch);
+    int err = 0;
+    while (!blk_queue_empty_resp(&drv_h)) {
+        err = blk_dequeue_resp(&drv_h, &drv_status, &drv_success_count, &drv_resp_id);
+        assert(!err);
+
+        /*
+         * Split the response between the client requests merged into the
+         * driver request. They cover consecutive blocks, so the blocks that
+         * succeeded are those of the first requests in the chain.
+         */
+        bool merged = reqbk[drv_resp_id].next != REQBK_NONE;
+        uint16_t remaining = drv_success_count;
+        uint32_t id = drv_resp_id;
+        while (id != REQBK_NONE) {
+            reqbk_t cli_data = reqbk[id];
+            err = ialloc_free(&ialloc, id);
+            assert(!err);
+            if (cli_data.sched_id != CACHE_ID) {
+                clients[cli_data.sched_id].inflight--;
+            }
+
+            blk_resp_status_t status = drv_status;
+            uint16_t success_count = drv_success_count;
+            if (merged) {
+                success_count = MIN(cli_data.count, remaining);
+                remaining -= success_count;
+                if (success_count == cli_data.count) {
+                    status = BLK_RESP_OK;
+                }
+            }
+            complete_request(&cli_data, id, status, success_count);
+
+            id = cli_data.next;
+        }
+    }
+}
+
+/*
+ * Scheduling of client requests, see sddf/blk/sched.h. Clients are eligible
+ * when they have requests queued, fewer than their limit of requests at the
+ * driver, and have not been blocked in the current round of submissions.
+ */
+static int sched_next(bool *blocked)
+{
+    bool eligible[BLK_NUM_CLIENTS];
+    for (int i = 0; i < BLK_NUM_CLIENTS; i++) {
+        eligible[i] = !blocked[i] && !blk_queue_empty_req(&clients[i].queue_h)
+                   && clients[i].inflight < blk_sched_inflight_limit[i];
     }
+
+#if BLK_SCHED_POLICY == BLK_SCHED_ROUND_ROBIN
+    return blk_sched_rr_next(&sched, eligible);
+#elif BLK_SCHED_POLICY == BLK_SCHED_DEADLINE
+    return blk_sched_deadline_next(&sched, eligible);
+#else
+#error "Unknown block scheduling policy"
+#endif
+}
+
+static void sched_submitted(int cli_id, uint16_t count)
+{
+#if BLK_SCHED_POLICY == BLK_SCHED_ROUND_ROBIN
+    blk_sched_rr_submitted(&sched, cli_id, count);
+#elif BLK_SCHED_POLICY == BLK_SCHED_DEADLINE
+    blk_sched_deadline_submitted(&sched, cli_id, count);
+#endif
 }
 
-static void handle_client(int cli_id)
+/*
+ * Take the request at the head of a client's queue and submit it to the
+ * driver, or respond with an error if it is invalid.
+ *
+ * @return false when the driver queue or the virtualiser's buffers cannot take
+ * the request, which is then left in the client's queue.
+ */
+static bool handle_request(int cli_id, uint16_t *count)
 {
     blk_queue_handle_t h = clients[cli_id].queue_h;
     uintptr_t cli_data_base = blk_virt_cli_data_region(blk_client_data_start, cli_id);
     uint64_t cli_data_region_size = blk_virt_cli_data_region_size(cli_id);
+    uintptr_t cli_data_paddr = blk_virt_cli_data_region_paddr(blk_client_data_paddr, cli_id);
+    bool zero_copy = blk_zero_copy_mapping[cli_id];
 
     blk_req_code_t cli_code;
     uintptr_t cli_offset;
@@ -300,72 +906,164 @@ static void handle_client(int cli_id)
     uint32_t cli_req_id;
 
     uintptr_t drv_addr;
+    uintptr_t drv_io;
     uint32_t drv_block_number;
     uint32_t drv_req_id = 0;
 
-    int err = 0;
-    while (!blk_queue_empty_req(&h)) {
-        err = blk_dequeue_req(&h, &cli_code, &cli_offset, &cli_block_number, &cli_count, &cli_req_id);
-        assert(!err);
+    // The request is read once, and removed without reading it again, so that the client cannot change it after
+    // it has been checked
+    int err = blk_peek_req(&h, &cli_code, &cli_offset, &cli_block_number, &cli_count, &cli_req_id);
+    assert(!err);
+    *count = cli_count;
 
-        drv_block_number = cli_block_number + (clients[cli_id].start_sector / (BLK_TRANSFER_SIZE / MSDOS_MBR_SECTOR_SIZE));
+    drv_block_number = cli_block_number + (clients[cli_id].start_sector / (BLK_TRANSFER_SIZE / MSDOS_MBR_SECTOR_SIZE));
 
-        if (cli_code == BLK_REQ_READ || cli_code == BLK_REQ_WRITE) {
-            // Check if client request is within its allocated bounds
-            unsigned long client_sectors = clients[cli_id].sectors / (BLK_TRANSFER_SIZE / MSDOS_MBR_SECTOR_SIZE);
-            unsigned long client_start_sector = clients[cli_id].start_sector / (BLK_TRANSFER_SIZE / MSDOS_MBR_SECTOR_SIZE);
-            if (drv_block_number < client_start_sector || drv_block_number + cli_count > client_start_sector + client_sectors) {
-                err = blk_enqueue_resp(&h, BLK_RESP_SEEK_ERROR, 0, cli_req_id);
-                assert(!err);
-                continue;
-            }
+    if (cli_code == BLK_REQ_READ || cli_code == BLK_REQ_WRITE) {
+        // Check if client request is within its allocated bounds, and if its offset is within its data region and
+        // aligned to transfer size. The sums are kept from wrapping, as the device may be given the client's data
+        // region to DMA into directly.
+        uint64_t client_sectors = clients[cli_id].sectors / (BLK_TRANSFER_SIZE / MSDOS_MBR_SECTOR_SIZE);
+        if ((uint64_t)cli_block_number + cli_count > client_sectors
+            || cli_offset % BLK_TRANSFER_SIZE != 0 || cli_offset >= cli_data_region_size
+            || cli_count > (cli_data_region_size - cli_offset) / BLK_TRANSFER_SIZE) {
+            err = blk_queue_skip_req(&h);
+            assert(!err);
+            err = blk_enqueue_resp(&h, BLK_RESP_SEEK_ERROR, 0, cli_req_id);
+            assert(!err);
+            clients[cli_id].notify = true;
+            return true;
+        }
+    }
 
-            // Check if client request offset is within its allocated bounds and is aligned to transfer size
-            if (cli_offset % BLK_TRANSFER_SIZE != 0 || (cli_offset + BLK_TRANSFER_SIZE * cli_count) > cli_data_region_size) {
-                err = blk_enqueue_resp(&h, BLK_RESP_SEEK_ERROR, 0, cli_req_id);
-                assert(!err);
-                continue;
-            }
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+#if BLK_CACHE_TIMING
+    uint64_t start = sddf_timer_time_now(TIMER_CH);
+#endif
+    int cached = cache_request(cli_id, cli_code, cli_offset + cli_data_base, drv_block_number, cli_count);
+    if (cached < 0) {
+        return false;
+    }
+    if (cached > 0) {
+        err = blk_queue_skip_req(&h);
+        assert(!err);
+        err = blk_enqueue_resp(&h, BLK_RESP_OK, cli_count, cli_req_id);
+        assert(!err);
+        clients[cli_id].notify = true;
+#if BLK_CACHE_TIMING
+        if (cli_code == BLK_REQ_READ) {
+            cache_stats.hit_reads++;
+            cache_stats.hit_time += sddf_timer_time_now(TIMER_CH) - start;
         }
+#endif
+#if BLK_READAHEAD
+        if (cli_code == BLK_REQ_READ) {
+            readahead(cli_id, drv_block_number, cli_count);
+        }
+#endif
+        return true;
+    }
+#endif
 
-        switch (cli_code) {
-        case BLK_REQ_READ:
-            if (blk_queue_full_req(&drv_h) || ialloc_full(&ialloc) || fsmalloc_full(&fsmalloc, cli_count)) {
-                continue;
-            }
-            // Allocate driver data buffers
-            err = fsmalloc_alloc(&fsmalloc, &drv_addr, cli_count);
-            assert(!err);
-            break;
-        case BLK_REQ_WRITE:
-            if (blk_queue_full_req(&drv_h) || ialloc_full(&ialloc) || fsmalloc_full(&fsmalloc, cli_count)) {
-                continue;
-            }
-            // Allocate driver data buffers
-            err = fsmalloc_alloc(&fsmalloc, &drv_addr, cli_count);
-            assert(!err);
-            // Copy data buffers from client to driver
-            sddf_memcpy((void *)drv_addr, (void *)(cli_offset + cli_data_base), BLK_TRANSFER_SIZE * cli_count);
-            // Flush the cache
-            cache_clean(drv_addr, drv_addr + (BLK_TRANSFER_SIZE * cli_count));
+    // Leave the request queued until there are resources for it
+    if (drv_queue_full() || ialloc_full(&ialloc)) {
+        return false;
+    }
+    // Allocate driver data buffers, counting an allocation that fails with enough cells free in the statistics
+    drv_addr = 0;
+    if ((cli_code == BLK_REQ_READ || cli_code == BLK_REQ_WRITE) && !zero_copy
+        && fsmalloc_alloc(&fsmalloc, &drv_addr, cli_count)) {
+#if defined(DEBUG_BLK_VIRT)
+        fsmalloc_stats_t stats;
+        fsmalloc_stats(&fsmalloc, &stats);
+        LOG_BLK_VIRT("No driver buffers for %u blocks: %lu free in %lu runs, largest allocation %lu, %lu failed\n",
+                     cli_count, stats.free_cells, stats.free_runs, stats.largest_alloc, stats.failed_allocs);
+#endif
+        return false;
+    }
+
+    err = blk_queue_skip_req(&h);
+    assert(!err);
+
+    drv_io = 0;
+    switch (cli_code) {
+    case BLK_REQ_READ:
+        if (zero_copy) {
+            // Write back any of the client's data in the cache, so that it cannot be evicted over the transfer
+            cache_clean(cli_offset + cli_data_base, cli_offset + cli_data_base + (BLK_TRANSFER_SIZE * cli_count));
+            drv_io = cli_offset + cli_data_paddr;
             break;
-        case BLK_REQ_FLUSH:
-        case BLK_REQ_BARRIER:
-            if (blk_queue_full_req(&drv_h) || ialloc_full(&ialloc)) {
-                continue;
-            }
+        }
+        drv_io = BLK_DRIV_TO_PADDR(drv_addr);
+        break;
+    case BLK_REQ_WRITE:
+        if (zero_copy) {
+            // Flush the cache, the device reads the client's data region directly
+            cache_clean(cli_offset + cli_data_base, cli_offset + cli_data_base + (BLK_TRANSFER_SIZE * cli_count));
+            drv_io = cli_offset + cli_data_paddr;
             break;
         }
+        // Copy data buffers from client to driver
+        sddf_memcpy((void *)drv_addr, (void *)(cli_offset + cli_data_base), BLK_TRANSFER_SIZE * cli_count);
+        // Flush the cache
+        cache_clean(drv_addr, drv_addr + (BLK_TRANSFER_SIZE * cli_count));
+        drv_io = BLK_DRIV_TO_PADDR(drv_addr);
+        break;
+    case BLK_REQ_FLUSH:
+    case BLK_REQ_BARRIER:
+        break;
+    }
 
-        // Bookkeep client request and generate driver req ID
-        reqbk_t cli_data = {cli_id, cli_req_id, cli_offset + cli_data_base, drv_addr, cli_count, cli_code};
-        err = ialloc_alloc(&ialloc, &drv_req_id);
-        assert(!err);
-        reqbk[drv_req_id] = cli_data;
+    // Bookkeep client request and generate driver req ID
+    reqbk_t cli_data = {cli_id, cli_id, cli_req_id, cli_offset + cli_data_base, drv_addr, cli_count, cli_code,
+                        drv_block_number, REQBK_NONE};
+#if BLK_CACHE_TIMING
+    cli_data.start = start;
+#endif
+    err = ialloc_alloc(&ialloc, &drv_req_id);
+    assert(!err);
+    reqbk[drv_req_id] = cli_data;
 
-        err = blk_enqueue_req(&drv_h, cli_code, BLK_DRIV_TO_PADDR(drv_addr), drv_block_number, cli_count, drv_req_id);
-        assert(!err);
+    submit_request(cli_code, drv_io, drv_block_number, cli_count, drv_req_id);
+    clients[cli_id].inflight++;
+
+#if BLK_CACHE_MODE != BLK_CACHE_OFF
+    if (cli_code == BLK_REQ_READ) {
+        cache_reserve(drv_req_id, drv_block_number, cli_count);
+    }
+#endif
+
+#if BLK_READAHEAD
+    // Read ahead after the client's read so that the driver serves the read first
+    if (cli_code == BLK_REQ_READ) {
+        readahead(cli_id, drv_block_number, cli_count);
+    }
+#endif
+
+    return true;
+}
+
+/*
+ * Submit client requests in the order chosen by the scheduler.
+ *
+ * @return whether any request was submitted to the driver.
+ */
+static bool handle_clients()
+{
+    uint64_t cli_requests = merge_cli_requests;
+    bool blocked[BLK_NUM_CLIENTS] = { false };
+    int cli_id;
+    while ((cli_id = sched_next(blocked)) >= 0) {
+        uint16_t count;
+        if (!handle_request(cli_id, &count)) {
+            // Skip the client for the rest of the round, the requests of others may still be served
+            blocked[cli_id] = true;
+            continue;
+        }
+        sched_submitted(cli_id, count);
     }
+    merge_flush();
+
+    return merge_cli_requests != cli_requests;
 }
 
 void notified(microkit_channel ch)
@@ -381,10 +1079,11 @@ void notified(microkit_channel ch)
 
     if (ch == DRIVER_CH) {
         handle_driver();
-    } else {
-        for (int i = 0; i < BLK_NUM_CLIENTS; i++) {
-            handle_client(i);
-        }
+    }
+
+    // Completed requests may have freed resources that queued requests were waiting on
+    if (handle_clients()) {
         microkit_deferred_notify(DRIVER_CH);
     }
+    notify_clients();
 }
@@ -913,7 +913,7 @@ void handle_clients(void)
             driver_state.data_transfer = DataStateInit;
 
             status = BLK_RESP_OK;
-            success_count = 1;
+            success_count = req_count;
             break;
 
         case BLK_REQ_WRITE:
@@ -925,7 +925,7 @@ void handle_clients(void)
             driver_state.data_transfer = DataStateInit;
 
             status = BLK_RESP_OK;
-            success_count = 1;
+            success_count = req_count;
             break;
 
         case BLK_REQ_FLUSH:
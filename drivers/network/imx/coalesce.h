@@ -0,0 +1,125 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sddf/util/util.h>
+
+#include "ethernet.h"
+
+/*
+ * Interrupt coalescing of the ENET. The device raises an interrupt once the
+ * frame threshold of a coalescing register has been reached, or the timer
+ * threshold has expired after the first frame, whichever comes first.
+ *
+ * In adaptive mode the receive thresholds are stepped between levels, from
+ * no coalescing up to the configured thresholds, depending on how many
+ * packets each receive interrupt harvests.
+ */
+
+/* The coalescing timer counts in units of 64 cycles of the transmit clock, 125MHz at 1000Mbps */
+#define IC_CLK_MHZ 125
+#define IC_USECS_MAX (ICTT(~0U) * 64 / IC_CLK_MHZ)
+
+/* Receive coalescing levels, each coalescing four times as many frames as the one below */
+#define COALESCE_LEVELS 4
+/* Number of receive interrupts between adjustments of the coalescing level */
+#define COALESCE_WINDOW 64
+
+typedef struct coalesce {
+    /* receive thresholds of the highest level */
+    uint32_t max_frames;
+    uint32_t max_usecs;
+    /* current level */
+    uint32_t level;
+    /* receive interrupts since the level was last adjusted, and packets they harvested */
+    uint32_t irqs;
+    uint32_t packets;
+} coalesce_t;
+
+/**
+ * Encode the value of a coalescing register.
+ *
+ * @param frames frame threshold, 1 or less disables coalescing.
+ * @param usecs timer threshold in microseconds, at most IC_USECS_MAX.
+ *
+ * @return value of the coalescing register.
+ */
+static inline uint32_t coalesce_reg(uint32_t frames, uint32_t usecs)
+{
+    if (frames <= 1) {
+        return 0;
+    }
+    /* A zero timer threshold would leave the last frames of a burst waiting indefinitely */
+    uint32_t ticks = MAX(usecs * IC_CLK_MHZ / 64, 1);
+    return ICEN | ICFT(frames) | ICTT(ticks);
+}
+
+static inline uint32_t coalesce_frames(coalesce_t *c, uint32_t level)
+{
+    return MAX(c->max_frames >> (2 * (COALESCE_LEVELS - 1 - level)), 1);
+}
+
+static inline uint32_t coalesce_usecs(coalesce_t *c, uint32_t level)
+{
+    return c->max_usecs >> (2 * (COALESCE_LEVELS - 1 - level));
+}
+
+/**
+ * Start adaptive receive coalescing at the lowest level.
+ *
+ * @param c coalescing state to initialise.
+ * @param eth device registers.
+ * @param max_frames frame threshold of the highest level.
+ * @param max_usecs timer threshold of the highest level, in microseconds.
+ */
+static inline void coalesce_init(coalesce_t *c, volatile struct enet_regs *eth, uint32_t max_frames,
+                                 uint32_t max_usecs)
+{
+    c->max_frames = max_frames;
+    c->max_usecs = max_usecs;
+    c->level = 0;
+    c->irqs = 0;
+    c->packets = 0;
+    eth->rxic0 = coalesce_reg(coalesce_frames(c, 0), coalesce_usecs(c, 0));
+}
+
+/**
+ * Account for a receive interrupt, adjusting the receive coalescing level
+ * once every COALESCE_WINDOW interrupts.
+ *
+ * Interrupts that each harvest close to the frame threshold mean packets are
+ * arriving faster than the coalescing timer expires, so coalesce more. When
+ * they harvest few, coalesce less to keep latency low.
+ *
+ * @param c coalescing state.
+ * @param eth device registers, the receive coalescing register is only written when the level changes.
+ * @param packets number of packets the interrupt harvested.
+ */
+static inline void coalesce_adapt(coalesce_t *c, volatile struct enet_regs *eth, uint32_t packets)
+{
+    c->irqs++;
+    c->packets += packets;
+    if (c->irqs < COALESCE_WINDOW) {
+        return;
+    }
+
+    uint32_t avg = c->packets / c->irqs;
+    uint32_t frames = coalesce_frames(c, c->level);
+    uint32_t level = c->level;
+    if (level + 1 < COALESCE_LEVELS && avg >= MAX(frames * 3 / 4, 2)) {
+        level++;
+    } else if (level > 0 && avg * 2 < frames) {
+        level--;
+    }
+
+    if (level != c->level) {
+        c->level = level;
+        eth->rxic0 = coalesce_reg(coalesce_frames(c, level), coalesce_usecs(c, level));
+    }
+    c->irqs = 0;
+    c->packets = 0;
+}
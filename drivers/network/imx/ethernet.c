@@ -7,12 +7,14 @@
 #include <stdint.h>
 #include <microkit.h>
 #include <sddf/network/queue.h>
+#include <sddf/network/hw_ring.h>
 #include <sddf/util/util.h>
 #include <sddf/util/fence.h>
 #include <sddf/util/printf.h>
 #include <ethernet_config.h>
 
 #include "ethernet.h"
+#include "coalesce.h"
 
 #define IRQ_CH 0
 #define TX_CH  1
@@ -26,9 +28,14 @@ net_queue_t *rx_active;
 net_queue_t *tx_free;
 net_queue_t *tx_active;
 
+#if NET_TRACE
+/* Trace region */
+uintptr_t net_trace;
+net_trace_handle_t trace;
+#endif
+
 #define RX_COUNT 256
 #define TX_COUNT 256
-#define MAX_COUNT MAX(RX_COUNT, TX_COUNT)
 
 _Static_assert((RX_COUNT + TX_COUNT) * 2 * NET_BUFFER_SIZE <= NET_DATA_REGION_SIZE,
                "Expect rx+tx buffers to fit in single 2MB page");
@@ -40,38 +47,37 @@ struct descriptor {
     uint32_t addr;
 };
 
-/* HW ring buffer data type */
-typedef struct {
-    unsigned int tail; /* index to insert at */
-    unsigned int head; /* index to remove from */
-    net_buff_desc_t descr_mdata[MAX_COUNT]; /* associated meta data array */
-    volatile struct descriptor *descr; /* buffer descripter array */
-} hw_ring_t;
-
-hw_ring_t rx; /* Rx NIC ring */
-hw_ring_t tx; /* Tx NIC ring */
+net_hw_ring_t rx; /* Rx NIC ring */
+net_hw_ring_t tx; /* Tx NIC ring */
+net_buff_desc_t rx_buffers[RX_COUNT];
+net_buff_desc_t tx_buffers[TX_COUNT];
+volatile struct descriptor *rx_descr;
+volatile struct descriptor *tx_descr;
 
 net_queue_handle_t rx_queue;
 net_queue_handle_t tx_queue;
 
 #define MAX_PACKET_SIZE     1536
 
-volatile struct enet_regs *eth;
+_Static_assert(MAX_PACKET_SIZE <= NET_BUFFER_SIZE - NET_BUFFER_HEADROOM,
+               "Received frames must fit in a buffer after its headroom");
 
-static inline bool hw_ring_full(hw_ring_t *ring, size_t ring_size)
-{
-    return !((ring->tail - ring->head + 1) % ring_size);
-}
+_Static_assert(NET_DRIV_COALESCE_RX_USECS <= IC_USECS_MAX && NET_DRIV_COALESCE_TX_USECS <= IC_USECS_MAX,
+               "Coalescing time exceeds the range of the coalescing timer.");
 
-static inline bool hw_ring_empty(hw_ring_t *ring, size_t ring_size)
-{
-    return !((ring->tail - ring->head) % ring_size);
-}
+#if NET_DRIV_COALESCE_ADAPTIVE
+coalesce_t coalesce;
+#endif
+
+volatile struct enet_regs *eth;
 
-static void update_ring_slot(hw_ring_t *ring, unsigned int idx, uintptr_t phys,
-                             uint16_t len, uint16_t stat)
+#if NET_DRIV_POLL
+/* Device interrupts are masked and the rings are harvested on virtualiser notifications */
+static bool polling;
+#endif
+
+static void update_ring_slot(volatile struct descriptor *d, uintptr_t phys, uint16_t len, uint16_t stat)
 {
-    volatile struct descriptor *d = &(ring->descr[idx]);
     d->addr = phys;
     d->len = len;
 
@@ -84,111 +90,127 @@ static void update_ring_slot(hw_ring_t *ring, unsigned int idx, uintptr_t phys,
 
 static void rx_provide(void)
 {
+    bool provided = false;
     bool reprocess = true;
     while (reprocess) {
-        while (!hw_ring_full(&rx, RX_COUNT) && !net_queue_empty_free(&rx_queue)) {
+        while (!net_hw_ring_full(&rx) && !net_queue_empty_free(&rx_queue)) {
             net_buff_desc_t buffer;
             int err = net_dequeue_free(&rx_queue, &buffer);
             assert(!err);
 
+            uint32_t slot = net_hw_ring_push(&rx, buffer);
             uint16_t stat = RXD_EMPTY;
-            if (rx.tail + 1 == RX_COUNT) {
+            if (net_hw_ring_last_slot(&rx, slot)) {
                 stat |= WRAP;
             }
-            rx.descr_mdata[rx.tail] = buffer;
-            update_ring_slot(&rx, rx.tail, buffer.io_or_offset, 0, stat);
-            rx.tail = (rx.tail + 1) % RX_COUNT;
-            eth->rdar = RDAR_RDAR;
+            update_ring_slot(&rx_descr[slot], buffer.io_or_offset, 0, stat);
+            provided = true;
         }
 
-        /* Only request a notification from virtualiser if HW ring not full */
-        if (!hw_ring_full(&rx, RX_COUNT)) {
+        /* Only request a notification from virtualiser if HW ring not full, or
+         * if polling, as returned buffers are what drive the next poll */
+#if NET_DRIV_POLL
+        if (!net_hw_ring_full(&rx) || polling) {
+#else
+        if (!net_hw_ring_full(&rx)) {
+#endif
             net_request_signal_free(&rx_queue);
         } else {
             net_cancel_signal_free(&rx_queue);
         }
         reprocess = false;
 
-        if (!net_queue_empty_free(&rx_queue) && !hw_ring_full(&rx, RX_COUNT)) {
+        if (!net_queue_empty_free(&rx_queue) && !net_hw_ring_full(&rx)) {
             net_cancel_signal_free(&rx_queue);
             reprocess = true;
         }
     }
+
+    /* A single doorbell covers every descriptor made available */
+    if (provided) {
+        eth->rdar = RDAR_RDAR;
+    }
 }
 
-static void rx_return(void)
+static uint32_t rx_return(uint32_t budget)
 {
-    bool packets_transferred = false;
-    while (!hw_ring_empty(&rx, RX_COUNT)) {
+    uint32_t packets_transferred = 0;
+    while (packets_transferred < budget && !net_hw_ring_empty(&rx)) {
         /* If buffer slot is still empty, we have processed all packets the device has filled */
-        volatile struct descriptor *d = &(rx.descr[rx.head]);
+        volatile struct descriptor *d = &rx_descr[net_hw_ring_head_slot(&rx)];
         if (d->stat & RXD_EMPTY) {
             break;
         }
 
-        net_buff_desc_t buffer = rx.descr_mdata[rx.head];
+        net_buff_desc_t buffer = net_hw_ring_pop(&rx);
         buffer.len = d->len;
+#if NET_TRACE
+        net_trace_stamp(&trace.rx[net_trace_slot(buffer.io_or_offset, NET_RX_DATA_REGION_SIZE_DRIV)], NET_TRACE_DRIVER);
+#endif
         int err = net_enqueue_active(&rx_queue, buffer);
         assert(!err);
 
-        packets_transferred = true;
-        rx.head = (rx.head + 1) % RX_COUNT;
+        packets_transferred++;
     }
 
     if (packets_transferred && net_require_signal_active(&rx_queue)) {
         net_cancel_signal_active(&rx_queue);
         microkit_notify(RX_CH);
     }
+
+    return packets_transferred;
 }
 
 static void tx_provide(void)
 {
+    bool provided = false;
     bool reprocess = true;
     while (reprocess) {
-        while (!(hw_ring_full(&tx, TX_COUNT)) && !net_queue_empty_active(&tx_queue)) {
+        while (!net_hw_ring_full(&tx) && !net_queue_empty_active(&tx_queue)) {
             net_buff_desc_t buffer;
             int err = net_dequeue_active(&tx_queue, &buffer);
             assert(!err);
 
+            uint32_t slot = net_hw_ring_push(&tx, buffer);
             uint16_t stat = TXD_READY | TXD_ADDCRC | TXD_LAST;
-            if (tx.tail + 1 == TX_COUNT) {
+            if (net_hw_ring_last_slot(&tx, slot)) {
                 stat |= WRAP;
             }
-            tx.descr_mdata[tx.tail] = buffer;
-            update_ring_slot(&tx, tx.tail, buffer.io_or_offset, buffer.len, stat);
-
-            tx.tail = (tx.tail + 1) % TX_COUNT;
-            eth->tdar = TDAR_TDAR;
+            update_ring_slot(&tx_descr[slot], buffer.io_or_offset, buffer.len, stat);
+            provided = true;
         }
 
         net_request_signal_active(&tx_queue);
         reprocess = false;
 
-        if (!hw_ring_full(&tx, TX_COUNT) && !net_queue_empty_active(&tx_queue)) {
+        if (!net_hw_ring_full(&tx) && !net_queue_empty_active(&tx_queue)) {
             net_cancel_signal_active(&tx_queue);
             reprocess = true;
         }
     }
+
+    /* A single doorbell covers every descriptor made ready */
+    if (provided) {
+        eth->tdar = TDAR_TDAR;
+    }
 }
 
-static void tx_return(void)
+static void tx_return(uint32_t budget)
 {
-    bool enqueued = false;
-    while (!hw_ring_empty(&tx, TX_COUNT)) {
+    uint32_t enqueued = 0;
+    while (enqueued < budget && !net_hw_ring_empty(&tx)) {
         /* Ensure that this buffer has been sent by the device */
-        volatile struct descriptor *d = &(tx.descr[tx.head]);
+        volatile struct descriptor *d = &tx_descr[net_hw_ring_head_slot(&tx)];
         if (d->stat & TXD_READY) {
             break;
         }
 
-        net_buff_desc_t buffer = tx.descr_mdata[tx.head];
+        net_buff_desc_t buffer = net_hw_ring_pop(&tx);
         buffer.len = 0;
 
-        tx.head = (tx.head + 1) % TX_COUNT;
-
         int err = net_enqueue_free(&tx_queue, buffer);
         assert(!err);
-        enqueued = true;
+        enqueued++;
     }
 
     if (enqueued && net_require_signal_free(&tx_queue)) {
@@ -197,22 +219,59 @@ static void tx_return(void)
     }
 }
 
+#if NET_DRIV_POLL
+static void poll_start(void)
+{
+    polling = true;
+    eth->eimr = NETIRQ_EBERR;
+}
+
+/* Harvest one budget of completions, leaving poll mode once the RX ring is drained */
+static void poll(void)
+{
+    tx_return(NET_DRIV_POLL_BUDGET);
+    if (rx_return(NET_DRIV_POLL_BUDGET) < NET_DRIV_POLL_BUDGET) {
+        polling = false;
+        /* Events that occurred while masked are latched in EIR and raise an interrupt once unmasked */
+        eth->eimr = IRQ_MASK;
+    }
+    rx_provide();
+}
+#endif
+
 static void handle_irq(void)
 {
     uint32_t e = eth->eir & IRQ_MASK;
     eth->eir = e;
 
     while (e & IRQ_MASK) {
+        if (e & NETIRQ_EBERR) {
+            sddf_dprintf("ETH|ERROR: System bus/uDMA\n");
+        }
         if (e & NETIRQ_TXF) {
-            tx_return();
+            tx_return(TX_COUNT);
         }
         if (e & NETIRQ_RXF) {
-            rx_return();
+#if NET_DRIV_POLL
+            uint32_t packets = rx_return(NET_DRIV_POLL_BUDGET);
+#elif NET_DRIV_COALESCE_ADAPTIVE
+            uint32_t packets = rx_return(RX_COUNT);
+#else
+            rx_return(RX_COUNT);
+#endif
+#if NET_DRIV_COALESCE_ADAPTIVE
+            coalesce_adapt(&coalesce, eth, packets);
+#endif
+#if NET_DRIV_POLL
+            if (packets >= NET_DRIV_POLL_THRESHOLD) {
+                /* Under load, keep harvesting on notifications rather than taking an interrupt per batch */
+                poll_start();
+                rx_provide();
+                return;
+            }
+#endif
             rx_provide();
         }
-        if (e & NETIRQ_EBERR) {
-            sddf_dprintf("ETH|ERROR: System bus/uDMA\n");
-        }
         e = eth->eir & IRQ_MASK;
         eth->eir = e;
     }
@@ -224,8 +283,10 @@ static void eth_setup(void)
     uint32_t h = eth->paur;
 
     /* Set up HW rings */
-    rx.descr = (volatile struct descriptor *)hw_ring_buffer_vaddr;
-    tx.descr = (volatile struct descriptor *)(hw_ring_buffer_vaddr + (sizeof(struct descriptor) * RX_COUNT));
+    rx_descr = (volatile struct descriptor *)hw_ring_buffer_vaddr;
+    tx_descr = (volatile struct descriptor *)(hw_ring_buffer_vaddr + (sizeof(struct descriptor) * RX_COUNT));
+    net_hw_ring_init(&rx, rx_buffers, RX_COUNT, RX_COUNT - 1);
+    net_hw_ring_init(&tx, tx_buffers, TX_COUNT, TX_COUNT - 1);
 
     /* Perform reset */
     eth->ecr = ECR_RESET;
@@ -263,8 +324,13 @@ static void eth_setup(void)
 
     eth->opd = PAUSE_OPCODE_FIELD;
 
-    /* coalesce transmit IRQs to batches of 128 */
-    eth->txic0 = ICEN | ICFT(128) | 0xFF;
+    /* Coalesce IRQs, receive starts at the lowest level in adaptive mode */
+    eth->txic0 = coalesce_reg(NET_DRIV_COALESCE_TX_FRAMES, NET_DRIV_COALESCE_TX_USECS);
+#if NET_DRIV_COALESCE_ADAPTIVE
+    coalesce_init(&coalesce, eth, NET_DRIV_COALESCE_RX_FRAMES, NET_DRIV_COALESCE_RX_USECS);
+#else
+    eth->rxic0 = coalesce_reg(NET_DRIV_COALESCE_RX_FRAMES, NET_DRIV_COALESCE_RX_USECS);
+#endif
     eth->tipg = TIPG;
     /* Transmit FIFO Watermark register - store and forward */
     eth->tfwr = STRFWD;
@@ -300,6 +366,10 @@ static void eth_setup(void)
 
 void init(void)
 {
+#if NET_TRACE
+    net_trace_init_sys(microkit_name, net_trace, &trace);
+#endif
+
     eth_setup();
 
     net_queue_init(&rx_queue, rx_free, rx_active, NET_RX_QUEUE_SIZE_DRIV);
@@ -321,10 +391,21 @@ void notified(microkit_channel ch)
         microkit_deferred_irq_ack(ch);
         break;
     case RX_CH:
+#if NET_DRIV_POLL
+        if (polling) {
+            poll();
+            break;
+        }
+#endif
         rx_provide();
         break;
     case TX_CH:
         tx_provide();
+#if NET_DRIV_POLL
+        if (polling) {
+            poll();
+        }
+#endif
         break;
     default:
         sddf_dprintf("ETH|LOG: received notification on unexpected channel: %u\n", ch);
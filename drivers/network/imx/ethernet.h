@@ -71,7 +71,8 @@
 #define RACC_IPDIS      (1UL << 1) /* check the IP checksum and discard if wrong. */
 #define RACC_PRODIS     (1UL << 2) /* check protocol checksum and discard if wrong. */
 
-#define ICFT(x)       (((x) & 0xff) << 20)
+#define ICFT(x)       (((x) & 0xff) << 20) /* Interrupt coalescing frame threshold */
+#define ICTT(x)       ((x) & 0xffff) /* Interrupt coalescing timer threshold */
 #define RCR_MAX_FL(x) (((x) & 0x3fff) << 16) /* Maximum Frame Length */
 
 /* Hardware registers */
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <microkit.h>
 #include <sddf/network/queue.h>
+#include <sddf/network/hw_ring.h>
 #include <sddf/util/fence.h>
 #include <sddf/util/util.h>
 #include <sddf/util/printf.h>
@@ -26,9 +27,14 @@ net_queue_t *rx_active;
 net_queue_t *tx_free;
 net_queue_t *tx_active;
 
+#if NET_TRACE
+/* Trace region */
+uintptr_t net_trace;
+net_trace_handle_t trace;
+#endif
+
 #define RX_COUNT 256
 #define TX_COUNT 256
-#define MAX_COUNT MAX(RX_COUNT, TX_COUNT)
 
 /* The same as Linux's default for pause frame timeout */
 const uint32_t pause_time = 0xffff;
@@ -42,16 +48,15 @@ struct descriptor {
 
 _Static_assert((RX_COUNT + TX_COUNT) * sizeof(struct descriptor) <= NET_HW_REGION_SIZE,
                "Expect rx+tx buffers to fit in single 2MB page");
+_Static_assert(MAX_RX_FRAME_SZ <= NET_BUFFER_SIZE - NET_BUFFER_HEADROOM,
+               "Received frames must fit in a buffer after its headroom");
 
-typedef struct {
-    unsigned int tail; /* index to insert at */
-    unsigned int head; /* index to remove from */
-    net_buff_desc_t descr_mdata[MAX_COUNT]; /* associated meta data array */
-    volatile struct descriptor *descr; /* buffer descripter array */
-} hw_ring_t;
-
-hw_ring_t rx;
-hw_ring_t tx;
+net_hw_ring_t rx;
+net_hw_ring_t tx;
+net_buff_desc_t rx_buffers[RX_COUNT];
+net_buff_desc_t tx_buffers[TX_COUNT];
+volatile struct descriptor *rx_descr;
+volatile struct descriptor *tx_descr;
 
 net_queue_handle_t rx_queue;
 net_queue_handle_t tx_queue;
@@ -59,20 +64,14 @@ net_queue_handle_t tx_queue;
 volatile struct eth_mac_regs *eth_mac;
 volatile struct eth_dma_regs *eth_dma;
 
-static inline bool hw_ring_full(hw_ring_t *ring, size_t ring_size)
-{
-    return !((ring->tail + 2 - ring->head) % ring_size);
-}
-
-static inline bool hw_ring_empty(hw_ring_t *ring, size_t ring_size)
-{
-    return !((ring->tail - ring->head) % ring_size);
-}
+#if NET_DRIV_POLL
+/* Device interrupts are masked and the rings are harvested on virtualiser notifications */
+static bool polling;
+#endif
 
-static void update_ring_slot(hw_ring_t *ring, unsigned int idx, uint32_t status,
-                             uint32_t cntl, uint32_t phys, uint32_t next)
+static void update_ring_slot(volatile struct descriptor *d, uint32_t status, uint32_t cntl, uint32_t phys,
+                             uint32_t next)
 {
-    volatile struct descriptor *d = &(ring->descr[idx]);
     d->addr = phys;
     d->next = next;
     d->cntl = cntl;
@@ -83,122 +82,134 @@ static void update_ring_slot(hw_ring_t *ring, unsigned int idx, uint32_t status,
     d->status = status;
 }
 
+static void rx_post(net_buff_desc_t buffer)
+{
+    uint32_t slot = net_hw_ring_push(&rx, buffer);
+    uint32_t cntl = (MAX_RX_FRAME_SZ << DESC_RXCTRL_SIZE1SHFT) & DESC_RXCTRL_SIZE1MASK;
+    if (net_hw_ring_last_slot(&rx, slot)) {
+        cntl |= DESC_RXCTRL_RXRINGEND;
+    }
+    update_ring_slot(&rx_descr[slot], DESC_RXSTS_OWNBYDMA, cntl, buffer.io_or_offset, 0);
+}
+
 static void rx_provide()
 {
+    bool provided = false;
     bool reprocess = true;
     while (reprocess) {
-        while (!hw_ring_full(&rx, RX_COUNT) && !net_queue_empty_free(&rx_queue)) {
+        while (!net_hw_ring_full(&rx) && !net_queue_empty_free(&rx_queue)) {
             net_buff_desc_t buffer;
             int err = net_dequeue_free(&rx_queue, &buffer);
             assert(!err);
 
-            uint32_t cntl = (MAX_RX_FRAME_SZ << DESC_RXCTRL_SIZE1SHFT) & DESC_RXCTRL_SIZE1MASK;
-            if (rx.tail + 1 == RX_COUNT) {
-                cntl |= DESC_RXCTRL_RXRINGEND;
-            }
-
-            rx.descr_mdata[rx.tail] = buffer;
-            update_ring_slot(&rx, rx.tail, DESC_RXSTS_OWNBYDMA, cntl, buffer.io_or_offset, 0);
-            eth_dma->rxpolldemand = POLL_DATA;
-
-            rx.tail = (rx.tail + 1) % RX_COUNT;
+            rx_post(buffer);
+            provided = true;
         }
 
         net_request_signal_free(&rx_queue);
         reprocess = false;
 
-        if (!net_queue_empty_free(&rx_queue) && !hw_ring_full(&rx, RX_COUNT)) {
+        if (!net_queue_empty_free(&rx_queue) && !net_hw_ring_full(&rx)) {
             net_cancel_signal_free(&rx_queue);
             reprocess = true;
         }
     }
+
+    /* A single poll demand covers every descriptor made available */
+    if (provided) {
+        eth_dma->rxpolldemand = POLL_DATA;
+    }
 }
 
-static void rx_return(void)
+static uint32_t rx_return(uint32_t budget)
 {
-    bool packets_transferred = false;
-    while (!hw_ring_empty(&rx, RX_COUNT)) {
+    uint32_t packets_transferred = 0;
+    bool reposted = false;
+    while (packets_transferred < budget && !net_hw_ring_empty(&rx)) {
         /* If buffer slot is still empty, we have processed all packets the device has filled */
-        volatile struct descriptor *d = &(rx.descr[rx.head]);
+        volatile struct descriptor *d = &rx_descr[net_hw_ring_head_slot(&rx)];
         if (d->status & DESC_RXSTS_OWNBYDMA) {
             break;
         }
-        net_buff_desc_t buffer = rx.descr_mdata[rx.head];
+        net_buff_desc_t buffer = net_hw_ring_pop(&rx);
         THREAD_MEMORY_ACQUIRE();
 
         if (d->status & DESC_RXSTS_ERROR) {
             sddf_dprintf("ETH|ERROR: RX descriptor returned with error status %x\n", d->status);
-            uint32_t cntl = (MAX_RX_FRAME_SZ << DESC_RXCTRL_SIZE1SHFT) & DESC_RXCTRL_SIZE1MASK;
-            if (rx.tail + 1 == RX_COUNT) {
-                cntl |= DESC_RXCTRL_RXRINGEND;
-            }
-
-            rx.descr_mdata[rx.tail] = buffer;
-            update_ring_slot(&rx, rx.tail, DESC_RXSTS_OWNBYDMA, cntl, buffer.io_or_offset, 0);
-            eth_dma->rxpolldemand = POLL_DATA;
-            rx.tail = (rx.tail + 1) % RX_COUNT;
+            rx_post(buffer);
+            reposted = true;
         } else {
             buffer.len = (d->status & DESC_RXSTS_LENMSK) >> DESC_RXSTS_LENSHFT;
+#if NET_TRACE
+            net_trace_stamp(&trace.rx[net_trace_slot(buffer.io_or_offset, NET_RX_DATA_REGION_SIZE_DRIV)], NET_TRACE_DRIVER);
+#endif
             int err = net_enqueue_active(&rx_queue, buffer);
             assert(!err);
-            packets_transferred = true;
+            packets_transferred++;
         }
-        rx.head = (rx.head + 1) % RX_COUNT;
+    }
+
+    if (reposted) {
+        eth_dma->rxpolldemand = POLL_DATA;
     }
 
     if (packets_transferred && net_require_signal_active(&rx_queue)) {
         net_cancel_signal_active(&rx_queue);
         microkit_notify(RX_CH);
     }
+
+    return packets_transferred;
 }
 
 static void tx_provide(void)
 {
+    bool provided = false;
     bool reprocess = true;
     while (reprocess) {
-        while (!(hw_ring_full(&tx, TX_COUNT)) && !net_queue_empty_active(&tx_queue)) {
+        while (!net_hw_ring_full(&tx) && !net_queue_empty_active(&tx_queue)) {
             net_buff_desc_t buffer;
             int err = net_dequeue_active(&tx_queue, &buffer);
             assert(!err);
 
+            uint32_t slot = net_hw_ring_push(&tx, buffer);
             uint32_t cntl = (((uint32_t) buffer.len) << DESC_TXCTRL_SIZE1SHFT) & DESC_TXCTRL_SIZE1MASK;
             cntl |= DESC_TXCTRL_TXLAST | DESC_TXCTRL_TXFIRST | DESC_TXCTRL_TXINT;
-            if (tx.tail + 1 == TX_COUNT) {
+            if (net_hw_ring_last_slot(&tx, slot)) {
                 cntl |= DESC_TXCTRL_TXRINGEND;
             }
-            tx.descr_mdata[tx.tail] = buffer;
-            update_ring_slot(&tx, tx.tail, DESC_TXSTS_OWNBYDMA, cntl, buffer.io_or_offset, 0);
-
-            tx.tail = (tx.tail + 1) % TX_COUNT;
+            update_ring_slot(&tx_descr[slot], DESC_TXSTS_OWNBYDMA, cntl, buffer.io_or_offset, 0);
+            provided = true;
         }
 
         net_request_signal_active(&tx_queue);
         reprocess = false;
 
-        if (!hw_ring_full(&tx, TX_COUNT) && !net_queue_empty_active(&tx_queue)) {
+        if (!net_hw_ring_full(&tx) && !net_queue_empty_active(&tx_queue)) {
             net_cancel_signal_active(&tx_queue);
             reprocess = true;
         }
     }
-    eth_dma->txpolldemand = POLL_DATA;
+
+    if (provided) {
+        eth_dma->txpolldemand = POLL_DATA;
+    }
 }
 
-static void tx_return(void)
+static void tx_return(uint32_t budget)
 {
-    bool enqueued = false;
-    while (!hw_ring_empty(&tx, TX_COUNT)) {
+    uint32_t enqueued = 0;
+    while (enqueued < budget && !net_hw_ring_empty(&tx)) {
         /* Ensure that this buffer has been sent by the device */
-        volatile struct descriptor *d = &(tx.descr[tx.head]);
+        volatile struct descriptor *d = &tx_descr[net_hw_ring_head_slot(&tx)];
         if (d->status & DESC_TXSTS_OWNBYDMA) {
             break;
         }
-        net_buff_desc_t buffer = tx.descr_mdata[tx.head];
+        net_buff_desc_t buffer = net_hw_ring_pop(&tx);
         THREAD_MEMORY_ACQUIRE();
 
         int err = net_enqueue_free(&tx_queue, buffer);
         assert(!err);
-        enqueued = true;
-        tx.head = (tx.head + 1) % TX_COUNT;
+        enqueued++;
     }
 
     if (enqueued && net_require_signal_free(&tx_queue)) {
@@ -207,14 +218,41 @@ static void tx_return(void)
     }
 }
 
+#if NET_DRIV_POLL
+static void poll_start(void)
+{
+    polling = true;
+    eth_dma->intenable &= ~DMA_INTR_NORMAL;
+}
+
+/* Harvest one budget of completions, leaving poll mode once the RX ring is drained */
+static void poll(void)
+{
+    tx_return(NET_DRIV_POLL_BUDGET);
+    if (rx_return(NET_DRIV_POLL_BUDGET) < NET_DRIV_POLL_BUDGET) {
+        polling = false;
+        /* Events that occurred while masked remain in the status register and raise an interrupt once unmasked */
+        eth_dma->intenable |= DMA_INTR_NORMAL;
+    }
+    rx_provide();
+}
+#endif
+
 static void handle_irq()
 {
     uint32_t e = eth_dma->status;
     if (e & DMA_INTR_RXF) {
-        rx_return();
+#if NET_DRIV_POLL
+        if (rx_return(NET_DRIV_POLL_BUDGET) >= NET_DRIV_POLL_THRESHOLD) {
+            /* Under load, keep harvesting on notifications rather than taking an interrupt per batch */
+            poll_start();
+        }
+#else
+        rx_return(RX_COUNT);
+#endif
     }
     if (e & DMA_INTR_TXF) {
-        tx_return();
+        tx_return(TX_COUNT);
     }
     if (e & DMA_INTR_ABNORMAL) {
         if (e & DMA_INTR_FBE) {
@@ -232,8 +270,10 @@ static void eth_setup(void)
 
     assert((hw_ring_buffer_paddr & 0xFFFFFFFF) == hw_ring_buffer_paddr);
 
-    rx.descr = (volatile struct descriptor *)hw_ring_buffer_vaddr;
-    tx.descr = (volatile struct descriptor *)(hw_ring_buffer_vaddr + (sizeof(struct descriptor) * RX_COUNT));
+    rx_descr = (volatile struct descriptor *)hw_ring_buffer_vaddr;
+    tx_descr = (volatile struct descriptor *)(hw_ring_buffer_vaddr + (sizeof(struct descriptor) * RX_COUNT));
+    net_hw_ring_init(&rx, rx_buffers, RX_COUNT, RX_COUNT - 2);
+    net_hw_ring_init(&tx, tx_buffers, TX_COUNT, TX_COUNT - 2);
 
     /* Perform reset */
     eth_dma->busmode |= DMAMAC_SWRST;
@@ -269,6 +309,10 @@ static void eth_setup(void)
 
 void init(void)
 {
+#if NET_TRACE
+    net_trace_init_sys(microkit_name, net_trace, &trace);
+#endif
+
     eth_setup();
 
     net_queue_init(&rx_queue, (net_queue_t *)rx_free, (net_queue_t *)rx_active, NET_RX_QUEUE_SIZE_DRIV);
@@ -298,10 +342,21 @@ void notified(microkit_channel ch)
         microkit_deferred_irq_ack(ch);
         break;
     case RX_CH:
+#if NET_DRIV_POLL
+        if (polling) {
+            poll();
+            break;
+        }
+#endif
         rx_provide();
         break;
     case TX_CH:
         tx_provide();
+#if NET_DRIV_POLL
+        if (polling) {
+            poll();
+        }
+#endif
         break;
     default:
         sddf_dprintf("ETH|LOG: received notification on unexpected channel %u\n", ch);
@@ -53,6 +53,12 @@ net_queue_t *rx_active;
 net_queue_t *tx_free;
 net_queue_t *tx_active;
 
+#if NET_TRACE
+/* Trace region */
+uintptr_t net_trace;
+net_trace_handle_t trace;
+#endif
+
 #define RX_COUNT 512
 #define TX_COUNT 512
 #define MAX_COUNT MAX(RX_COUNT, TX_COUNT)
@@ -70,16 +76,25 @@ net_queue_handle_t tx_queue;
 /*
  * This driver has no use of the virtIO net headers that go before
  * each packet. Our policy is to discard them when we get RX and
- * initialise to the default values on TX. In order to this, we use a
- * separate memory region and not the sDDF data region.
+ * initialise to the default values on TX. On RX, the device writes the
+ * header into the headroom of the buffer, in front of the frame. On TX, we
+ * only have the IO address of the client's buffer and cannot write to it, so
+ * headers are kept in a separate memory region and not the sDDF data region.
  */
 uintptr_t virtio_net_tx_headers_vaddr;
 uintptr_t virtio_net_tx_headers_paddr;
-uintptr_t virtio_net_rx_headers_paddr;
 virtio_net_hdr_t *virtio_net_tx_headers;
 
+_Static_assert(sizeof(virtio_net_hdr_t) <= NET_BUFFER_HEADROOM,
+               "The virtIO net header is received into the buffer headroom.");
+
 volatile virtio_mmio_regs_t *regs;
 
+#if NET_DRIV_POLL
+/* Used buffer notifications are suppressed and the virtqueues are harvested on virtualiser notifications */
+static bool polling;
+#endif
+
 ialloc_t rx_ialloc_desc;
 uint32_t rx_descriptors[RX_COUNT];
 ialloc_t tx_ialloc_desc;
@@ -108,33 +123,20 @@ static void rx_provide(void)
             int err = net_dequeue_free(&rx_queue, &buffer);
             assert(!err);
 
-            // Allocate a desc entry for the header, and one for the packet
-            uint32_t hdr_desc_idx;
-            err = ialloc_alloc(&rx_ialloc_desc, &hdr_desc_idx);
-            assert(!err);
+            // Allocate a single desc entry for the header and the packet
             uint32_t pkt_desc_idx;
             err = ialloc_alloc(&rx_ialloc_desc, &pkt_desc_idx);
             assert(!err);
-
-            assert(hdr_desc_idx < rx_virtq.num);
             assert(pkt_desc_idx < rx_virtq.num);
 
-            // Get the header address, which is an index into the virtio net headers memory region
-            rx_virtq.desc[hdr_desc_idx].addr = virtio_net_rx_headers_paddr + (hdr_desc_idx * sizeof(virtio_net_hdr_t));
-            rx_virtq.desc[hdr_desc_idx].len = sizeof(virtio_net_hdr_t);
-            // Set the next of the header to the packet
-            rx_virtq.desc[hdr_desc_idx].next = pkt_desc_idx;
-            rx_virtq.desc[hdr_desc_idx].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
-            // The packet address will be the actual buffer that we have dequeued from the client
+            // The device writes the header into the headroom, directly in front of the packet
+            net_buff_push(&buffer, sizeof(virtio_net_hdr_t));
             rx_virtq.desc[pkt_desc_idx].addr = buffer.io_or_offset;
-            rx_virtq.desc[pkt_desc_idx].len = NET_BUFFER_SIZE;
+            rx_virtq.desc[pkt_desc_idx].len = NET_BUFFER_SIZE - net_buff_headroom(&buffer);
             rx_virtq.desc[pkt_desc_idx].flags = VIRTQ_DESC_F_WRITE;
-            // Set the entry in the available ring to point to the desc entry for the header
-            rx_virtq.avail->ring[rx_virtq.avail->idx % rx_virtq.num] = hdr_desc_idx;
-            // We only want to increment the avail ring by 1, as we are only increasing by one in
-            // this list, but we are adding two desc entries.
+            rx_virtq.avail->ring[rx_virtq.avail->idx % rx_virtq.num] = pkt_desc_idx;
             rx_virtq.avail->idx++;
-            rx_last_desc_idx += 2;
+            rx_last_desc_idx++;
         }
 
         net_request_signal_free(&rx_queue);
@@ -147,33 +149,33 @@ static void rx_provide(void)
     }
 }
 
-static void rx_return(void)
+static uint16_t rx_return(uint16_t budget)
 {
     /* Extract RX buffers from the 'used' and pass them up to the client by putting them
      * in our sDDF 'active' queues. */
     uint16_t packets_transferred = 0;
     uint16_t i = rx_last_seen_used;
     uint16_t curr_idx = rx_virtq.used->idx;
-    while (i != curr_idx) {
+    while (i != curr_idx && packets_transferred < budget) {
         LOG_DRIVER("i: 0x%lx\n", i);
-        struct virtq_used_elem hdr_used = rx_virtq.used->ring[i % rx_virtq.num];
-        assert(rx_virtq.desc[hdr_used.id].flags & VIRTQ_DESC_F_NEXT);
-
-        struct virtq_desc pkt = rx_virtq.desc[rx_virtq.desc[hdr_used.id].next % rx_virtq.num];
-        uint64_t addr = pkt.addr;
-        uint32_t len = pkt.len;
+        struct virtq_used_elem pkt_used = rx_virtq.used->ring[i % rx_virtq.num];
+        struct virtq_desc pkt = rx_virtq.desc[pkt_used.id];
         assert(!(pkt.flags & VIRTQ_DESC_F_NEXT));
+        assert(pkt_used.len >= sizeof(virtio_net_hdr_t));
 
-        net_buff_desc_t buffer = { addr, len };
+        // The device reports the length of the header and the packet it wrote
+        net_buff_desc_t buffer = { pkt.addr, pkt_used.len };
+        net_buff_pull(&buffer, sizeof(virtio_net_hdr_t));
+#if NET_TRACE
+        net_trace_stamp(&trace.rx[net_trace_slot(buffer.io_or_offset, NET_RX_DATA_REGION_SIZE_DRIV)], NET_TRACE_DRIVER);
+#endif
         int err = net_enqueue_active(&rx_queue, buffer);
         assert(!err);
 
-        err = ialloc_free(&rx_ialloc_desc, hdr_used.id);
-        assert(!err);
-        err = ialloc_free(&rx_ialloc_desc, rx_virtq.desc[hdr_used.id].next);
+        err = ialloc_free(&rx_ialloc_desc, pkt_used.id);
         assert(!err);
 
-        rx_last_desc_idx -= 2;
+        rx_last_desc_idx--;
         assert(rx_last_desc_idx >= 0);
         i++;
         packets_transferred++;
@@ -185,6 +187,8 @@ static void rx_return(void)
         net_cancel_signal_active(&rx_queue);
         microkit_notify(RX_CH);
     }
+
+    return packets_transferred;
 }
 
 static void tx_provide(void)
@@ -216,6 +220,7 @@ static void tx_provide(void)
             hdr->gso_size = 0; /* same */
             hdr->csum_start = 0;
             hdr->csum_offset = 0;
+            hdr->num_buffers = 0;
             tx_virtq.desc[hdr_desc_idx].addr = virtio_net_tx_headers_paddr + (hdr_desc_idx * sizeof(virtio_net_hdr_t));
             tx_virtq.desc[hdr_desc_idx].len = sizeof(virtio_net_hdr_t);
             tx_virtq.desc[hdr_desc_idx].next = pkt_desc_idx;
@@ -246,14 +251,14 @@ static void tx_provide(void)
     }
 }
 
-static void tx_return(void)
+static void tx_return(uint16_t budget)
 {
     /* We must look through the 'used' ring of the TX virtqueue and place them in our
      * sDDF TX free queue. */
     uint16_t enqueued = 0;
     uint16_t i = tx_last_seen_used;
     uint16_t curr_idx = tx_virtq.used->idx;
-    while (i != curr_idx && !net_queue_full_free(&tx_queue)) {
+    while (i != curr_idx && !net_queue_full_free(&tx_queue) && enqueued < budget) {
         /* For each TX free entry in the sDDF queue, there are *two* virtq used entries.
          * One for the virtIO header, and one for the packet. */
         struct virtq_used_elem hdr_used = tx_virtq.used->ring[i % tx_virtq.num];
@@ -287,14 +292,47 @@ static void tx_return(void)
     }
 }
 
+#if NET_DRIV_POLL
+static void poll_start(void)
+{
+    polling = true;
+    rx_virtq.avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    tx_virtq.avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+/* Harvest one budget of completions, leaving poll mode once the RX virtqueue is drained */
+static void poll(void)
+{
+    tx_return(NET_DRIV_POLL_BUDGET);
+    if (rx_return(NET_DRIV_POLL_BUDGET) < NET_DRIV_POLL_BUDGET) {
+        polling = false;
+        rx_virtq.avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+        tx_virtq.avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+        /* The device does not raise an interrupt for buffers it used while notifications were
+         * suppressed, so harvest any used since the last pass. */
+        THREAD_MEMORY_FENCE();
+        rx_return(RX_COUNT);
+        tx_return(TX_COUNT);
+    }
+    rx_provide();
+}
+#endif
+
 static void handle_irq()
 {
     uint32_t irq_status = regs->InterruptStatus;
     if (irq_status & VIRTIO_MMIO_IRQ_VQUEUE) {
         // We don't know whether the IRQ is related to a change to the RX queue
         // or TX queue, so we check both.
-        rx_return();
-        tx_return();
+#if NET_DRIV_POLL
+        if (rx_return(NET_DRIV_POLL_BUDGET) >= NET_DRIV_POLL_THRESHOLD) {
+            /* Under load, keep harvesting on notifications rather than taking an interrupt per batch */
+            poll_start();
+        }
+#else
+        rx_return(RX_COUNT);
+#endif
+        tx_return(TX_COUNT);
         // We have handled the used buffer notification
         regs->InterruptACK = VIRTIO_MMIO_IRQ_VQUEUE;
     }
@@ -334,17 +372,26 @@ static void eth_setup(void)
     // Set the DRIVER bit to say we know how to drive the device
     regs->Status = VIRTIO_DEVICE_STATUS_DRIVER;
 
-#ifdef DEBUG_DRIVER
+    regs->DeviceFeaturesSel = 0;
     uint32_t feature_low = regs->DeviceFeatures;
     regs->DeviceFeaturesSel = 1;
     uint32_t feature_high = regs->DeviceFeatures;
     uint64_t feature = feature_low | ((uint64_t)feature_high << 32);
+#ifdef DEBUG_DRIVER
     virtio_net_print_features(feature);
 #endif
 
-    regs->DriverFeatures = VIRTIO_NET_F_MAC;
+    // The network header includes num_buffers, which is only present with VIRTIO_F_VERSION_1
+    if (!(feature & BIT(VIRTIO_F_VERSION_1))) {
+        LOG_DRIVER_ERR("device does not support VIRTIO_F_VERSION_1!\n");
+        return;
+    }
+
+    // Feature bits are selected 32 at a time
+    regs->DriverFeaturesSel = 0;
+    regs->DriverFeatures = feature_low & BIT(VIRTIO_NET_F_MAC);
     regs->DriverFeaturesSel = 1;
-    regs->DriverFeatures = VIRTIO_F_VERSION_1;
+    regs->DriverFeatures = BIT(VIRTIO_F_VERSION_1 - 32);
 
     regs->Status = VIRTIO_DEVICE_STATUS_FEATURES_OK;
 
@@ -386,15 +433,13 @@ static void eth_setup(void)
     assert((uintptr_t)tx_virtq.avail % 2 == 0);
     assert((uintptr_t)tx_virtq.used % 4 == 0);
 
-    /* Virtio TX headers will proceed the virtq structures. Then RX headers. */
+    /* Virtio TX headers will proceed the virtq structures. RX headers are received into the buffer headroom. */
     virtio_net_tx_headers_vaddr = hw_ring_buffer_vaddr + virtq_size;
     virtio_net_tx_headers_paddr = hw_ring_buffer_paddr + virtq_size;
     virtio_net_tx_headers = (virtio_net_hdr_t *) virtio_net_tx_headers_vaddr;
-    size_t tx_headers_size = ((TX_COUNT / 2) * sizeof(virtio_net_hdr_t));
-    virtio_net_rx_headers_paddr = virtio_net_tx_headers_paddr + tx_headers_size;
-    size_t rx_headers_size = ((RX_COUNT / 2) * sizeof(virtio_net_hdr_t));
+    size_t tx_headers_size = (TX_COUNT * sizeof(virtio_net_hdr_t));
 
-    assert(virtq_size + tx_headers_size + rx_headers_size <= HW_RING_SIZE);
+    assert(virtq_size + tx_headers_size <= HW_RING_SIZE);
 
     rx_provide();
     tx_provide();
@@ -438,6 +483,10 @@ static void eth_setup(void)
 
 void init(void)
 {
+#if NET_TRACE
+    net_trace_init_sys(microkit_name, net_trace, &trace);
+#endif
+
     regs = (volatile virtio_mmio_regs_t *)(eth_regs + VIRTIO_MMIO_NET_OFFSET);
 
     ialloc_init(&rx_ialloc_desc, rx_descriptors, RX_COUNT);
@@ -459,10 +508,21 @@ void notified(microkit_channel ch)
         microkit_deferred_irq_ack(ch);
         break;
     case RX_CH:
+#if NET_DRIV_POLL
+        if (polling) {
+            poll();
+            break;
+        }
+#endif
         rx_provide();
         break;
     case TX_CH:
         tx_provide();
+#if NET_DRIV_POLL
+        if (polling) {
+            poll();
+        }
+#endif
         break;
     default:
         LOG_DRIVER_ERR("received notification on unexpected channel %u\n", ch);
@@ -76,6 +76,7 @@ typedef struct virtio_net_hdr {
     uint16_t gso_size;        /* Bytes to append to hdr_len per frame */
     uint16_t csum_start;  /* Position to start checksumming from */
     uint16_t csum_offset; /* Offset after that to place checksum */
+    uint16_t num_buffers; /* Always present with VIRTIO_F_VERSION_1 */
 } virtio_net_hdr_t;
 
 static void virtio_net_print_config(volatile virtio_net_config_t *config)
@@ -102,6 +103,7 @@ static void virtio_net_print_hdr(volatile virtio_net_hdr_t *hdr)
     sddf_printf("    gso_size: 0x%x\n", hdr->gso_size);
     sddf_printf("    csum_start: 0x%x\n", hdr->csum_start);
     sddf_printf("    csum_offset: 0x%x\n", hdr->csum_offset);
+    sddf_printf("    num_buffers: 0x%x\n", hdr->num_buffers);
 }
 
 static void virtio_net_print_features(uint64_t features)
@@ -29,9 +29,86 @@ _Static_assert(BLK_DATA_REGION_SIZE_CLI0 >= BLK_TRANSFER_SIZE && BLK_DATA_REGION
 _Static_assert(BLK_DATA_REGION_SIZE_DRIV >= BLK_TRANSFER_SIZE && BLK_DATA_REGION_SIZE_DRIV % BLK_TRANSFER_SIZE == 0,
                "Driver data region size must be a multiple of the transfer size");
 
+/*
+ * Maximum number of blocks in a driver request that the virtualiser merges
+ * adjacent client reads or writes into, 1 disables merging.
+ */
+#define BLK_MERGE_MAX_COUNT                 32
+
+_Static_assert(BLK_MERGE_MAX_COUNT >= 1 && BLK_MERGE_MAX_COUNT <= UINT16_MAX,
+               "Merged requests must fit the count of a request");
+
+/*
+ * Cache of blocks in the virtualiser, shared by all clients. In write-through
+ * mode writes go to the device as they are made, in write-back mode they are
+ * held in the cache until they are evicted or a client flushes or issues a
+ * barrier. Off by default.
+ */
+#define BLK_CACHE_OFF                       0
+#define BLK_CACHE_WRITE_THROUGH             1
+#define BLK_CACHE_WRITE_BACK                2
+
+#define BLK_CACHE_MODE                      BLK_CACHE_OFF
+#define BLK_CACHE_REGION_SIZE               BLK_REGION_SIZE
+
+/* Measure the time the virtualiser takes to respond to reads, using the timer */
+#define BLK_CACHE_TIMING                    0
+
+_Static_assert(BLK_CACHE_REGION_SIZE >= BLK_TRANSFER_SIZE && BLK_CACHE_REGION_SIZE % BLK_TRANSFER_SIZE == 0
+               && ((BLK_CACHE_REGION_SIZE / BLK_TRANSFER_SIZE) & (BLK_CACHE_REGION_SIZE / BLK_TRANSFER_SIZE - 1)) == 0,
+               "Cache region must hold a power of two blocks");
+_Static_assert(!BLK_CACHE_TIMING || BLK_CACHE_MODE != BLK_CACHE_OFF, "Timing requires the cache");
+
+/*
+ * Read ahead of each client's sequential reads into the cache. The number of
+ * blocks read ahead grows from the minimum to the maximum while a client keeps
+ * reading sequentially. Off by default, it requires the cache.
+ */
+#define BLK_READAHEAD                       0
+#define BLK_READAHEAD_MIN                   4
+#define BLK_READAHEAD_MAX                   64
+
+_Static_assert(!BLK_READAHEAD || BLK_CACHE_MODE != BLK_CACHE_OFF, "Read-ahead requires the cache");
+_Static_assert(BLK_READAHEAD_MIN >= 1 && BLK_READAHEAD_MIN <= BLK_READAHEAD_MAX
+               && BLK_READAHEAD_MAX <= BLK_CACHE_REGION_SIZE / BLK_TRANSFER_SIZE / 2,
+               "Read-ahead window must leave room in the cache");
+
 /* Mapping from client index to disk partition that the client will have access to. */
 static const int blk_partition_mapping[BLK_NUM_CLIENTS] = { 2 };
 
+/* Policies for the virtualiser to choose which client's request to submit to the driver next */
+#define BLK_SCHED_ROUND_ROBIN               0
+#define BLK_SCHED_DEADLINE                  1
+
+#define BLK_SCHED_POLICY                    BLK_SCHED_ROUND_ROBIN
+
+/* Number of blocks a client of weight 1 may submit per turn of the round-robin policy */
+#define BLK_SCHED_QUANTUM                   8
+
+_Static_assert(BLK_SCHED_QUANTUM >= 1, "Round-robin quantum must be at least one block");
+
+/* Weight of each client in the round-robin policy, the number of quanta it gets per turn, 0 is taken as 1 */
+static const uint32_t blk_sched_weight[BLK_NUM_CLIENTS] = { 1 };
+
+/*
+ * Deadline of each client's requests in the deadline policy, as the number of
+ * blocks of other requests that may be submitted to the driver before the
+ * request at the head of the client's queue.
+ */
+static const uint32_t blk_sched_deadline[BLK_NUM_CLIENTS] = { 0 };
+
+/* Maximum number of each client's requests submitted to the driver at a time */
+static const uint32_t blk_sched_inflight_limit[BLK_NUM_CLIENTS] = { BLK_QUEUE_SIZE_CLI0 };
+
+/*
+ * Whether the driver transfers data directly to and from each client's data
+ * region. The device is then given physical addresses within the client's
+ * region, so this must only be enabled for clients that are trusted with DMA
+ * into their data region. Requests of other clients are copied through the
+ * virtualiser's own data region.
+ */
+static const bool blk_zero_copy_mapping[BLK_NUM_CLIENTS] = { false };
+
 static inline blk_storage_info_t *blk_virt_cli_config_info(blk_storage_info_t *info, unsigned int id)
 {
     switch (id) {
@@ -54,6 +131,16 @@ static inline uintptr_t blk_virt_cli_data_region(uintptr_t data, unsigned int id
     }
 }
 
+static inline uintptr_t blk_virt_cli_data_region_paddr(uintptr_t paddr, unsigned int id)
+{
+    switch (id) {
+    case 0:
+        return paddr;
+    default:
+        return 0;
+    }
+}
+
 static inline uint64_t blk_virt_cli_data_region_size(unsigned int id)
 {
     switch (id) {
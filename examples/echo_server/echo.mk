@@ -16,6 +16,7 @@ ETHERNET_CONFIG_INCLUDE:=${ECHO_SERVER}/include/ethernet_config
 SERIAL_COMPONENTS := $(SDDF)/serial/components
 UART_DRIVER := $(SDDF)/drivers/serial/$(UART_DRIV_DIR)
 SERIAL_CONFIG_INCLUDE:=${ECHO_SERVER}/include/serial_config
+BENCHMARK_CONFIG_INCLUDE:=${ECHO_SERVER}/include/benchmark_config
 TIMER_DRIVER:=$(SDDF)/drivers/clock/$(TIMER_DRV_DIR)
 NETWORK_COMPONENTS:=$(SDDF)/network/components
 
@@ -27,7 +28,8 @@ REPORT_FILE := report.txt
 vpath %.c ${SDDF} ${ECHO_SERVER}
 
 IMAGES := eth_driver.elf lwip.elf benchmark.elf idle.elf network_virt_rx.elf\
-	  network_virt_tx.elf copy.elf timer_driver.elf uart_driver.elf serial_virt_tx.elf
+	  network_virt_tx.elf copy.elf timer_driver.elf uart_driver.elf serial_virt_tx.elf \
+	  udp_fast_echo.elf
 
 CFLAGS := -mcpu=$(CPU) \
 	  -mstrict-align \
@@ -40,6 +42,7 @@ CFLAGS := -mcpu=$(CPU) \
 	  -I${ECHO_INCLUDE}/lwip \
 	  -I${ETHERNET_CONFIG_INCLUDE} \
 	  -I$(SERIAL_CONFIG_INCLUDE) \
+	  -I$(BENCHMARK_CONFIG_INCLUDE) \
 	  -I${SDDF}/$(LWIPDIR)/include \
 	  -I${SDDF}/$(LWIPDIR)/include/ipv4 \
 	  -MD \
@@ -68,13 +71,17 @@ LWIPFILES=lwip.c $(COREFILES) $(CORE4FILES) $(NETIFFILES)
 LWIP_OBJS := $(LWIPFILES:.c=.o) lwip.o utilization_socket.o \
 	     udp_echo_socket.o tcp_echo_socket.o
 
-OBJS := $(LWIP_OBJS)
+OBJS := $(LWIP_OBJS) udp_fast_echo.o
 DEPS := $(filter %.d,$(OBJS:.o=.d))
 
 all: loader.img
 
 ${LWIP_OBJS}: ${CHECK_FLAGS_BOARD_MD5}
-lwip.elf: $(LWIP_OBJS) libsddf_util.a
+lwip.elf: $(LWIP_OBJS) lib_sddf_lwip.a libsddf_util.a
+	$(LD) $(LDFLAGS) $^ $(LIBS) -o $@
+
+udp_fast_echo.o: ${CHECK_FLAGS_BOARD_MD5}
+udp_fast_echo.elf: udp_fast_echo.o lib_sddf_udp.a libsddf_util.a
 	$(LD) $(LDFLAGS) $^ $(LIBS) -o $@
 
 LWIPDIRS := $(addprefix ${LWIPDIR}/, core/ipv4 netif api)
@@ -91,6 +98,8 @@ ${IMAGE_FILE} $(REPORT_FILE): $(IMAGES) $(SYSTEM_FILE)
 
 
 include ${SDDF}/util/util.mk
+include ${SDDF}/network/lib/sddf_lwip/lib_sddf_lwip.mk
+include ${SDDF}/network/lib/sddf_udp/lib_sddf_udp.mk
 include ${SDDF}/network/components/network_components.mk
 include ${ETHERNET_DRIVER}/eth_driver.mk
 include ${BENCHMARK}/benchmark.mk
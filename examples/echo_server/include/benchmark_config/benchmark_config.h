@@ -0,0 +1,27 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sddf/benchmark/bench.h>
+#include <ethernet_config.h>
+
+/* PDs to track utilisation of. Ids must match the child ids in the .system file! */
+static const benchmark_pd_t benchmark_pds[] = {
+    { 1, NET_DRIVER_NAME },
+    { 2, NET_VIRT_RX_NAME },
+    { 3, NET_VIRT_TX_NAME },
+    { 4, NET_COPY0_NAME },
+    { 5, NET_COPY1_NAME },
+    { 6, NET_CLI0_NAME },
+    { 7, NET_CLI1_NAME },
+    { 8, NET_TIMER_NAME },
+};
+
+/* Set to 1 to report the network stats region and derive per packet metrics from it */
+#define BENCHMARK_NET_STATS 1
+
+/* Set to 1 to report per hop latency percentiles of received packets, requires NET_TRACE */
+#define BENCHMARK_NET_TRACE NET_TRACE
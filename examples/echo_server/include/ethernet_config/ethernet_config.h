@@ -8,8 +8,18 @@
 #include <microkit.h>
 #include <sddf/util/string.h>
 #include <sddf/network/queue.h>
+#include <sddf/network/capture.h>
+#include <sddf/network/stats.h>
+#include <sddf/network/vlan.h>
 #include <sddf/util/util.h>
 
+/* Set to 1 to trace the latency of received packets through each component */
+#define NET_TRACE                               0
+
+#if NET_TRACE
+#include <sddf/network/trace.h>
+#endif
+
 #define NUM_NETWORK_CLIENTS 2
 
 #define NET_CLI0_NAME "client0"
@@ -18,8 +28,10 @@
 #define NET_COPY1_NAME "copy1"
 #define NET_VIRT_RX_NAME "net_virt_rx"
 #define NET_VIRT_TX_NAME "net_virt_tx"
+#define NET_ARP_NAME "arp"
 #define NET_DRIVER_NAME "eth"
 #define NET_TIMER_NAME "timer"
+#define NET_CAPTURE_NAME "net_capture"
 
 #define NET_DATA_REGION_SIZE                    0x200000
 #define NET_HW_REGION_SIZE                      0x10000
@@ -40,6 +52,24 @@
 #error "Must define MAC addresses for clients in ethernet config"
 #endif
 
+/*
+ * Set to 1 to place each client in an 802.1Q VLAN. The RX virtualiser only
+ * delivers tagged frames whose VLAN ID and destination MAC address match a
+ * client, and the copy components remove the tag, recording it in the buffer
+ * descriptor. The TX virtualiser inserts the client's tag into the headroom of
+ * each transmit buffer.
+ */
+#define NET_VLAN                                0
+#define NET_VLAN_ID_CLI0                        10
+#define NET_VLAN_ID_CLI1                        20
+
+_Static_assert(NET_VLAN_ID_CLI0 >= 1 && NET_VLAN_ID_CLI0 < NET_VLAN_VID_MASK
+               && NET_VLAN_ID_CLI1 >= 1 && NET_VLAN_ID_CLI1 < NET_VLAN_VID_MASK,
+               "Client VLAN IDs must be between 1 and 4094.");
+
+_Static_assert(!NET_VLAN || NET_BUFFER_HEADROOM >= NET_VLAN_TAG_LEN,
+               "VLAN tags are inserted into the buffer headroom.");
+
 #define NET_TX_QUEUE_SIZE_CLI0                   512
 #define NET_TX_QUEUE_SIZE_CLI1                   512
 #define NET_TX_QUEUE_SIZE_DRIV                   (NET_TX_QUEUE_SIZE_CLI0 + NET_TX_QUEUE_SIZE_CLI1)
@@ -80,6 +110,162 @@ _Static_assert(NET_RX_QUEUE_SIZE_COPY1 >= NET_RX_QUEUE_SIZE_DRIV,
 _Static_assert(sizeof(net_queue_t) + NET_MAX_QUEUE_SIZE *sizeof(net_buff_desc_t) <= NET_DATA_REGION_SIZE,
                "net_queue_t must fit into a single data region.");
 
+/*
+ * Overload policy of the RX path, so that a client which stops returning
+ * buffers cannot hold on to all of the driver's buffers. Once
+ * NET_RX_CLIENT_LIMIT frames are waiting for a client, either the RX
+ * virtualiser drops new frames for it (NET_RX_OVERLOAD_TAIL_DROP), or its
+ * copy component drops the oldest waiting frames (NET_RX_OVERLOAD_OLDEST_DROP).
+ * Once NET_RX_BROADCAST_LAG frames are waiting, the copy component copies
+ * broadcast frames out of the driver's buffers into up to
+ * NET_RX_COPY_OUT_SLOTS buffers of its own, so that they are returned to the
+ * driver without waiting for the client.
+ */
+#define NET_RX_OVERLOAD_TAIL_DROP               0
+#define NET_RX_OVERLOAD_OLDEST_DROP             1
+#define NET_RX_OVERLOAD_POLICY                  NET_RX_OVERLOAD_TAIL_DROP
+#define NET_RX_CLIENT_LIMIT                     (NET_RX_QUEUE_SIZE_DRIV / 4)
+#define NET_RX_BROADCAST_LAG                    (NET_RX_CLIENT_LIMIT / 2)
+#define NET_RX_COPY_OUT_SLOTS                   16
+
+_Static_assert(NET_RX_CLIENT_LIMIT > 0 && NET_RX_CLIENT_LIMIT < NET_RX_QUEUE_SIZE_DRIV,
+               "Clients must be limited to fewer than all of the driver's RX buffers.");
+_Static_assert(NET_RX_BROADCAST_LAG <= NET_RX_CLIENT_LIMIT,
+               "Broadcast frames must be copied out before the client limit is reached.");
+
+/*
+ * Set to 1 for the RX virtualiser and copy components to hold free receive
+ * buffers on a LIFO stack and hand out the most recently returned, and most
+ * likely cached, buffers first. The RX virtualiser only keeps
+ * NET_RX_RECYCLE_DEPTH buffers in the driver's free queue.
+ */
+#define NET_RX_RECYCLE                          0
+#define NET_RX_RECYCLE_DEPTH                    32
+
+#if NET_RX_RECYCLE
+#include <sddf/network/recycle.h>
+#endif
+
+/*
+ * Number of received frames the RX virtualiser dequeues from the driver at
+ * once. The headers of a burst are prefetched before any of its frames are
+ * classified, and each client's share of it is published to the client with
+ * a single queue update.
+ */
+#define NET_VIRT_RX_BURST                       32
+
+/*
+ * Set to 1 for the TX virtualiser to switch frames between clients itself
+ * rather than relying on the network to send them back. Frames addressed to
+ * another client are copied into a buffer of the driver's RX data region and
+ * handed to the RX virtualiser through a queue of NET_LOCAL_QUEUE_SIZE
+ * entries, without reaching the device. Broadcast frames are both switched
+ * and transmitted. The buffers used for switching follow those of the driver.
+ */
+#define NET_LOCAL_SWITCH                        0
+#define NET_LOCAL_QUEUE_SIZE                    128
+
+#if NET_LOCAL_SWITCH
+#define NET_RX_SLOTS_DRIV                       (NET_RX_QUEUE_SIZE_DRIV + NET_LOCAL_QUEUE_SIZE)
+#else
+#define NET_RX_SLOTS_DRIV                       NET_RX_QUEUE_SIZE_DRIV
+#endif
+
+_Static_assert(NET_RX_SLOTS_DRIV *NET_BUFFER_SIZE <= NET_RX_DATA_REGION_SIZE_DRIV,
+               "Driver RX data region size must fit the buffers of the driver and of local switching");
+
+/*
+ * Set to 1 for the ethernet drivers to switch from interrupts to polling under
+ * load. An interrupt that harvests at least NET_DRIV_POLL_THRESHOLD received
+ * packets masks device interrupts, after which the rings are harvested
+ * NET_DRIV_POLL_BUDGET packets at a time whenever the virtualisers notify the
+ * driver, until a pass finds the receive ring drained.
+ */
+#define NET_DRIV_POLL                           0
+#define NET_DRIV_POLL_BUDGET                    64
+#define NET_DRIV_POLL_THRESHOLD                 16
+
+_Static_assert(NET_DRIV_POLL_THRESHOLD <= NET_DRIV_POLL_BUDGET,
+               "Drivers must be able to harvest the poll threshold within a single budget.");
+
+/*
+ * Interrupt coalescing, for drivers whose device supports it (currently imx).
+ * The device raises an interrupt once the given number of frames have been
+ * received or transmitted, or the given number of microseconds after the
+ * first of them, whichever comes first. A frame count of 1 disables
+ * coalescing. When NET_DRIV_COALESCE_ADAPTIVE is 1, the driver adjusts the
+ * receive thresholds to the packet rate, up to the configured values.
+ */
+#define NET_DRIV_COALESCE_RX_FRAMES             1
+#define NET_DRIV_COALESCE_RX_USECS              0
+#define NET_DRIV_COALESCE_TX_FRAMES             128
+#define NET_DRIV_COALESCE_TX_USECS              130
+#define NET_DRIV_COALESCE_ADAPTIVE              0
+
+_Static_assert(NET_DRIV_COALESCE_RX_FRAMES >= 1 && NET_DRIV_COALESCE_RX_FRAMES <= 255
+               && NET_DRIV_COALESCE_TX_FRAMES >= 1 && NET_DRIV_COALESCE_TX_FRAMES <= 255,
+               "Coalescing frame counts must be between 1 and 255.");
+
+/*
+ * Set to 1 for the virtualisers and copy components to busy poll their queues
+ * instead of waiting for notifications, and to ask their peers not to notify
+ * them while they do. A component goes back to waiting for notifications
+ * after NET_VIRT_SPIN_IDLE consecutive polls find no work, backing off for up
+ * to NET_VIRT_SPIN_BACKOFF iterations between polls. Only for multicore
+ * systems where each of these components runs on a core of its own.
+ */
+#define NET_VIRT_SPIN                           0
+#define NET_VIRT_SPIN_IDLE                      4096
+#define NET_VIRT_SPIN_BACKOFF                   256
+
+#if NET_VIRT_SPIN
+#include <sddf/util/spin.h>
+#endif
+
+/* Set to 1 to have the virtualisers mirror packets to the capture component */
+#define NET_CAPTURE                             0
+#define NET_CAPTURE_RING_SIZE                   512
+#define NET_CAPTURE_RING_REGION_SIZE            0x10000
+#define NET_CAPTURE_PCAP_REGION_SIZE            0x1000000
+/* Capture one in every NET_CAPTURE_SAMPLE_RATE packets */
+#define NET_CAPTURE_SAMPLE_RATE                 1
+/* Only capture packets of this ethertype, 0 captures all packets */
+#define NET_CAPTURE_ETHERTYPE                   0
+/* Maximum number of bytes of each packet to capture */
+#define NET_CAPTURE_SNAPLEN                     NET_BUFFER_SIZE
+
+_Static_assert(sizeof(net_capture_ring_t) + NET_CAPTURE_RING_SIZE *sizeof(net_capture_record_t) <= NET_CAPTURE_RING_REGION_SIZE,
+               "net_capture_ring_t must fit into the capture ring region.");
+
+/* Components with a slot in the network stats region */
+#define NET_STATS_VIRT_RX                       0
+#define NET_STATS_VIRT_TX                       1
+#define NET_STATS_COPY0                         2
+#define NET_STATS_COPY1                         3
+#define NET_STATS_CLI0                          4
+#define NET_STATS_CLI1                          5
+/* For systems that include the ARP component */
+#define NET_STATS_ARP                           6
+#define NET_STATS_NUM_COMPONENTS                7
+/* Followed by the stats of the tagged traffic of each client, for each direction */
+#define NET_STATS_CLIENT_RX                     NET_STATS_NUM_COMPONENTS
+#define NET_STATS_CLIENT_TX                     (NET_STATS_CLIENT_RX + NUM_NETWORK_CLIENTS)
+#define NET_STATS_NUM_SLOTS                     (NET_STATS_CLIENT_TX + NUM_NETWORK_CLIENTS)
+#define NET_STATS_REGION_SIZE                   0x1000
+
+_Static_assert(NET_STATS_NUM_SLOTS *sizeof(net_stats_t) <= NET_STATS_REGION_SIZE,
+               "Stats of all components must fit into the stats region.");
+
+#if NET_TRACE
+#define NET_TRACE_REGION_SIZE                   0x20000
+/* The region holds the trace table of the driver's RX buffers, followed by the trace state of each client */
+#define NET_TRACE_RX_SIZE                       (NET_RX_SLOTS_DRIV * sizeof(net_trace_entry_t))
+#define NET_TRACE_CLIENT_SIZE                   (sizeof(net_trace_client_t) + NET_MAX_CLIENT_QUEUE_SIZE * sizeof(net_trace_entry_t))
+
+_Static_assert(NET_TRACE_RX_SIZE + NUM_NETWORK_CLIENTS *NET_TRACE_CLIENT_SIZE <= NET_TRACE_REGION_SIZE,
+               "Trace tables of the driver and all clients must fit into the trace region.");
+#endif
+
 static void __net_set_mac_addr(uint8_t *mac, uint64_t val)
 {
     mac[0] = val >> 40 & 0xff;
@@ -101,12 +287,20 @@ static inline void net_cli_mac_addr_init_sys(char *pd_name, uint8_t *macs)
 
 static inline void net_virt_mac_addr_init_sys(char *pd_name, uint8_t *macs)
 {
-    if (!sddf_strcmp(pd_name, NET_VIRT_RX_NAME)) {
+    if (!sddf_strcmp(pd_name, NET_VIRT_RX_NAME) || !sddf_strcmp(pd_name, NET_VIRT_TX_NAME)) {
         __net_set_mac_addr(macs, MAC_ADDR_CLI0);
         __net_set_mac_addr(&macs[ETH_HWADDR_LEN], MAC_ADDR_CLI1);
     }
 }
 
+static inline void net_virt_vlan_init_sys(char *pd_name, uint16_t *vlans)
+{
+    if (!sddf_strcmp(pd_name, NET_VIRT_RX_NAME) || !sddf_strcmp(pd_name, NET_VIRT_TX_NAME)) {
+        vlans[0] = NET_VLAN_ID_CLI0;
+        vlans[1] = NET_VLAN_ID_CLI1;
+    }
+}
+
 static inline void net_cli_queue_init_sys(char *pd_name, net_queue_handle_t *rx_queue, net_queue_t *rx_free,
                                           net_queue_t *rx_active, net_queue_handle_t *tx_queue, net_queue_t *tx_free,
                                           net_queue_t *tx_active)
@@ -149,8 +343,70 @@ static inline void net_virt_queue_init_sys(char *pd_name, net_queue_handle_t *cl
 
 static inline void net_mem_region_init_sys(char *pd_name, uintptr_t *mem_regions, uintptr_t start_region)
 {
-    if (!sddf_strcmp(pd_name, NET_VIRT_TX_NAME)) {
+    if (!sddf_strcmp(pd_name, NET_VIRT_TX_NAME) || !sddf_strcmp(pd_name, NET_CAPTURE_NAME)) {
         mem_regions[0] = start_region;
         mem_regions[1] = start_region + NET_DATA_REGION_SIZE;
     }
 }
+
+static inline const char *net_stats_component_name(int component)
+{
+    switch (component) {
+    case NET_STATS_VIRT_RX:
+        return NET_VIRT_RX_NAME;
+    case NET_STATS_VIRT_TX:
+        return NET_VIRT_TX_NAME;
+    case NET_STATS_COPY0:
+        return NET_COPY0_NAME;
+    case NET_STATS_COPY1:
+        return NET_COPY1_NAME;
+    case NET_STATS_CLI0:
+        return NET_CLI0_NAME;
+    case NET_STATS_CLI1:
+        return NET_CLI1_NAME;
+    case NET_STATS_ARP:
+        return NET_ARP_NAME;
+    default:
+        return "unknown";
+    }
+}
+
+static inline net_stats_t *net_stats_init_sys(char *pd_name, net_stats_t *stats_region)
+{
+    for (int i = 0; i < NET_STATS_NUM_COMPONENTS; i++) {
+        if (!sddf_strcmp(pd_name, net_stats_component_name(i))) {
+            return &stats_region[i];
+        }
+    }
+    return NULL;
+}
+
+static inline net_stats_t *net_stats_client_init_sys(char *pd_name, net_stats_t *stats_region)
+{
+    if (!sddf_strcmp(pd_name, NET_VIRT_RX_NAME)) {
+        return &stats_region[NET_STATS_CLIENT_RX];
+    } else if (!sddf_strcmp(pd_name, NET_VIRT_TX_NAME)) {
+        return &stats_region[NET_STATS_CLIENT_TX];
+    }
+    return NULL;
+}
+
+#if NET_TRACE
+static inline void net_trace_init_sys(char *pd_name, uintptr_t trace_region, net_trace_handle_t *handle)
+{
+    handle->rx = (net_trace_entry_t *)trace_region;
+    handle->client = NULL;
+
+    uintptr_t clients = trace_region + NET_TRACE_RX_SIZE;
+    if (!sddf_strcmp(pd_name, NET_COPY0_NAME) || !sddf_strcmp(pd_name, NET_CLI0_NAME)) {
+        handle->client = (net_trace_client_t *)clients;
+    } else if (!sddf_strcmp(pd_name, NET_COPY1_NAME) || !sddf_strcmp(pd_name, NET_CLI1_NAME)) {
+        handle->client = (net_trace_client_t *)(clients + NET_TRACE_CLIENT_SIZE);
+    }
+}
+
+static inline net_trace_client_t *net_trace_client(uintptr_t trace_region, int client)
+{
+    return (net_trace_client_t *)(trace_region + NET_TRACE_RX_SIZE + client * NET_TRACE_CLIENT_SIZE);
+}
+#endif
@@ -186,16 +186,13 @@
 
 /**
  * Enable LWIP pbuf custom to store private data on pbufs. This extends struct
- * pbuf so user can store custom data on every pbuf. We enable pbufs to be
- * chained so they can be processed at a later time.
+ * pbuf so user can store custom data on every pbuf.
  */
 #define LWIP_PBUF_CUSTOM_DATA \
-    bool in_use; \
-    struct pbuf *next_chain;
+    bool in_use;
 
 #define LWIP_PBUF_INIT_CUSTOM_DATA(p) \
-    (p)->in_use = false; \
-    (p)->next_chain = NULL;
+    (p)->in_use = false;
 
 /* Debugging options */
 #define LWIP_DEBUG // we always want this on
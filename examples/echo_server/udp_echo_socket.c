@@ -12,6 +12,7 @@
 
 #include <sddf/util/util.h>
 #include <sddf/util/printf.h>
+#include <sddf/network/lib/sddf_lwip.h>
 
 #include "echo.h"
 
@@ -19,11 +20,21 @@ static struct udp_pcb *udp_socket;
 
 static void lwip_udp_recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
 {
-    err_t error = udp_sendto(pcb, p, addr, port);
+    /* Build the reply directly in a transmit buffer so it can be sent without
+     * another copy, falling back to sending the received pbuf if there are none */
+    struct pbuf *reply = sddf_lwip_tx_pbuf_alloc(PBUF_TRANSPORT, p->tot_len);
+    if (reply != NULL) {
+        pbuf_copy(reply, p);
+        pbuf_free(p);
+    } else {
+        reply = p;
+    }
+
+    err_t error = udp_sendto(pcb, reply, addr, port);
     if (error) {
         sddf_dprintf("Failed to send UDP packet through socket: %s\n", lwip_strerr(error));
     }
-    pbuf_free(p);
+    pbuf_free(reply);
 }
 
 int setup_udp_socket(void)
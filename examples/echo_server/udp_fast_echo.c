@@ -0,0 +1,106 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <microkit.h>
+#include <sddf/util/util.h>
+#include <sddf/util/printf.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/stats.h>
+#include <sddf/network/lib/sddf_udp.h>
+#include <sddf/serial/queue.h>
+#include <serial_config.h>
+#include <ethernet_config.h>
+
+#include "echo.h"
+
+/*
+ * UDP echo server using the sDDF UDP endpoint library rather than lwIP. It
+ * can replace lwip.elf as the program image of a client, in which case it
+ * answers on the same UDP echo port, for comparison with udp_echo_socket.c.
+ */
+
+#define SERIAL_TX_CH 0
+#define RX_CH  2
+#define TX_CH  3
+
+/* Static address of the echo server, in network byte order */
+#ifndef UDP_FAST_ECHO_ADDR
+#define UDP_FAST_ECHO_ADDR SDDF_IPV4_ADDR(10, 0, 2, 16)
+#endif
+
+char *serial_tx_data;
+serial_queue_t *serial_tx_queue;
+serial_queue_handle_t serial_tx_queue_handle;
+
+net_queue_t *rx_free;
+net_queue_t *rx_active;
+net_queue_t *tx_free;
+net_queue_t *tx_active;
+uintptr_t rx_buffer_data_region;
+uintptr_t tx_buffer_data_region;
+
+net_stats_t *net_stats;
+static net_stats_t *stats;
+
+#if NET_TRACE
+/* Trace region */
+uintptr_t net_trace;
+#endif
+
+static uint16_t udp_echo(const sddf_udp_datagram_t *request, uint8_t *reply, uint16_t reply_size)
+{
+    uint16_t len = MIN(request->len, reply_size);
+    memcpy(reply, request->payload, len);
+    return len;
+}
+
+void init(void)
+{
+    serial_cli_queue_init_sys(microkit_name, NULL, NULL, NULL, &serial_tx_queue_handle, serial_tx_queue, serial_tx_data);
+    serial_putchar_init(SERIAL_TX_CH, &serial_tx_queue_handle);
+
+    sddf_udp_config_t config = {
+        .rx_ch = RX_CH,
+        .tx_ch = TX_CH,
+        .rx_buffer_data_region = rx_buffer_data_region,
+        .tx_buffer_data_region = tx_buffer_data_region,
+        .ipv4_addr = UDP_FAST_ECHO_ADDR,
+        .port = UDP_ECHO_PORT,
+        .handler = udp_echo,
+    };
+    net_cli_queue_init_sys(microkit_name, &config.rx_queue, rx_free, rx_active, &config.tx_queue, tx_free, tx_active);
+    config.stats = net_stats_init_sys(microkit_name, net_stats);
+    assert(config.stats);
+#if NET_TRACE
+    net_trace_init_sys(microkit_name, net_trace, &config.trace);
+    assert(config.trace.client);
+#endif
+    net_cli_mac_addr_init_sys(microkit_name, config.mac);
+    stats = config.stats;
+
+    sddf_udp_init(&config);
+
+    uint8_t *addr = (uint8_t *)&config.ipv4_addr;
+    sddf_printf("UDP_FAST_ECHO|NOTICE: %s echoing on %u.%u.%u.%u:%u\n", microkit_name, addr[0], addr[1], addr[2],
+                addr[3], UDP_ECHO_PORT);
+}
+
+void notified(microkit_channel ch)
+{
+    net_stats_notified(stats);
+    switch (ch) {
+    case RX_CH:
+    case TX_CH:
+        sddf_udp_process();
+        break;
+    default:
+        sddf_dprintf("UDP_FAST_ECHO|LOG: received notification on unexpected channel: %u\n", ch);
+        break;
+    }
+
+    sddf_udp_maybe_notify();
+}
@@ -5,8 +5,17 @@
 
 #pragma once
 
+#include <stdint.h>
+
 struct bench {
     uint64_t ccount;
     uint64_t prev;
     uint64_t ts;
 };
+
+/* Entry of the table of PDs tracked by the benchmark PD */
+typedef struct benchmark_pd {
+    /* child id of the PD */
+    uint64_t id;
+    const char *name;
+} benchmark_pd_t;
@@ -0,0 +1,261 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/blk/queue.h>
+#include <sddf/util/util.h>
+
+/*
+ * Cache of blocks of BLK_TRANSFER_SIZE bytes in a data region, keyed by block
+ * number. Blocks are found through a hash table with chained buckets, and
+ * kept on a list from most to least recently used, from whose end blocks are
+ * replaced.
+ *
+ * Entries that are dirty hold data that has not been written to the device
+ * yet, and entries that are busy have their data in use by the device. Neither
+ * is ever replaced, and the data of a busy entry must not be modified. Busy
+ * entries that are pending are being read from the device and do not hold
+ * their data yet, which the read identified by the entry's reader provides.
+ */
+
+#define BLK_CACHE_NONE UINT32_MAX
+
+typedef struct blk_cache_entry {
+    uint32_t block_number;
+    /* next entry in the same hash bucket */
+    uint32_t hash_next;
+    /* neighbouring entries in the list of entries by use */
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    bool valid;
+    bool dirty;
+    bool busy;
+    bool pending;
+    /* read that provides the data of a pending entry, its meaning is up to the user */
+    uint32_t reader;
+    /* read ahead of a client and not read by a client since */
+    bool prefetched;
+} blk_cache_entry_t;
+
+typedef struct blk_cache {
+    blk_cache_entry_t *entries;
+    uint32_t num_entries;
+    /* first entry of each hash bucket */
+    uint32_t *buckets;
+    /* number of hash buckets, a power of two */
+    uint32_t num_buckets;
+    /* most recently used entry */
+    uint32_t lru_head;
+    /* least recently used entry */
+    uint32_t lru_tail;
+    /* number of dirty entries */
+    uint32_t num_dirty;
+    /* data region holding the data of each entry in turn */
+    uintptr_t data;
+} blk_cache_t;
+
+static inline uint32_t blk_cache_hash(blk_cache_t *cache, uint32_t block_number)
+{
+    return block_number & (cache->num_buckets - 1);
+}
+
+static inline void blk_cache_lru_remove(blk_cache_t *cache, uint32_t idx)
+{
+    blk_cache_entry_t *entry = &cache->entries[idx];
+    if (entry->lru_prev != BLK_CACHE_NONE) {
+        cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != BLK_CACHE_NONE) {
+        cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+}
+
+static inline void blk_cache_lru_push(blk_cache_t *cache, uint32_t idx)
+{
+    blk_cache_entry_t *entry = &cache->entries[idx];
+    entry->lru_prev = BLK_CACHE_NONE;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != BLK_CACHE_NONE) {
+        cache->entries[cache->lru_head].lru_prev = idx;
+    } else {
+        cache->lru_tail = idx;
+    }
+    cache->lru_head = idx;
+}
+
+static inline void blk_cache_unhash(blk_cache_t *cache, uint32_t idx)
+{
+    uint32_t *link = &cache->buckets[blk_cache_hash(cache, cache->entries[idx].block_number)];
+    while (*link != idx) {
+        link = &cache->entries[*link].hash_next;
+    }
+    *link = cache->entries[idx].hash_next;
+}
+
+/**
+ * Initialise an empty cache.
+ *
+ * @param cache cache to initialise.
+ * @param entries array of num_entries entries.
+ * @param num_entries number of blocks the cache holds.
+ * @param buckets array of num_buckets hash buckets.
+ * @param num_buckets number of hash buckets, a power of two.
+ * @param data data region of num_entries blocks.
+ */
+static inline void blk_cache_init(blk_cache_t *cache, blk_cache_entry_t *entries, uint32_t num_entries,
+                                  uint32_t *buckets, uint32_t num_buckets, uintptr_t data)
+{
+    assert(num_buckets != 0 && (num_buckets & (num_buckets - 1)) == 0);
+
+    cache->entries = entries;
+    cache->num_entries = num_entries;
+    cache->buckets = buckets;
+    cache->num_buckets = num_buckets;
+    cache->lru_head = BLK_CACHE_NONE;
+    cache->lru_tail = BLK_CACHE_NONE;
+    cache->num_dirty = 0;
+    cache->data = data;
+
+    for (uint32_t i = 0; i < num_buckets; i++) {
+        buckets[i] = BLK_CACHE_NONE;
+    }
+    for (uint32_t i = 0; i < num_entries; i++) {
+        entries[i] = (blk_cache_entry_t) {
+            .hash_next = BLK_CACHE_NONE,
+        };
+        blk_cache_lru_push(cache, i);
+    }
+}
+
+/**
+ * Find the entry of a block.
+ *
+ * @param cache cache to search.
+ * @param block_number block to find.
+ *
+ * @return index of the entry, BLK_CACHE_NONE when the block is not cached.
+ */
+static inline uint32_t blk_cache_lookup(blk_cache_t *cache, uint32_t block_number)
+{
+    uint32_t idx = cache->buckets[blk_cache_hash(cache, block_number)];
+    while (idx != BLK_CACHE_NONE && cache->entries[idx].block_number != block_number) {
+        idx = cache->entries[idx].hash_next;
+    }
+
+    return idx;
+}
+
+/**
+ * Mark an entry as the most recently used.
+ *
+ * @param cache cache of the entry.
+ * @param idx index of the entry.
+ */
+static inline void blk_cache_touch(blk_cache_t *cache, uint32_t idx)
+{
+    if (cache->lru_head != idx) {
+        blk_cache_lru_remove(cache, idx);
+        blk_cache_lru_push(cache, idx);
+    }
+}
+
+/**
+ * Give a block an entry, replacing the least recently used entry that is
+ * neither dirty nor busy. The entry is clean, most recently used and its data
+ * is undefined.
+ *
+ * @param cache cache to add the block to.
+ * @param block_number block to add, which must not be cached.
+ *
+ * @return index of the entry, BLK_CACHE_NONE when every entry is dirty or busy.
+ */
+static inline uint32_t blk_cache_alloc(blk_cache_t *cache, uint32_t block_number)
+{
+    uint32_t idx = cache->lru_tail;
+    while (idx != BLK_CACHE_NONE && (cache->entries[idx].dirty || cache->entries[idx].busy)) {
+        idx = cache->entries[idx].lru_prev;
+    }
+    if (idx == BLK_CACHE_NONE) {
+        return BLK_CACHE_NONE;
+    }
+
+    blk_cache_entry_t *entry = &cache->entries[idx];
+    if (entry->valid) {
+        blk_cache_unhash(cache, idx);
+    }
+    entry->block_number = block_number;
+    entry->valid = true;
+    entry->prefetched = false;
+    uint32_t *bucket = &cache->buckets[blk_cache_hash(cache, block_number)];
+    entry->hash_next = *bucket;
+    *bucket = idx;
+    blk_cache_touch(cache, idx);
+
+    return idx;
+}
+
+/**
+ * Remove the block of an entry from the cache, making the entry the first to
+ * be replaced. The entry must be neither dirty nor busy.
+ *
+ * @param cache cache of the entry.
+ * @param idx index of the entry.
+ */
+static inline void blk_cache_invalidate(blk_cache_t *cache, uint32_t idx)
+{
+    blk_cache_entry_t *entry = &cache->entries[idx];
+    assert(entry->valid && !entry->dirty && !entry->busy);
+
+    blk_cache_unhash(cache, idx);
+    entry->valid = false;
+    entry->prefetched = false;
+
+    if (cache->lru_tail != idx) {
+        blk_cache_lru_remove(cache, idx);
+        entry->lru_next = BLK_CACHE_NONE;
+        entry->lru_prev = cache->lru_tail;
+        cache->entries[cache->lru_tail].lru_next = idx;
+        cache->lru_tail = idx;
+    }
+}
+
+/**
+ * Mark an entry as holding data that has or has not been written to the device.
+ *
+ * @param cache cache of the entry.
+ * @param idx index of the entry.
+ * @param dirty whether the data has not been written to the device.
+ */
+static inline void blk_cache_set_dirty(blk_cache_t *cache, uint32_t idx, bool dirty)
+{
+    if (cache->entries[idx].dirty != dirty) {
+        cache->entries[idx].dirty = dirty;
+        if (dirty) {
+            cache->num_dirty++;
+        } else {
+            cache->num_dirty--;
+        }
+    }
+}
+
+/**
+ * Get the data of an entry.
+ *
+ * @param cache cache of the entry.
+ * @param idx index of the entry.
+ *
+ * @return address of the BLK_TRANSFER_SIZE bytes of data of the entry.
+ */
+static inline uintptr_t blk_cache_entry_data(blk_cache_t *cache, uint32_t idx)
+{
+    return cache->data + (uintptr_t)idx * BLK_TRANSFER_SIZE;
+}
@@ -63,6 +63,12 @@ typedef struct blk_resp {
     uint32_t id; /* stores corresponding request ID */
 } blk_resp_t;
 
+/*
+ * The producer of a queue is the only writer of tail and the consumer the only
+ * writer of head. Indices are published with release stores and the other
+ * side's index is read with an acquire load.
+ */
+
 /* Circular buffer containing requests */
 typedef struct blk_req_queue {
     uint32_t head;
@@ -112,7 +118,7 @@ static inline void blk_queue_init(blk_queue_handle_t *h,
  */
 static inline bool blk_queue_empty_req(blk_queue_handle_t *h)
 {
-    return h->req_queue->tail - h->req_queue->head == 0;
+    return __atomic_load_n(&h->req_queue->tail, __ATOMIC_ACQUIRE) - h->req_queue->head == 0;
 }
 
 /**
@@ -124,7 +130,7 @@ static inline bool blk_queue_empty_req(blk_queue_handle_t *h)
  */
 static inline bool blk_queue_empty_resp(blk_queue_handle_t *h)
 {
-    return h->resp_queue->tail - h->resp_queue->head == 0;
+    return __atomic_load_n(&h->resp_queue->tail, __ATOMIC_ACQUIRE) - h->resp_queue->head == 0;
 }
 
 /**
@@ -136,7 +142,7 @@ static inline bool blk_queue_empty_resp(blk_queue_handle_t *h)
  */
 static inline bool blk_queue_full_req(blk_queue_handle_t *h)
 {
-    return h->req_queue->tail - h->req_queue->head + 1 == h->capacity;
+    return h->req_queue->tail - __atomic_load_n(&h->req_queue->head, __ATOMIC_ACQUIRE) + 1 == h->capacity;
 }
 
 /**
@@ -148,7 +154,7 @@ static inline bool blk_queue_full_req(blk_queue_handle_t *h)
  */
 static inline bool blk_queue_full_resp(blk_queue_handle_t *h)
 {
-    return h->resp_queue->tail - h->resp_queue->head + 1 == h->capacity;
+    return h->resp_queue->tail - __atomic_load_n(&h->resp_queue->head, __ATOMIC_ACQUIRE) + 1 == h->capacity;
 }
 
 /**
@@ -160,7 +166,7 @@ static inline bool blk_queue_full_resp(blk_queue_handle_t *h)
  */
 static inline int blk_queue_length_req(blk_queue_handle_t *h)
 {
-    return (h->req_queue->tail - h->req_queue->head);
+    return __atomic_load_n(&h->req_queue->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&h->req_queue->head, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -172,7 +178,8 @@ static inline int blk_queue_length_req(blk_queue_handle_t *h)
  */
 static inline int blk_queue_length_resp(blk_queue_handle_t *h)
 {
-    return (h->resp_queue->tail - h->resp_queue->head);
+    return __atomic_load_n(&h->resp_queue->tail, __ATOMIC_ACQUIRE)
+           - __atomic_load_n(&h->resp_queue->head, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -209,8 +216,7 @@ static inline int blk_enqueue_req(blk_queue_handle_t *h,
     brp->count = count;
     brp->id = id;
 
-    THREAD_MEMORY_RELEASE();
-    brqp->tail++;
+    __atomic_store_n(&brqp->tail, brqp->tail + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -243,8 +249,7 @@ static inline int blk_enqueue_resp(blk_queue_handle_t *h,
     brp->success_count = success_count;
     brp->id = id;
 
-    THREAD_MEMORY_RELEASE();
-    brqp->tail++;
+    __atomic_store_n(&brqp->tail, brqp->tail + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -282,8 +287,65 @@ static inline int blk_dequeue_req(blk_queue_handle_t *h,
     *count = brp->count;
     *id = brp->id;
 
-    THREAD_MEMORY_RELEASE();
-    brqp->head++;
+    __atomic_store_n(&brqp->head, brqp->head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Read the request at the head of the request queue without dequeuing it.
+ *
+ * @param h queue handle containing request queue to read from.
+ * @param code pointer to request code.
+ * @param io_or_offset pointer to offset of buffer within buffer memory region or io address of buffer
+ * @param block_number pointer to  block number to read/write to.
+ * @param count pointer to number of blocks to read/write.
+ * @param id pointer to store request ID.
+ *
+ * @return -1 when request queue is empty, 0 on success.
+ */
+static inline int blk_peek_req(blk_queue_handle_t *h,
+                               blk_req_code_t *code,
+                               uintptr_t *io_or_offset,
+                               uint32_t *block_number,
+                               uint16_t *count,
+                               uint32_t *id)
+{
+    struct blk_req *brp;
+    struct blk_req_queue *brqp;
+    if (blk_queue_empty_req(h)) {
+        return -1;
+    }
+
+    brqp = h->req_queue;
+    brp = brqp->buffers + (brqp->head % h->capacity);
+    *code = brp->code;
+    *io_or_offset = brp->io_or_offset;
+    *block_number = brp->block_number;
+    *count = brp->count;
+    *id = brp->id;
+
+    return 0;
+}
+
+/**
+ * Remove the request at the head of the request queue, after it has been read
+ * with blk_peek_req. The request is not read again, so the values checked
+ * from the peek are the ones acted on.
+ *
+ * @param h queue handle containing request queue to remove from.
+ *
+ * @return -1 when request queue is empty, 0 on success.
+ */
+static inline int blk_queue_skip_req(blk_queue_handle_t *h)
+{
+    struct blk_req_queue *brqp;
+    if (blk_queue_empty_req(h)) {
+        return -1;
+    }
+
+    brqp = h->req_queue;
+    __atomic_store_n(&brqp->head, brqp->head + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -314,8 +376,7 @@ static inline int blk_dequeue_resp(blk_queue_handle_t *h,
     *success_count = brp->success_count;
     *id = brp->id;
 
-    THREAD_MEMORY_RELEASE();
-    brqp->head++;
+    __atomic_store_n(&brqp->head, brqp->head + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -327,7 +388,7 @@ static inline int blk_dequeue_resp(blk_queue_handle_t *h,
 */
 static inline void blk_queue_plug_req(blk_queue_handle_t *h)
 {
-    h->req_queue->plugged = true;
+    __atomic_store_n(&h->req_queue->plugged, true, __ATOMIC_RELAXED);
 }
 
 /**
@@ -337,7 +398,7 @@ static inline void blk_queue_plug_req(blk_queue_handle_t *h)
 */
 static inline void blk_queue_unplug_req(blk_queue_handle_t *h)
 {
-    h->req_queue->plugged = false;
+    __atomic_store_n(&h->req_queue->plugged, false, __ATOMIC_RELAXED);
 }
 
 /**
@@ -349,6 +410,6 @@ static inline void blk_queue_unplug_req(blk_queue_handle_t *h)
 */
 static inline bool blk_queue_plugged_req(blk_queue_handle_t *h)
 {
-    return h->req_queue->plugged;
+    return __atomic_load_n(&h->req_queue->plugged, __ATOMIC_RELAXED);
 }
 
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/util/util.h>
+
+/*
+ * Scheduling of client requests in the block virtualiser. The scheduler
+ * chooses the client whose request is submitted to the driver next, from the
+ * clients the caller marks as eligible, and is told the number of blocks of
+ * each request submitted.
+ *
+ * Deficit round-robin gives each client its weight in quanta of blocks per
+ * turn, and the client submits requests until it has used them up. A request
+ * larger than what is left of the turn is still submitted, and the overrun is
+ * taken from the client's next turn.
+ *
+ * Earliest deadline first counts time in blocks submitted to the driver, and
+ * gives the request at the head of a client's queue its deadline when the
+ * scheduler first sees it.
+ */
+
+typedef struct blk_sched_client {
+    /* number of quanta per turn of round-robin */
+    uint32_t weight;
+    /* number of blocks left in the client's turn, negative when it overran its last turn */
+    int32_t deficit;
+    /* number of blocks of other requests that may be submitted ahead of the client's */
+    uint32_t deadline_offset;
+    /* whether the request at the head of the client's queue has been given a deadline */
+    bool deadline_set;
+    uint64_t deadline;
+} blk_sched_client_t;
+
+typedef struct blk_sched {
+    blk_sched_client_t *clients;
+    uint32_t num_clients;
+    /* number of blocks a client of weight 1 may submit per turn */
+    uint32_t quantum;
+    /* client whose turn it is */
+    uint32_t turn;
+    /* number of blocks submitted */
+    uint64_t time;
+} blk_sched_t;
+
+/**
+ * Initialise the scheduler.
+ *
+ * @param sched scheduler to initialise.
+ * @param clients per-client state of num_clients entries.
+ * @param num_clients number of clients.
+ * @param quantum number of blocks a client of weight 1 may submit per turn of round-robin, at least 1.
+ * @param weights number of quanta of each client per turn of round-robin, a weight of 0 is taken as 1.
+ * @param deadlines number of blocks of other requests that may be submitted ahead of each client's.
+ */
+static inline void blk_sched_init(blk_sched_t *sched, blk_sched_client_t *clients, uint32_t num_clients,
+                                  uint32_t quantum, const uint32_t *weights, const uint32_t *deadlines)
+{
+    sched->clients = clients;
+    sched->num_clients = num_clients;
+    sched->quantum = quantum;
+    sched->turn = 0;
+    sched->time = 0;
+    for (uint32_t i = 0; i < num_clients; i++) {
+        /* A client without quanta would never have a turn, and the search for one would not end */
+        clients[i] = (blk_sched_client_t) {
+            .weight = MAX(weights[i], 1),
+            .deadline_offset = deadlines[i],
+        };
+    }
+}
+
+/**
+ * Choose the next client under deficit round-robin.
+ *
+ * @param sched scheduler.
+ * @param eligible whether each client has a request that can be submitted.
+ *
+ * @return client to submit a request of, -1 if no client is eligible.
+ */
+static inline int blk_sched_rr_next(blk_sched_t *sched, const bool *eligible)
+{
+    bool any_eligible = false;
+    for (uint32_t i = 0; i < sched->num_clients; i++) {
+        any_eligible |= eligible[i];
+    }
+    if (!any_eligible) {
+        return -1;
+    }
+
+    while (true) {
+        blk_sched_client_t *client = &sched->clients[sched->turn];
+        if (eligible[sched->turn]) {
+            if (client->deficit > 0) {
+                return sched->turn;
+            }
+        } else if (client->deficit > 0) {
+            /* A client does not keep the rest of its turn while it has nothing to submit */
+            client->deficit = 0;
+        }
+
+        sched->turn = (sched->turn + 1) % sched->num_clients;
+        sched->clients[sched->turn].deficit += sched->quantum * sched->clients[sched->turn].weight;
+    }
+}
+
+/**
+ * Account for a request submitted under deficit round-robin.
+ *
+ * @param sched scheduler.
+ * @param cli_id client the request was submitted for.
+ * @param count number of blocks of the request, requests without blocks count as one.
+ */
+static inline void blk_sched_rr_submitted(blk_sched_t *sched, int cli_id, uint16_t count)
+{
+    sched->clients[cli_id].deficit -= MAX(count, 1);
+}
+
+/**
+ * Choose the next client under earliest deadline first.
+ *
+ * @param sched scheduler.
+ * @param eligible whether each client has a request that can be submitted.
+ *
+ * @return client to submit a request of, -1 if no client is eligible.
+ */
+static inline int blk_sched_deadline_next(blk_sched_t *sched, const bool *eligible)
+{
+    int next = -1;
+    for (uint32_t i = 0; i < sched->num_clients; i++) {
+        blk_sched_client_t *client = &sched->clients[i];
+        if (!eligible[i]) {
+            continue;
+        }
+        if (!client->deadline_set) {
+            client->deadline = sched->time + client->deadline_offset;
+            client->deadline_set = true;
+        }
+        if (next < 0 || client->deadline < sched->clients[next].deadline) {
+            next = i;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Account for a request submitted under earliest deadline first.
+ *
+ * @param sched scheduler.
+ * @param cli_id client the request was submitted for.
+ * @param count number of blocks of the request, requests without blocks count as one.
+ */
+static inline void blk_sched_deadline_submitted(blk_sched_t *sched, int cli_id, uint16_t count)
+{
+    sched->time += MAX(count, 1);
+    sched->clients[cli_id].deadline_set = false;
+}
@@ -65,7 +65,12 @@ typedef struct i2c_queue_entry {
     size_t bus_address;
 } i2c_queue_entry_t;
 
-/* Shared queue structure that contains either requests or responses */
+/*
+ * Shared queue structure that contains either requests or responses. The
+ * producer is the only writer of tail and the consumer the only writer of
+ * head. Indices are published with release stores and the other side's index
+ * is read with an acquire load.
+ */
 typedef struct i2c_queue {
     uint32_t tail;
     uint32_t head;
@@ -104,7 +109,7 @@ static inline i2c_queue_handle_t i2c_queue_init(i2c_queue_t *request, i2c_queue_
  */
 static inline int i2c_queue_empty(i2c_queue_t *queue)
 {
-    return queue->tail - queue->head == 0;
+    return __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - queue->head == 0;
 }
 
 /**
@@ -116,7 +121,7 @@ static inline int i2c_queue_empty(i2c_queue_t *queue)
  */
 static inline int i2c_queue_full(i2c_queue_t *queue)
 {
-    return queue->tail - queue->head + 1 == NUM_QUEUE_ENTRIES;
+    return queue->tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) + 1 == NUM_QUEUE_ENTRIES;
 }
 
 /**
@@ -128,7 +133,7 @@ static inline int i2c_queue_full(i2c_queue_t *queue)
  */
 static inline uint32_t i2c_queue_length(i2c_queue_t *queue)
 {
-    return (queue->tail - queue->head);
+    return __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -152,8 +157,7 @@ static inline int i2c_enqueue(i2c_queue_t *queue, size_t bus_address, size_t off
     queue->entries[index].offset = offset;
     queue->entries[index].len = len;
 
-    THREAD_MEMORY_RELEASE();
-    queue->tail++;
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -179,8 +183,7 @@ static inline int i2c_dequeue(i2c_queue_t *queue, size_t *bus_address, size_t *o
     *offset = queue->entries[index].offset;
     *len = queue->entries[index].len;
 
-    THREAD_MEMORY_RELEASE();
-    queue->head++;
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
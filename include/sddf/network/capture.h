@@ -0,0 +1,227 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/util/fence.h>
+#include <sddf/util/util.h>
+
+/*
+ * Packet capture tap.
+ *
+ * The virtualisers mirror a small record for each packet they forward into a
+ * capture ring that is shared with the capture component. Only the record is
+ * written on the fast path; the capture component copies the packet data out
+ * of the (read-only mapped) data regions itself. The ring is lossy: if the
+ * capture component falls behind, records are dropped and counted rather than
+ * applying back-pressure to the data path.
+ */
+
+#define NET_CAPTURE_DIR_RX 0
+#define NET_CAPTURE_DIR_TX 1
+
+typedef struct net_capture_record {
+    /* time the packet was seen by the virtualiser, in generic timer ticks */
+    uint64_t timestamp;
+    /* offset of buffer within its data region */
+    uint64_t offset;
+    /* length of data inside buffer */
+    uint16_t len;
+    /* one of NET_CAPTURE_DIR_RX or NET_CAPTURE_DIR_TX */
+    uint8_t dir;
+    /* data region the offset refers to, the client id for transmitted packets */
+    uint8_t region;
+} net_capture_record_t;
+
+typedef struct net_capture_ring {
+    /* index to insert at, written by the virtualiser */
+    uint32_t tail;
+    /* index to remove from, written by the capture component */
+    uint32_t head;
+    /* flag set by the capture component while capturing is enabled */
+    uint32_t enabled;
+    /* flag to indicate whether consumer requires signalling */
+    uint32_t consumer_signalled;
+    /* number of records lost due to the ring being full */
+    uint64_t dropped;
+    /* record array */
+    net_capture_record_t records[];
+} net_capture_ring_t;
+
+typedef struct net_capture_handle {
+    /* capture ring */
+    net_capture_ring_t *ring;
+    /* size of the ring */
+    uint32_t size;
+} net_capture_handle_t;
+
+/**
+ * Read the timestamp used for capture records. This is the ARM generic timer
+ * physical count, which is readable from user level when the kernel is
+ * configured to export it.
+ *
+ * @return current timestamp in generic timer ticks, 0 if unavailable.
+ */
+static inline uint64_t net_capture_timestamp(void)
+{
+#if defined(CONFIG_EXPORT_PCNT_USER)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Check whether the capture component currently wants records.
+ *
+ * @param handle capture ring handle.
+ *
+ * @return true if capturing is enabled, false otherwise.
+ */
+static inline bool net_capture_enabled(net_capture_handle_t *handle)
+{
+    return __atomic_load_n(&handle->ring->enabled, __ATOMIC_RELAXED);
+}
+
+/**
+ * Mirror a packet into the capture ring. Never blocks, if the ring is full the
+ * record is dropped and the dropped counter incremented.
+ *
+ * @param handle capture ring handle.
+ * @param dir direction of the packet.
+ * @param region data region the offset refers to.
+ * @param offset offset of the buffer within the data region.
+ * @param len length of the packet.
+ *
+ * @return -1 when the record was dropped, 0 on success.
+ */
+static inline int net_capture_mirror(net_capture_handle_t *handle, uint8_t dir, uint8_t region, uint64_t offset,
+                                     uint16_t len)
+{
+    net_capture_ring_t *ring = handle->ring;
+    if (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == handle->size) {
+        ring->dropped++;
+        return -1;
+    }
+
+    net_capture_record_t *record = &ring->records[ring->tail % handle->size];
+    record->timestamp = net_capture_timestamp();
+    record->offset = offset;
+    record->len = len;
+    record->dir = dir;
+    record->region = region;
+
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Check if the capture ring is empty.
+ *
+ * @param handle capture ring handle.
+ *
+ * @return true indicates the ring is empty, false otherwise.
+ */
+static inline bool net_capture_empty(net_capture_handle_t *handle)
+{
+    return __atomic_load_n(&handle->ring->tail, __ATOMIC_ACQUIRE) - handle->ring->head == 0;
+}
+
+/**
+ * Remove a record from the capture ring.
+ *
+ * @param handle capture ring handle.
+ * @param record pointer to record to be filled.
+ *
+ * @return -1 when ring is empty, 0 on success.
+ */
+static inline int net_capture_dequeue(net_capture_handle_t *handle, net_capture_record_t *record)
+{
+    if (net_capture_empty(handle)) {
+        return -1;
+    }
+
+    *record = handle->ring->records[handle->ring->head % handle->size];
+
+    __atomic_store_n(&handle->ring->head, handle->ring->head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Indicate to the virtualiser that the capture component requires signalling.
+ *
+ * @param handle capture ring handle.
+ */
+static inline void net_capture_request_signal(net_capture_handle_t *handle)
+{
+    __atomic_store_n(&handle->ring->consumer_signalled, 0, __ATOMIC_RELAXED);
+    SMP_MEMORY_FENCE();
+}
+
+/**
+ * Indicate to the virtualiser that the capture component does not require signalling.
+ *
+ * @param handle capture ring handle.
+ */
+static inline void net_capture_cancel_signal(net_capture_handle_t *handle)
+{
+    __atomic_store_n(&handle->ring->consumer_signalled, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Consumer signalling status of the capture ring.
+ *
+ * @param handle capture ring handle.
+ *
+ * @return true indicates signalling is required, false otherwise.
+ */
+static inline bool net_capture_require_signal(net_capture_handle_t *handle)
+{
+    SMP_MEMORY_FENCE();
+    return !__atomic_load_n(&handle->ring->consumer_signalled, __ATOMIC_RELAXED);
+}
+
+/**
+ * Initialise the capture ring handle.
+ *
+ * @param handle pointer to capture ring handle to initialise.
+ * @param ring pointer to the shared capture ring.
+ * @param size size of the ring.
+ */
+static inline void net_capture_init(net_capture_handle_t *handle, net_capture_ring_t *ring, uint32_t size)
+{
+    handle->ring = ring;
+    handle->size = size;
+}
+
+/* libpcap file format, see https://wiki.wireshark.org/Development/LibpcapFileFormat */
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_LINKTYPE_ETHERNET 1
+
+typedef struct pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_header_t;
+
+typedef struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_header_t;
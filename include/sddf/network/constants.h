@@ -16,6 +16,19 @@
 
 #define NET_BUFFER_SIZE 2048
 
+/*
+ * Space reserved at the start of every buffer, in front of the frame, for
+ * components to prepend headers into without moving the frame or chaining a
+ * separate descriptor. Buffer descriptors point past it. All components of a
+ * system must be built with the same headroom.
+ */
+#ifndef NET_BUFFER_HEADROOM
+#define NET_BUFFER_HEADROOM 64
+#endif
+
+_Static_assert(NET_BUFFER_HEADROOM % 64 == 0 && NET_BUFFER_HEADROOM < NET_BUFFER_SIZE,
+               "Buffer headroom must keep frames cache line aligned and leave space for a frame.");
+
 struct ethernet_address {
   uint8_t addr[6];
 } __attribute__((packed));
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/network/queue.h>
+#include <sddf/util/util.h>
+
+/*
+ * Book-keeping for the descriptor rings that ethernet drivers share with their
+ * device. The layout of descriptors is device specific, so drivers own the
+ * descriptor array and index it with the slots handed out here, while the ring
+ * tracks which slots are in use and the sDDF buffer held by each.
+ *
+ * Head and tail are free running and converted to slots by masking, so the
+ * ring size must be a power of two. Drivers are expected to fill a burst of
+ * descriptors and then ring the device's doorbell once for the whole burst.
+ */
+
+typedef struct net_hw_ring {
+    /* index to insert at */
+    uint32_t tail;
+    /* index to remove from */
+    uint32_t head;
+    /* number of descriptors, a power of two */
+    uint32_t size;
+    /* maximum number of descriptors owned by the device at once */
+    uint32_t capacity;
+    /* buffer held by each descriptor */
+    net_buff_desc_t *buffers;
+} net_hw_ring_t;
+
+/**
+ * Initialise a hardware ring.
+ *
+ * @param ring ring to initialise.
+ * @param buffers array of size entries to track buffers held by descriptors.
+ * @param size number of descriptors in the ring, must be a power of two.
+ * @param capacity maximum number of descriptors in use at once, at most size.
+ */
+static inline void net_hw_ring_init(net_hw_ring_t *ring, net_buff_desc_t *buffers, uint32_t size, uint32_t capacity)
+{
+    assert(size && !(size & (size - 1)));
+    assert(capacity <= size);
+    ring->tail = 0;
+    ring->head = 0;
+    ring->size = size;
+    ring->capacity = capacity;
+    ring->buffers = buffers;
+}
+
+/**
+ * Check if the ring is empty.
+ *
+ * @param ring ring to check.
+ *
+ * @return true indicates the ring is empty, false otherwise.
+ */
+static inline bool net_hw_ring_empty(net_hw_ring_t *ring)
+{
+    return ring->tail == ring->head;
+}
+
+/**
+ * Check if the ring is full.
+ *
+ * @param ring ring to check.
+ *
+ * @return true indicates the ring is full, false otherwise.
+ */
+static inline bool net_hw_ring_full(net_hw_ring_t *ring)
+{
+    return ring->tail - ring->head == ring->capacity;
+}
+
+/**
+ * Get the descriptor slot at the tail of the ring.
+ *
+ * @param ring ring to use.
+ *
+ * @return slot the next buffer will be inserted into.
+ */
+static inline uint32_t net_hw_ring_tail_slot(net_hw_ring_t *ring)
+{
+    return ring->tail & (ring->size - 1);
+}
+
+/**
+ * Get the descriptor slot at the head of the ring.
+ *
+ * @param ring ring to use.
+ *
+ * @return slot the next buffer will be removed from.
+ */
+static inline uint32_t net_hw_ring_head_slot(net_hw_ring_t *ring)
+{
+    return ring->head & (ring->size - 1);
+}
+
+/**
+ * Check if a slot is the last in the ring, whose descriptor must be marked
+ * for the device to wrap around.
+ *
+ * @param ring ring to use.
+ * @param slot slot to check.
+ *
+ * @return true indicates slot is the last in the ring, false otherwise.
+ */
+static inline bool net_hw_ring_last_slot(net_hw_ring_t *ring, uint32_t slot)
+{
+    return slot == ring->size - 1;
+}
+
+/**
+ * Insert a buffer at the tail of the ring. The caller must have checked that
+ * the ring is not full, and fills the descriptor of the returned slot.
+ *
+ * @param ring ring to insert into.
+ * @param buffer buffer to be held by the descriptor.
+ *
+ * @return slot of the descriptor to fill.
+ */
+static inline uint32_t net_hw_ring_push(net_hw_ring_t *ring, net_buff_desc_t buffer)
+{
+    uint32_t slot = net_hw_ring_tail_slot(ring);
+    ring->buffers[slot] = buffer;
+    ring->tail++;
+    return slot;
+}
+
+/**
+ * Remove the buffer at the head of the ring, once the device has finished with
+ * its descriptor. The caller must have checked that the ring is not empty. The
+ * book-keeping of the next slot is prefetched for the following call.
+ *
+ * @param ring ring to remove from.
+ *
+ * @return buffer held by the descriptor.
+ */
+static inline net_buff_desc_t net_hw_ring_pop(net_hw_ring_t *ring)
+{
+    net_buff_desc_t buffer = ring->buffers[net_hw_ring_head_slot(ring)];
+    ring->head++;
+    __builtin_prefetch(&ring->buffers[net_hw_ring_head_slot(ring)]);
+    return buffer;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <microkit.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/stats.h>
+#include <ethernet_config.h>
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+
+/*
+ * Adaptor between the sDDF network queues of a client and an lwIP network
+ * interface, for lwIP running without an operating system (NO_SYS).
+ *
+ * Received buffers are handed to lwIP as custom pbufs referencing the receive
+ * buffer, which is returned to the free queue once lwIP frees the pbuf.
+ * Frames are transmitted directly from pbufs allocated with
+ * sddf_lwip_tx_pbuf_alloc, and otherwise copied into a transmit buffer. When
+ * no transmit buffer is available, frames are held in a bounded backlog and
+ * sent once buffers are returned. Once SDDF_LWIP_TX_BACKLOG frames are held,
+ * lwIP is told it is out of memory, so that it backs off. Received buffers are
+ * dequeued in bursts of up to SDDF_LWIP_RX_BURST, with their headers
+ * prefetched before lwIP parses them. Both limits can be set through CFLAGS.
+ *
+ * Notifications to the virtualisers are only sent from sddf_lwip_maybe_notify,
+ * which the client should call once it has finished handling each
+ * notification, so that a single notification covers every buffer enqueued.
+ */
+
+typedef struct sddf_lwip_config {
+    /* queues shared with the virtualisers, the transmit free queue is filled
+     * with buffers by sddf_lwip_init */
+    net_queue_handle_t rx_queue;
+    net_queue_handle_t tx_queue;
+    /* channels to the RX and TX virtualisers */
+    microkit_channel rx_ch;
+    microkit_channel tx_ch;
+    /* client buffer data regions */
+    uintptr_t rx_buffer_data_region;
+    uintptr_t tx_buffer_data_region;
+    /* MAC address of the interface */
+    uint8_t mac[ETH_HWADDR_LEN];
+    /* stats of the client */
+    net_stats_t *stats;
+#if NET_TRACE
+    /* trace state of the client */
+    net_trace_handle_t trace;
+#endif
+    /* called when the status of the interface changes, may be NULL */
+    netif_status_callback_fn status_callback;
+} sddf_lwip_config_t;
+
+/**
+ * Initialise lwIP and add the network interface as the default interface.
+ * The interface is brought up with no address.
+ *
+ * @param config configuration of the interface.
+ */
+void sddf_lwip_init(sddf_lwip_config_t *config);
+
+/**
+ * Get the network interface.
+ *
+ * @return the network interface.
+ */
+struct netif *sddf_lwip_netif(void);
+
+/**
+ * Hand all received buffers to lwIP.
+ */
+void sddf_lwip_process_rx(void);
+
+/**
+ * Transmit frames held in the backlog while transmit buffers are available.
+ */
+void sddf_lwip_process_tx(void);
+
+/**
+ * Notify the virtualisers of any buffers enqueued since the last call, if
+ * they have requested it.
+ */
+void sddf_lwip_maybe_notify(void);
+
+/**
+ * Allocate a PBUF_RAM pbuf directly inside a free transmit buffer, with
+ * headroom for the headers of every layer below the requested one. Once all
+ * headers have been added the pbuf begins where the buffer descriptor points,
+ * past the buffer headroom, so it can be transmitted without copying.
+ *
+ * @param layer header headroom to leave, as for pbuf_alloc.
+ * @param length size of the payload.
+ *
+ * @return the newly created pbuf, NULL if no transmit buffer is available or
+ *         the payload does not fit in a buffer.
+ */
+struct pbuf *sddf_lwip_tx_pbuf_alloc(pbuf_layer layer, u16_t length);
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <microkit.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/stats.h>
+#include <sddf/network/constants.h>
+#include <sddf/network/util.h>
+#include <ethernet_config.h>
+
+/*
+ * Minimal UDP/IPv4 endpoint for clients that only answer UDP requests, as a
+ * lighter alternative to a full IP stack.
+ *
+ * The endpoint has a static IPv4 address and a single port. Replies are sent
+ * to the MAC address, IP address and port each request came from, so no
+ * address resolution is needed. ARP requests for the endpoint's address are
+ * either answered by the endpoint itself or, when an ARP component is
+ * configured, registered with it and left to it.
+ *
+ * The Ethernet, IPv4 and UDP headers of replies are kept as a template, with
+ * the part of the IPv4 header checksum covering the constant fields computed
+ * once. For each request, the template is copied into a transmit buffer, the
+ * per-reply fields are filled in and the handler writes the reply payload
+ * directly after it. UDP checksums are not generated.
+ */
+
+/* IPv4 address a.b.c.d in network byte order */
+#if BYTE_ORDER == BIG_ENDIAN
+#define SDDF_IPV4_ADDR(a, b, c, d) ((uint32_t)(((a) << 24) | ((b) << 16) | ((c) << 8) | (d)))
+#else
+#define SDDF_IPV4_ADDR(a, b, c, d) ((uint32_t)(((d) << 24) | ((c) << 16) | ((b) << 8) | (a)))
+#endif
+
+#define SDDF_UDP_HDR_LEN (sizeof(struct ethernet_header) + sizeof(struct sddf_ipv4_header) \
+                          + sizeof(struct sddf_udp_header))
+/* Maximum size of a reply payload */
+#define SDDF_UDP_MAX_PAYLOAD (NET_BUFFER_SIZE - NET_BUFFER_HEADROOM - SDDF_UDP_HDR_LEN)
+
+struct sddf_ipv4_header {
+    uint8_t ihl_version;
+    uint8_t tos;
+    uint16_t tot_len;
+    uint16_t id;
+    uint16_t frag_off;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t check;
+    uint32_t saddr;
+    uint32_t daddr;
+} __attribute__((packed));
+
+struct sddf_udp_header {
+    uint16_t source;
+    uint16_t dest;
+    uint16_t len;
+    uint16_t check;
+} __attribute__((packed));
+
+/* A received datagram */
+typedef struct sddf_udp_datagram {
+    /* source address in network byte order */
+    uint32_t src_addr;
+    /* source port in host byte order */
+    uint16_t src_port;
+    /* payload, which may be modified */
+    uint8_t *payload;
+    uint16_t len;
+} sddf_udp_datagram_t;
+
+/**
+ * Handle a received datagram.
+ *
+ * @param request received datagram.
+ * @param reply location to write the reply payload to.
+ * @param reply_size space available for the reply payload.
+ *
+ * @return length of the reply payload, 0 to not reply.
+ */
+typedef uint16_t (*sddf_udp_handler_t)(const sddf_udp_datagram_t *request, uint8_t *reply, uint16_t reply_size);
+
+typedef struct sddf_udp_config {
+    /* queues shared with the virtualisers, the transmit free queue is filled
+     * with buffers by sddf_udp_init */
+    net_queue_handle_t rx_queue;
+    net_queue_handle_t tx_queue;
+    /* channels to the RX and TX virtualisers */
+    microkit_channel rx_ch;
+    microkit_channel tx_ch;
+    /* client buffer data regions */
+    uintptr_t rx_buffer_data_region;
+    uintptr_t tx_buffer_data_region;
+    /* MAC address of the endpoint */
+    uint8_t mac[ETH_HWADDR_LEN];
+    /* IPv4 address in network byte order and port in host byte order */
+    uint32_t ipv4_addr;
+    uint16_t port;
+    /* whether ARP requests are answered by an ARP component, and its channel */
+    bool arp_component;
+    microkit_channel arp_ch;
+    /* stats of the client */
+    net_stats_t *stats;
+#if NET_TRACE
+    /* trace state of the client */
+    net_trace_handle_t trace;
+#endif
+    /* handler of received datagrams */
+    sddf_udp_handler_t handler;
+} sddf_udp_config_t;
+
+/**
+ * Initialise the endpoint, and register its address with the ARP component
+ * if one is configured.
+ *
+ * @param config configuration of the endpoint.
+ */
+void sddf_udp_init(sddf_udp_config_t *config);
+
+/**
+ * Handle all received frames, and transmit replies for as long as transmit
+ * buffers are available. Replies to requests received while no transmit
+ * buffer is available are dropped.
+ */
+void sddf_udp_process(void);
+
+/**
+ * Notify the virtualisers of any buffers enqueued since the last call, if
+ * they have requested it.
+ */
+void sddf_udp_maybe_notify(void);
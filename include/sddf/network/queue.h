@@ -18,8 +18,24 @@ typedef struct net_buff_desc {
     uint64_t io_or_offset;
     /* length of data inside buffer */
     uint16_t len;
+    /* tag control information of a received frame whose VLAN tag was removed, otherwise 0 */
+    uint16_t vlan_tci;
+    /* client that sent a frame the TX virtualiser switched to other clients, unused otherwise */
+    uint16_t src_client;
 } net_buff_desc_t;
 
+/*
+ * Each queue has a single producer, the only writer of tail, and a single
+ * consumer, the only writer of head. An index is published with a release
+ * store once the descriptor it covers has been written (producer) or read
+ * (consumer), and the other side's index is read with an acquire load, so
+ * the producer and consumer may run concurrently on different cores.
+ *
+ * Requesting a signal and checking whether one is required are each
+ * separated from the preceding index update by a full fence, so that either
+ * the producer observes the request or the consumer observes the enqueued
+ * buffer.
+ */
 typedef struct net_queue {
     /* index to insert at */
     uint16_t tail;
@@ -49,7 +65,7 @@ typedef struct net_queue_handle {
  */
 static inline uint16_t net_queue_size(net_queue_t *queue)
 {
-    return queue->tail - queue->head;
+    return __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -61,7 +77,7 @@ static inline uint16_t net_queue_size(net_queue_t *queue)
  */
 static inline bool net_queue_empty_free(net_queue_handle_t *queue)
 {
-    return queue->free->tail - queue->free->head == 0;
+    return __atomic_load_n(&queue->free->tail, __ATOMIC_ACQUIRE) - queue->free->head == 0;
 }
 
 /**
@@ -73,7 +89,7 @@ static inline bool net_queue_empty_free(net_queue_handle_t *queue)
  */
 static inline bool net_queue_empty_active(net_queue_handle_t *queue)
 {
-    return queue->active->tail - queue->active->head == 0;
+    return __atomic_load_n(&queue->active->tail, __ATOMIC_ACQUIRE) - queue->active->head == 0;
 }
 
 /**
@@ -85,7 +101,7 @@ static inline bool net_queue_empty_active(net_queue_handle_t *queue)
  */
 static inline bool net_queue_full_free(net_queue_handle_t *queue)
 {
-    return queue->free->tail + 1 - queue->free->head == queue->size;
+    return (uint16_t)(queue->free->tail + 1 - __atomic_load_n(&queue->free->head, __ATOMIC_ACQUIRE)) == queue->size;
 }
 
 /**
@@ -97,7 +113,7 @@ static inline bool net_queue_full_free(net_queue_handle_t *queue)
  */
 static inline bool net_queue_full_active(net_queue_handle_t *queue)
 {
-    return queue->active->tail + 1 - queue->active->head == queue->size;
+    return (uint16_t)(queue->active->tail + 1 - __atomic_load_n(&queue->active->head, __ATOMIC_ACQUIRE)) == queue->size;
 }
 
 /**
@@ -115,10 +131,7 @@ static inline int net_enqueue_free(net_queue_handle_t *queue, net_buff_desc_t bu
     }
 
     queue->free->buffers[queue->free->tail % queue->size] = buffer;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
-    queue->free->tail++;
+    __atomic_store_n(&queue->free->tail, queue->free->tail + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -138,10 +151,32 @@ static inline int net_enqueue_active(net_queue_handle_t *queue, net_buff_desc_t
     }
 
     queue->active->buffers[queue->active->tail % queue->size] = buffer;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
-    queue->active->tail++;
+    __atomic_store_n(&queue->active->tail, queue->active->tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Enqueue a burst of elements into an active queue, publishing them to the
+ * consumer with a single update of the tail.
+ *
+ * @param queue queue to enqueue into.
+ * @param buffers buffer descriptors for buffers to be enqueued.
+ * @param count number of buffers to be enqueued.
+ *
+ * @return -1 when the queue does not have space for all of the buffers, 0 on success.
+ */
+static inline int net_enqueue_active_burst(net_queue_handle_t *queue, net_buff_desc_t *buffers, uint32_t count)
+{
+    uint16_t tail = queue->active->tail;
+    if ((uint16_t)(tail + count - __atomic_load_n(&queue->active->head, __ATOMIC_ACQUIRE)) >= queue->size) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        queue->active->buffers[(uint16_t)(tail + i) % queue->size] = buffers[i];
+    }
+    __atomic_store_n(&queue->active->tail, tail + count, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -161,10 +196,7 @@ static inline int net_dequeue_free(net_queue_handle_t *queue, net_buff_desc_t *b
     }
 
     *buffer = queue->free->buffers[queue->free->head % queue->size];
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
-    queue->free->head++;
+    __atomic_store_n(&queue->free->head, queue->free->head + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -184,10 +216,26 @@ static inline int net_dequeue_active(net_queue_handle_t *queue, net_buff_desc_t
     }
 
     *buffer = queue->active->buffers[queue->active->head % queue->size];
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
-    queue->active->head++;
+    __atomic_store_n(&queue->active->head, queue->active->head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Read the buffer at the head of an active queue without dequeuing it.
+ *
+ * @param queue queue handle to read from.
+ * @param buffer pointer to buffer descriptor to fill.
+ *
+ * @return -1 when queue is empty, 0 on success.
+ */
+static inline int net_peek_active(net_queue_handle_t *queue, net_buff_desc_t *buffer)
+{
+    if (net_queue_empty_active(queue)) {
+        return -1;
+    }
+
+    *buffer = queue->active->buffers[queue->active->head % queue->size];
 
     return 0;
 }
@@ -216,12 +264,64 @@ static inline void net_queue_init(net_queue_handle_t *queue, net_queue_t *free,
 static inline void net_buffers_init(net_queue_handle_t *queue, uintptr_t base_addr)
 {
     for (uint32_t i = 0; i < queue->size - 1; i++) {
-        net_buff_desc_t buffer = {(NET_BUFFER_SIZE * i) + base_addr, 0};
+        net_buff_desc_t buffer = {(NET_BUFFER_SIZE * i) + NET_BUFFER_HEADROOM + base_addr, 0};
         int err = net_enqueue_free(queue, buffer);
         assert(!err);
     }
 }
 
+/**
+ * Get the space left in front of the data a buffer descriptor points to.
+ *
+ * @param buffer buffer descriptor.
+ *
+ * @return number of bytes that can be pushed onto the buffer.
+ */
+static inline uint32_t net_buff_headroom(net_buff_desc_t *buffer)
+{
+    return buffer->io_or_offset % NET_BUFFER_SIZE;
+}
+
+/**
+ * Extend the data of a buffer to the front, into its headroom, for a header
+ * to be written in place in front of the frame.
+ *
+ * @param buffer buffer descriptor to update.
+ * @param len number of bytes to prepend, at most the remaining headroom.
+ */
+static inline void net_buff_push(net_buff_desc_t *buffer, uint16_t len)
+{
+    assert(net_buff_headroom(buffer) >= len);
+    buffer->io_or_offset -= len;
+    buffer->len += len;
+}
+
+/**
+ * Remove bytes from the front of the data of a buffer, returning them to its
+ * headroom.
+ *
+ * @param buffer buffer descriptor to update.
+ * @param len number of bytes to remove, at most the length of the data.
+ */
+static inline void net_buff_pull(net_buff_desc_t *buffer, uint16_t len)
+{
+    assert(buffer->len >= len && net_buff_headroom(buffer) + len < NET_BUFFER_SIZE);
+    buffer->io_or_offset += len;
+    buffer->len -= len;
+}
+
+/**
+ * Reset a buffer descriptor to an empty buffer with the full headroom, undoing
+ * any pushes and pulls.
+ *
+ * @param buffer buffer descriptor to reset.
+ */
+static inline void net_buff_reset(net_buff_desc_t *buffer)
+{
+    buffer->io_or_offset = buffer->io_or_offset - net_buff_headroom(buffer) + NET_BUFFER_HEADROOM;
+    buffer->len = 0;
+}
+
 /**
  * Indicate to producer of the free queue that consumer requires signalling.
  *
@@ -229,10 +329,8 @@ static inline void net_buffers_init(net_queue_handle_t *queue, uintptr_t base_ad
  */
 static inline void net_request_signal_free(net_queue_handle_t *queue)
 {
-    queue->free->consumer_signalled = 0;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue->free->consumer_signalled, 0, __ATOMIC_RELAXED);
+    SMP_MEMORY_FENCE();
 }
 
 /**
@@ -242,10 +340,8 @@ static inline void net_request_signal_free(net_queue_handle_t *queue)
  */
 static inline void net_request_signal_active(net_queue_handle_t *queue)
 {
-    queue->active->consumer_signalled = 0;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue->active->consumer_signalled, 0, __ATOMIC_RELAXED);
+    SMP_MEMORY_FENCE();
 }
 
 /**
@@ -255,10 +351,7 @@ static inline void net_request_signal_active(net_queue_handle_t *queue)
  */
 static inline void net_cancel_signal_free(net_queue_handle_t *queue)
 {
-    queue->free->consumer_signalled = 1;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue->free->consumer_signalled, 1, __ATOMIC_RELAXED);
 }
 
 /**
@@ -268,10 +361,7 @@ static inline void net_cancel_signal_free(net_queue_handle_t *queue)
  */
 static inline void net_cancel_signal_active(net_queue_handle_t *queue)
 {
-    queue->active->consumer_signalled = 1;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue->active->consumer_signalled, 1, __ATOMIC_RELAXED);
 }
 
 /**
@@ -281,7 +371,8 @@ static inline void net_cancel_signal_active(net_queue_handle_t *queue)
  */
 static inline bool net_require_signal_free(net_queue_handle_t *queue)
 {
-    return !queue->free->consumer_signalled;
+    SMP_MEMORY_FENCE();
+    return !__atomic_load_n(&queue->free->consumer_signalled, __ATOMIC_RELAXED);
 }
 
 /**
@@ -291,5 +382,6 @@ static inline bool net_require_signal_free(net_queue_handle_t *queue)
  */
 static inline bool net_require_signal_active(net_queue_handle_t *queue)
 {
-    return !queue->active->consumer_signalled;
+    SMP_MEMORY_FENCE();
+    return !__atomic_load_n(&queue->active->consumer_signalled, __ATOMIC_RELAXED);
 }
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/network/queue.h>
+#include <sddf/util/util.h>
+
+/*
+ * LIFO stack of free buffers, for components that hand out buffers to keep
+ * the most recently returned buffer, which is most likely still cached, on
+ * top. Free queues are FIFO and cycle through every buffer in turn, so a
+ * component that holds its free buffers here and only hands them out from
+ * the top keeps its working set as small as the load allows.
+ */
+
+typedef struct net_recycle {
+    /* number of buffers held */
+    uint32_t count;
+    /* maximum number of buffers held */
+    uint32_t capacity;
+    /* held buffers, the top of the stack last */
+    net_buff_desc_t *buffers;
+} net_recycle_t;
+
+/**
+ * Initialise an empty stack.
+ *
+ * @param recycle stack to initialise.
+ * @param buffers array of capacity entries to hold buffers in.
+ * @param capacity maximum number of buffers held.
+ */
+static inline void net_recycle_init(net_recycle_t *recycle, net_buff_desc_t *buffers, uint32_t capacity)
+{
+    recycle->count = 0;
+    recycle->capacity = capacity;
+    recycle->buffers = buffers;
+}
+
+/**
+ * Check if the stack is empty.
+ *
+ * @param recycle stack to check.
+ *
+ * @return true indicates the stack is empty, false otherwise.
+ */
+static inline bool net_recycle_empty(net_recycle_t *recycle)
+{
+    return recycle->count == 0;
+}
+
+/**
+ * Push a buffer onto the stack. The stack must not be full.
+ *
+ * @param recycle stack to push onto.
+ * @param buffer buffer to push.
+ */
+static inline void net_recycle_push(net_recycle_t *recycle, net_buff_desc_t buffer)
+{
+    assert(recycle->count < recycle->capacity);
+    recycle->buffers[recycle->count++] = buffer;
+}
+
+/**
+ * Pop the most recently pushed buffer off the stack. The stack must not be
+ * empty.
+ *
+ * @param recycle stack to pop from.
+ *
+ * @return most recently pushed buffer.
+ */
+static inline net_buff_desc_t net_recycle_pop(net_recycle_t *recycle)
+{
+    assert(recycle->count != 0);
+    return recycle->buffers[--recycle->count];
+}
+
+/**
+ * Fill the stack with consecutive buffers of a data region, the first buffer
+ * on top, in place of net_buffers_init.
+ *
+ * @param recycle stack to fill.
+ * @param num_buffers number of buffers in the data region.
+ * @param base_addr address or offset of the data region.
+ */
+static inline void net_recycle_buffers_init(net_recycle_t *recycle, uint32_t num_buffers, uintptr_t base_addr)
+{
+    for (uint32_t i = num_buffers; i > 0; i--) {
+        net_buff_desc_t buffer = {(NET_BUFFER_SIZE * (i - 1)) + NET_BUFFER_HEADROOM + base_addr, 0};
+        net_recycle_push(recycle, buffer);
+    }
+}
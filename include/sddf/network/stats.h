@@ -0,0 +1,102 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Network telemetry counters.
+ *
+ * Each network component owns one cache line of a shared stats region. A
+ * component is the only writer of its own line, so counters are updated with
+ * plain (relaxed) stores and no synchronisation. Readers, such as the
+ * benchmark PD, may observe counters that are slightly out of date but never
+ * contend with the writers.
+ */
+
+#define NET_STATS_CACHE_LINE 64
+
+/* Reasons a packet was dropped */
+#define NET_STATS_DROP_BAD_OFFSET 0 /* buffer offset was not buffer aligned or outside of the data region */
+#define NET_STATS_DROP_NO_MATCH 1 /* destination MAC address did not match any client */
+#define NET_STATS_DROP_NO_BUFFER 2 /* no free buffer was available */
+#define NET_STATS_DROP_TOO_LARGE 3 /* packet did not fit into a buffer */
+#define NET_STATS_DROP_OVERLOAD 4 /* client held too many buffers */
+#define NET_STATS_DROP_REASONS 5
+
+typedef struct net_stats {
+    /* packets processed, in either direction */
+    uint64_t packets;
+    /* bytes processed, in either direction */
+    uint64_t bytes;
+    /* notifications sent to other components */
+    uint64_t notifications_sent;
+    /* notifications received from other components */
+    uint64_t notifications_received;
+    /* packets dropped, indexed by reason */
+    uint32_t drops[NET_STATS_DROP_REASONS];
+    /* largest number of buffers observed in the component's input queue */
+    uint32_t queue_hwm;
+} __attribute__((aligned(NET_STATS_CACHE_LINE))) net_stats_t;
+
+_Static_assert(sizeof(net_stats_t) == NET_STATS_CACHE_LINE, "net_stats_t must occupy a single cache line");
+
+/**
+ * Count a processed packet.
+ *
+ * @param stats stats of the calling component.
+ * @param len length of the packet.
+ */
+static inline void net_stats_packet(net_stats_t *stats, uint16_t len)
+{
+    stats->packets++;
+    stats->bytes += len;
+}
+
+/**
+ * Count a dropped packet.
+ *
+ * @param stats stats of the calling component.
+ * @param reason one of NET_STATS_DROP_*.
+ */
+static inline void net_stats_drop(net_stats_t *stats, uint32_t reason)
+{
+    stats->drops[reason]++;
+}
+
+/**
+ * Count a notification sent to another component.
+ *
+ * @param stats stats of the calling component.
+ */
+static inline void net_stats_notify(net_stats_t *stats)
+{
+    stats->notifications_sent++;
+}
+
+/**
+ * Count a notification received from another component.
+ *
+ * @param stats stats of the calling component.
+ */
+static inline void net_stats_notified(net_stats_t *stats)
+{
+    stats->notifications_received++;
+}
+
+/**
+ * Update the queue occupancy high-water mark.
+ *
+ * @param stats stats of the calling component.
+ * @param occupancy number of buffers currently in the queue.
+ */
+static inline void net_stats_queue_occupancy(net_stats_t *stats, uint32_t occupancy)
+{
+    if (occupancy > stats->queue_hwm) {
+        stats->queue_hwm = occupancy;
+    }
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sddf/network/constants.h>
+#include <sddf/benchmark/sel4bench.h>
+
+/*
+ * Per-hop latency tracing of received packets.
+ *
+ * As a received buffer passes through the system each component stamps the
+ * cycle counter into a side table entry indexed by the buffer's slot in its
+ * data region. The driver, RX virtualiser and copy component stamp entries in
+ * the table for the driver's data region. The copy component then copies the
+ * entry into its client's table, since the client sees the packet in a
+ * different buffer. When the client stamps the final hop, the trace is
+ * complete and the latency of each hop is recorded into histograms owned by
+ * the client, from which percentiles can be computed at any time.
+ *
+ * Every table and histogram has a single writer, except that broadcast
+ * packets are stamped by multiple copy components.
+ *
+ * Stamps are read from the PMU cycle counter, which is only accessible from
+ * user level in the benchmark configuration.
+ */
+
+#if !defined(MICROKIT_CONFIG_benchmark)
+#error "Network tracing requires the benchmark configuration"
+#endif
+
+/* Points at which a buffer is stamped */
+#define NET_TRACE_DRIVER 0
+#define NET_TRACE_VIRT_RX 1
+#define NET_TRACE_COPY 2
+#define NET_TRACE_CLIENT 3
+#define NET_TRACE_NUM_POINTS 4
+
+/* Histograms are kept for each hop between points, plus one for the total latency */
+#define NET_TRACE_TOTAL (NET_TRACE_NUM_POINTS - 1)
+#define NET_TRACE_NUM_HISTS NET_TRACE_NUM_POINTS
+
+/*
+ * Histogram buckets are exact for values below 2^NET_TRACE_SUB_BITS and above
+ * that each power of two is split into 2^NET_TRACE_SUB_BITS buckets, bounding
+ * the relative error of a bucket at 1/2^NET_TRACE_SUB_BITS.
+ */
+#define NET_TRACE_SUB_BITS 3
+#define NET_TRACE_SUB_BUCKETS (1 << NET_TRACE_SUB_BITS)
+#define NET_TRACE_BUCKETS ((64 - NET_TRACE_SUB_BITS + 1) * NET_TRACE_SUB_BUCKETS)
+
+typedef struct net_trace_entry {
+    uint64_t stamps[NET_TRACE_NUM_POINTS];
+} net_trace_entry_t;
+
+typedef struct net_trace_hist {
+    uint64_t count;
+    uint32_t buckets[NET_TRACE_BUCKETS];
+} net_trace_hist_t;
+
+typedef struct net_trace_client {
+    /* histograms of hop latencies, in cycles */
+    net_trace_hist_t hists[NET_TRACE_NUM_HISTS];
+    /* entries indexed by client buffer slot */
+    net_trace_entry_t entries[];
+} net_trace_client_t;
+
+typedef struct net_trace_handle {
+    /* entries indexed by driver buffer slot */
+    net_trace_entry_t *rx;
+    /* trace state of the client, NULL for components that don't serve a single client */
+    net_trace_client_t *client;
+} net_trace_handle_t;
+
+/**
+ * Get the slot of a buffer within its data region. Data regions must be
+ * aligned to their size so that physical addresses can be used directly.
+ *
+ * @param io_or_offset offset or io address of buffer.
+ * @param region_size size of the data region.
+ *
+ * @return slot of the buffer.
+ */
+static inline uint32_t net_trace_slot(uint64_t io_or_offset, uint64_t region_size)
+{
+    return (io_or_offset % region_size) / NET_BUFFER_SIZE;
+}
+
+/**
+ * Stamp the current cycle count into a trace entry.
+ *
+ * @param entry trace entry of the buffer.
+ * @param point one of NET_TRACE_DRIVER ... NET_TRACE_CLIENT.
+ */
+static inline void net_trace_stamp(net_trace_entry_t *entry, int point)
+{
+    uint64_t cycles;
+    SEL4BENCH_READ_CCNT(cycles);
+    entry->stamps[point] = cycles;
+}
+
+/**
+ * Get the histogram bucket of a value.
+ *
+ * @param value value to find the bucket of.
+ *
+ * @return bucket index.
+ */
+static inline uint32_t net_trace_bucket(uint64_t value)
+{
+    if (value < NET_TRACE_SUB_BUCKETS) {
+        return value;
+    }
+    uint32_t msb = 63 - __builtin_clzll(value);
+    uint32_t shift = msb - NET_TRACE_SUB_BITS;
+    return (shift + 1) * NET_TRACE_SUB_BUCKETS + ((value >> shift) & (NET_TRACE_SUB_BUCKETS - 1));
+}
+
+/**
+ * Get the smallest value that falls into a histogram bucket.
+ *
+ * @param bucket bucket index.
+ *
+ * @return lower bound of the bucket.
+ */
+static inline uint64_t net_trace_bucket_value(uint32_t bucket)
+{
+    if (bucket < NET_TRACE_SUB_BUCKETS) {
+        return bucket;
+    }
+    uint32_t shift = bucket / NET_TRACE_SUB_BUCKETS - 1;
+    return (uint64_t)(NET_TRACE_SUB_BUCKETS + bucket % NET_TRACE_SUB_BUCKETS) << shift;
+}
+
+/**
+ * Record the hop latencies of a completed trace entry. Entries with missing or
+ * out of order stamps, such as those of buffers that were dropped on a previous
+ * pass through the system, are ignored.
+ *
+ * @param client trace state of the client.
+ * @param entry completed trace entry.
+ */
+static inline void net_trace_complete(net_trace_client_t *client, net_trace_entry_t *entry)
+{
+    for (int point = 1; point < NET_TRACE_NUM_POINTS; point++) {
+        if (!entry->stamps[point - 1] || entry->stamps[point] < entry->stamps[point - 1]) {
+            return;
+        }
+    }
+
+    for (int point = 1; point < NET_TRACE_NUM_POINTS; point++) {
+        net_trace_hist_t *hist = &client->hists[point - 1];
+        hist->buckets[net_trace_bucket(entry->stamps[point] - entry->stamps[point - 1])]++;
+        hist->count++;
+    }
+
+    net_trace_hist_t *total = &client->hists[NET_TRACE_TOTAL];
+    total->buckets[net_trace_bucket(entry->stamps[NET_TRACE_CLIENT] - entry->stamps[NET_TRACE_DRIVER])]++;
+    total->count++;
+}
+
+/**
+ * Find a percentile of a histogram.
+ *
+ * @param hist histogram.
+ * @param per_mille percentile in tenths of a percent, e.g. 999 for p99.9.
+ *
+ * @return lower bound of the bucket containing the percentile, 0 if the histogram is empty.
+ */
+static inline uint64_t net_trace_percentile(net_trace_hist_t *hist, uint32_t per_mille)
+{
+    uint64_t target = (hist->count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < NET_TRACE_BUCKETS; bucket++) {
+        seen += hist->buckets[bucket];
+        if (seen && seen >= target) {
+            return net_trace_bucket_value(bucket);
+        }
+    }
+    return 0;
+}
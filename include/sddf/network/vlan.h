@@ -0,0 +1,86 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/network/constants.h>
+#include <sddf/network/util.h>
+#include <sddf/util/string.h>
+
+/*
+ * IEEE 802.1Q VLAN tags. A tag is inserted between the source MAC address
+ * and the ethertype, and consists of the tag protocol identifier followed by
+ * the tag control information: a 3 bit priority, a drop eligible bit and the
+ * 12 bit VLAN ID.
+ */
+
+#define NET_VLAN_TPID 0x8100U
+#define NET_VLAN_TAG_LEN 4
+#define NET_VLAN_VID_MASK 0x0fffU
+/* Offset of the tag within a frame */
+#define NET_VLAN_TAG_OFFSET (2 * ETH_HWADDR_LEN)
+
+struct vlan_ethernet_header {
+    struct ethernet_address dest;
+    struct ethernet_address src;
+    uint16_t tpid;
+    uint16_t tci;
+    uint16_t type;
+} __attribute__((packed));
+
+/**
+ * Get the tag control information of a frame.
+ *
+ * @param frame address of the frame.
+ * @param len length of the frame.
+ * @param tci location to write the tag control information to.
+ *
+ * @return true if the frame is tagged, false otherwise.
+ */
+static inline bool net_vlan_get(uintptr_t frame, uint16_t len, uint16_t *tci)
+{
+    struct vlan_ethernet_header *hdr = (struct vlan_ethernet_header *)frame;
+    if (len < sizeof(struct vlan_ethernet_header) || hdr->tpid != HTONS(NET_VLAN_TPID)) {
+        return false;
+    }
+    *tci = HTONS(hdr->tci);
+    return true;
+}
+
+/**
+ * Tag a frame whose buffer has been pushed by NET_VLAN_TAG_LEN bytes. The MAC
+ * addresses are moved to the new start of the buffer's data and the tag
+ * written after them.
+ *
+ * @param frame address of the pushed data, NET_VLAN_TAG_LEN bytes before the untagged frame.
+ * @param tci tag control information to insert.
+ */
+static inline void net_vlan_insert(uintptr_t frame, uint16_t tci)
+{
+    sddf_memmove((void *)frame, (void *)(frame + NET_VLAN_TAG_LEN), NET_VLAN_TAG_OFFSET);
+
+    struct vlan_ethernet_header *hdr = (struct vlan_ethernet_header *)frame;
+    hdr->tpid = HTONS(NET_VLAN_TPID);
+    hdr->tci = HTONS(tci);
+}
+
+/**
+ * Copy a tagged frame with its tag removed.
+ *
+ * @param dst address to copy the untagged frame to.
+ * @param src address of the tagged frame.
+ * @param len length of the tagged frame.
+ *
+ * @return length of the untagged frame.
+ */
+static inline uint16_t net_vlan_strip_copy(uintptr_t dst, uintptr_t src, uint16_t len)
+{
+    sddf_memcpy((void *)dst, (void *)src, NET_VLAN_TAG_OFFSET);
+    sddf_memcpy((void *)(dst + NET_VLAN_TAG_OFFSET), (void *)(src + NET_VLAN_TAG_OFFSET + NET_VLAN_TAG_LEN),
+                len - NET_VLAN_TAG_OFFSET - NET_VLAN_TAG_LEN);
+    return len - NET_VLAN_TAG_LEN;
+}
@@ -13,6 +13,13 @@
 #include <sddf/util/util.h>
 #include <sddf/util/fence.h>
 
+/*
+ * The producer is the only writer of tail and the consumer the only writer of
+ * head. Indices are published with release stores and the other side's index
+ * is read with an acquire load, so the producer and consumer may run
+ * concurrently on different cores. Indices passed to serial_enqueue and
+ * serial_dequeue may point directly at the shared index.
+ */
 typedef struct serial_queue {
     /* index to insert at */
     uint32_t tail;
@@ -40,7 +47,7 @@ typedef struct serial_queue_handle {
  */
 static inline int serial_queue_empty(serial_queue_handle_t *queue_handle, uint32_t local_head)
 {
-    return local_head == queue_handle->queue->tail;
+    return local_head == __atomic_load_n(&queue_handle->queue->tail, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -53,7 +60,7 @@ static inline int serial_queue_empty(serial_queue_handle_t *queue_handle, uint32
  */
 static inline int serial_queue_full(serial_queue_handle_t *queue_handle, uint32_t local_tail)
 {
-    return local_tail - queue_handle->queue->head == queue_handle->size;
+    return local_tail - __atomic_load_n(&queue_handle->queue->head, __ATOMIC_ACQUIRE) == queue_handle->size;
 }
 
 /**
@@ -74,7 +81,7 @@ static inline int serial_enqueue(serial_queue_handle_t *queue_handle, uint32_t *
     }
 
     queue_handle->data_region[*local_tail % queue_handle->size] = character;
-    (*local_tail)++;
+    __atomic_store_n(local_tail, *local_tail + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -97,7 +104,7 @@ static inline int serial_dequeue(serial_queue_handle_t *queue_handle, uint32_t *
     }
 
     *character = queue_handle->data_region[*local_head % queue_handle->size];
-    (*local_head)++;
+    __atomic_store_n(local_head, *local_head + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -112,7 +119,7 @@ static inline int serial_dequeue(serial_queue_handle_t *queue_handle, uint32_t *
 static inline void serial_update_visible_tail(serial_queue_handle_t *queue_handle,
                                               uint32_t local_tail)
 {
-    uint32_t head = queue_handle->queue->head;
+    uint32_t head = __atomic_load_n(&queue_handle->queue->head, __ATOMIC_ACQUIRE);
     uint32_t tail = queue_handle->queue->tail;
     uint32_t max_tail = head + queue_handle->size;
 
@@ -132,11 +139,7 @@ static inline void serial_update_visible_tail(serial_queue_handle_t *queue_handl
         assert(local_tail >= head || local_tail <= max_tail);
     }
 
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
-
-    queue_handle->queue->tail = local_tail;
+    __atomic_store_n(&queue_handle->queue->tail, local_tail, __ATOMIC_RELEASE);
 }
 
 /**
@@ -150,7 +153,7 @@ static inline void serial_update_visible_head(serial_queue_handle_t *queue_handl
                                               uint32_t local_head)
 {
     uint32_t head = queue_handle->queue->head;
-    uint32_t tail = queue_handle->queue->tail;
+    uint32_t tail = __atomic_load_n(&queue_handle->queue->tail, __ATOMIC_ACQUIRE);
 
     /* Ensure updates to head don't corrupt queue size constraints */
     if (head <= tail) {
@@ -160,11 +163,7 @@ static inline void serial_update_visible_head(serial_queue_handle_t *queue_handl
         assert(local_head >= head || local_head <= tail);
     }
 
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
-
-    queue_handle->queue->head = local_head;
+    __atomic_store_n(&queue_handle->queue->head, local_head, __ATOMIC_RELEASE);
 }
 
 /**
@@ -176,7 +175,8 @@ static inline void serial_update_visible_head(serial_queue_handle_t *queue_handl
  */
 static inline uint32_t serial_queue_length(serial_queue_handle_t *queue_handle)
 {
-    return queue_handle->queue->tail - queue_handle->queue->head;
+    return __atomic_load_n(&queue_handle->queue->tail, __ATOMIC_ACQUIRE)
+           - __atomic_load_n(&queue_handle->queue->head, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -367,10 +367,8 @@ static inline void serial_queue_init(serial_queue_handle_t *queue_handle,
  */
 static inline void serial_request_consumer_signal(serial_queue_handle_t *queue_handle)
 {
-    queue_handle->queue->consumer_signalled = 0;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue_handle->queue->consumer_signalled, 0, __ATOMIC_RELAXED);
+    SMP_MEMORY_FENCE();
 }
 
 /**
@@ -380,10 +378,8 @@ static inline void serial_request_consumer_signal(serial_queue_handle_t *queue_h
  */
 static inline void serial_request_producer_signal(serial_queue_handle_t *queue_handle)
 {
-    queue_handle->queue->producer_signalled = 0;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue_handle->queue->producer_signalled, 0, __ATOMIC_RELAXED);
+    SMP_MEMORY_FENCE();
 }
 
 /**
@@ -393,10 +389,7 @@ static inline void serial_request_producer_signal(serial_queue_handle_t *queue_h
  */
 static inline void serial_cancel_consumer_signal(serial_queue_handle_t *queue_handle)
 {
-    queue_handle->queue->consumer_signalled = 1;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue_handle->queue->consumer_signalled, 1, __ATOMIC_RELAXED);
 }
 
 /**
@@ -406,10 +399,7 @@ static inline void serial_cancel_consumer_signal(serial_queue_handle_t *queue_ha
  */
 static inline void serial_cancel_producer_signal(serial_queue_handle_t *queue_handle)
 {
-    queue_handle->queue->producer_signalled = 1;
-#ifdef CONFIG_ENABLE_SMP_SUPPORT
-    THREAD_MEMORY_RELEASE();
-#endif
+    __atomic_store_n(&queue_handle->queue->producer_signalled, 1, __ATOMIC_RELAXED);
 }
 
 /**
@@ -419,7 +409,8 @@ static inline void serial_cancel_producer_signal(serial_queue_handle_t *queue_ha
  */
 static inline bool serial_require_consumer_signal(serial_queue_handle_t *queue_handle)
 {
-    return !queue_handle->queue->consumer_signalled;
+    SMP_MEMORY_FENCE();
+    return !__atomic_load_n(&queue_handle->queue->consumer_signalled, __ATOMIC_RELAXED);
 }
 
 /**
@@ -429,5 +420,6 @@ static inline bool serial_require_consumer_signal(serial_queue_handle_t *queue_h
  */
 static inline bool serial_require_producer_signal(serial_queue_handle_t *queue_handle)
 {
-    return !queue_handle->queue->producer_signalled;
+    SMP_MEMORY_FENCE();
+    return !__atomic_load_n(&queue_handle->queue->producer_signalled, __ATOMIC_RELAXED);
 }
@@ -60,6 +60,11 @@ typedef struct sound_pcm {
     uint32_t latency_bytes;
 } sound_pcm_t;
 
+/*
+ * The producer of a queue is the only writer of tail and the consumer the only
+ * writer of head. Indices are published with release stores and the other
+ * side's index is read with an acquire load.
+ */
 typedef struct sound_cmd_queue_t {
     uint32_t tail;
     uint32_t head;
@@ -126,13 +131,13 @@ static inline void sound_queues_init_buffers(sound_queues_t *queues)
 /** Returns true if CMD queue is empty */
 static inline bool sound_cmd_queue_empty(sound_cmd_queue_handle_t *h)
 {
-    return h->q->tail == h->q->head;
+    return __atomic_load_n(&h->q->tail, __ATOMIC_ACQUIRE) == h->q->head;
 }
 
 /** Returns true if PCM queue is empty */
 static inline bool sound_pcm_queue_empty(sound_pcm_queue_handle_t *h)
 {
-    return h->q->tail == h->q->head;
+    return __atomic_load_n(&h->q->tail, __ATOMIC_ACQUIRE) == h->q->head;
 }
 
 /**
@@ -145,7 +150,7 @@ static inline bool sound_pcm_queue_empty(sound_pcm_queue_handle_t *h)
  */
 static inline bool sound_cmd_queue_full(sound_cmd_queue_handle_t *h)
 {
-    return (h->q->tail - h->q->head) == h->size;
+    return (h->q->tail - __atomic_load_n(&h->q->head, __ATOMIC_ACQUIRE)) == h->size;
 }
 
 /**
@@ -158,7 +163,7 @@ static inline bool sound_cmd_queue_full(sound_cmd_queue_handle_t *h)
  */
 static inline bool sound_pcm_queue_full(sound_pcm_queue_handle_t *h)
 {
-    return (h->q->tail - h->q->head) == h->size;
+    return (h->q->tail - __atomic_load_n(&h->q->head, __ATOMIC_ACQUIRE)) == h->size;
 }
 
 /**
@@ -170,7 +175,7 @@ static inline bool sound_pcm_queue_full(sound_pcm_queue_handle_t *h)
  */
 static inline int sound_cmd_queue_size(sound_cmd_queue_handle_t *h)
 {
-    return h->q->tail - h->q->head;
+    return __atomic_load_n(&h->q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&h->q->head, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -182,7 +187,7 @@ static inline int sound_cmd_queue_size(sound_cmd_queue_handle_t *h)
  */
 static inline int sound_pcm_queue_size(sound_pcm_queue_handle_t *h)
 {
-    return h->q->tail - h->q->head;
+    return __atomic_load_n(&h->q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&h->q->head, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -206,8 +211,7 @@ static inline int sound_enqueue_cmd(sound_cmd_queue_handle_t *h, const sound_cmd
     dest->stream_id = command->stream_id;
     dest->set_params = command->set_params;
 
-    THREAD_MEMORY_RELEASE();
-    h->q->tail++;
+    __atomic_store_n(&h->q->tail, h->q->tail + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -235,8 +239,7 @@ static inline int sound_enqueue_pcm(sound_pcm_queue_handle_t *h, sound_pcm_t *pc
     data->status = pcm->status;
     data->latency_bytes = pcm->latency_bytes;
 
-    THREAD_MEMORY_RELEASE();
-    h->q->tail++;
+    __atomic_store_n(&h->q->tail, h->q->tail + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -261,8 +264,7 @@ static inline int sound_dequeue_cmd(sound_cmd_queue_handle_t *h, sound_cmd_t *ou
     out->stream_id = src->stream_id;
     out->set_params = src->set_params;
 
-    THREAD_MEMORY_RELEASE();
-    h->q->head++;
+    __atomic_store_n(&h->q->head, h->q->head + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -290,8 +292,7 @@ static inline int sound_dequeue_pcm(sound_pcm_queue_handle_t *h, sound_pcm_t *ou
     out->status = pcm->status;
     out->latency_bytes = pcm->latency_bytes;
 
-    THREAD_MEMORY_RELEASE();
-    h->q->head++;
+    __atomic_store_n(&h->q->head, h->q->head + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -23,7 +23,7 @@
  * All stores before this point are completed, and all loads after this
  * point are delayed until after it.
  */
-#define THREAD_MEMORY_FENCE() __atomic_thread_fence(__ATOMIC_ACQ_REL)
+#define THREAD_MEMORY_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
 
 /* THREAD_MEMORY_RELEASE: Implements a fence which has the effect of
  * forcing all stores before this point to complete.
@@ -34,3 +34,14 @@
  * forcing all loads beyond this point to occur after this point.
  */
 #define THREAD_MEMORY_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+/* SMP_MEMORY_FENCE: Orders all stores before this point with all loads
+ * after it, as observed by protection domains on other cores. Without SMP
+ * support protection domains never run concurrently, so only compiler
+ * re-ordering needs to be prevented.
+ */
+#ifdef CONFIG_ENABLE_SMP_SUPPORT
+#define SMP_MEMORY_FENCE() THREAD_MEMORY_FENCE()
+#else
+#define SMP_MEMORY_FENCE() COMPILER_MEMORY_FENCE()
+#endif
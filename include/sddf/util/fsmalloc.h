@@ -7,24 +7,51 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include <sddf/util/bitarray.h>
 
 /**
  * This file handles the allocation and freeing of fixed size data cells in a memory region.
- * The allocator uses a really simple algorithm, it stores a memory region offset that is incremented
- * on allocation of a cell. The allocator does not handle fragmentation, it will only check for
- * available cells from the offset. The allocator uses a bit array to keep track of available cells.
+ * The allocator is a binary buddy allocator: free cells are kept in runs of a power of two
+ * cells aligned to their size, with a free list for each size. An allocation takes a run of
+ * the smallest sufficient size, splitting a larger one if needed, and returns the cells it
+ * does not need. Freed runs are merged with their free buddies. Allocating and freeing a
+ * single cell takes at most FSMALLOC_NUM_ORDERS steps, independent of the number of cells
+ * and of how fragmented they are.
  */
 
+/* Number of run sizes, runs hold up to 2^(FSMALLOC_NUM_ORDERS - 1) cells */
+#define FSMALLOC_NUM_ORDERS 17
+
+/* Marks the end of a free list and cells that do not start a free run */
+#define FSMALLOC_NONE UINT32_MAX
+
+/* Per cell state, only meaningful for the first cell of a free run */
+typedef struct fsmalloc_cell {
+    uint32_t next; /* next free run of the same size */
+    uint32_t prev; /* previous free run of the same size */
+    uint32_t order; /* log2 of the number of cells in the free run, FSMALLOC_NONE if the cell does not start one */
+} fsmalloc_cell_t;
+
 /* Data struct that handles allocation and freeing of fixed size data cells in memory region */
 typedef struct fsmalloc {
-    uint64_t avail_bitpos; /* bit position of next available cell */
-    bitarray_t *avail_bitarr; /* bit array representing available data cells */
+    fsmalloc_cell_t *cells; /* state of each data cell */
+    uint32_t free_lists[FSMALLOC_NUM_ORDERS]; /* first free run of each size */
+    uint32_t nonempty; /* bit mask of the sizes that have free runs */
     uint64_t num_cells; /* number of cells in data region */
     uint64_t cell_size; /* number of bytes in a cell */
     uintptr_t base_addr; /* base address of data region */
+    uint64_t free_cells; /* number of free cells */
+    uint64_t free_runs; /* number of free runs the free cells are in */
+    uint64_t failed_allocs; /* allocations that failed although enough cells were free */
 } fsmalloc_t;
 
+/* Fragmentation statistics of a data region */
+typedef struct fsmalloc_stats {
+    uint64_t free_cells; /* number of free cells */
+    uint64_t free_runs; /* number of free runs the free cells are in */
+    uint64_t largest_alloc; /* largest number of cells that can be allocated at once */
+    uint64_t failed_allocs; /* allocations that failed although enough cells were free */
+} fsmalloc_stats_t;
+
 /**
  * Check if the memory region can fit count more free cells.
  *
@@ -42,7 +69,8 @@ bool fsmalloc_full(fsmalloc_t *fsmalloc, uint64_t count);
  * @param addr pointer to base address of the resulting contiguous cell.
  * @param count number of free cells to get.
  *
- * @return -1 when data region is full, 0 on success.
+ * @return -1 when data region is full, 0 on success. A failure while count
+ * cells are free is counted in failed_allocs, a check with fsmalloc_full is not.
  */
 int fsmalloc_alloc(fsmalloc_t *fsmalloc, uintptr_t *addr, uint64_t count);
 
@@ -55,16 +83,22 @@ int fsmalloc_alloc(fsmalloc_t *fsmalloc, uintptr_t *addr, uint64_t count);
  */
 void fsmalloc_free(fsmalloc_t *fsmalloc, uintptr_t addr, uint64_t count);
 
+/**
+ * Get fragmentation statistics of the data region.
+ *
+ * @param fsmalloc pointer to the fsmalloc struct.
+ * @param stats pointer to the statistics to fill.
+ */
+void fsmalloc_stats(fsmalloc_t *fsmalloc, fsmalloc_stats_t *stats);
+
 /**
  * Initialise fixed size memory allocation struct.
  *
  * @param fsmalloc pointer to the fsmalloc struct.
  * @param base_addr base address of the data region.
  * @param cell_size number of bytes in a cell.
- * @param num_cells number of cells in the data region.
- * @param bitarr pointer to the bitarray struct representing available data cells.
- * @param words pointer to the array of words in bitarray struct.
- * @param num_words number of words in the array of bitarray struct. This needs to be > num_cells/64. Can be calculated using roundup_bits2words64(num_cells).
+ * @param num_cells number of cells in the data region, less than FSMALLOC_NONE.
+ * @param cells pointer to an array of num_cells cell states.
  */
 void fsmalloc_init(fsmalloc_t *fsmalloc, uintptr_t base_addr, uint64_t cell_size, uint64_t num_cells,
-                   bitarray_t *bitarr, word_t *words, word_index_t num_words);
\ No newline at end of file
+                   fsmalloc_cell_t *cells);
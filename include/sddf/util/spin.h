@@ -0,0 +1,102 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <microkit.h>
+#include <sddf/util/fence.h>
+
+/*
+ * Bounded backoff for components that busy poll shared queues rather than
+ * wait for notifications. Between polls that find no work the component
+ * relaxes for an exponentially increasing number of iterations, up to a
+ * maximum. After a number of consecutive empty polls the component is
+ * considered idle and should go back to waiting for notifications.
+ *
+ * Busy polling only makes sense when the poller has a core to itself, since
+ * it never yields to lower priority protection domains on its core.
+ */
+
+#ifndef CONFIG_ENABLE_SMP_SUPPORT
+#error "Busy polling requires a multicore configuration"
+#endif
+
+typedef struct sddf_spin {
+    /* consecutive polls that found no work */
+    uint32_t idle;
+    /* number of polls after which the poller is idle */
+    uint32_t idle_limit;
+    /* current and maximum number of iterations to relax for between polls */
+    uint32_t backoff;
+    uint32_t backoff_limit;
+} sddf_spin_t;
+
+/**
+ * Hint to the processor that we are spinning, without giving up the core.
+ */
+static inline void sddf_spin_relax(void)
+{
+#if defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#elif defined(__x86_64__)
+    asm volatile("pause" ::: "memory");
+#else
+    COMPILER_MEMORY_FENCE();
+#endif
+}
+
+/**
+ * Reset the backoff, to be called after a poll that found work.
+ *
+ * @param spin spin state.
+ */
+static inline void sddf_spin_reset(sddf_spin_t *spin)
+{
+    spin->idle = 0;
+    spin->backoff = 1;
+}
+
+/**
+ * Initialise spin state.
+ *
+ * @param spin spin state.
+ * @param idle_limit number of consecutive empty polls after which to stop spinning.
+ * @param backoff_limit maximum number of iterations to relax for between polls.
+ */
+static inline void sddf_spin_init(sddf_spin_t *spin, uint32_t idle_limit, uint32_t backoff_limit)
+{
+    spin->idle_limit = idle_limit;
+    spin->backoff_limit = backoff_limit;
+    sddf_spin_reset(spin);
+}
+
+/**
+ * Back off after a poll that found no work.
+ *
+ * @param spin spin state.
+ *
+ * @return false if the poller has been idle for too long and should stop
+ * spinning, true after backing off.
+ */
+static inline bool sddf_spin_backoff(sddf_spin_t *spin)
+{
+    if (spin->idle >= spin->idle_limit) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < spin->backoff; i++) {
+        sddf_spin_relax();
+    }
+
+    spin->backoff *= 2;
+    if (spin->backoff > spin->backoff_limit) {
+        spin->backoff = spin->backoff_limit;
+    }
+    spin->idle++;
+
+    return true;
+}
@@ -8,6 +8,7 @@
 #include <sddf/network/queue.h>
 #include <sddf/network/constants.h>
 #include <sddf/network/util.h>
+#include <sddf/network/stats.h>
 #include <sddf/util/printf.h>
 #include <ethernet_config.h>
 
@@ -31,6 +32,9 @@ net_queue_t *tx_active;
 uintptr_t rx_buffer_data_region;
 uintptr_t tx_buffer_data_region;
 
+net_stats_t *net_stats;
+net_stats_t *stats;
+
 uint8_t mac_addrs[NUM_ARP_CLIENTS][ETH_HWADDR_LEN];
 uint32_t ipv4_addrs[NUM_ARP_CLIENTS];
 
@@ -100,6 +104,7 @@ static int arp_reply(const uint8_t ethsrc_addr[ETH_HWADDR_LEN],
 {
     if (net_queue_empty_free(&tx_queue)) {
         sddf_dprintf("ARP|LOG: Transmit free queue empty or transmit active queue full. Dropping reply\n");
+        net_stats_drop(stats, NET_STATS_DROP_NO_BUFFER);
         return -1;
     }
 
@@ -127,6 +132,7 @@ static int arp_reply(const uint8_t ethsrc_addr[ETH_HWADDR_LEN],
     buffer.len = 56;
     err = net_enqueue_active(&tx_queue, buffer);
     assert(!err);
+    net_stats_packet(stats, buffer.len);
 
     return 0;
 }
@@ -136,6 +142,7 @@ void receive(void)
     bool transmitted = false;
     bool reprocess = true;
     while (reprocess) {
+        net_stats_queue_occupancy(stats, net_queue_size(rx_queue.active));
         while (!net_queue_empty_active(&rx_queue)) {
             net_buff_desc_t buffer;
             int err = net_dequeue_active(&rx_queue, &buffer);
@@ -176,11 +183,13 @@ void receive(void)
     if (transmitted && net_require_signal_active(&tx_queue)) {
         net_cancel_signal_active(&tx_queue);
         microkit_deferred_notify(TX_CH);
+        net_stats_notify(stats);
     }
 }
 
 void notified(microkit_channel ch)
 {
+    net_stats_notified(stats);
     receive();
 }
 
@@ -221,4 +230,7 @@ void init(void)
     net_buffers_init(&tx_queue, 0);
 
     ethernet_arp_mac_addr_init_sys(microkit_name, (uint8_t *) mac_addrs);
+
+    stats = net_stats_init_sys(microkit_name, net_stats);
+    assert(stats);
 }
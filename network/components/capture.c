@@ -0,0 +1,254 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <microkit.h>
+#include <sddf/network/capture.h>
+#include <sddf/network/constants.h>
+#include <sddf/network/util.h>
+#include <sddf/util/util.h>
+#include <sddf/util/string.h>
+#include <sddf/util/printf.h>
+#include <ethernet_config.h>
+
+/*
+ * Packet capture component. Drains the capture rings filled by the RX and TX
+ * virtualisers, copies the mirrored packets out of the data regions and
+ * assembles them into a pcap file in the pcap buffer region. Once the buffer
+ * is full, or when notified on the dump channel, the pcap file is written to
+ * the debug serial output as hex, which can be turned back into a file with:
+ *     sed -n '/pcap begin/,/pcap end/{//!p}' log | xxd -r -p > capture.pcap
+ *
+ * Data is copied after the virtualiser has forwarded the buffer, so this
+ * component should be given a higher priority than the components it is
+ * capturing from to minimise the chance of a buffer being reused before it
+ * has been copied.
+ */
+
+/* Notification channels */
+#define VIRT_RX_CH 0
+#define VIRT_TX_CH 1
+#define DUMP_CH 2
+
+#define HEX_BYTES_PER_LINE 32
+
+/* Capture ring regions */
+net_capture_ring_t *capture_ring_rx;
+net_capture_ring_t *capture_ring_tx;
+
+/* Buffer data regions, mapped read only */
+uintptr_t rx_buffer_data_region;
+uintptr_t tx_buffer_data_region_cli0;
+
+/* Region the pcap file is assembled in */
+uintptr_t pcap_buffer;
+
+typedef struct state {
+    /* capture rings, indexed by direction */
+    net_capture_handle_t rings[2];
+    uintptr_t tx_regions[NUM_NETWORK_CLIENTS];
+    /* record taken from each ring but not yet written */
+    net_capture_record_t pending[2];
+    bool have_pending[2];
+    /* number of bytes of the pcap buffer in use */
+    uint32_t pcap_len;
+    /* generic timer frequency, used to convert timestamps */
+    uint64_t timer_freq;
+    /* number of packets seen, used for sampling */
+    uint64_t seen;
+    uint64_t captured;
+    uint64_t filtered;
+} state_t;
+
+state_t state;
+
+static void capture_set_enabled(bool enabled)
+{
+    __atomic_store_n(&state.rings[NET_CAPTURE_DIR_RX].ring->enabled, enabled, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.rings[NET_CAPTURE_DIR_TX].ring->enabled, enabled, __ATOMIC_RELAXED);
+}
+
+static void pcap_reset(void)
+{
+    pcap_file_header_t *header = (pcap_file_header_t *)pcap_buffer;
+    header->magic = PCAP_MAGIC;
+    header->version_major = PCAP_VERSION_MAJOR;
+    header->version_minor = PCAP_VERSION_MINOR;
+    header->thiszone = 0;
+    header->sigfigs = 0;
+    header->snaplen = NET_CAPTURE_SNAPLEN;
+    header->linktype = PCAP_LINKTYPE_ETHERNET;
+
+    state.pcap_len = sizeof(pcap_file_header_t);
+}
+
+static void pcap_dump(void)
+{
+    static const char hex[] = "0123456789abcdef";
+    char line[HEX_BYTES_PER_LINE * 2 + 1];
+    uint8_t *data = (uint8_t *)pcap_buffer;
+
+    sddf_printf("CAPTURE|INFO: pcap begin (%u bytes)\n", state.pcap_len);
+    for (uint32_t i = 0; i < state.pcap_len; i += HEX_BYTES_PER_LINE) {
+        uint32_t n = MIN(HEX_BYTES_PER_LINE, state.pcap_len - i);
+        for (uint32_t j = 0; j < n; j++) {
+            line[2 * j] = hex[data[i + j] >> 4];
+            line[2 * j + 1] = hex[data[i + j] & 0xf];
+        }
+        line[2 * n] = '\0';
+        sddf_printf("%s\n", line);
+    }
+    sddf_printf("CAPTURE|INFO: pcap end, captured %lu, filtered %lu, dropped rx %lu, dropped tx %lu\n",
+                state.captured, state.filtered, state.rings[NET_CAPTURE_DIR_RX].ring->dropped,
+                state.rings[NET_CAPTURE_DIR_TX].ring->dropped);
+}
+
+static uintptr_t record_vaddr(net_capture_record_t *record)
+{
+    if (record->len > NET_BUFFER_SIZE) {
+        return 0;
+    }
+
+    if (record->dir == NET_CAPTURE_DIR_RX) {
+        if (record->offset + record->len > NET_RX_DATA_REGION_SIZE_DRIV) {
+            return 0;
+        }
+        return rx_buffer_data_region + record->offset;
+    }
+
+    if (record->region >= NUM_NETWORK_CLIENTS || record->offset + record->len > NET_DATA_REGION_SIZE) {
+        return 0;
+    }
+    return state.tx_regions[record->region] + record->offset;
+}
+
+/* Returns false if the pcap buffer has no room for the record */
+static bool pcap_write(net_capture_record_t *record)
+{
+    uintptr_t vaddr = record_vaddr(record);
+    if (!vaddr) {
+        sddf_dprintf("CAPTURE|LOG: Invalid capture record, offset %lx len %u\n", record->offset, record->len);
+        return true;
+    }
+
+#if NET_CAPTURE_ETHERTYPE
+    struct ethernet_header *eth = (struct ethernet_header *)vaddr;
+    if (record->len < sizeof(struct ethernet_header) || eth->type != HTONS(NET_CAPTURE_ETHERTYPE)) {
+        state.filtered++;
+        return true;
+    }
+#endif
+
+    uint32_t incl_len = MIN(record->len, NET_CAPTURE_SNAPLEN);
+    if (state.pcap_len + sizeof(pcap_record_header_t) + incl_len > NET_CAPTURE_PCAP_REGION_SIZE) {
+        return false;
+    }
+
+    pcap_record_header_t *header = (pcap_record_header_t *)(pcap_buffer + state.pcap_len);
+    if (state.timer_freq) {
+        header->ts_sec = record->timestamp / state.timer_freq;
+        header->ts_usec = ((record->timestamp % state.timer_freq) * 1000000) / state.timer_freq;
+    } else {
+        header->ts_sec = 0;
+        header->ts_usec = 0;
+    }
+    header->incl_len = incl_len;
+    header->orig_len = record->len;
+    state.pcap_len += sizeof(pcap_record_header_t);
+
+    sddf_memcpy((void *)(pcap_buffer + state.pcap_len), (void *)vaddr, incl_len);
+    state.pcap_len += incl_len;
+    state.captured++;
+
+    return true;
+}
+
+void capture_drain(void)
+{
+    bool reprocess = true;
+    while (reprocess) {
+        while (true) {
+            for (int dir = 0; dir < 2; dir++) {
+                if (!state.have_pending[dir]) {
+                    state.have_pending[dir] = !net_capture_dequeue(&state.rings[dir], &state.pending[dir]);
+                }
+            }
+            if (!state.have_pending[NET_CAPTURE_DIR_RX] && !state.have_pending[NET_CAPTURE_DIR_TX]) {
+                break;
+            }
+
+            /* Merge the two rings so records are written in timestamp order */
+            int dir;
+            if (!state.have_pending[NET_CAPTURE_DIR_TX]) {
+                dir = NET_CAPTURE_DIR_RX;
+            } else if (!state.have_pending[NET_CAPTURE_DIR_RX]) {
+                dir = NET_CAPTURE_DIR_TX;
+            } else {
+                dir = state.pending[NET_CAPTURE_DIR_RX].timestamp <= state.pending[NET_CAPTURE_DIR_TX].timestamp ?
+                      NET_CAPTURE_DIR_RX : NET_CAPTURE_DIR_TX;
+            }
+
+            if (state.seen % NET_CAPTURE_SAMPLE_RATE) {
+                state.seen++;
+                state.have_pending[dir] = false;
+                continue;
+            }
+
+            if (!pcap_write(&state.pending[dir])) {
+                /* Buffer full, flush it and start a new capture file */
+                capture_set_enabled(false);
+                pcap_dump();
+                pcap_reset();
+                capture_set_enabled(true);
+                continue;
+            }
+            state.seen++;
+            state.have_pending[dir] = false;
+        }
+
+        net_capture_request_signal(&state.rings[NET_CAPTURE_DIR_RX]);
+        net_capture_request_signal(&state.rings[NET_CAPTURE_DIR_TX]);
+        reprocess = false;
+
+        if (!net_capture_empty(&state.rings[NET_CAPTURE_DIR_RX]) || !net_capture_empty(&state.rings[NET_CAPTURE_DIR_TX])) {
+            net_capture_cancel_signal(&state.rings[NET_CAPTURE_DIR_RX]);
+            net_capture_cancel_signal(&state.rings[NET_CAPTURE_DIR_TX]);
+            reprocess = true;
+        }
+    }
+}
+
+void notified(microkit_channel ch)
+{
+    switch (ch) {
+    case VIRT_RX_CH:
+    case VIRT_TX_CH:
+        capture_drain();
+        break;
+    case DUMP_CH:
+        capture_drain();
+        pcap_dump();
+        pcap_reset();
+        break;
+    default:
+        sddf_dprintf("CAPTURE|LOG: received notification on unexpected channel %u\n", ch);
+        break;
+    }
+}
+
+void init(void)
+{
+    net_capture_init(&state.rings[NET_CAPTURE_DIR_RX], capture_ring_rx, NET_CAPTURE_RING_SIZE);
+    net_capture_init(&state.rings[NET_CAPTURE_DIR_TX], capture_ring_tx, NET_CAPTURE_RING_SIZE);
+    net_mem_region_init_sys(microkit_name, state.tx_regions, tx_buffer_data_region_cli0);
+
+#if defined(CONFIG_EXPORT_PCNT_USER)
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(state.timer_freq));
+#endif
+
+    pcap_reset();
+    capture_set_enabled(true);
+}
@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <microkit.h>
 #include <sddf/network/queue.h>
+#include <sddf/network/constants.h>
+#include <sddf/network/stats.h>
 #include <sddf/util/string.h>
 #include <sddf/util/util.h>
 #include <sddf/util/printf.h>
@@ -25,46 +27,212 @@ net_queue_t *rx_active_cli;
 uintptr_t virt_buffer_data_region;
 uintptr_t cli_buffer_data_region;
 
+net_stats_t *net_stats;
+net_stats_t *stats;
+
+#if NET_TRACE
+/* Trace region */
+uintptr_t net_trace;
+net_trace_handle_t trace;
+#endif
+
+/* Broadcast frames copied out of the RX virtualiser's buffers while the client lags */
+typedef struct copy_out {
+    uint16_t len;
+    uint16_t vlan_tci;
+#if NET_TRACE
+    net_trace_entry_t trace;
+#endif
+    uint8_t data[NET_BUFFER_SIZE];
+} copy_out_t;
+
+copy_out_t copy_out[NET_RX_COPY_OUT_SLOTS];
+/* Free running indices of the next copied out frame to deliver and to fill */
+uint32_t copy_out_head;
+uint32_t copy_out_tail;
+
+#if NET_RX_RECYCLE
+/* Free client buffers taken from the client's free queue, most recently returned on top */
+net_buff_desc_t recycle_buffers[NET_MAX_CLIENT_QUEUE_SIZE];
+net_recycle_t recycle;
+#endif
+
+/* Check if a client buffer is available. When recycling, the client's free
+ * queue is first drained onto the stack, so that the most recently returned
+ * buffer is on top. */
+static bool cli_buffer_available(void)
+{
+#if NET_RX_RECYCLE
+    while (recycle.count < recycle.capacity && !net_queue_empty_free(&rx_queue_cli)) {
+        net_buff_desc_t buffer;
+        int err = net_dequeue_free(&rx_queue_cli, &buffer);
+        assert(!err);
+        net_recycle_push(&recycle, buffer);
+    }
+    return !net_recycle_empty(&recycle);
+#else
+    return !net_queue_empty_free(&rx_queue_cli);
+#endif
+}
+
+/* Take an available client buffer */
+static net_buff_desc_t cli_buffer_get(void)
+{
+#if NET_RX_RECYCLE
+    return net_recycle_pop(&recycle);
+#else
+    net_buff_desc_t buffer;
+    int err = net_dequeue_free(&rx_queue_cli, &buffer);
+    assert(!err);
+    return buffer;
+#endif
+}
+
+/* Check if any frames are waiting for the client */
+static bool frames_waiting(void)
+{
+    return copy_out_head != copy_out_tail || !net_queue_empty_active(&rx_queue_virt);
+}
+
+/* Copy a frame into a client buffer and hand it to the client */
+static void deliver(net_buff_desc_t cli_buffer, uintptr_t frame, uint16_t len, uint16_t vlan_tci)
+{
+    uintptr_t cli_addr = cli_buffer_data_region + cli_buffer.io_or_offset;
+#if NET_VLAN
+    /* The RX virtualiser only forwards tagged frames, the tag is handed to the client in the descriptor */
+    cli_buffer.len = net_vlan_strip_copy(cli_addr, frame, len);
+    cli_buffer.vlan_tci = vlan_tci;
+#else
+    sddf_memcpy((void *)cli_addr, (void *)frame, len);
+    cli_buffer.len = len;
+#endif
+    net_stats_packet(stats, cli_buffer.len);
+
+    int err = net_enqueue_active(&rx_queue_cli, cli_buffer);
+    assert(!err);
+}
+
+/* Check if the frame at the head of the RX virtualiser's queue is a broadcast */
+static bool broadcast_waiting(void)
+{
+    net_buff_desc_t virt_buffer;
+    if (net_peek_active(&rx_queue_virt, &virt_buffer)) {
+        return false;
+    }
+
+    struct ethernet_header *hdr = (struct ethernet_header *)(virt_buffer_data_region + virt_buffer.io_or_offset);
+    for (int i = 0; i < ETH_HWADDR_LEN; i++) {
+        if (hdr->dest.addr[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* While the client has no free buffers, copy broadcast frames out of the RX
+ * virtualiser's buffers, and apply the overload policy to the frames left
+ * waiting. Returns whether any buffers were returned to the virtualiser. */
+static bool shed_load(void)
+{
+    bool returned = false;
+    while (net_queue_size(rx_queue_virt.active) + (copy_out_tail - copy_out_head) >= NET_RX_BROADCAST_LAG
+           && copy_out_tail - copy_out_head < NET_RX_COPY_OUT_SLOTS && broadcast_waiting()) {
+        net_buff_desc_t virt_buffer;
+        int err = net_dequeue_active(&rx_queue_virt, &virt_buffer);
+        assert(!err);
+
+        copy_out_t *slot = &copy_out[copy_out_tail % NET_RX_COPY_OUT_SLOTS];
+        sddf_memcpy(slot->data, (void *)(virt_buffer_data_region + virt_buffer.io_or_offset), virt_buffer.len);
+        slot->len = virt_buffer.len;
+        slot->vlan_tci = virt_buffer.vlan_tci;
+#if NET_TRACE
+        slot->trace = trace.rx[net_trace_slot(virt_buffer.io_or_offset, NET_RX_DATA_REGION_SIZE_DRIV)];
+#endif
+        copy_out_tail++;
+
+        virt_buffer.len = 0;
+        err = net_enqueue_free(&rx_queue_virt, virt_buffer);
+        assert(!err);
+        returned = true;
+    }
+
+#if NET_RX_OVERLOAD_POLICY == NET_RX_OVERLOAD_OLDEST_DROP
+    while (net_queue_size(rx_queue_virt.active) >= NET_RX_CLIENT_LIMIT) {
+        net_buff_desc_t virt_buffer;
+        int err = net_dequeue_active(&rx_queue_virt, &virt_buffer);
+        assert(!err);
+        net_stats_drop(stats, NET_STATS_DROP_OVERLOAD);
+
+        virt_buffer.len = 0;
+        err = net_enqueue_free(&rx_queue_virt, virt_buffer);
+        assert(!err);
+        returned = true;
+    }
+#endif
+
+    return returned;
+}
+
 void rx_return(void)
 {
-    bool enqueued = false;
+    bool delivered = false;
+    bool returned = false;
     bool reprocess = true;
 
     while (reprocess) {
-        while (!net_queue_empty_active(&rx_queue_virt) && !net_queue_empty_free(&rx_queue_cli)) {
-            net_buff_desc_t cli_buffer, virt_buffer = {0};
-            int err = net_dequeue_free(&rx_queue_cli, &cli_buffer);
-            assert(!err);
+        net_stats_queue_occupancy(stats, net_queue_size(rx_queue_virt.active));
+        while (frames_waiting() && cli_buffer_available()) {
+            net_buff_desc_t cli_buffer = cli_buffer_get(), virt_buffer = {0};
 
-            if (cli_buffer.io_or_offset % NET_BUFFER_SIZE || cli_buffer.io_or_offset >= NET_BUFFER_SIZE * rx_queue_cli.size) {
-                sddf_dprintf("COPY|LOG: Client provided offset %lx which is not buffer aligned or outside of buffer region\n",
+            if (net_buff_headroom(&cli_buffer) != NET_BUFFER_HEADROOM
+                || cli_buffer.io_or_offset >= NET_BUFFER_SIZE * rx_queue_cli.size) {
+                sddf_dprintf("COPY|LOG: Client provided offset %lx which is not past a buffer's headroom or outside of buffer region\n",
                              cli_buffer.io_or_offset);
+                net_stats_drop(stats, NET_STATS_DROP_BAD_OFFSET);
                 continue;
             }
 
-            err = net_dequeue_active(&rx_queue_virt, &virt_buffer);
+            /* Frames that were copied out arrived before those still queued */
+            if (copy_out_head != copy_out_tail) {
+                copy_out_t *slot = &copy_out[copy_out_head % NET_RX_COPY_OUT_SLOTS];
+                deliver(cli_buffer, (uintptr_t)slot->data, slot->len, slot->vlan_tci);
+#if NET_TRACE
+                net_trace_stamp(&slot->trace, NET_TRACE_COPY);
+                trace.client->entries[net_trace_slot(cli_buffer.io_or_offset, NET_DATA_REGION_SIZE)] = slot->trace;
+#endif
+                copy_out_head++;
+                delivered = true;
+                continue;
+            }
+
+            int err = net_dequeue_active(&rx_queue_virt, &virt_buffer);
             assert(!err);
 
-            uintptr_t cli_addr = cli_buffer_data_region + cli_buffer.io_or_offset;
-            uintptr_t virt_addr = virt_buffer_data_region + virt_buffer.io_or_offset;
+            deliver(cli_buffer, virt_buffer_data_region + virt_buffer.io_or_offset, virt_buffer.len,
+                    virt_buffer.vlan_tci);
+#if NET_TRACE
+            /* The client sees the packet in its own buffer, so the trace moves with the data */
+            net_trace_entry_t *entry = &trace.rx[net_trace_slot(virt_buffer.io_or_offset, NET_RX_DATA_REGION_SIZE_DRIV)];
+            net_trace_stamp(entry, NET_TRACE_COPY);
+            trace.client->entries[net_trace_slot(cli_buffer.io_or_offset, NET_DATA_REGION_SIZE)] = *entry;
+#endif
 
-            sddf_memcpy((void *)cli_addr, (void *)virt_addr, virt_buffer.len);
-            cli_buffer.len = virt_buffer.len;
             virt_buffer.len = 0;
-
-            err = net_enqueue_active(&rx_queue_cli, cli_buffer);
-            assert(!err);
-
             err = net_enqueue_free(&rx_queue_virt, virt_buffer);
             assert(!err);
 
-            enqueued = true;
+            delivered = true;
+            returned = true;
+        }
+
+        if (!cli_buffer_available() && shed_load()) {
+            returned = true;
         }
 
         net_request_signal_active(&rx_queue_virt);
 
         /* Only request signal from client if incoming packets from multiplexer are awaiting free buffers */
-        if (!net_queue_empty_active(&rx_queue_virt)) {
+        if (frames_waiting()) {
             net_request_signal_free(&rx_queue_cli);
         } else {
             net_cancel_signal_free(&rx_queue_cli);
@@ -72,32 +240,79 @@ void rx_return(void)
 
         reprocess = false;
 
-        if (!net_queue_empty_active(&rx_queue_virt) && !net_queue_empty_free(&rx_queue_cli)) {
+        if (frames_waiting() && cli_buffer_available()) {
             net_cancel_signal_active(&rx_queue_virt);
             net_cancel_signal_free(&rx_queue_cli);
             reprocess = true;
         }
     }
 
-    if (enqueued && net_require_signal_active(&rx_queue_cli)) {
+    if (delivered && net_require_signal_active(&rx_queue_cli)) {
         net_cancel_signal_active(&rx_queue_cli);
         microkit_notify(CLIENT_CH);
+        net_stats_notify(stats);
     }
 
-    if (enqueued && net_require_signal_free(&rx_queue_virt)) {
+    if (returned && net_require_signal_free(&rx_queue_virt)) {
         net_cancel_signal_free(&rx_queue_virt);
+#if NET_VIRT_SPIN
+        /* Deferred notifications are not delivered until we stop spinning */
+        microkit_notify(VIRT_RX_CH);
+#else
         microkit_deferred_notify(VIRT_RX_CH);
+#endif
+        net_stats_notify(stats);
     }
 }
 
+#if NET_VIRT_SPIN
+/* Poll the queues with signals cancelled until they go idle, then request signals again */
+static void spin(void)
+{
+    sddf_spin_t spin;
+    sddf_spin_init(&spin, NET_VIRT_SPIN_IDLE, NET_VIRT_SPIN_BACKOFF);
+    net_cancel_signal_active(&rx_queue_virt);
+    net_cancel_signal_free(&rx_queue_cli);
+    while (true) {
+        if (frames_waiting() && cli_buffer_available()) {
+            rx_return();
+            net_cancel_signal_active(&rx_queue_virt);
+            net_cancel_signal_free(&rx_queue_cli);
+            sddf_spin_reset(&spin);
+        } else if (!sddf_spin_backoff(&spin)) {
+            break;
+        }
+    }
+
+    rx_return();
+}
+#endif
+
 void notified(microkit_channel ch)
 {
+    net_stats_notified(stats);
+#if NET_VIRT_SPIN
+    spin();
+#else
     rx_return();
+#endif
 }
 
 void init(void)
 {
+    stats = net_stats_init_sys(microkit_name, net_stats);
+    assert(stats);
+#if NET_TRACE
+    net_trace_init_sys(microkit_name, net_trace, &trace);
+    assert(trace.client);
+#endif
+
     net_copy_queue_init_sys(microkit_name, &rx_queue_cli, rx_free_cli, rx_active_cli, &rx_queue_virt, rx_free_virt,
                             rx_active_virt);
+#if NET_RX_RECYCLE
+    net_recycle_init(&recycle, recycle_buffers, rx_queue_cli.size);
+    net_recycle_buffers_init(&recycle, rx_queue_cli.size - 1, 0);
+#else
     net_buffers_init(&rx_queue_cli, 0);
+#endif
 }
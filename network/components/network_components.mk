@@ -8,15 +8,18 @@
 # it should be included into your project Makefile
 #
 # NOTES:
-# Generates network_virt_rx.elf network_virt_tx.elf arp.elf copy.elf
+# Generates network_virt_rx.elf network_virt_tx.elf arp.elf copy.elf capture.elf
+# reflector.elf pktgen.elf
 # Requires ${SDDF}/util/util.mk to build the utility library for debug output
 
 NETWORK_COMPONENTS_DIR := $(abspath $(dir $(lastword ${MAKEFILE_LIST})))
-NETWORK_IMAGES:= network_virt_rx.elf network_virt_tx.elf arp.elf copy.elf
+NETWORK_IMAGES:= network_virt_rx.elf network_virt_tx.elf arp.elf copy.elf capture.elf \
+		reflector.elf pktgen.elf
 network/components/%.o: ${SDDF}/network/components/%.c
 	${CC} ${CFLAGS} -c -o $@ $<
 
-NETWORK_COMPONENT_OBJ := $(addprefix network/components/, copy.o arp.o network_virt_tx.o network_virt_rx.o)
+NETWORK_COMPONENT_OBJ := $(addprefix network/components/, copy.o arp.o capture.o reflector.o pktgen.o \
+			network_virt_tx.o network_virt_rx.o)
 
 CHECK_NETWORK_FLAGS_MD5:=.network_cflags-$(shell echo -- ${CFLAGS} ${CFLAGS_network} | shasum | sed 's/ *-//')
 
@@ -40,7 +43,7 @@ network/components/network_virt_%.o: ${SDDF}/network/components/virt_%.c
 	${LD} ${LDFLAGS} -o $@ $< ${LIBS}
 
 clean::
-	rm -f network_virt_[rt]x.[od] copy.[od] arp.[od]
+	rm -f network_virt_[rt]x.[od] copy.[od] arp.[od] capture.[od] reflector.[od] pktgen.[od]
 
 clobber::
 	rm -f ${IMAGES}
@@ -0,0 +1,257 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <microkit.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/constants.h>
+#include <sddf/network/util.h>
+#include <sddf/timer/client.h>
+#include <sddf/util/util.h>
+#include <sddf/util/printf.h>
+#include <ethernet_config.h>
+
+/*
+ * Packet generator. Runs as a network client and transmits fixed size frames
+ * at a target rate, paced by the timer. Each frame carries a sequence number
+ * and transmit timestamp, so that frames returned by a reflector (such as
+ * reflector.c on the far end of the link) can be counted and their round trip
+ * latency measured. Timestamps are taken once per batch, so latency includes
+ * the time frames wait to be processed within a batch.
+ *
+ * The following can be overridden through CFLAGS.
+ */
+
+/* Size of generated frames in bytes, excluding the FCS */
+#ifndef PKTGEN_FRAME_SIZE
+#define PKTGEN_FRAME_SIZE 64
+#endif
+
+/* Target transmit rate in frames per second */
+#ifndef PKTGEN_RATE
+#define PKTGEN_RATE 100000
+#endif
+
+/* Interval between transmit batches in nanoseconds */
+#ifndef PKTGEN_TICK_NS
+#define PKTGEN_TICK_NS NS_IN_MS
+#endif
+
+/* Number of ticks between reports */
+#ifndef PKTGEN_REPORT_TICKS
+#define PKTGEN_REPORT_TICKS 1000
+#endif
+
+/* Destination MAC address of generated frames */
+#ifndef PKTGEN_DST_MAC
+#define PKTGEN_DST_MAC 0xffffffffffff
+#endif
+
+/* IEEE 802 local experimental ethertype */
+#define PKTGEN_ETH_TYPE 0x88b5
+#define PKTGEN_MAGIC 0x7067656e
+
+#define RX_CH 0
+#define TX_CH 1
+#define TIMER_CH 2
+
+struct pktgen_frame {
+    struct ethernet_header eth;
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t timestamp;
+} __attribute__((packed));
+
+_Static_assert(PKTGEN_FRAME_SIZE >= sizeof(struct pktgen_frame) && PKTGEN_FRAME_SIZE + NET_BUFFER_HEADROOM <= NET_BUFFER_SIZE,
+               "Generated frames must fit the pktgen header and a single buffer");
+
+net_queue_t *rx_free;
+net_queue_t *rx_active;
+net_queue_t *tx_free;
+net_queue_t *tx_active;
+uintptr_t rx_buffer_data_region;
+uintptr_t tx_buffer_data_region;
+
+typedef struct pktgen_stats {
+    uint64_t sent;
+    uint64_t received;
+    /* frames that could not be sent at the target rate due to no free buffers */
+    uint64_t no_buffer;
+    /* received frames not generated by us */
+    uint64_t foreign;
+    uint64_t latency_total;
+    uint64_t latency_min;
+    uint64_t latency_max;
+} pktgen_stats_t;
+
+typedef struct state {
+    net_queue_handle_t rx_queue;
+    net_queue_handle_t tx_queue;
+    uint8_t mac[ETH_HWADDR_LEN];
+    uint8_t dst_mac[ETH_HWADDR_LEN];
+    uint32_t seq;
+    /* transmit credit, in frames * ns */
+    uint64_t credit;
+    uint64_t ticks;
+    pktgen_stats_t stats;
+} state_t;
+
+state_t state;
+
+static void set_mac(uint8_t *mac, uint64_t val)
+{
+    for (int i = 0; i < ETH_HWADDR_LEN; i++) {
+        mac[i] = val >> (8 * (ETH_HWADDR_LEN - 1 - i)) & 0xff;
+    }
+}
+
+static void stats_reset(void)
+{
+    state.stats = (pktgen_stats_t) {
+        0
+    };
+    state.stats.latency_min = UINT64_MAX;
+}
+
+static void report(void)
+{
+    pktgen_stats_t *stats = &state.stats;
+    uint64_t interval_ns = PKTGEN_TICK_NS * PKTGEN_REPORT_TICKS;
+    uint64_t rx_mbps = (stats->received * PKTGEN_FRAME_SIZE * 8 * (NS_IN_S / 1000000)) / interval_ns;
+    uint64_t latency_avg = stats->received ? stats->latency_total / stats->received : 0;
+    uint64_t latency_min = stats->received ? stats->latency_min : 0;
+
+    sddf_printf("PKTGEN|INFO: sent %lu received %lu (%lu Mbps) no_buffer %lu foreign %lu latency min/avg/max %lu/%lu/%lu ns\n",
+                stats->sent, stats->received, rx_mbps, stats->no_buffer, stats->foreign, latency_min, latency_avg,
+                stats->latency_max);
+    stats_reset();
+}
+
+void generate(uint64_t now)
+{
+    state.credit += (uint64_t)PKTGEN_RATE * PKTGEN_TICK_NS;
+    uint64_t budget = state.credit / NS_IN_S;
+    state.credit -= budget * NS_IN_S;
+
+    bool transmitted = false;
+    while (budget && !net_queue_empty_free(&state.tx_queue)) {
+        net_buff_desc_t buffer;
+        int err = net_dequeue_free(&state.tx_queue, &buffer);
+        assert(!err);
+
+        struct pktgen_frame *frame = (struct pktgen_frame *)(tx_buffer_data_region + buffer.io_or_offset);
+        for (int i = 0; i < ETH_HWADDR_LEN; i++) {
+            frame->eth.dest.addr[i] = state.dst_mac[i];
+            frame->eth.src.addr[i] = state.mac[i];
+        }
+        frame->eth.type = HTONS(PKTGEN_ETH_TYPE);
+        frame->magic = PKTGEN_MAGIC;
+        frame->seq = state.seq++;
+        frame->timestamp = now;
+
+        buffer.len = PKTGEN_FRAME_SIZE;
+        err = net_enqueue_active(&state.tx_queue, buffer);
+        assert(!err);
+
+        state.stats.sent++;
+        budget--;
+        transmitted = true;
+    }
+
+    /* Don't let unmet budget accumulate, we want a steady rate rather than bursts */
+    state.stats.no_buffer += budget;
+
+    if (transmitted && net_require_signal_active(&state.tx_queue)) {
+        net_cancel_signal_active(&state.tx_queue);
+        microkit_notify(TX_CH);
+    }
+}
+
+void receive(void)
+{
+    bool reprocess = true;
+    bool returned = false;
+    uint64_t now = 0;
+    while (reprocess) {
+        while (!net_queue_empty_active(&state.rx_queue)) {
+            net_buff_desc_t buffer;
+            int err = net_dequeue_active(&state.rx_queue, &buffer);
+            assert(!err);
+
+            if (!now) {
+                now = sddf_timer_time_now(TIMER_CH);
+            }
+
+            struct pktgen_frame *frame = (struct pktgen_frame *)(rx_buffer_data_region + buffer.io_or_offset);
+            if (buffer.len >= sizeof(struct pktgen_frame) && frame->eth.type == HTONS(PKTGEN_ETH_TYPE)
+                && frame->magic == PKTGEN_MAGIC) {
+                uint64_t latency = now - frame->timestamp;
+                state.stats.received++;
+                state.stats.latency_total += latency;
+                state.stats.latency_min = MIN(state.stats.latency_min, latency);
+                state.stats.latency_max = MAX(state.stats.latency_max, latency);
+            } else {
+                state.stats.foreign++;
+            }
+
+            buffer.len = 0;
+            err = net_enqueue_free(&state.rx_queue, buffer);
+            assert(!err);
+            returned = true;
+        }
+
+        net_request_signal_active(&state.rx_queue);
+        reprocess = false;
+
+        if (!net_queue_empty_active(&state.rx_queue)) {
+            net_cancel_signal_active(&state.rx_queue);
+            reprocess = true;
+        }
+    }
+
+    if (returned && net_require_signal_free(&state.rx_queue)) {
+        net_cancel_signal_free(&state.rx_queue);
+        microkit_notify(RX_CH);
+    }
+}
+
+void notified(microkit_channel ch)
+{
+    switch (ch) {
+    case TIMER_CH: {
+        sddf_timer_set_timeout(TIMER_CH, PKTGEN_TICK_NS);
+        receive();
+        generate(sddf_timer_time_now(TIMER_CH));
+        if (++state.ticks % PKTGEN_REPORT_TICKS == 0) {
+            report();
+        }
+        break;
+    }
+    case RX_CH:
+    case TX_CH:
+        receive();
+        break;
+    default:
+        sddf_dprintf("PKTGEN|LOG: received notification on unexpected channel: %u\n", ch);
+        break;
+    }
+}
+
+void init(void)
+{
+    net_cli_queue_init_sys(microkit_name, &state.rx_queue, rx_free, rx_active, &state.tx_queue, tx_free, tx_active);
+    net_buffers_init(&state.tx_queue, 0);
+    net_cli_mac_addr_init_sys(microkit_name, state.mac);
+    set_mac(state.dst_mac, PKTGEN_DST_MAC);
+
+    /* Transmission is paced by the timer, so we never wait on free buffers */
+    net_cancel_signal_free(&state.tx_queue);
+
+    stats_reset();
+    sddf_printf("PKTGEN|INFO: generating %u byte frames at %lu frames/s\n", PKTGEN_FRAME_SIZE,
+                (uint64_t)PKTGEN_RATE);
+    sddf_timer_set_timeout(TIMER_CH, PKTGEN_TICK_NS);
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <microkit.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/constants.h>
+#include <sddf/util/util.h>
+#include <sddf/util/printf.h>
+#include <sddf/util/cache.h>
+#include <ethernet_config.h>
+
+/*
+ * Layer 2 reflector. Connects directly to the ethernet driver in place of the
+ * virtualisers and sends every received frame straight back out, with the
+ * source and destination MAC addresses swapped. Frames are reflected in place:
+ * the received buffer is enqueued for transmission and, once transmitted,
+ * handed back to the driver for receiving. No data is copied, so this
+ * measures the throughput of the driver in isolation.
+ *
+ * Since the same buffers are used for receive and transmit, the data region
+ * must be mapped read-write and the driver's transmit queue must have capacity
+ * for all receive buffers.
+ */
+
+#define DRIVER_CH 0
+
+net_queue_t *rx_free;
+net_queue_t *rx_active;
+net_queue_t *tx_free;
+net_queue_t *tx_active;
+
+/* Buffer data region, shared between receive and transmit */
+uintptr_t buffer_data_vaddr;
+uintptr_t buffer_data_paddr;
+
+_Static_assert(NET_TX_QUEUE_SIZE_DRIV >= NET_RX_QUEUE_SIZE_DRIV,
+               "Driver TX queue must have capacity to fit all RX buffers.");
+
+typedef struct state {
+    net_queue_handle_t rx_queue;
+    net_queue_handle_t tx_queue;
+} state_t;
+
+state_t state;
+
+static void swap_mac_addrs(struct ethernet_header *header)
+{
+    for (int i = 0; i < ETH_HWADDR_LEN; i++) {
+        uint8_t tmp = header->dest.addr[i];
+        header->dest.addr[i] = header->src.addr[i];
+        header->src.addr[i] = tmp;
+    }
+}
+
+void reflect(void)
+{
+    bool reprocess = true;
+    bool transmitted = false;
+    while (reprocess) {
+        while (!net_queue_empty_active(&state.rx_queue)) {
+            net_buff_desc_t buffer;
+            int err = net_dequeue_active(&state.rx_queue, &buffer);
+            assert(!err);
+
+            if (buffer.len < sizeof(struct ethernet_header)) {
+                buffer.len = 0;
+                err = net_enqueue_free(&state.rx_queue, buffer);
+                assert(!err);
+                continue;
+            }
+
+            // Only the header is touched, so only it needs to be invalidated
+            // before reading and cleaned before being DMA'd out again.
+            uintptr_t header_vaddr = buffer.io_or_offset - buffer_data_paddr + buffer_data_vaddr;
+            cache_clean_and_invalidate(header_vaddr, header_vaddr + sizeof(struct ethernet_header));
+            swap_mac_addrs((struct ethernet_header *)header_vaddr);
+            cache_clean(header_vaddr, header_vaddr + sizeof(struct ethernet_header));
+
+            err = net_enqueue_active(&state.tx_queue, buffer);
+            assert(!err);
+            transmitted = true;
+        }
+
+        net_request_signal_active(&state.rx_queue);
+        reprocess = false;
+
+        if (!net_queue_empty_active(&state.rx_queue)) {
+            net_cancel_signal_active(&state.rx_queue);
+            reprocess = true;
+        }
+    }
+
+    reprocess = true;
+    bool returned = false;
+    while (reprocess) {
+        while (!net_queue_empty_free(&state.tx_queue)) {
+            net_buff_desc_t buffer;
+            int err = net_dequeue_free(&state.tx_queue, &buffer);
+            assert(!err);
+
+            buffer.len = 0;
+            err = net_enqueue_free(&state.rx_queue, buffer);
+            assert(!err);
+            returned = true;
+        }
+
+        net_request_signal_free(&state.tx_queue);
+        reprocess = false;
+
+        if (!net_queue_empty_free(&state.tx_queue)) {
+            net_cancel_signal_free(&state.tx_queue);
+            reprocess = true;
+        }
+    }
+
+    bool notify = false;
+    if (transmitted && net_require_signal_active(&state.tx_queue)) {
+        net_cancel_signal_active(&state.tx_queue);
+        notify = true;
+    }
+
+    if (returned && net_require_signal_free(&state.rx_queue)) {
+        net_cancel_signal_free(&state.rx_queue);
+        notify = true;
+    }
+
+    if (notify) {
+        microkit_deferred_notify(DRIVER_CH);
+    }
+}
+
+void notified(microkit_channel ch)
+{
+    reflect();
+}
+
+void init(void)
+{
+    net_queue_init(&state.rx_queue, rx_free, rx_active, NET_RX_QUEUE_SIZE_DRIV);
+    net_queue_init(&state.tx_queue, tx_free, tx_active, NET_TX_QUEUE_SIZE_DRIV);
+    net_buffers_init(&state.rx_queue, buffer_data_paddr);
+
+    if (net_require_signal_free(&state.rx_queue)) {
+        net_cancel_signal_free(&state.rx_queue);
+        microkit_deferred_notify(DRIVER_CH);
+    }
+}
@@ -8,6 +8,7 @@
 #include <microkit.h>
 #include <sddf/network/queue.h>
 #include <sddf/network/constants.h>
+#include <sddf/network/stats.h>
 #include <sddf/util/util.h>
 #include <sddf/util/printf.h>
 #include <sddf/util/cache.h>
@@ -16,6 +17,8 @@
 /* Notification channels */
 #define DRIVER_CH 0
 #define CLIENT_CH 1
+#define CAPTURE_CH (CLIENT_CH + NUM_NETWORK_CLIENTS)
+#define LOCAL_CH (CAPTURE_CH + 1)
 
 /* Used to signify that a packet has come in for the broadcast address and does not match with
  * any particular client. */
@@ -26,20 +29,63 @@ net_queue_t *rx_free_drv;
 net_queue_t *rx_active_drv;
 net_queue_t *rx_free_cli0;
 net_queue_t *rx_active_cli0;
+#if NET_LOCAL_SWITCH
+net_queue_t *rx_free_local;
+net_queue_t *rx_active_local;
+#endif
 
 /* Buffer data regions */
 uintptr_t buffer_data_vaddr;
 uintptr_t buffer_data_paddr;
 
+/* Network stats region */
+net_stats_t *net_stats;
+
+#if NET_CAPTURE
+/* Capture ring region */
+net_capture_ring_t *capture_ring;
+#endif
+
+#if NET_TRACE
+/* Trace region */
+uintptr_t net_trace;
+#endif
+
 /* In order to handle broadcast packets where the same buffer is given to multiple clients
   * we keep track of a reference count of each buffer and only hand it back to the driver once
   * all clients have returned the buffer. */
-uint32_t buffer_refs[NET_RX_QUEUE_SIZE_DRIV] = {0};
+uint32_t buffer_refs[NET_RX_SLOTS_DRIV] = {0};
+
+#if NET_RX_RECYCLE
+/* Free driver buffers not in the driver's free queue, most recently returned on top */
+net_buff_desc_t recycle_buffers[NET_RX_QUEUE_SIZE_DRIV];
+#endif
 
 typedef struct state {
     net_queue_handle_t rx_queue_drv;
     net_queue_handle_t rx_queue_clients[NUM_NETWORK_CLIENTS];
+#if NET_LOCAL_SWITCH
+    /* frames switched by the TX virtualiser, in buffers following the driver's */
+    net_queue_handle_t rx_queue_local;
+#endif
     uint8_t mac_addrs[NUM_NETWORK_CLIENTS][ETH_HWADDR_LEN];
+    /* number of buffers held by each client */
+    uint32_t held[NUM_NETWORK_CLIENTS];
+    net_stats_t *stats;
+#if NET_RX_RECYCLE
+    net_recycle_t recycle;
+#endif
+#if NET_VLAN
+    uint16_t vlans[NUM_NETWORK_CLIENTS];
+    /* stats of the tagged traffic of each client */
+    net_stats_t *client_stats;
+#endif
+#if NET_CAPTURE
+    net_capture_handle_t capture;
+#endif
+#if NET_TRACE
+    net_trace_handle_t trace;
+#endif
 } state_t;
 
 state_t state;
@@ -48,10 +94,17 @@ state_t state;
 static bool notify_drv;
 
 /* Return the client ID if the Mac address is a match to a client, return the broadcast ID if MAC address
-  is a broadcast address. */
-int get_mac_addr_match(struct ethernet_header *buffer)
+  is a broadcast address. With VLANs, only clients in the frame's VLAN are considered. */
+int get_mac_addr_match(struct ethernet_header *buffer, uint16_t vid)
 {
+    bool member = false;
     for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+#if NET_VLAN
+        if (state.vlans[client] != vid) {
+            continue;
+        }
+#endif
+        member = true;
         bool match = true;
         for (int i = 0; (i < ETH_HWADDR_LEN) && match; i++) {
             if (buffer->dest.addr[i] != state.mac_addrs[client][i]) {
@@ -69,71 +122,245 @@ int get_mac_addr_match(struct ethernet_header *buffer)
             broadcast_match = false;
         }
     }
-    if (broadcast_match) {
+    if (broadcast_match && member) {
         return BROADCAST_ID;
     }
 
     return -1;
 }
 
+#if NET_LOCAL_SWITCH
+/* Check whether a buffer is one of those used for frames switched between clients */
+static bool local_buffer(net_buff_desc_t *buffer)
+{
+    return buffer->io_or_offset >= NET_RX_QUEUE_SIZE_DRIV * NET_BUFFER_SIZE;
+}
+#endif
+
+/* Return a buffer that no client holds to the driver */
+static void drv_return(net_buff_desc_t buffer)
+{
+#if NET_LOCAL_SWITCH
+    if (local_buffer(&buffer)) {
+        /* The TX virtualiser takes free buffers as it needs them, without being notified */
+        int err = net_enqueue_free(&state.rx_queue_local, buffer);
+        assert(!err);
+        return;
+    }
+#endif
+    buffer.io_or_offset = buffer.io_or_offset + buffer_data_paddr;
+#if NET_RX_RECYCLE
+    net_recycle_push(&state.recycle, buffer);
+#else
+    int err = net_enqueue_free(&state.rx_queue_drv, buffer);
+    assert(!err);
+    notify_drv = true;
+#endif
+}
+
+#if NET_RX_RECYCLE
+/* Top up the driver's free queue from the top of the recycle stack */
+static void drv_refill(void)
+{
+    while (net_queue_size(state.rx_queue_drv.free) < NET_RX_RECYCLE_DEPTH && !net_recycle_empty(&state.recycle)) {
+        int err = net_enqueue_free(&state.rx_queue_drv, net_recycle_pop(&state.recycle));
+        assert(!err);
+        notify_drv = true;
+    }
+}
+#endif
+
+/* Each client's share of the burst being classified, published to the client
+ * with a single queue update once the whole burst has been classified */
+static net_buff_desc_t pending[NUM_NETWORK_CLIENTS][NET_VIRT_RX_BURST];
+static uint32_t num_pending[NUM_NETWORK_CLIENTS];
+
+/* Hand a buffer to a client, unless the client is overloaded. With the
+ * oldest-drop policy, the copy component sheds the client's load instead and
+ * the client is only refused once its queue is full. */
+static bool deliver(int client, net_buff_desc_t buffer)
+{
+#if NET_RX_OVERLOAD_POLICY == NET_RX_OVERLOAD_TAIL_DROP
+    bool overloaded = state.held[client] >= NET_RX_CLIENT_LIMIT;
+#else
+    bool overloaded = net_queue_size(state.rx_queue_clients[client].active) + num_pending[client]
+                   >= state.rx_queue_clients[client].size - 1;
+#endif
+    if (overloaded) {
+        net_stats_drop(state.stats, NET_STATS_DROP_OVERLOAD);
+        return false;
+    }
+
+    pending[client][num_pending[client]++] = buffer;
+    state.held[client]++;
+    return true;
+}
+
+/* Publish each client's share of the burst */
+static void publish(bool *notify_clients)
+{
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        if (!num_pending[client]) {
+            continue;
+        }
+
+        int err = net_enqueue_active_burst(&state.rx_queue_clients[client], pending[client], num_pending[client]);
+        assert(!err);
+        num_pending[client] = 0;
+        notify_clients[client] = true;
+    }
+}
+
+/* Check whether received or switched frames are waiting */
+static bool frames_waiting(void)
+{
+#if NET_LOCAL_SWITCH
+    if (!net_queue_empty_active(&state.rx_queue_local)) {
+        return true;
+    }
+#endif
+    return !net_queue_empty_active(&state.rx_queue_drv);
+}
+
 void rx_return(void)
 {
     bool reprocess = true;
     bool notify_clients[NUM_NETWORK_CLIENTS] = {false};
+#if NET_CAPTURE
+    bool notify_capture = false;
+#endif
     while (reprocess) {
-        while (!net_queue_empty_active(&state.rx_queue_drv)) {
-            net_buff_desc_t buffer;
-            int err = net_dequeue_active(&state.rx_queue_drv, &buffer);
-            assert(!err);
-
-            buffer.io_or_offset = buffer.io_or_offset - buffer_data_paddr;
-            uintptr_t buffer_vaddr = buffer.io_or_offset + buffer_data_vaddr;
-
-            // Cache invalidate after DMA write, so we don't read stale data.
-            // This must be performed after the DMA write to avoid reading
-            // data that was speculatively fetched before the DMA write.
-            //
-            // We would invalidate if it worked in usermode. Alas, it
-            // does not -- see [1]. The fastest operation that works is a
-            // usermode CleanInvalidate (faster than a Invalidate via syscall).
-            //
-            // [1]: https://developer.arm.com/documentation/ddi0595/2021-06/AArch64-Instructions/DC-IVAC--Data-or-unified-Cache-line-Invalidate-by-VA-to-PoC
-            cache_clean_and_invalidate(buffer_vaddr, buffer_vaddr + buffer.len);
-            int client = get_mac_addr_match((struct ethernet_header *) buffer_vaddr);
-            if (client == BROADCAST_ID) {
-                int ref_index = buffer.io_or_offset / NET_BUFFER_SIZE;
-                assert(buffer_refs[ref_index] == 0);
-                // For broadcast packets, set the refcount to number of clients
-                // in the system. Only enqueue buffer back to driver if
-                // all clients have consumed the buffer.
-                buffer_refs[ref_index] = NUM_NETWORK_CLIENTS;
-
-                for (int i = 0; i < NUM_NETWORK_CLIENTS; i++) {
-                    err = net_enqueue_active(&state.rx_queue_clients[i], buffer);
-                    assert(!err);
-                    notify_clients[i] = true;
-                }
-                continue;
-            } else if (client >= 0) {
-                int ref_index = buffer.io_or_offset / NET_BUFFER_SIZE;
-                assert(buffer_refs[ref_index] == 0);
-                buffer_refs[ref_index] = 1;
-
-                err = net_enqueue_active(&state.rx_queue_clients[client], buffer);
+        net_stats_queue_occupancy(state.stats, net_queue_size(state.rx_queue_drv.active));
+        while (frames_waiting()) {
+            /* Dequeue a burst of buffers and prefetch their headers, so that
+             * the header of each frame is in the cache by the time it is
+             * classified. */
+            net_buff_desc_t burst[NET_VIRT_RX_BURST];
+            uint32_t count = 0;
+            while (count < NET_VIRT_RX_BURST && !net_queue_empty_active(&state.rx_queue_drv)) {
+                net_buff_desc_t *buffer = &burst[count++];
+                int err = net_dequeue_active(&state.rx_queue_drv, buffer);
                 assert(!err);
-                notify_clients[client] = true;
-            } else {
-                buffer.io_or_offset = buffer.io_or_offset + buffer_data_paddr;
-                err = net_enqueue_free(&state.rx_queue_drv, buffer);
+
+                buffer->io_or_offset = buffer->io_or_offset - buffer_data_paddr;
+                uintptr_t buffer_vaddr = buffer->io_or_offset + buffer_data_vaddr;
+#if NET_TRACE
+                net_trace_stamp(&state.trace.rx[net_trace_slot(buffer->io_or_offset, NET_RX_DATA_REGION_SIZE_DRIV)],
+                                NET_TRACE_VIRT_RX);
+#endif
+
+                // Cache invalidate after DMA write, so we don't read stale data.
+                // This must be performed after the DMA write to avoid reading
+                // data that was speculatively fetched before the DMA write.
+                //
+                // We would invalidate if it worked in usermode. Alas, it
+                // does not -- see [1]. The fastest operation that works is a
+                // usermode CleanInvalidate (faster than a Invalidate via syscall).
+                //
+                // [1]: https://developer.arm.com/documentation/ddi0595/2021-06/AArch64-Instructions/DC-IVAC--Data-or-unified-Cache-line-Invalidate-by-VA-to-PoC
+                cache_clean_and_invalidate(buffer_vaddr, buffer_vaddr + buffer->len);
+                __builtin_prefetch((void *)buffer_vaddr);
+            }
+#if NET_LOCAL_SWITCH
+            /* Switched frames were written by the TX virtualiser rather than by DMA */
+            while (count < NET_VIRT_RX_BURST && !net_queue_empty_active(&state.rx_queue_local)) {
+                net_buff_desc_t *buffer = &burst[count++];
+                int err = net_dequeue_active(&state.rx_queue_local, buffer);
                 assert(!err);
-                notify_drv = true;
+#if NET_TRACE
+                net_trace_entry_t *entry = &state.trace.rx[net_trace_slot(buffer->io_or_offset,
+                                                                          NET_RX_DATA_REGION_SIZE_DRIV)];
+                net_trace_stamp(entry, NET_TRACE_DRIVER);
+                net_trace_stamp(entry, NET_TRACE_VIRT_RX);
+#endif
+                __builtin_prefetch((void *)(buffer->io_or_offset + buffer_data_vaddr));
+            }
+#endif
+
+            for (uint32_t b = 0; b < count; b++) {
+                net_buff_desc_t buffer = burst[b];
+                uintptr_t buffer_vaddr = buffer.io_or_offset + buffer_data_vaddr;
+#if NET_CAPTURE
+                if (net_capture_enabled(&state.capture)) {
+                    net_capture_mirror(&state.capture, NET_CAPTURE_DIR_RX, 0, buffer.io_or_offset, buffer.len);
+                    notify_capture = true;
+                }
+#endif
+#if NET_VLAN
+                /* Untagged frames belong to no client. The tag is removed by the copy component. */
+                int client = -1;
+                uint16_t tci = 0;
+                if (net_vlan_get(buffer_vaddr, buffer.len, &tci)) {
+                    client = get_mac_addr_match((struct ethernet_header *) buffer_vaddr, tci & NET_VLAN_VID_MASK);
+                }
+                buffer.vlan_tci = tci;
+#else
+                int client = get_mac_addr_match((struct ethernet_header *) buffer_vaddr, 0);
+#endif
+                if (client == BROADCAST_ID) {
+                    int ref_index = buffer.io_or_offset / NET_BUFFER_SIZE;
+                    assert(buffer_refs[ref_index] == 0);
+                    // For broadcast packets, set the refcount to number of clients
+                    // receiving it. Only enqueue buffer back to driver if
+                    // all clients have consumed the buffer.
+                    net_stats_packet(state.stats, buffer.len);
+
+                    for (int i = 0; i < NUM_NETWORK_CLIENTS; i++) {
+#if NET_LOCAL_SWITCH
+                        /* A client does not receive its own broadcasts back */
+                        if (local_buffer(&buffer) && buffer.src_client == i) {
+                            continue;
+                        }
+#endif
+#if NET_VLAN
+                        if (state.vlans[i] != (tci & NET_VLAN_VID_MASK)) {
+                            continue;
+                        }
+#endif
+                        if (!deliver(i, buffer)) {
+                            continue;
+                        }
+#if NET_VLAN
+                        net_stats_packet(&state.client_stats[i], buffer.len);
+#endif
+                        buffer_refs[ref_index]++;
+                    }
+
+                    if (buffer_refs[ref_index] == 0) {
+                        drv_return(buffer);
+                    }
+                } else if (client >= 0) {
+                    if (!deliver(client, buffer)) {
+                        drv_return(buffer);
+                        continue;
+                    }
+
+                    int ref_index = buffer.io_or_offset / NET_BUFFER_SIZE;
+                    assert(buffer_refs[ref_index] == 0);
+                    buffer_refs[ref_index] = 1;
+                    net_stats_packet(state.stats, buffer.len);
+#if NET_VLAN
+                    net_stats_packet(&state.client_stats[client], buffer.len);
+#endif
+                } else {
+                    net_stats_drop(state.stats, NET_STATS_DROP_NO_MATCH);
+                    drv_return(buffer);
+                }
             }
+
+            publish(notify_clients);
         }
         net_request_signal_active(&state.rx_queue_drv);
+#if NET_LOCAL_SWITCH
+        net_request_signal_active(&state.rx_queue_local);
+#endif
         reprocess = false;
 
-        if (!net_queue_empty_active(&state.rx_queue_drv)) {
+        if (frames_waiting()) {
             net_cancel_signal_active(&state.rx_queue_drv);
+#if NET_LOCAL_SWITCH
+            net_cancel_signal_active(&state.rx_queue_local);
+#endif
             reprocess = true;
         }
     }
@@ -142,8 +369,17 @@ void rx_return(void)
         if (notify_clients[client] && net_require_signal_active(&state.rx_queue_clients[client])) {
             net_cancel_signal_active(&state.rx_queue_clients[client]);
             microkit_notify(client + CLIENT_CH);
+            net_stats_notify(state.stats);
         }
     }
+
+#if NET_CAPTURE
+    if (notify_capture && net_capture_require_signal(&state.capture)) {
+        net_capture_cancel_signal(&state.capture);
+        microkit_notify(CAPTURE_CH);
+        net_stats_notify(state.stats);
+    }
+#endif
 }
 
 void rx_provide(void)
@@ -155,13 +391,14 @@ void rx_provide(void)
                 net_buff_desc_t buffer;
                 int err = net_dequeue_free(&state.rx_queue_clients[client], &buffer);
                 assert(!err);
-                assert(!(buffer.io_or_offset % NET_BUFFER_SIZE) &&
-                       (buffer.io_or_offset < NET_BUFFER_SIZE * state.rx_queue_clients[client].size));
+                assert(net_buff_headroom(&buffer) == NET_BUFFER_HEADROOM &&
+                       (buffer.io_or_offset < NET_BUFFER_SIZE * NET_RX_SLOTS_DRIV));
 
                 int ref_index = buffer.io_or_offset / NET_BUFFER_SIZE;
-                assert(buffer_refs[ref_index] != 0);
+                assert(buffer_refs[ref_index] != 0 && state.held[client] != 0);
 
                 buffer_refs[ref_index]--;
+                state.held[client]--;
 
                 if (buffer_refs[ref_index] != 0) {
                     continue;
@@ -171,10 +408,7 @@ void rx_provide(void)
                 // the DMA region is only mapped in read only. This avoids the
                 // case where pending writes are only written to the buffer
                 // memory after DMA has occured.
-                buffer.io_or_offset = buffer.io_or_offset + buffer_data_paddr;
-                err = net_enqueue_free(&state.rx_queue_drv, buffer);
-                assert(!err);
-                notify_drv = true;
+                drv_return(buffer);
             }
 
             net_request_signal_free(&state.rx_queue_clients[client]);
@@ -187,29 +421,115 @@ void rx_provide(void)
         }
     }
 
+#if NET_RX_RECYCLE
+    drv_refill();
+#endif
+
     if (notify_drv && net_require_signal_free(&state.rx_queue_drv)) {
         net_cancel_signal_free(&state.rx_queue_drv);
+#if NET_VIRT_SPIN
+        /* Deferred notifications are not delivered until we stop spinning */
+        microkit_notify(DRIVER_CH);
+#else
         microkit_deferred_notify(DRIVER_CH);
+#endif
+        net_stats_notify(state.stats);
         notify_drv = false;
     }
 }
 
+#if NET_VIRT_SPIN
+static bool work_pending(void)
+{
+    if (frames_waiting()) {
+        return true;
+    }
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        if (!net_queue_empty_free(&state.rx_queue_clients[client])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cancel_signals(void)
+{
+    net_cancel_signal_active(&state.rx_queue_drv);
+#if NET_LOCAL_SWITCH
+    net_cancel_signal_active(&state.rx_queue_local);
+#endif
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        net_cancel_signal_free(&state.rx_queue_clients[client]);
+    }
+}
+
+/* Poll the queues with signals cancelled until they go idle, then request signals again */
+static void spin(void)
+{
+    sddf_spin_t spin;
+    sddf_spin_init(&spin, NET_VIRT_SPIN_IDLE, NET_VIRT_SPIN_BACKOFF);
+    cancel_signals();
+    while (true) {
+        if (work_pending()) {
+            rx_return();
+            rx_provide();
+            cancel_signals();
+            sddf_spin_reset(&spin);
+        } else if (!sddf_spin_backoff(&spin)) {
+            break;
+        }
+    }
+
+    rx_return();
+    rx_provide();
+}
+#endif
+
 void notified(microkit_channel ch)
 {
+    net_stats_notified(state.stats);
+#if NET_VIRT_SPIN
+    spin();
+#else
     rx_return();
     rx_provide();
+#endif
 }
 
 void init(void)
 {
     net_virt_mac_addr_init_sys(microkit_name, (uint8_t *) state.mac_addrs);
+    state.stats = net_stats_init_sys(microkit_name, net_stats);
+    assert(state.stats);
+#if NET_VLAN
+    net_virt_vlan_init_sys(microkit_name, state.vlans);
+    state.client_stats = net_stats_client_init_sys(microkit_name, net_stats);
+    assert(state.client_stats);
+#endif
 
     net_queue_init(&state.rx_queue_drv, rx_free_drv, rx_active_drv, NET_RX_QUEUE_SIZE_DRIV);
     net_virt_queue_init_sys(microkit_name, state.rx_queue_clients, rx_free_cli0, rx_active_cli0);
+#if NET_RX_RECYCLE
+    net_recycle_init(&state.recycle, recycle_buffers, NET_RX_QUEUE_SIZE_DRIV);
+    net_recycle_buffers_init(&state.recycle, NET_RX_QUEUE_SIZE_DRIV - 1, buffer_data_paddr);
+    drv_refill();
+#else
     net_buffers_init(&state.rx_queue_drv, buffer_data_paddr);
+#endif
+#if NET_LOCAL_SWITCH
+    net_queue_init(&state.rx_queue_local, rx_free_local, rx_active_local, NET_LOCAL_QUEUE_SIZE);
+    net_buffers_init(&state.rx_queue_local, NET_RX_QUEUE_SIZE_DRIV * NET_BUFFER_SIZE);
+#endif
+#if NET_CAPTURE
+    net_capture_init(&state.capture, capture_ring, NET_CAPTURE_RING_SIZE);
+#endif
+#if NET_TRACE
+    net_trace_init_sys(microkit_name, net_trace, &state.trace);
+#endif
 
     if (net_require_signal_free(&state.rx_queue_drv)) {
         net_cancel_signal_free(&state.rx_queue_drv);
         microkit_deferred_notify(DRIVER_CH);
+        net_stats_notify(state.stats);
     }
 }
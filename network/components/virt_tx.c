@@ -5,6 +5,7 @@
 
 #include <microkit.h>
 #include <sddf/network/queue.h>
+#include <sddf/network/stats.h>
 #include <sddf/util/cache.h>
 #include <sddf/util/util.h>
 #include <sddf/util/printf.h>
@@ -12,6 +13,11 @@
 
 #define DRIVER 0
 #define CLIENT_CH 1
+#define CAPTURE_CH (CLIENT_CH + NUM_NETWORK_CLIENTS)
+#define LOCAL_CH (CAPTURE_CH + 1)
+
+/* Used to signify that a frame is for the broadcast address */
+#define BROADCAST_ID (NUM_NETWORK_CLIENTS + 1)
 
 net_queue_t *tx_free_drv;
 net_queue_t *tx_active_drv;
@@ -22,11 +28,37 @@ uintptr_t buffer_data_region_cli0_vaddr;
 uintptr_t buffer_data_region_cli0_paddr;
 uintptr_t buffer_data_region_cli1_paddr;
 
+#if NET_LOCAL_SWITCH
+/* Queues shared with the RX virtualiser, and the driver's RX data region */
+net_queue_t *rx_free_local;
+net_queue_t *rx_active_local;
+uintptr_t rx_buffer_data_region;
+#endif
+
+net_stats_t *net_stats;
+
+#if NET_CAPTURE
+net_capture_ring_t *capture_ring;
+#endif
+
 typedef struct state {
     net_queue_handle_t tx_queue_drv;
     net_queue_handle_t tx_queue_clients[NUM_NETWORK_CLIENTS];
     uintptr_t buffer_region_vaddrs[NUM_NETWORK_CLIENTS];
     uintptr_t buffer_region_paddrs[NUM_NETWORK_CLIENTS];
+    net_stats_t *stats;
+#if NET_LOCAL_SWITCH
+    net_queue_handle_t rx_queue_local;
+    uint8_t mac_addrs[NUM_NETWORK_CLIENTS][ETH_HWADDR_LEN];
+#endif
+#if NET_VLAN
+    uint16_t vlans[NUM_NETWORK_CLIENTS];
+    /* stats of the tagged traffic of each client */
+    net_stats_t *client_stats;
+#endif
+#if NET_CAPTURE
+    net_capture_handle_t capture;
+#endif
 } state_t;
 
 state_t state;
@@ -43,32 +75,127 @@ int extract_offset(uintptr_t *phys)
     return -1;
 }
 
+#if NET_LOCAL_SWITCH
+/* Return the ID of the other client a frame from a client is addressed to,
+ * the broadcast ID if it is a broadcast, or -1 if it is for the network */
+static int get_local_dest(int client, struct ethernet_header *frame)
+{
+    bool broadcast = true;
+    for (int i = 0; i < ETH_HWADDR_LEN; i++) {
+        if (frame->dest.addr[i] != 0xFF) {
+            broadcast = false;
+        }
+    }
+    if (broadcast) {
+        return BROADCAST_ID;
+    }
+
+    for (int dest = 0; dest < NUM_NETWORK_CLIENTS; dest++) {
+#if NET_VLAN
+        if (state.vlans[dest] != state.vlans[client]) {
+            continue;
+        }
+#endif
+        if (dest != client && !sddf_memcmp(frame->dest.addr, state.mac_addrs[dest], ETH_HWADDR_LEN)) {
+            return dest;
+        }
+    }
+    return -1;
+}
+
+/* Copy a frame from a client into a buffer of the driver's RX data region for
+ * the RX virtualiser to deliver. Returns whether a buffer was available. */
+static bool switch_local(int client, uintptr_t frame, uint16_t len)
+{
+    net_buff_desc_t buffer;
+    if (net_dequeue_free(&state.rx_queue_local, &buffer)) {
+        net_stats_drop(state.stats, NET_STATS_DROP_NO_BUFFER);
+        return false;
+    }
+
+    sddf_memcpy((void *)(rx_buffer_data_region + buffer.io_or_offset), (void *)frame, len);
+    buffer.len = len;
+    buffer.src_client = client;
+    int err = net_enqueue_active(&state.rx_queue_local, buffer);
+    assert(!err);
+    return true;
+}
+#endif
+
 void tx_provide(void)
 {
     bool enqueued = false;
+#if NET_LOCAL_SWITCH
+    bool switched = false;
+    bool notify_clients[NUM_NETWORK_CLIENTS] = {false};
+#endif
+#if NET_CAPTURE
+    bool notify_capture = false;
+#endif
     for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
         bool reprocess = true;
         while (reprocess) {
+            net_stats_queue_occupancy(state.stats, net_queue_size(state.tx_queue_clients[client].active));
             while (!net_queue_empty_active(&state.tx_queue_clients[client])) {
                 net_buff_desc_t buffer;
                 int err = net_dequeue_active(&state.tx_queue_clients[client], &buffer);
                 assert(!err);
 
-                if (buffer.io_or_offset % NET_BUFFER_SIZE ||
+                if (net_buff_headroom(&buffer) != NET_BUFFER_HEADROOM ||
                     buffer.io_or_offset >= NET_BUFFER_SIZE * state.tx_queue_clients[client].size) {
-                    sddf_dprintf("VIRT_TX|LOG: Client provided offset %lx which is not buffer aligned or outside of buffer region\n",
+                    sddf_dprintf("VIRT_TX|LOG: Client provided offset %lx which is not past a buffer's headroom or outside of buffer region\n",
                                  buffer.io_or_offset);
+                    net_stats_drop(state.stats, NET_STATS_DROP_BAD_OFFSET);
+                    err = net_enqueue_free(&state.tx_queue_clients[client], buffer);
+                    assert(!err);
+                    continue;
+                }
+
+#if NET_VLAN
+                if (buffer.len < 2 * ETH_HWADDR_LEN || buffer.len > NET_BUFFER_SIZE - NET_BUFFER_HEADROOM) {
+                    sddf_dprintf("VIRT_TX|LOG: Client provided frame of length %u which cannot be tagged\n", buffer.len);
+                    net_stats_drop(state.stats, NET_STATS_DROP_TOO_LARGE);
+                    err = net_enqueue_free(&state.tx_queue_clients[client], buffer);
+                    assert(!err);
+                    continue;
+                }
+
+                net_buff_push(&buffer, NET_VLAN_TAG_LEN);
+                net_vlan_insert(buffer.io_or_offset + state.buffer_region_vaddrs[client], state.vlans[client]);
+                net_stats_packet(&state.client_stats[client], buffer.len);
+#endif
+
+#if NET_LOCAL_SWITCH
+                uintptr_t frame = buffer.io_or_offset + state.buffer_region_vaddrs[client];
+                int dest = get_local_dest(client, (struct ethernet_header *)frame);
+                bool local = dest >= 0 && switch_local(client, frame, buffer.len);
+                switched |= local;
+                if (dest >= 0 && dest != BROADCAST_ID) {
+                    /* Unicast frames for another client never reach the device, a failed switch counted a drop */
+                    if (local) {
+                        net_stats_packet(state.stats, buffer.len);
+                    }
+                    net_buff_reset(&buffer);
                     err = net_enqueue_free(&state.tx_queue_clients[client], buffer);
                     assert(!err);
+                    notify_clients[client] = true;
                     continue;
                 }
+#endif
 
                 cache_clean(buffer.io_or_offset + state.buffer_region_vaddrs[client],
                             buffer.io_or_offset + state.buffer_region_vaddrs[client] + buffer.len);
+#if NET_CAPTURE
+                if (net_capture_enabled(&state.capture)) {
+                    net_capture_mirror(&state.capture, NET_CAPTURE_DIR_TX, client, buffer.io_or_offset, buffer.len);
+                    notify_capture = true;
+                }
+#endif
 
                 buffer.io_or_offset = buffer.io_or_offset + state.buffer_region_paddrs[client];
                 err = net_enqueue_active(&state.tx_queue_drv, buffer);
                 assert(!err);
+                net_stats_packet(state.stats, buffer.len);
                 enqueued = true;
             }
 
@@ -82,10 +209,40 @@ void tx_provide(void)
         }
     }
 
+#if NET_LOCAL_SWITCH
+    if (switched && net_require_signal_active(&state.rx_queue_local)) {
+        net_cancel_signal_active(&state.rx_queue_local);
+        microkit_notify(LOCAL_CH);
+        net_stats_notify(state.stats);
+    }
+
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        if (notify_clients[client] && net_require_signal_free(&state.tx_queue_clients[client])) {
+            net_cancel_signal_free(&state.tx_queue_clients[client]);
+            microkit_notify(client + CLIENT_CH);
+            net_stats_notify(state.stats);
+        }
+    }
+#endif
+
     if (enqueued && net_require_signal_active(&state.tx_queue_drv)) {
         net_cancel_signal_active(&state.tx_queue_drv);
+#if NET_VIRT_SPIN
+        /* Deferred notifications are not delivered until we stop spinning */
+        microkit_notify(DRIVER);
+#else
         microkit_deferred_notify(DRIVER);
+#endif
+        net_stats_notify(state.stats);
     }
+
+#if NET_CAPTURE
+    if (notify_capture && net_capture_require_signal(&state.capture)) {
+        net_capture_cancel_signal(&state.capture);
+        microkit_notify(CAPTURE_CH);
+        net_stats_notify(state.stats);
+    }
+#endif
 }
 
 void tx_return(void)
@@ -100,6 +257,8 @@ void tx_return(void)
 
             int client = extract_offset(&buffer.io_or_offset);
             assert(client >= 0);
+            /* Undo any headers pushed on the way to the driver */
+            net_buff_reset(&buffer);
 
             err = net_enqueue_free(&state.tx_queue_clients[client], buffer);
             assert(!err);
@@ -119,18 +278,76 @@ void tx_return(void)
         if (notify_clients[client] && net_require_signal_free(&state.tx_queue_clients[client])) {
             net_cancel_signal_free(&state.tx_queue_clients[client]);
             microkit_notify(client + CLIENT_CH);
+            net_stats_notify(state.stats);
         }
     }
 }
 
+#if NET_VIRT_SPIN
+static bool work_pending(void)
+{
+    if (!net_queue_empty_free(&state.tx_queue_drv)) {
+        return true;
+    }
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        if (!net_queue_empty_active(&state.tx_queue_clients[client])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cancel_signals(void)
+{
+    net_cancel_signal_free(&state.tx_queue_drv);
+    for (int client = 0; client < NUM_NETWORK_CLIENTS; client++) {
+        net_cancel_signal_active(&state.tx_queue_clients[client]);
+    }
+}
+
+/* Poll the queues with signals cancelled until they go idle, then request signals again */
+static void spin(void)
+{
+    sddf_spin_t spin;
+    sddf_spin_init(&spin, NET_VIRT_SPIN_IDLE, NET_VIRT_SPIN_BACKOFF);
+    cancel_signals();
+    while (true) {
+        if (work_pending()) {
+            tx_return();
+            tx_provide();
+            cancel_signals();
+            sddf_spin_reset(&spin);
+        } else if (!sddf_spin_backoff(&spin)) {
+            break;
+        }
+    }
+
+    tx_return();
+    tx_provide();
+}
+#endif
+
 void notified(microkit_channel ch)
 {
+    net_stats_notified(state.stats);
+#if NET_VIRT_SPIN
+    spin();
+#else
     tx_return();
     tx_provide();
+#endif
 }
 
 void init(void)
 {
+    state.stats = net_stats_init_sys(microkit_name, net_stats);
+    assert(state.stats);
+#if NET_VLAN
+    net_virt_vlan_init_sys(microkit_name, state.vlans);
+    state.client_stats = net_stats_client_init_sys(microkit_name, net_stats);
+    assert(state.client_stats);
+#endif
+
     net_queue_init(&state.tx_queue_drv, tx_free_drv, tx_active_drv, NET_TX_QUEUE_SIZE_DRIV);
     net_virt_queue_init_sys(microkit_name, state.tx_queue_clients, tx_free_cli0, tx_active_cli0);
 
@@ -140,5 +357,13 @@ void init(void)
     state.buffer_region_paddrs[0] = buffer_data_region_cli0_paddr;
     state.buffer_region_paddrs[1] = buffer_data_region_cli1_paddr;
 
+#if NET_CAPTURE
+    net_capture_init(&state.capture, capture_ring, NET_CAPTURE_RING_SIZE);
+#endif
+#if NET_LOCAL_SWITCH
+    net_queue_init(&state.rx_queue_local, rx_free_local, rx_active_local, NET_LOCAL_QUEUE_SIZE);
+    net_virt_mac_addr_init_sys(microkit_name, (uint8_t *) state.mac_addrs);
+#endif
+
     tx_provide();
 }
@@ -0,0 +1,41 @@
+#
+# Copyright 2024, UNSW
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# This Makefile snippet builds lib_sddf_lwip.a, the adaptor between the sDDF
+# network queues and an lwIP network interface.
+# It should be included into your project Makefile
+#
+# NOTES:
+# Requires CFLAGS to contain the lwIP include directories and the directory
+# of the system's lwipopts.h and ethernet_config.h.
+# lwIP itself is not included and must be built by the project.
+
+LIB_SDDF_LWIP_OBJS := network/lib/sddf_lwip/sddf_lwip.o
+
+CHECK_LIB_SDDF_LWIP_FLAGS_MD5:=.lib_sddf_lwip_cflags-$(shell echo -- ${CFLAGS} | shasum | sed 's/ *-//')
+
+${CHECK_LIB_SDDF_LWIP_FLAGS_MD5}:
+	-rm -f .lib_sddf_lwip_cflags-*
+	touch $@
+
+lib_sddf_lwip.a: ${LIB_SDDF_LWIP_OBJS}
+	${AR} rv $@ $^
+	${RANLIB} $@
+
+${LIB_SDDF_LWIP_OBJS}: ${CHECK_LIB_SDDF_LWIP_FLAGS_MD5} |network/lib/sddf_lwip
+
+network/lib/sddf_lwip/%.o: ${SDDF}/network/lib/sddf_lwip/%.c
+	${CC} ${CFLAGS} -c -o $@ $<
+
+network/lib/sddf_lwip:
+	mkdir -p $@
+
+clean::
+	${RM} -f ${LIB_SDDF_LWIP_OBJS} ${LIB_SDDF_LWIP_OBJS:.o=.d}
+
+clobber:: clean
+	${RM} -f lib_sddf_lwip.a
+
+-include ${LIB_SDDF_LWIP_OBJS:.o=.d}
@@ -0,0 +1,482 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <microkit.h>
+#include <sddf/util/util.h>
+#include <sddf/util/printf.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/stats.h>
+#include <sddf/network/lib/sddf_lwip.h>
+#include <ethernet_config.h>
+#include "lwip/init.h"
+#include "netif/etharp.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/sys.h"
+
+#define NUM_PBUFFS NET_MAX_CLIENT_QUEUE_SIZE
+
+/* Maximum number of received buffers dequeued before handing them to lwIP */
+#ifndef SDDF_LWIP_RX_BURST
+#define SDDF_LWIP_RX_BURST 32
+#endif
+
+/* Maximum number of frames held while waiting for transmit buffers */
+#ifndef SDDF_LWIP_TX_BACKLOG
+#define SDDF_LWIP_TX_BACKLOG 64
+#endif
+
+#define SDDF_LWIP_LINK_SPEED 1000000000 // Gigabit
+#define SDDF_LWIP_MTU 1500
+
+/* Wrapper over custom_pbuf structure to keep track of buffer offset */
+typedef struct pbuf_custom_offset {
+    struct pbuf_custom custom;
+    uint64_t offset;
+} pbuf_custom_offset_t;
+
+LWIP_MEMPOOL_DECLARE(
+    RX_POOL,
+    NUM_PBUFFS * 2,
+    sizeof(struct pbuf_custom_offset),
+    "Zero-copy RX pool"
+);
+
+/* Wrapper over custom_pbuf structure for pbufs allocated directly in a transmit buffer */
+typedef struct pbuf_custom_tx {
+    struct pbuf_custom custom;
+    uint64_t offset;
+    /* Whether the underlying buffer has been handed to the multiplexer */
+    bool sent;
+} pbuf_custom_tx_t;
+
+LWIP_MEMPOOL_DECLARE(
+    TX_POOL,
+    NUM_PBUFFS,
+    sizeof(struct pbuf_custom_tx),
+    "Zero-copy TX pool"
+);
+
+typedef struct state {
+    struct netif netif;
+    sddf_lwip_config_t config;
+    /* Frames waiting for transmit buffers, in a ring of backlog frames from backlog_head */
+    struct pbuf *backlog_frames[SDDF_LWIP_TX_BACKLOG];
+    uint32_t backlog_head;
+    uint32_t backlog;
+    /* Transmit buffers taken from the free queue by zero-copy pbufs that were freed without being sent */
+    uint64_t tx_unsent[NUM_PBUFFS];
+    uint32_t num_tx_unsent;
+    /* Whether buffers have been enqueued since the virtualisers were last notified */
+    bool notify_rx;
+    bool notify_tx;
+} state_t;
+
+static state_t state;
+
+/**
+ * Free a pbuf. This also returns the underlying buffer to the receive free ring.
+ *
+ * @param p pbuf to free.
+ */
+static void interface_free_buffer(struct pbuf *p)
+{
+    SYS_ARCH_DECL_PROTECT(old_level);
+    pbuf_custom_offset_t *custom_pbuf_offset = (pbuf_custom_offset_t *)p;
+    SYS_ARCH_PROTECT(old_level);
+    net_buff_desc_t buffer = {custom_pbuf_offset->offset, 0};
+    int err = net_enqueue_free(&state.config.rx_queue, buffer);
+    assert(!err);
+    state.notify_rx = true;
+    LWIP_MEMPOOL_FREE(RX_POOL, custom_pbuf_offset);
+    SYS_ARCH_UNPROTECT(old_level);
+}
+
+/**
+ * Create a pbuf structure to pass to the network interface.
+ *
+ * @param offset offset of the buffer containing the data.
+ * @param length length of data.
+ *
+ * @return the newly created pbuf. Can be cast to pbuf_custom.
+ */
+static struct pbuf *create_interface_buffer(uint64_t offset, size_t length)
+{
+    pbuf_custom_offset_t *custom_pbuf_offset = (pbuf_custom_offset_t *) LWIP_MEMPOOL_ALLOC(RX_POOL);
+    custom_pbuf_offset->offset = offset;
+    custom_pbuf_offset->custom.custom_free_function = interface_free_buffer;
+
+    return pbuf_alloced_custom(
+               PBUF_RAW,
+               length,
+               PBUF_REF,
+               &custom_pbuf_offset->custom,
+               (void *)(offset + state.config.rx_buffer_data_region),
+               NET_BUFFER_SIZE - NET_BUFFER_HEADROOM
+           );
+}
+
+/**
+ * Check whether a transmit buffer is available.
+ *
+ * @return true if a transmit buffer can be taken, false otherwise.
+ */
+static bool tx_buffer_available(void)
+{
+    return state.num_tx_unsent || !net_queue_empty_free(&state.config.tx_queue);
+}
+
+/**
+ * Take a transmit buffer, preferring buffers that were allocated but never sent.
+ *
+ * @param buffer buffer descriptor to fill.
+ *
+ * @return -1 if no transmit buffers are available, 0 on success.
+ */
+static int tx_buffer_get(net_buff_desc_t *buffer)
+{
+    if (state.num_tx_unsent) {
+        buffer->io_or_offset = state.tx_unsent[--state.num_tx_unsent];
+        buffer->len = 0;
+        return 0;
+    }
+
+    return net_dequeue_free(&state.config.tx_queue, buffer);
+}
+
+/**
+ * Free a pbuf allocated by sddf_lwip_tx_pbuf_alloc. The underlying buffer is
+ * kept for reuse unless it was handed to the multiplexer, in which case it
+ * will be returned through the transmit free queue.
+ *
+ * @param p pbuf to free.
+ */
+static void interface_free_tx_buffer(struct pbuf *p)
+{
+    SYS_ARCH_DECL_PROTECT(old_level);
+    pbuf_custom_tx_t *custom_pbuf_tx = (pbuf_custom_tx_t *)p;
+    SYS_ARCH_PROTECT(old_level);
+    if (!custom_pbuf_tx->sent) {
+        state.tx_unsent[state.num_tx_unsent++] = custom_pbuf_tx->offset;
+    }
+    LWIP_MEMPOOL_FREE(TX_POOL, custom_pbuf_tx);
+    SYS_ARCH_UNPROTECT(old_level);
+}
+
+struct pbuf *sddf_lwip_tx_pbuf_alloc(pbuf_layer layer, u16_t length)
+{
+    if ((uint32_t)layer + length > NET_BUFFER_SIZE - NET_BUFFER_HEADROOM || !tx_buffer_available()) {
+        return NULL;
+    }
+
+    pbuf_custom_tx_t *custom_pbuf_tx = (pbuf_custom_tx_t *) LWIP_MEMPOOL_ALLOC(TX_POOL);
+    if (custom_pbuf_tx == NULL) {
+        return NULL;
+    }
+
+    net_buff_desc_t buffer;
+    int err = tx_buffer_get(&buffer);
+    assert(!err);
+
+    custom_pbuf_tx->offset = buffer.io_or_offset;
+    custom_pbuf_tx->sent = false;
+    custom_pbuf_tx->custom.custom_free_function = interface_free_tx_buffer;
+
+    /* Allocate from the start of the frame and then hide the space for the
+     * headers rather than passing the layer, as lwIP would align it up */
+    struct pbuf *p = pbuf_alloced_custom(
+                         PBUF_RAW,
+                         layer + length,
+                         PBUF_RAM,
+                         &custom_pbuf_tx->custom,
+                         (void *)(buffer.io_or_offset + state.config.tx_buffer_data_region),
+                         NET_BUFFER_SIZE - NET_BUFFER_HEADROOM
+                     );
+    pbuf_remove_header(p, layer);
+
+    return p;
+}
+
+/**
+ * Check whether a pbuf was allocated in a transmit buffer and starts where
+ * frames are expected, so that it can be handed to the multiplexer as is.
+ *
+ * @param p pbuf to check.
+ *
+ * @return true if the pbuf can be sent without copying, false otherwise.
+ */
+static bool tx_pbuf_in_place(struct pbuf *p)
+{
+    pbuf_custom_tx_t *custom_pbuf_tx = (pbuf_custom_tx_t *)p;
+    return p->next == NULL && (p->flags & PBUF_FLAG_IS_CUSTOM)
+           && custom_pbuf_tx->custom.custom_free_function == interface_free_tx_buffer && !custom_pbuf_tx->sent
+           && p->payload == (void *)(custom_pbuf_tx->offset + state.config.tx_buffer_data_region);
+}
+
+/**
+ * Check whether the frame at the head of the backlog can be sent.
+ *
+ * @return true if the backlog is not empty and its first frame can be sent, false otherwise.
+ */
+static bool backlog_sendable(void)
+{
+    return state.backlog != 0 && (tx_buffer_available() || tx_pbuf_in_place(state.backlog_frames[state.backlog_head]));
+}
+
+/**
+ * Insert a frame into the transmit active queue. The caller must have checked
+ * that the frame can be sent.
+ *
+ * @param p pbuf holding the frame.
+ */
+static void tx_send(struct pbuf *p)
+{
+    if (tx_pbuf_in_place(p)) {
+        pbuf_custom_tx_t *custom_pbuf_tx = (pbuf_custom_tx_t *)p;
+        net_buff_desc_t buffer = {custom_pbuf_tx->offset, p->tot_len};
+        int err = net_enqueue_active(&state.config.tx_queue, buffer);
+        assert(!err);
+        custom_pbuf_tx->sent = true;
+        net_stats_packet(state.config.stats, buffer.len);
+        state.notify_tx = true;
+        return;
+    }
+
+    net_buff_desc_t buffer;
+    int err = tx_buffer_get(&buffer);
+    assert(!err);
+
+    uintptr_t frame = buffer.io_or_offset + state.config.tx_buffer_data_region;
+    uint16_t copied = 0;
+    for (struct pbuf *curr = p; curr != NULL; curr = curr->next) {
+        memcpy((void *)(frame + copied), curr->payload, curr->len);
+        copied += curr->len;
+    }
+
+    buffer.len = copied;
+    err = net_enqueue_active(&state.config.tx_queue, buffer);
+    assert(!err);
+    net_stats_packet(state.config.stats, buffer.len);
+    state.notify_tx = true;
+}
+
+/**
+ * Stores a pbuf to be transmitted upon available transmit buffers.
+ *
+ * @param p pbuf to be stored.
+ */
+static void enqueue_pbufs(struct pbuf *p)
+{
+    /* Indicate to the multiplexer that we require transmit free buffers */
+    net_request_signal_free(&state.config.tx_queue);
+
+    state.backlog_frames[(state.backlog_head + state.backlog) % SDDF_LWIP_TX_BACKLOG] = p;
+    state.backlog++;
+
+    /* Increment refernce count to ensure this pbuf is not freed by lwip */
+    pbuf_ref(p);
+}
+
+/**
+ * Transmit a frame on behalf of lwIP. Frames are held in the backlog while
+ * earlier frames are waiting or no transmit buffer is available, and refused
+ * once the backlog is full.
+ */
+static err_t lwip_eth_send(struct netif *netif, struct pbuf *p)
+{
+    if (p->tot_len > NET_BUFFER_SIZE - NET_BUFFER_HEADROOM) {
+        sddf_dprintf("LWIP|ERROR: attempted to send a packet of size  %u > BUFFER SIZE  %u\n", p->tot_len,
+                     NET_BUFFER_SIZE - NET_BUFFER_HEADROOM);
+        net_stats_drop(state.config.stats, NET_STATS_DROP_TOO_LARGE);
+        return ERR_MEM;
+    }
+
+    if (state.backlog != 0 || !(tx_buffer_available() || tx_pbuf_in_place(p))) {
+        if (state.backlog == SDDF_LWIP_TX_BACKLOG) {
+            net_stats_drop(state.config.stats, NET_STATS_DROP_NO_BUFFER);
+            return ERR_MEM;
+        }
+        enqueue_pbufs(p);
+        return ERR_OK;
+    }
+
+    tx_send(p);
+
+    return ERR_OK;
+}
+
+void sddf_lwip_process_tx(void)
+{
+    bool reprocess = true;
+    while (reprocess) {
+        while (backlog_sendable()) {
+            struct pbuf *temp = state.backlog_frames[state.backlog_head];
+            tx_send(temp);
+
+            state.backlog_head = (state.backlog_head + 1) % SDDF_LWIP_TX_BACKLOG;
+            state.backlog--;
+            pbuf_free(temp);
+        }
+
+        /* Only request a signal if no more pbufs enqueud to send */
+        if (state.backlog == 0 || tx_buffer_available()) {
+            net_cancel_signal_free(&state.config.tx_queue);
+        } else {
+            net_request_signal_free(&state.config.tx_queue);
+        }
+        reprocess = false;
+
+        if (backlog_sendable()) {
+            net_cancel_signal_free(&state.config.tx_queue);
+            reprocess = true;
+        }
+    }
+}
+
+void sddf_lwip_process_rx(void)
+{
+    net_buff_desc_t burst[SDDF_LWIP_RX_BURST];
+
+    bool reprocess = true;
+    while (reprocess) {
+        net_stats_queue_occupancy(state.config.stats, net_queue_size(state.config.rx_queue.active));
+        while (!net_queue_empty_active(&state.config.rx_queue)) {
+            /* Dequeue a burst of buffers and prefetch their headers, so that
+             * the headers are in the cache by the time lwIP parses them */
+            uint32_t count = 0;
+            while (count < SDDF_LWIP_RX_BURST && !net_queue_empty_active(&state.config.rx_queue)) {
+                int err = net_dequeue_active(&state.config.rx_queue, &burst[count]);
+                assert(!err);
+                __builtin_prefetch((void *)(burst[count].io_or_offset + state.config.rx_buffer_data_region));
+                count++;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                net_buff_desc_t buffer = burst[i];
+                net_stats_packet(state.config.stats, buffer.len);
+#if NET_TRACE
+                net_trace_entry_t *entry = &state.config.trace.client->entries[net_trace_slot(buffer.io_or_offset,
+                                                                                               NET_DATA_REGION_SIZE)];
+                net_trace_stamp(entry, NET_TRACE_CLIENT);
+                net_trace_complete(state.config.trace.client, entry);
+#endif
+
+                struct pbuf *p = create_interface_buffer(buffer.io_or_offset, buffer.len);
+                assert(p != NULL);
+                if (state.netif.input(p, &state.netif) != ERR_OK) {
+                    sddf_dprintf("LWIP|ERROR: unkown error inputting pbuf into network stack\n");
+                    pbuf_free(p);
+                }
+            }
+        }
+
+        net_request_signal_active(&state.config.rx_queue);
+        reprocess = false;
+
+        if (!net_queue_empty_active(&state.config.rx_queue)) {
+            net_cancel_signal_active(&state.config.rx_queue);
+            reprocess = true;
+        }
+    }
+}
+
+/**
+ * Notify a virtualiser, deferring the notification if no other notification
+ * is pending so that it is delivered when the protection domain next waits.
+ *
+ * @param ch channel to notify.
+ */
+static void notify(microkit_channel ch)
+{
+    if (!microkit_have_signal) {
+        microkit_deferred_notify(ch);
+    } else if (microkit_signal_cap != BASE_OUTPUT_NOTIFICATION_CAP + ch) {
+        microkit_notify(ch);
+    }
+    net_stats_notify(state.config.stats);
+}
+
+void sddf_lwip_maybe_notify(void)
+{
+    if (state.notify_rx && net_require_signal_free(&state.config.rx_queue)) {
+        net_cancel_signal_free(&state.config.rx_queue);
+        state.notify_rx = false;
+        notify(state.config.rx_ch);
+    }
+
+    if (state.notify_tx && net_require_signal_active(&state.config.tx_queue)) {
+        net_cancel_signal_active(&state.config.tx_queue);
+        state.notify_tx = false;
+        notify(state.config.tx_ch);
+    }
+}
+
+/**
+ * Initialise the network interface data structure.
+ *
+ * @param netif network interface data structuer.
+ */
+static err_t ethernet_init(struct netif *netif)
+{
+    if (netif->state == NULL) {
+        return ERR_ARG;
+    }
+    state_t *data = netif->state;
+
+    netif->hwaddr[0] = data->config.mac[0];
+    netif->hwaddr[1] = data->config.mac[1];
+    netif->hwaddr[2] = data->config.mac[2];
+    netif->hwaddr[3] = data->config.mac[3];
+    netif->hwaddr[4] = data->config.mac[4];
+    netif->hwaddr[5] = data->config.mac[5];
+    netif->mtu = SDDF_LWIP_MTU;
+    netif->hwaddr_len = ETHARP_HWADDR_LEN;
+    netif->output = etharp_output;
+    netif->linkoutput = lwip_eth_send;
+    NETIF_INIT_SNMP(netif, snmp_ifType_ethernet_csmacd, SDDF_LWIP_LINK_SPEED);
+    netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_IGMP;
+    return ERR_OK;
+}
+
+struct netif *sddf_lwip_netif(void)
+{
+    return &state.netif;
+}
+
+void sddf_lwip_init(sddf_lwip_config_t *config)
+{
+    state.config = *config;
+    net_buffers_init(&state.config.tx_queue, 0);
+
+    lwip_init();
+
+    LWIP_MEMPOOL_INIT(RX_POOL);
+    LWIP_MEMPOOL_INIT(TX_POOL);
+
+    /* Set dummy IP configuration values to get lwIP bootstrapped  */
+    struct ip4_addr netmask, ipaddr, gw, multicast;
+    ipaddr_aton("0.0.0.0", &gw);
+    ipaddr_aton("0.0.0.0", &ipaddr);
+    ipaddr_aton("0.0.0.0", &multicast);
+    ipaddr_aton("255.255.255.0", &netmask);
+
+    state.netif.name[0] = 'e';
+    state.netif.name[1] = '0';
+
+    if (!netif_add(&state.netif, &ipaddr, &netmask, &gw, (void *)&state, ethernet_init, ethernet_input)) {
+        sddf_dprintf("LWIP|ERROR: Netif add returned NULL\n");
+    }
+
+    netif_set_default(&state.netif);
+    if (state.config.status_callback != NULL) {
+        netif_set_status_callback(&state.netif, state.config.status_callback);
+    }
+    netif_set_up(&state.netif);
+}
@@ -0,0 +1,39 @@
+#
+# Copyright 2024, UNSW
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# This Makefile snippet builds lib_sddf_udp.a, a minimal UDP/IPv4 endpoint
+# on top of the sDDF network queues.
+# It should be included into your project Makefile
+#
+# NOTES:
+# Requires CFLAGS to contain the directory of the system's ethernet_config.h.
+
+LIB_SDDF_UDP_OBJS := network/lib/sddf_udp/sddf_udp.o
+
+CHECK_LIB_SDDF_UDP_FLAGS_MD5:=.lib_sddf_udp_cflags-$(shell echo -- ${CFLAGS} | shasum | sed 's/ *-//')
+
+${CHECK_LIB_SDDF_UDP_FLAGS_MD5}:
+	-rm -f .lib_sddf_udp_cflags-*
+	touch $@
+
+lib_sddf_udp.a: ${LIB_SDDF_UDP_OBJS}
+	${AR} rv $@ $^
+	${RANLIB} $@
+
+${LIB_SDDF_UDP_OBJS}: ${CHECK_LIB_SDDF_UDP_FLAGS_MD5} |network/lib/sddf_udp
+
+network/lib/sddf_udp/%.o: ${SDDF}/network/lib/sddf_udp/%.c
+	${CC} ${CFLAGS} -c -o $@ $<
+
+network/lib/sddf_udp:
+	mkdir -p $@
+
+clean::
+	${RM} -f ${LIB_SDDF_UDP_OBJS} ${LIB_SDDF_UDP_OBJS:.o=.d}
+
+clobber:: clean
+	${RM} -f lib_sddf_udp.a
+
+-include ${LIB_SDDF_UDP_OBJS:.o=.d}
@@ -0,0 +1,358 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <microkit.h>
+#include <sddf/util/util.h>
+#include <sddf/util/printf.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/stats.h>
+#include <sddf/network/constants.h>
+#include <sddf/network/util.h>
+#include <sddf/network/arp.h>
+#include <sddf/network/lib/sddf_udp.h>
+#include <ethernet_config.h>
+
+/* Maximum number of received buffers dequeued before processing them */
+#ifndef SDDF_UDP_RX_BURST
+#define SDDF_UDP_RX_BURST 32
+#endif
+
+#define IPV4_VERSION 4
+#define IPV4_HDR_LEN 20
+#define IPV4_PROTO_UDP 17
+#define IPV4_PROTO_LEN 4
+#define IPV4_DEFAULT_TTL 64
+/* Don't fragment flag, and more fragments flag and fragment offset */
+#define IPV4_DF 0x4000U
+#define IPV4_MF_OFFSET 0x3fffU
+#define ARP_HWTYPE_ETHERNET 1
+#define ARP_PADDING_SIZE 18
+
+struct __attribute__((__packed__)) arp_packet {
+    struct ethernet_header ethhdr;
+    uint16_t hwtype;
+    uint16_t proto;
+    uint8_t hwlen;
+    uint8_t protolen;
+    uint16_t opcode;
+    uint8_t hwsrc_addr[ETH_HWADDR_LEN];
+    uint32_t ipsrc_addr;
+    uint8_t hwdst_addr[ETH_HWADDR_LEN];
+    uint32_t ipdst_addr;
+    uint8_t padding[ARP_PADDING_SIZE];
+};
+
+/* Headers of a UDP frame */
+struct __attribute__((__packed__)) udp_frame {
+    struct ethernet_header ethhdr;
+    struct sddf_ipv4_header iphdr;
+    struct sddf_udp_header udphdr;
+};
+
+typedef struct state {
+    sddf_udp_config_t config;
+    /* Headers of replies, with the per reply fields zeroed */
+    struct udp_frame template;
+    /* Ones' complement sum of the constant fields of the IPv4 header */
+    uint32_t ip_check_partial;
+    uint16_t ip_id;
+    /* Transmit buffer taken from the free queue but not used for a reply */
+    net_buff_desc_t spare;
+    bool have_spare;
+    /* Whether buffers have been enqueued since the virtualisers were last notified */
+    bool notify_rx;
+    bool notify_tx;
+} state_t;
+
+static state_t state;
+
+/**
+ * Fold a ones' complement sum into 16 bits.
+ *
+ * @param sum sum to fold.
+ *
+ * @return folded sum.
+ */
+static inline uint16_t checksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+/**
+ * Take a transmit buffer, preferring one left over from a previous request.
+ *
+ * @param buffer buffer descriptor to fill.
+ *
+ * @return -1 if no transmit buffers are available, 0 on success.
+ */
+static int tx_buffer_get(net_buff_desc_t *buffer)
+{
+    if (state.have_spare) {
+        *buffer = state.spare;
+        state.have_spare = false;
+        return 0;
+    }
+
+    return net_dequeue_free(&state.config.tx_queue, buffer);
+}
+
+/**
+ * Hand a transmit buffer to the TX virtualiser.
+ *
+ * @param buffer buffer to transmit, with its length set.
+ */
+static void tx_send(net_buff_desc_t buffer)
+{
+    int err = net_enqueue_active(&state.config.tx_queue, buffer);
+    assert(!err);
+    net_stats_packet(state.config.stats, buffer.len);
+    state.notify_tx = true;
+}
+
+/**
+ * Answer an ARP request for the endpoint's address.
+ *
+ * @param request received ARP packet.
+ * @param len length of the received frame.
+ */
+static void handle_arp(struct arp_packet *request, uint16_t len)
+{
+    if (len < offsetof(struct arp_packet, padding) || request->opcode != HTONS(ETHARP_OPCODE_REQUEST)
+        || request->ipdst_addr != state.config.ipv4_addr) {
+        return;
+    }
+
+    net_buff_desc_t buffer;
+    if (tx_buffer_get(&buffer)) {
+        net_stats_drop(state.config.stats, NET_STATS_DROP_NO_BUFFER);
+        return;
+    }
+
+    struct arp_packet *reply = (struct arp_packet *)(buffer.io_or_offset + state.config.tx_buffer_data_region);
+    memcpy(&reply->ethhdr.dest, request->hwsrc_addr, ETH_HWADDR_LEN);
+    memcpy(&reply->ethhdr.src, state.config.mac, ETH_HWADDR_LEN);
+    reply->ethhdr.type = HTONS(ETH_TYPE_ARP);
+    reply->hwtype = HTONS(ARP_HWTYPE_ETHERNET);
+    reply->proto = HTONS(ETH_TYPE_IP);
+    reply->hwlen = ETH_HWADDR_LEN;
+    reply->protolen = IPV4_PROTO_LEN;
+    reply->opcode = HTONS(ETHARP_OPCODE_REPLY);
+    memcpy(reply->hwsrc_addr, state.config.mac, ETH_HWADDR_LEN);
+    reply->ipsrc_addr = state.config.ipv4_addr;
+    memcpy(reply->hwdst_addr, request->hwsrc_addr, ETH_HWADDR_LEN);
+    reply->ipdst_addr = request->ipsrc_addr;
+    memset(reply->padding, 0, ARP_PADDING_SIZE);
+
+    buffer.len = sizeof(struct arp_packet);
+    tx_send(buffer);
+}
+
+/**
+ * Hand a datagram addressed to the endpoint to the handler, and transmit its
+ * reply.
+ *
+ * @param request headers of the received frame.
+ * @param len length of the received frame.
+ *
+ * @return false if the frame is not a UDP datagram for the endpoint, true otherwise.
+ */
+static bool handle_udp(struct udp_frame *request, uint16_t len)
+{
+    struct sddf_ipv4_header *iphdr = &request->iphdr;
+    uint16_t ihl = (iphdr->ihl_version & 0xf) * 4;
+    if (len < sizeof(struct udp_frame) || (iphdr->ihl_version >> 4) != IPV4_VERSION || ihl < IPV4_HDR_LEN
+        || iphdr->protocol != IPV4_PROTO_UDP || iphdr->daddr != state.config.ipv4_addr
+        || (iphdr->frag_off & HTONS(IPV4_MF_OFFSET))) {
+        return false;
+    }
+
+    uint16_t ip_len = HTONS(iphdr->tot_len);
+    if (ip_len > len - sizeof(struct ethernet_header) || ip_len < ihl + sizeof(struct sddf_udp_header)) {
+        return false;
+    }
+
+    struct sddf_udp_header *udphdr = (struct sddf_udp_header *)((uintptr_t)iphdr + ihl);
+    uint16_t udp_len = HTONS(udphdr->len);
+    if (udphdr->dest != HTONS(state.config.port) || udp_len < sizeof(struct sddf_udp_header)
+        || udp_len > ip_len - ihl) {
+        return false;
+    }
+
+    net_buff_desc_t buffer;
+    if (tx_buffer_get(&buffer)) {
+        net_stats_drop(state.config.stats, NET_STATS_DROP_NO_BUFFER);
+        return true;
+    }
+
+    struct udp_frame *reply = (struct udp_frame *)(buffer.io_or_offset + state.config.tx_buffer_data_region);
+    sddf_udp_datagram_t datagram = {
+        .src_addr = iphdr->saddr,
+        .src_port = HTONS(udphdr->source),
+        .payload = (uint8_t *)(udphdr + 1),
+        .len = udp_len - sizeof(struct sddf_udp_header),
+    };
+    uint16_t reply_len = state.config.handler(&datagram, (uint8_t *)(reply + 1), SDDF_UDP_MAX_PAYLOAD);
+    if (!reply_len) {
+        state.spare = buffer;
+        state.have_spare = true;
+        return true;
+    }
+    assert(reply_len <= SDDF_UDP_MAX_PAYLOAD);
+
+    memcpy(reply, &state.template, sizeof(struct udp_frame));
+    reply->ethhdr.dest = request->ethhdr.src;
+    reply->iphdr.tot_len = HTONS(IPV4_HDR_LEN + sizeof(struct sddf_udp_header) + reply_len);
+    reply->iphdr.id = HTONS(state.ip_id);
+    state.ip_id++;
+    reply->iphdr.daddr = iphdr->saddr;
+#ifndef NETWORK_HW_HAS_CHECKSUM
+    /* The sum is independent of byte order, so the fields are added as stored */
+    uint32_t sum = state.ip_check_partial + reply->iphdr.tot_len + reply->iphdr.id + (reply->iphdr.daddr & 0xffff)
+                   + (reply->iphdr.daddr >> 16);
+    reply->iphdr.check = ~checksum_fold(sum);
+#endif
+    reply->udphdr.dest = udphdr->source;
+    reply->udphdr.len = HTONS(sizeof(struct sddf_udp_header) + reply_len);
+
+    buffer.len = sizeof(struct udp_frame) + reply_len;
+    tx_send(buffer);
+
+    return true;
+}
+
+/**
+ * Handle a received frame.
+ *
+ * @param frame address of the frame.
+ * @param len length of the frame.
+ */
+static void handle_frame(uintptr_t frame, uint16_t len)
+{
+    struct ethernet_header *ethhdr = (struct ethernet_header *)frame;
+    if (len < sizeof(struct ethernet_header)) {
+        net_stats_drop(state.config.stats, NET_STATS_DROP_NO_MATCH);
+        return;
+    }
+
+    if (ethhdr->type == HTONS(ETH_TYPE_IP)) {
+        if (!handle_udp((struct udp_frame *)frame, len)) {
+            net_stats_drop(state.config.stats, NET_STATS_DROP_NO_MATCH);
+        }
+    } else if (ethhdr->type == HTONS(ETH_TYPE_ARP) && !state.config.arp_component) {
+        handle_arp((struct arp_packet *)frame, len);
+    } else {
+        net_stats_drop(state.config.stats, NET_STATS_DROP_NO_MATCH);
+    }
+}
+
+void sddf_udp_process(void)
+{
+    net_buff_desc_t burst[SDDF_UDP_RX_BURST];
+
+    bool reprocess = true;
+    while (reprocess) {
+        net_stats_queue_occupancy(state.config.stats, net_queue_size(state.config.rx_queue.active));
+        while (!net_queue_empty_active(&state.config.rx_queue)) {
+            /* Dequeue a burst of buffers and prefetch their headers */
+            uint32_t count = 0;
+            while (count < SDDF_UDP_RX_BURST && !net_queue_empty_active(&state.config.rx_queue)) {
+                int err = net_dequeue_active(&state.config.rx_queue, &burst[count]);
+                assert(!err);
+                __builtin_prefetch((void *)(burst[count].io_or_offset + state.config.rx_buffer_data_region));
+                count++;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                net_buff_desc_t buffer = burst[i];
+                net_stats_packet(state.config.stats, buffer.len);
+#if NET_TRACE
+                net_trace_entry_t *entry = &state.config.trace.client->entries[net_trace_slot(buffer.io_or_offset,
+                                                                                               NET_DATA_REGION_SIZE)];
+                net_trace_stamp(entry, NET_TRACE_CLIENT);
+                net_trace_complete(state.config.trace.client, entry);
+#endif
+
+                handle_frame(buffer.io_or_offset + state.config.rx_buffer_data_region, buffer.len);
+
+                buffer.len = 0;
+                int err = net_enqueue_free(&state.config.rx_queue, buffer);
+                assert(!err);
+                state.notify_rx = true;
+            }
+        }
+
+        net_request_signal_active(&state.config.rx_queue);
+        reprocess = false;
+
+        if (!net_queue_empty_active(&state.config.rx_queue)) {
+            net_cancel_signal_active(&state.config.rx_queue);
+            reprocess = true;
+        }
+    }
+}
+
+/**
+ * Notify a virtualiser, deferring the notification if no other notification
+ * is pending so that it is delivered when the protection domain next waits.
+ *
+ * @param ch channel to notify.
+ */
+static void notify(microkit_channel ch)
+{
+    if (!microkit_have_signal) {
+        microkit_deferred_notify(ch);
+    } else if (microkit_signal_cap != BASE_OUTPUT_NOTIFICATION_CAP + ch) {
+        microkit_notify(ch);
+    }
+    net_stats_notify(state.config.stats);
+}
+
+void sddf_udp_maybe_notify(void)
+{
+    if (state.notify_rx && net_require_signal_free(&state.config.rx_queue)) {
+        net_cancel_signal_free(&state.config.rx_queue);
+        state.notify_rx = false;
+        notify(state.config.rx_ch);
+    }
+
+    if (state.notify_tx && net_require_signal_active(&state.config.tx_queue)) {
+        net_cancel_signal_active(&state.config.tx_queue);
+        state.notify_tx = false;
+        notify(state.config.tx_ch);
+    }
+}
+
+void sddf_udp_init(sddf_udp_config_t *config)
+{
+    state.config = *config;
+    assert(state.config.handler != NULL);
+    net_buffers_init(&state.config.tx_queue, 0);
+
+    struct udp_frame *template = &state.template;
+    memcpy(&template->ethhdr.src, state.config.mac, ETH_HWADDR_LEN);
+    template->ethhdr.type = HTONS(ETH_TYPE_IP);
+    template->iphdr.ihl_version = (IPV4_VERSION << 4) | (IPV4_HDR_LEN / 4);
+    template->iphdr.frag_off = HTONS(IPV4_DF);
+    template->iphdr.ttl = IPV4_DEFAULT_TTL;
+    template->iphdr.protocol = IPV4_PROTO_UDP;
+    template->iphdr.saddr = state.config.ipv4_addr;
+    template->udphdr.source = HTONS(state.config.port);
+
+    uint16_t words[IPV4_HDR_LEN / sizeof(uint16_t)];
+    memcpy(words, &template->iphdr, IPV4_HDR_LEN);
+    for (uint32_t i = 0; i < IPV4_HDR_LEN / sizeof(uint16_t); i++) {
+        state.ip_check_partial += words[i];
+    }
+
+    if (state.config.arp_component) {
+        arp_register_ipv4(state.config.arp_ch, state.config.ipv4_addr, state.config.mac);
+    }
+}
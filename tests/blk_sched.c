@@ -0,0 +1,178 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests of the block request scheduling in sddf/blk/sched.h, with a streaming
+ * client that submits large reads back to back alongside a latency-sensitive
+ * client that submits single blocks.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/blk/sched.h>
+#include "test.h"
+
+#define NUM_CLIENTS 2
+#define STREAM 0
+#define LATENCY 1
+
+#define QUANTUM 8
+/* Blocks per request of each client */
+#define STREAM_COUNT 32
+#define LATENCY_COUNT 1
+
+static const uint16_t counts[NUM_CLIENTS] = { STREAM_COUNT, LATENCY_COUNT };
+
+static blk_sched_t sched;
+static blk_sched_client_t sched_clients[NUM_CLIENTS];
+
+typedef struct run {
+    /* blocks submitted for each client */
+    uint64_t blocks[NUM_CLIENTS];
+    /* longest run of consecutive requests of the streaming client */
+    uint32_t max_stream_run;
+    /* most blocks submitted for the streaming client while the latency-sensitive one was waiting */
+    uint32_t max_latency_wait;
+    /* most blocks submitted for the latency-sensitive client while the streaming one was waiting */
+    uint32_t max_stream_wait;
+} run_t;
+
+/* Submit requests of both clients, which always have requests queued, as chosen by the scheduler */
+static void run(bool deadline, uint32_t requests, run_t *r)
+{
+    bool eligible[NUM_CLIENTS] = { true, true };
+    uint32_t stream_run = 0;
+    uint32_t latency_wait = 0;
+    uint32_t stream_wait = 0;
+    *r = (run_t) { 0 };
+    for (uint32_t i = 0; i < requests; i++) {
+        int next = deadline ? blk_sched_deadline_next(&sched, eligible) : blk_sched_rr_next(&sched, eligible);
+        CHECK(next == STREAM || next == LATENCY);
+        if (deadline) {
+            blk_sched_deadline_submitted(&sched, next, counts[next]);
+        } else {
+            blk_sched_rr_submitted(&sched, next, counts[next]);
+        }
+        r->blocks[next] += counts[next];
+
+        if (next == STREAM) {
+            stream_run++;
+            latency_wait += STREAM_COUNT;
+            stream_wait = 0;
+        } else {
+            stream_run = 0;
+            latency_wait = 0;
+            stream_wait += LATENCY_COUNT;
+        }
+        r->max_stream_run = MAX(r->max_stream_run, stream_run);
+        r->max_latency_wait = MAX(r->max_latency_wait, latency_wait);
+        r->max_stream_wait = MAX(r->max_stream_wait, stream_wait);
+    }
+}
+
+static void test_rr_equal(void)
+{
+    const uint32_t weights[NUM_CLIENTS] = { 1, 1 };
+    const uint32_t deadlines[NUM_CLIENTS] = { 0, 0 };
+    blk_sched_init(&sched, sched_clients, NUM_CLIENTS, QUANTUM, weights, deadlines);
+
+    run_t r;
+    run(false, 10000, &r);
+    // Equal weights share the driver equally in blocks rather than in requests
+    uint64_t total = r.blocks[STREAM] + r.blocks[LATENCY];
+    CHECK(r.blocks[STREAM] * 100 / total >= 45 && r.blocks[STREAM] * 100 / total <= 55);
+    // The latency-sensitive client never waits behind more than one large request
+    CHECK(r.max_stream_run == 1);
+    CHECK(r.max_latency_wait == STREAM_COUNT);
+    // The streaming client waits for the latency-sensitive one's turns while it pays off its overrun
+    CHECK(r.max_stream_wait == STREAM_COUNT);
+
+    TEST_PASS("blk_sched round-robin with equal weights");
+}
+
+static void test_rr_weighted(void)
+{
+    const uint32_t weights[NUM_CLIENTS] = { 3, 1 };
+    const uint32_t deadlines[NUM_CLIENTS] = { 0, 0 };
+    blk_sched_init(&sched, sched_clients, NUM_CLIENTS, QUANTUM, weights, deadlines);
+
+    run_t r;
+    run(false, 10000, &r);
+    uint64_t total = r.blocks[STREAM] + r.blocks[LATENCY];
+    CHECK(r.blocks[STREAM] * 100 / total >= 70 && r.blocks[STREAM] * 100 / total <= 80);
+    CHECK(r.max_stream_run == 1);
+
+    TEST_PASS("blk_sched round-robin with weights");
+}
+
+static void test_rr_eligibility(void)
+{
+    const uint32_t weights[NUM_CLIENTS] = { 0, 1 };
+    const uint32_t deadlines[NUM_CLIENTS] = { 0, 0 };
+    blk_sched_init(&sched, sched_clients, NUM_CLIENTS, QUANTUM, weights, deadlines);
+
+    bool none[NUM_CLIENTS] = { false, false };
+    CHECK(blk_sched_rr_next(&sched, none) == -1);
+
+    // A client of weight 0 is given turns as if its weight were 1, rather than never
+    bool stream_only[NUM_CLIENTS] = { true, false };
+    for (int i = 0; i < 4; i++) {
+        CHECK(blk_sched_rr_next(&sched, stream_only) == STREAM);
+        blk_sched_rr_submitted(&sched, STREAM, STREAM_COUNT);
+    }
+
+    // A client that is not eligible, e.g. because it was blocked, is skipped and gives up the rest of its turn
+    bool latency_only[NUM_CLIENTS] = { false, true };
+    CHECK(blk_sched_rr_next(&sched, latency_only) == LATENCY);
+    blk_sched_rr_submitted(&sched, LATENCY, LATENCY_COUNT);
+    CHECK(sched_clients[LATENCY].deficit == QUANTUM - LATENCY_COUNT);
+    CHECK(blk_sched_rr_next(&sched, stream_only) == STREAM);
+    CHECK(sched_clients[LATENCY].deficit == 0);
+
+    TEST_PASS("blk_sched round-robin eligibility");
+}
+
+static void test_deadline(void)
+{
+    const uint32_t weights[NUM_CLIENTS] = { 1, 1 };
+    const uint32_t deadlines[NUM_CLIENTS] = { 256, 0 };
+    blk_sched_init(&sched, sched_clients, NUM_CLIENTS, QUANTUM, weights, deadlines);
+
+    run_t r;
+    run(true, 10000, &r);
+    // The latency-sensitive client goes first, until the streaming client's deadline passes
+    CHECK(r.max_stream_run == 1);
+    CHECK(r.max_stream_wait == 256);
+    uint64_t total = r.blocks[STREAM] + r.blocks[LATENCY];
+    // The streaming client gets a request in for every deadline's worth of blocks
+    uint64_t expected = STREAM_COUNT * 1000 / (256 + STREAM_COUNT);
+    CHECK(r.blocks[STREAM] * 1000 / total >= expected - 10 && r.blocks[STREAM] * 1000 / total <= expected + 10);
+
+    // A request that arrives while the streaming client is submitting is taken next
+    bool stream_only[NUM_CLIENTS] = { true, false };
+    bool both[NUM_CLIENTS] = { true, true };
+    blk_sched_init(&sched, sched_clients, NUM_CLIENTS, QUANTUM, weights, deadlines);
+    for (int i = 0; i < 8; i++) {
+        CHECK(blk_sched_deadline_next(&sched, stream_only) == STREAM);
+        blk_sched_deadline_submitted(&sched, STREAM, STREAM_COUNT);
+    }
+    CHECK(blk_sched_deadline_next(&sched, both) == LATENCY);
+    blk_sched_deadline_submitted(&sched, LATENCY, LATENCY_COUNT);
+
+    bool none[NUM_CLIENTS] = { false, false };
+    CHECK(blk_sched_deadline_next(&sched, none) == -1);
+
+    TEST_PASS("blk_sched earliest deadline first");
+}
+
+int main(void)
+{
+    test_rr_equal();
+    test_rr_weighted();
+    test_rr_eligibility();
+    test_deadline();
+
+    return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests of the buddy allocator of data cells in util/fsmalloc.c.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/util/fsmalloc.h>
+#include "test.h"
+
+#define CELL_SIZE 0x1000
+#define BASE_ADDR 0x10000000
+#define MAX_CELLS 256
+
+static fsmalloc_t fsmalloc;
+static fsmalloc_cell_t cells[MAX_CELLS];
+
+static void setup(uint64_t num_cells)
+{
+    fsmalloc_init(&fsmalloc, BASE_ADDR, CELL_SIZE, num_cells, cells);
+}
+
+static uint64_t alloc(uint64_t count)
+{
+    uintptr_t addr;
+    CHECK(!fsmalloc_alloc(&fsmalloc, &addr, count));
+    CHECK(addr >= BASE_ADDR && (addr - BASE_ADDR) % CELL_SIZE == 0);
+    return (addr - BASE_ADDR) / CELL_SIZE;
+}
+
+static void dealloc(uint64_t idx, uint64_t count)
+{
+    fsmalloc_free(&fsmalloc, BASE_ADDR + idx * CELL_SIZE, count);
+}
+
+static fsmalloc_stats_t stats(void)
+{
+    fsmalloc_stats_t s;
+    fsmalloc_stats(&fsmalloc, &s);
+    return s;
+}
+
+static void test_init(void)
+{
+    // A region that is not a power of two is made up of the largest aligned runs that fit
+    setup(100);
+    fsmalloc_stats_t s = stats();
+    CHECK(s.free_cells == 100);
+    CHECK(s.free_runs == 3);
+    CHECK(s.largest_alloc == 64);
+    CHECK(s.failed_allocs == 0);
+    CHECK(!fsmalloc_full(&fsmalloc, 64));
+    CHECK(fsmalloc_full(&fsmalloc, 65));
+    CHECK(!fsmalloc_full(&fsmalloc, 0));
+
+    TEST_PASS("fsmalloc initialisation");
+}
+
+static void test_split_merge(void)
+{
+    setup(64);
+
+    // A single cell splits the region into one run of each smaller size
+    uint64_t idx = alloc(1);
+    CHECK(idx == 0);
+    fsmalloc_stats_t s = stats();
+    CHECK(s.free_cells == 63);
+    CHECK(s.free_runs == 6);
+    CHECK(s.largest_alloc == 32);
+
+    // Further allocations take the smallest runs that fit
+    CHECK(alloc(1) == 1);
+    CHECK(alloc(2) == 2);
+    CHECK(alloc(16) == 16);
+    CHECK(stats().free_runs == 3);
+
+    // Freeing merges runs with their buddies back into the whole region
+    dealloc(1, 1);
+    dealloc(16, 16);
+    dealloc(0, 1);
+    CHECK(stats().free_runs == 5);
+    dealloc(2, 2);
+    s = stats();
+    CHECK(s.free_cells == 64);
+    CHECK(s.free_runs == 1);
+    CHECK(s.largest_alloc == 64);
+
+    TEST_PASS("fsmalloc splitting and merging");
+}
+
+static void test_rounding(void)
+{
+    setup(64);
+
+    // Three cells take a run of four aligned to four cells, the fourth is returned
+    CHECK(alloc(1) == 0);
+    CHECK(alloc(3) == 4);
+    CHECK(stats().free_cells == 60);
+    CHECK(stats().largest_alloc == 32);
+    uint64_t a = alloc(1);
+    uint64_t b = alloc(1);
+    CHECK((a == 1 && b == 7) || (a == 7 && b == 1));
+
+    // Later allocations take the smallest runs that fit
+    CHECK(alloc(2) == 2);
+    CHECK(alloc(3) == 8);
+    CHECK(stats().free_cells == 53);
+
+    // Runs can be freed together regardless of how they were allocated
+    dealloc(0, 8);
+    dealloc(8, 3);
+    CHECK(stats().free_cells == 64);
+    CHECK(stats().free_runs == 1);
+
+    TEST_PASS("fsmalloc rounding to runs of a power of two");
+}
+
+static void test_exhaustion(void)
+{
+    setup(48);
+
+    bool used[48] = { false };
+    for (uint64_t i = 0; i < 48; i++) {
+        uint64_t idx = alloc(1);
+        CHECK(idx < 48 && !used[idx]);
+        used[idx] = true;
+    }
+    CHECK(fsmalloc_full(&fsmalloc, 1));
+    uintptr_t addr;
+    CHECK(fsmalloc_alloc(&fsmalloc, &addr, 1) == -1);
+    // Not a failure due to fragmentation, as there are no free cells
+    CHECK(stats().failed_allocs == 0);
+    CHECK(stats().largest_alloc == 0);
+
+    // Freeing every other cell leaves half the region free but no two adjacent cells
+    for (uint64_t i = 0; i < 48; i += 2) {
+        dealloc(i, 1);
+    }
+    fsmalloc_stats_t s = stats();
+    CHECK(s.free_cells == 24);
+    CHECK(s.free_runs == 24);
+    CHECK(s.largest_alloc == 1);
+    CHECK(fsmalloc_full(&fsmalloc, 2));
+    CHECK(fsmalloc_alloc(&fsmalloc, &addr, 2) == -1);
+    CHECK(stats().failed_allocs == 1);
+
+    for (uint64_t i = 1; i < 48; i += 2) {
+        dealloc(i, 1);
+    }
+    s = stats();
+    CHECK(s.free_cells == 48);
+    CHECK(s.free_runs == 2);
+    CHECK(s.largest_alloc == 32);
+
+    TEST_PASS("fsmalloc exhaustion and fragmentation");
+}
+
+static void test_unaligned_free(void)
+{
+    setup(64);
+
+    // Runs freed in pieces that are not aligned to their size merge back together
+    CHECK(alloc(16) == 0);
+    dealloc(3, 7);
+    CHECK(stats().free_cells == 55);
+    dealloc(10, 6);
+    dealloc(1, 2);
+    CHECK(stats().free_cells == 63);
+    CHECK(stats().free_runs == 6);
+    CHECK(alloc(1) == 1);
+    dealloc(0, 2);
+    CHECK(stats().free_runs == 1);
+
+    // As do runs that were allocated rounded up and freed in parts
+    uint64_t idx = alloc(5);
+    CHECK(idx == 0);
+    CHECK(stats().free_cells == 59);
+    dealloc(idx + 1, 4);
+    dealloc(idx, 1);
+    CHECK(stats().free_runs == 1);
+    CHECK(stats().largest_alloc == 64);
+
+    TEST_PASS("fsmalloc freeing unaligned runs");
+}
+
+/* Simple deterministic pseudo-random numbers */
+static uint64_t rand_state = 0x2545f4914f6cdd1d;
+
+static uint64_t rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static void test_random(void)
+{
+    const uint64_t num_cells = 200;
+    setup(num_cells);
+
+    // Cells in use, checked for overlapping allocations
+    bool used[MAX_CELLS] = { false };
+    struct {
+        uint64_t idx;
+        uint64_t count;
+    } allocs[MAX_CELLS];
+    uint32_t num_allocs = 0;
+    uint64_t used_cells = 0;
+
+    for (int i = 0; i < 100000; i++) {
+        if (num_allocs > 0 && (rand_next() % 2 || num_allocs == MAX_CELLS)) {
+            uint32_t a = rand_next() % num_allocs;
+            for (uint64_t c = 0; c < allocs[a].count; c++) {
+                used[allocs[a].idx + c] = false;
+            }
+            dealloc(allocs[a].idx, allocs[a].count);
+            used_cells -= allocs[a].count;
+            allocs[a] = allocs[--num_allocs];
+        } else {
+            uint64_t count = 1 + rand_next() % 9;
+            bool full = fsmalloc_full(&fsmalloc, count);
+            uintptr_t addr;
+            int err = fsmalloc_alloc(&fsmalloc, &addr, count);
+            CHECK(!err == !full);
+            if (err) {
+                continue;
+            }
+            uint64_t idx = (addr - BASE_ADDR) / CELL_SIZE;
+            // Runs are aligned to the power of two they were rounded up to
+            uint64_t run = 1;
+            while (run < count) {
+                run *= 2;
+            }
+            CHECK(idx % run == 0 && idx + count <= num_cells);
+            for (uint64_t c = 0; c < count; c++) {
+                CHECK(!used[idx + c]);
+                used[idx + c] = true;
+            }
+            allocs[num_allocs].idx = idx;
+            allocs[num_allocs].count = count;
+            num_allocs++;
+            used_cells += count;
+        }
+        CHECK(stats().free_cells == num_cells - used_cells);
+    }
+
+    while (num_allocs > 0) {
+        num_allocs--;
+        dealloc(allocs[num_allocs].idx, allocs[num_allocs].count);
+    }
+    // The region is back to its initial runs of 128, 64 and 8 cells
+    fsmalloc_stats_t s = stats();
+    CHECK(s.free_cells == num_cells);
+    CHECK(s.free_runs == 3);
+    CHECK(s.largest_alloc == 128);
+
+    TEST_PASS("fsmalloc random allocations");
+}
+
+int main(void)
+{
+    test_init();
+    test_split_merge();
+    test_rounding();
+    test_exhaustion();
+    test_unaligned_free();
+    test_random();
+
+    return 0;
+}
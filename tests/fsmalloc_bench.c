@@ -0,0 +1,236 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Microbenchmark of the buddy allocator of data cells in util/fsmalloc.c,
+ * against the next-fit allocator it replaced, kept in bench/fsmalloc_nextfit.c.
+ *
+ * Both allocators run the same workloads: bursts of single cells allocated
+ * and freed in order, pairs of allocations and frees of mixed sizes on an
+ * empty and on a fragmented region, and random allocations and frees that
+ * keep the region about three quarters full, freed in order of allocation or
+ * at random, counting the allocations that fail.
+ *
+ * The buddy allocator rounds requests up to a power of two, so under
+ * fragmentation it fails some allocations that would fit in the free cells.
+ * The next-fit allocator only looks at the cells after the last allocation,
+ * so it fails allocations whenever those are in use.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sddf/util/fsmalloc.h>
+#include "fsmalloc_nextfit.h"
+
+#define CELL_SIZE 0x1000
+#define BASE_ADDR 0x10000000
+#define NUM_CELLS 512
+#define MAX_COUNT 16
+/* Number of cells allocated before they are freed in the single cell bursts */
+#define BURST 64
+
+#define TIMED_OPS 10000000
+#define WORKLOAD_OPS 1000000
+
+typedef struct allocator {
+    const char *name;
+    void (*init)(void);
+    int (*alloc)(uintptr_t *addr, uint64_t count);
+    void (*free)(uintptr_t addr, uint64_t count);
+} allocator_t;
+
+static fsmalloc_t buddy;
+static fsmalloc_cell_t buddy_cells[NUM_CELLS];
+
+static void buddy_init(void)
+{
+    fsmalloc_init(&buddy, BASE_ADDR, CELL_SIZE, NUM_CELLS, buddy_cells);
+}
+
+static int buddy_alloc(uintptr_t *addr, uint64_t count)
+{
+    return fsmalloc_alloc(&buddy, addr, count);
+}
+
+static void buddy_free(uintptr_t addr, uint64_t count)
+{
+    fsmalloc_free(&buddy, addr, count);
+}
+
+static fsmalloc_nextfit_t nextfit;
+static bitarray_t nextfit_bitarr;
+static word_t nextfit_words[roundup_bits2words64(NUM_CELLS)];
+
+static void nextfit_init(void)
+{
+    fsmalloc_nextfit_init(&nextfit, BASE_ADDR, CELL_SIZE, NUM_CELLS, &nextfit_bitarr, nextfit_words,
+                          roundup_bits2words64(NUM_CELLS));
+}
+
+static int nextfit_alloc(uintptr_t *addr, uint64_t count)
+{
+    return fsmalloc_nextfit_alloc(&nextfit, addr, count);
+}
+
+static void nextfit_free(uintptr_t addr, uint64_t count)
+{
+    fsmalloc_nextfit_free(&nextfit, addr, count);
+}
+
+static const allocator_t allocators[] = {
+    { "buddy", buddy_init, buddy_alloc, buddy_free },
+    { "next-fit", nextfit_init, nextfit_alloc, nextfit_free },
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/* Simple deterministic pseudo-random numbers */
+static uint64_t rand_state;
+
+static uint64_t rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Time bursts of single cells allocated and then freed in the order they were allocated */
+static void bench_bursts(const allocator_t *a)
+{
+    uintptr_t addrs[BURST];
+    a->init();
+
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < TIMED_OPS / BURST; i++) {
+        for (uint32_t j = 0; j < BURST; j++) {
+            a->alloc(&addrs[j], 1);
+        }
+        for (uint32_t j = 0; j < BURST; j++) {
+            a->free(addrs[j], 1);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("%s: bursts of %u single cells: %.1f ns per alloc and free\n", a->name, BURST,
+           (double)elapsed / (TIMED_OPS / BURST * BURST));
+}
+
+/* Time an allocation and free of a random size, on an empty region or one with cells in use throughout half of it */
+static void bench_mixed(const allocator_t *a, bool fragmented)
+{
+    a->init();
+    rand_state = 0x2545f4914f6cdd1d;
+    if (fragmented) {
+        uintptr_t addr;
+        for (uint64_t i = 0; i < NUM_CELLS / 2; i++) {
+            a->alloc(&addr, 1);
+        }
+        // Leave one cell in use in every run of 32 of the first half
+        for (uint64_t i = 0; i < NUM_CELLS / 2; i++) {
+            if (i % 32 != 0) {
+                a->free(BASE_ADDR + i * CELL_SIZE, 1);
+            }
+        }
+    }
+
+    uint64_t failed = 0;
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < TIMED_OPS; i++) {
+        uint64_t count = 1 + rand_next() % MAX_COUNT;
+        uintptr_t addr;
+        if (!a->alloc(&addr, count)) {
+            a->free(addr, count);
+        } else {
+            failed++;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("%s: mixed sizes, %s region: %.1f ns per alloc and free, %" PRIu64 " failed\n", a->name,
+           fragmented ? "fragmented" : "empty", (double)elapsed / TIMED_OPS, failed);
+}
+
+/*
+ * Count failed allocations under random allocations and frees that keep the
+ * region about three quarters full, freeing the oldest allocation or a random one.
+ */
+static void bench_failures(const allocator_t *a, bool in_order)
+{
+    static struct {
+        uintptr_t addr;
+        uint64_t count;
+    } allocs[NUM_CELLS];
+    uint32_t num_allocs = 0;
+    uint64_t used = 0;
+    uint64_t attempts = 0, failed = 0, failed_free = 0;
+
+    a->init();
+    rand_state = 0x9e3779b97f4a7c15;
+
+    for (uint32_t i = 0; i < WORKLOAD_OPS; i++) {
+        uint64_t r = rand_next();
+        uint64_t count = 1 + r % MAX_COUNT;
+
+        // Allocate less often the more cells are in use
+        if ((r >> 32) % NUM_CELLS >= used * 2 / 3) {
+            attempts++;
+            uintptr_t addr;
+            if (a->alloc(&addr, count)) {
+                failed++;
+                if (count <= NUM_CELLS - used) {
+                    failed_free++;
+                }
+            } else {
+                allocs[num_allocs].addr = addr;
+                allocs[num_allocs].count = count;
+                num_allocs++;
+                used += count;
+            }
+        } else if (num_allocs > 0) {
+            uint32_t n = in_order ? 0 : (r >> 16) % num_allocs;
+            a->free(allocs[n].addr, allocs[n].count);
+            used -= allocs[n].count;
+            if (in_order) {
+                for (uint32_t j = 1; j < num_allocs; j++) {
+                    allocs[j - 1] = allocs[j];
+                }
+                num_allocs--;
+            } else {
+                allocs[n] = allocs[--num_allocs];
+            }
+        }
+    }
+
+    printf("%s: %s frees, failed allocations of %" PRIu64 ": %" PRIu64 " (%" PRIu64 " with enough cells free)\n",
+           a->name, in_order ? "in order" : "random", attempts, failed, failed_free);
+}
+
+int main(void)
+{
+    for (uint32_t i = 0; i < NUM_ALLOCATORS; i++) {
+        bench_bursts(&allocators[i]);
+    }
+    for (uint32_t i = 0; i < NUM_ALLOCATORS; i++) {
+        bench_mixed(&allocators[i], false);
+        bench_mixed(&allocators[i], true);
+    }
+    for (uint32_t i = 0; i < NUM_ALLOCATORS; i++) {
+        bench_failures(&allocators[i], true);
+        bench_failures(&allocators[i], false);
+    }
+
+    return 0;
+}
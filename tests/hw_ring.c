@@ -0,0 +1,182 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests of the hardware ring book-keeping in sddf/network/hw_ring.h, against a
+ * fake device that walks a descriptor array the way the imx and meson NICs do:
+ * in order, and back to the first descriptor after the one marked to wrap.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sddf/network/hw_ring.h>
+#include "test.h"
+
+#define RING_SIZE 16
+
+#define DESC_READY BIT(0)
+#define DESC_WRAP BIT(1)
+
+/* Descriptor as laid out by a device */
+typedef struct fake_desc {
+    uint64_t addr;
+    uint32_t flags;
+} fake_desc_t;
+
+typedef struct fake_device {
+    fake_desc_t descs[RING_SIZE];
+    /* descriptor the device processes next */
+    uint32_t next;
+    /* number of times the driver rang the doorbell */
+    uint32_t doorbells;
+} fake_device_t;
+
+static net_hw_ring_t ring;
+static net_buff_desc_t ring_buffers[RING_SIZE];
+static fake_device_t device;
+
+static void setup(uint32_t capacity, uint32_t start)
+{
+    memset(&device, 0, sizeof(device));
+    net_hw_ring_init(&ring, ring_buffers, RING_SIZE, capacity);
+    ring.head = ring.tail = start;
+    device.next = start & (RING_SIZE - 1);
+}
+
+/* Fill descriptors for up to count buffers as the drivers do, ringing the doorbell once */
+static uint32_t driver_fill(uint64_t first_addr, uint32_t count)
+{
+    uint32_t filled = 0;
+    while (filled < count && !net_hw_ring_full(&ring)) {
+        net_buff_desc_t buffer = { first_addr + filled, 0 };
+        uint32_t slot = net_hw_ring_push(&ring, buffer);
+        uint32_t flags = DESC_READY;
+        if (net_hw_ring_last_slot(&ring, slot)) {
+            flags |= DESC_WRAP;
+        }
+        device.descs[slot].addr = buffer.io_or_offset;
+        device.descs[slot].flags = flags;
+        filled++;
+    }
+    if (filled) {
+        device.doorbells++;
+    }
+
+    return filled;
+}
+
+/* Process up to count ready descriptors, checking they hold consecutive addresses */
+static uint32_t device_process(uint64_t *next_addr, uint32_t count)
+{
+    uint32_t processed = 0;
+    while (processed < count && (device.descs[device.next].flags & DESC_READY)) {
+        fake_desc_t *d = &device.descs[device.next];
+        CHECK(d->addr == *next_addr);
+        (*next_addr)++;
+        d->flags &= ~DESC_READY;
+        device.next = (d->flags & DESC_WRAP) ? 0 : device.next + 1;
+        CHECK(device.next < RING_SIZE);
+        processed++;
+    }
+
+    return processed;
+}
+
+/* Reclaim descriptors the device has finished with, checking the buffers come back in order */
+static uint32_t driver_reclaim(uint64_t *next_addr)
+{
+    uint32_t reclaimed = 0;
+    while (!net_hw_ring_empty(&ring) && !(device.descs[net_hw_ring_head_slot(&ring)].flags & DESC_READY)) {
+        net_buff_desc_t buffer = net_hw_ring_pop(&ring);
+        CHECK(buffer.io_or_offset == *next_addr);
+        (*next_addr)++;
+        reclaimed++;
+    }
+
+    return reclaimed;
+}
+
+static void test_empty_full(void)
+{
+    setup(RING_SIZE - 1, 0);
+    CHECK(net_hw_ring_empty(&ring));
+    CHECK(!net_hw_ring_full(&ring));
+
+    CHECK(driver_fill(0, RING_SIZE) == RING_SIZE - 1);
+    CHECK(net_hw_ring_full(&ring));
+    CHECK(!net_hw_ring_empty(&ring));
+    CHECK(device.doorbells == 1);
+
+    // A ring may be limited to fewer descriptors than it has
+    setup(4, 0);
+    CHECK(driver_fill(0, RING_SIZE) == 4);
+    CHECK(net_hw_ring_full(&ring));
+
+    TEST_PASS("hw_ring empty and full");
+}
+
+static void test_slots(void)
+{
+    setup(RING_SIZE, RING_SIZE - 2);
+    CHECK(net_hw_ring_tail_slot(&ring) == RING_SIZE - 2);
+    CHECK(net_hw_ring_push(&ring, (net_buff_desc_t) { 0, 0 }) == RING_SIZE - 2);
+    CHECK(!net_hw_ring_last_slot(&ring, RING_SIZE - 2));
+    CHECK(net_hw_ring_push(&ring, (net_buff_desc_t) { 1, 0 }) == RING_SIZE - 1);
+    CHECK(net_hw_ring_last_slot(&ring, RING_SIZE - 1));
+    CHECK(net_hw_ring_push(&ring, (net_buff_desc_t) { 2, 0 }) == 0);
+    CHECK(net_hw_ring_tail_slot(&ring) == 1);
+
+    CHECK(net_hw_ring_head_slot(&ring) == RING_SIZE - 2);
+    CHECK(net_hw_ring_pop(&ring).io_or_offset == 0);
+    CHECK(net_hw_ring_pop(&ring).io_or_offset == 1);
+    CHECK(net_hw_ring_head_slot(&ring) == 0);
+    CHECK(net_hw_ring_pop(&ring).io_or_offset == 2);
+    CHECK(net_hw_ring_empty(&ring));
+
+    TEST_PASS("hw_ring slots");
+}
+
+/*
+ * Run bursts of varying sizes through the ring for several laps, starting
+ * from a given index so that the free running indices also wrap around.
+ */
+static void run_bursts(uint32_t start)
+{
+    setup(RING_SIZE - 1, start);
+
+    uint64_t filled = 0;
+    uint64_t device_addr = 0;
+    uint64_t reclaimed_addr = 0;
+    uint32_t bursts = 0;
+    for (uint32_t i = 0; reclaimed_addr < RING_SIZE * 20; i++) {
+        uint32_t n = driver_fill(filled, 1 + i % 7);
+        filled += n;
+        bursts += n != 0;
+        device_process(&device_addr, 1 + i % 5);
+        driver_reclaim(&reclaimed_addr);
+        CHECK(ring.tail - ring.head <= ring.capacity);
+    }
+    CHECK(device.doorbells == bursts);
+    CHECK(bursts < filled);
+}
+
+static void test_bursts(void)
+{
+    run_bursts(0);
+    run_bursts(RING_SIZE - 3);
+    run_bursts(UINT32_MAX - RING_SIZE / 2);
+
+    TEST_PASS("hw_ring bursts against a fake device");
+}
+
+int main(void)
+{
+    test_empty_full();
+    test_slots();
+    test_bursts();
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests of the i.MX ENET interrupt coalescing in drivers/network/imx, against
+ * a register block in memory standing in for the device.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "coalesce.h"
+#include "test.h"
+
+/* Value written to a register to detect whether it was written since */
+#define UNWRITTEN 0xdeadbeef
+
+static struct enet_regs regs;
+
+/* Fields of a coalescing register */
+static uint32_t reg_frames(uint32_t reg)
+{
+    return (reg >> 20) & 0xff;
+}
+
+static uint32_t reg_ticks(uint32_t reg)
+{
+    return reg & 0xffff;
+}
+
+static void test_layout(void)
+{
+    CHECK(offsetof(struct enet_regs, txic0) == 0xf0);
+    CHECK(offsetof(struct enet_regs, rxic0) == 0x100);
+
+    TEST_PASS("imx coalescing register offsets");
+}
+
+static void test_encoding(void)
+{
+    // A threshold of a single frame interrupts on every frame, which is no coalescing at all
+    CHECK(coalesce_reg(0, 100) == 0);
+    CHECK(coalesce_reg(1, 100) == 0);
+
+    // The previous fixed transmit setting of 128 frames or about 130us
+    uint32_t reg = coalesce_reg(128, 130);
+    CHECK(reg & ICEN);
+    CHECK(reg_frames(reg) == 128);
+    CHECK(reg_ticks(reg) == 130 * IC_CLK_MHZ / 64);
+
+    CHECK(reg_frames(coalesce_reg(255, 0)) == 255);
+    // The timer must not be left at zero
+    CHECK(reg_ticks(coalesce_reg(2, 0)) == 1);
+
+    // The longest time fits the timer field without wrapping, rounding down loses at most two ticks
+    reg = coalesce_reg(16, IC_USECS_MAX);
+    CHECK(reg_ticks(reg) == IC_USECS_MAX * IC_CLK_MHZ / 64);
+    CHECK(reg_ticks(reg) >= 0xffff - 2);
+    CHECK(reg_frames(reg) == 16);
+    CHECK((reg & ~(ICEN | ICFT(0xff) | ICTT(0xffff))) == 0);
+
+    TEST_PASS("imx coalescing register encoding");
+}
+
+/* Take a window of receive interrupts that each harvest the given number of packets */
+static void interrupts(coalesce_t *c, uint32_t packets)
+{
+    for (int i = 0; i < COALESCE_WINDOW; i++) {
+        coalesce_adapt(c, &regs, packets);
+    }
+}
+
+static void test_adaptive(void)
+{
+    coalesce_t c;
+    memset(&regs, 0, sizeof(regs));
+    regs.rxic0 = UNWRITTEN;
+    coalesce_init(&c, &regs, 64, 200);
+
+    // The lowest level of 64 >> 6 frames is no coalescing
+    CHECK(c.level == 0);
+    CHECK(regs.rxic0 == 0);
+
+    // A level is only adjusted at the end of a window, and not written while it stays the same
+    regs.rxic0 = UNWRITTEN;
+    interrupts(&c, 1);
+    CHECK(c.level == 0);
+    CHECK(regs.rxic0 == UNWRITTEN);
+    for (int i = 0; i < COALESCE_WINDOW - 1; i++) {
+        coalesce_adapt(&c, &regs, 64);
+    }
+    CHECK(regs.rxic0 == UNWRITTEN);
+    coalesce_adapt(&c, &regs, 64);
+    CHECK(c.level == 1);
+
+    // Under load the levels step up to the configured thresholds and no further
+    uint32_t expected_frames[] = { 1, 4, 16, 64 };
+    uint32_t expected_usecs[] = { 3, 12, 50, 200 };
+    for (uint32_t level = 1; level < COALESCE_LEVELS; level++) {
+        CHECK(c.level == level);
+        CHECK(reg_frames(regs.rxic0) == expected_frames[level]);
+        CHECK(reg_ticks(regs.rxic0) == expected_usecs[level] * IC_CLK_MHZ / 64);
+        interrupts(&c, expected_frames[level]);
+    }
+    CHECK(c.level == COALESCE_LEVELS - 1);
+    regs.rxic0 = UNWRITTEN;
+    interrupts(&c, 255);
+    CHECK(c.level == COALESCE_LEVELS - 1);
+    CHECK(regs.rxic0 == UNWRITTEN);
+
+    // Harvesting about half the threshold holds the level
+    interrupts(&c, 32);
+    CHECK(c.level == COALESCE_LEVELS - 1);
+
+    // When load drops the levels step down to no coalescing
+    for (uint32_t level = COALESCE_LEVELS - 1; level > 0; level--) {
+        interrupts(&c, 1);
+        CHECK(c.level == level - 1);
+    }
+    CHECK(regs.rxic0 == 0);
+    interrupts(&c, 0);
+    CHECK(c.level == 0);
+
+    TEST_PASS("imx adaptive receive coalescing");
+}
+
+int main(void)
+{
+    test_layout();
+    test_encoding();
+    test_adaptive();
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Stand-in for the Microkit SDK's microkit.h, for building sDDF code on the
+ * host. It only declares what the code under test uses, and the tests define
+ * any of the functions they call.
+ */
+
+#pragma once
+
+/* Use the host's assert, so that failed assertions in sDDF code abort the test */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef unsigned long seL4_Word;
+typedef unsigned int microkit_channel;
+
+extern char microkit_name[];
+
+void microkit_notify(microkit_channel ch);
+void microkit_deferred_notify(microkit_channel ch);
+void microkit_irq_ack(microkit_channel ch);
+void microkit_dbg_puts(const char *s);
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Network configuration for running the virtualisers on the host. Queues are
+ * kept small so that the buffers used for local switching lie beyond any
+ * client's queue size, and there are three clients so that a broadcast has
+ * more than one recipient besides its sender.
+ */
+
+#pragma once
+
+#include <microkit.h>
+#include <sddf/util/string.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/stats.h>
+#include <sddf/util/util.h>
+
+#define NET_TRACE                               0
+
+#define NUM_NETWORK_CLIENTS                     3
+
+#define NET_VIRT_RX_NAME                        "net_virt_rx"
+#define NET_VIRT_TX_NAME                        "net_virt_tx"
+
+#define MAC_ADDR_CLI0                           0x525401000001
+#define MAC_ADDR_CLI1                           0x525401000002
+#define MAC_ADDR_CLI2                           0x525401000003
+
+#define NET_VLAN                                0
+
+#define NET_RX_QUEUE_SIZE_DRIV                  16
+#define NET_RX_QUEUE_SIZE_CLI                   8
+#define NET_MAX_CLIENT_QUEUE_SIZE               NET_RX_QUEUE_SIZE_CLI
+#define NET_RX_DATA_REGION_SIZE_DRIV            0x20000
+
+#define NET_RX_OVERLOAD_TAIL_DROP               0
+#define NET_RX_OVERLOAD_OLDEST_DROP             1
+#define NET_RX_OVERLOAD_POLICY                  NET_RX_OVERLOAD_TAIL_DROP
+#define NET_RX_CLIENT_LIMIT                     NET_RX_QUEUE_SIZE_CLI
+
+#define NET_RX_RECYCLE                          0
+
+#define NET_VIRT_RX_BURST                       4
+
+#define NET_LOCAL_SWITCH                        1
+#define NET_LOCAL_QUEUE_SIZE                    8
+#define NET_RX_SLOTS_DRIV                       (NET_RX_QUEUE_SIZE_DRIV + NET_LOCAL_QUEUE_SIZE)
+
+_Static_assert(NET_RX_SLOTS_DRIV *NET_BUFFER_SIZE <= NET_RX_DATA_REGION_SIZE_DRIV,
+               "Driver RX data region size must fit the buffers of the driver and of local switching");
+
+#define NET_VIRT_SPIN                           0
+#define NET_CAPTURE                             0
+
+#define NET_STATS_VIRT_RX                       0
+#define NET_STATS_NUM_SLOTS                     1
+
+/* Distance between the queues of consecutive clients */
+#define NET_CLI_QUEUE_REGION_SIZE               0x1000
+
+static void __net_set_mac_addr(uint8_t *mac, uint64_t val)
+{
+    mac[0] = val >> 40 & 0xff;
+    mac[1] = val >> 32 & 0xff;
+    mac[2] = val >> 24 & 0xff;
+    mac[3] = val >> 16 & 0xff;
+    mac[4] = val >> 8 & 0xff;
+    mac[5] = val & 0xff;
+}
+
+static inline void net_virt_mac_addr_init_sys(char *pd_name, uint8_t *macs)
+{
+    if (!sddf_strcmp(pd_name, NET_VIRT_RX_NAME) || !sddf_strcmp(pd_name, NET_VIRT_TX_NAME)) {
+        __net_set_mac_addr(macs, MAC_ADDR_CLI0);
+        __net_set_mac_addr(&macs[ETH_HWADDR_LEN], MAC_ADDR_CLI1);
+        __net_set_mac_addr(&macs[2 * ETH_HWADDR_LEN], MAC_ADDR_CLI2);
+    }
+}
+
+static inline void net_virt_queue_init_sys(char *pd_name, net_queue_handle_t *cli_queue, net_queue_t *cli_free,
+                                           net_queue_t *cli_active)
+{
+    if (!sddf_strcmp(pd_name, NET_VIRT_RX_NAME)) {
+        for (int i = 0; i < NUM_NETWORK_CLIENTS; i++) {
+            net_queue_init(&cli_queue[i], (net_queue_t *)((uintptr_t)cli_free + i * NET_CLI_QUEUE_REGION_SIZE),
+                           (net_queue_t *)((uintptr_t)cli_active + i * NET_CLI_QUEUE_REGION_SIZE),
+                           NET_RX_QUEUE_SIZE_CLI);
+        }
+    }
+}
+
+static inline net_stats_t *net_stats_init_sys(char *pd_name, net_stats_t *stats_region)
+{
+    if (!sddf_strcmp(pd_name, NET_VIRT_RX_NAME)) {
+        return &stats_region[NET_STATS_VIRT_RX];
+    }
+    return NULL;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests of the RX virtualiser in network/components/virt_rx.c with local
+ * switching enabled, configured by net/ethernet_config.h. The test plays the
+ * driver, the TX virtualiser and the clients, and checks where each buffer
+ * ends up.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <microkit.h>
+#include <sddf/network/queue.h>
+#include <ethernet_config.h>
+#include "test.h"
+
+/* Notification channels of the RX virtualiser */
+#define DRIVER_CH 0
+#define CLIENT_CH 1
+#define LOCAL_CH (CLIENT_CH + NUM_NETWORK_CLIENTS + 1)
+
+/* Where the driver's RX data region would be mapped into the device */
+#define DATA_PADDR 0x40000000
+
+/* Regions of the RX virtualiser */
+extern net_queue_t *rx_free_drv;
+extern net_queue_t *rx_active_drv;
+extern net_queue_t *rx_free_cli0;
+extern net_queue_t *rx_active_cli0;
+extern net_queue_t *rx_free_local;
+extern net_queue_t *rx_active_local;
+extern uintptr_t buffer_data_vaddr;
+extern uintptr_t buffer_data_paddr;
+extern net_stats_t *net_stats;
+
+void init(void);
+void notified(microkit_channel ch);
+
+char microkit_name[] = NET_VIRT_RX_NAME;
+
+static uint8_t queue_region[4][NUM_NETWORK_CLIENTS * NET_CLI_QUEUE_REGION_SIZE] __attribute__((aligned(64)));
+static uint8_t data_region[NET_RX_DATA_REGION_SIZE_DRIV] __attribute__((aligned(64)));
+static net_stats_t stats_region[NET_STATS_NUM_SLOTS];
+
+/* Queues as seen by the driver, the TX virtualiser and each client */
+static net_queue_handle_t drv_queue;
+static net_queue_handle_t local_queue;
+static net_queue_handle_t cli_queues[NUM_NETWORK_CLIENTS];
+
+/* Number of notifications the RX virtualiser sent on each channel */
+static uint32_t notifications[LOCAL_CH + 1];
+
+void microkit_notify(microkit_channel ch)
+{
+    CHECK(ch <= LOCAL_CH);
+    notifications[ch]++;
+}
+
+void microkit_deferred_notify(microkit_channel ch)
+{
+    microkit_notify(ch);
+}
+
+void cache_clean_and_invalidate(unsigned long start, unsigned long end)
+{
+}
+
+static void setup(void)
+{
+    memset(queue_region, 0, sizeof(queue_region));
+    rx_free_drv = (net_queue_t *)queue_region[0];
+    rx_active_drv = (net_queue_t *)(queue_region[0] + NET_CLI_QUEUE_REGION_SIZE);
+    rx_free_local = (net_queue_t *)(queue_region[1]);
+    rx_active_local = (net_queue_t *)(queue_region[1] + NET_CLI_QUEUE_REGION_SIZE);
+    rx_free_cli0 = (net_queue_t *)queue_region[2];
+    rx_active_cli0 = (net_queue_t *)queue_region[3];
+    buffer_data_vaddr = (uintptr_t)data_region;
+    buffer_data_paddr = DATA_PADDR;
+    net_stats = stats_region;
+
+    init();
+    CHECK(notifications[DRIVER_CH] == 1);
+
+    net_queue_init(&drv_queue, rx_free_drv, rx_active_drv, NET_RX_QUEUE_SIZE_DRIV);
+    net_queue_init(&local_queue, rx_free_local, rx_active_local, NET_LOCAL_QUEUE_SIZE);
+    for (int i = 0; i < NUM_NETWORK_CLIENTS; i++) {
+        net_queue_init(&cli_queues[i], (net_queue_t *)(queue_region[2] + i * NET_CLI_QUEUE_REGION_SIZE),
+                       (net_queue_t *)(queue_region[3] + i * NET_CLI_QUEUE_REGION_SIZE), NET_RX_QUEUE_SIZE_CLI);
+    }
+}
+
+/* Write a frame from one client's MAC address to another's, or to broadcast if dest is -1 */
+static uint16_t write_frame(uint64_t offset, int src, int dest)
+{
+    static const uint64_t macs[] = { MAC_ADDR_CLI0, MAC_ADDR_CLI1, MAC_ADDR_CLI2 };
+    struct ethernet_header *frame = (struct ethernet_header *)(data_region + offset);
+    if (dest < 0) {
+        memset(frame->dest.addr, 0xff, ETH_HWADDR_LEN);
+    } else {
+        __net_set_mac_addr(frame->dest.addr, macs[dest]);
+    }
+    __net_set_mac_addr(frame->src.addr, macs[src]);
+    frame->type = 0x0008;
+
+    return 60;
+}
+
+/* Switch a frame from a client as the TX virtualiser does */
+static net_buff_desc_t tx_virt_switch(int src, int dest)
+{
+    net_buff_desc_t buffer;
+    CHECK(!net_dequeue_free(&local_queue, &buffer));
+    CHECK(buffer.io_or_offset >= NET_RX_QUEUE_SIZE_DRIV * NET_BUFFER_SIZE);
+    buffer.len = write_frame(buffer.io_or_offset, src, dest);
+    buffer.src_client = src;
+    CHECK(!net_enqueue_active(&local_queue, buffer));
+    return buffer;
+}
+
+/* Receive a frame as the driver does */
+static net_buff_desc_t driver_receive(int src, int dest)
+{
+    net_buff_desc_t buffer;
+    CHECK(!net_dequeue_free(&drv_queue, &buffer));
+    buffer.len = write_frame(buffer.io_or_offset - DATA_PADDR, src, dest);
+    CHECK(!net_enqueue_active(&drv_queue, buffer));
+    return buffer;
+}
+
+/* Check that a client was given a buffer, and free it as the client would */
+static void client_free(int client, uint64_t offset)
+{
+    net_buff_desc_t buffer;
+    CHECK(!net_dequeue_active(&cli_queues[client], &buffer));
+    CHECK(buffer.io_or_offset == offset);
+    net_buff_reset(&buffer);
+    CHECK(!net_enqueue_free(&cli_queues[client], buffer));
+    notified(CLIENT_CH + client);
+}
+
+static void test_switch_unicast(void)
+{
+    uint32_t local_free = net_queue_size(local_queue.free);
+    uint32_t drv_free = net_queue_size(drv_queue.free);
+
+    net_buff_desc_t buffer = tx_virt_switch(0, 2);
+    notified(LOCAL_CH);
+    CHECK(net_queue_empty_active(&cli_queues[0]));
+    CHECK(net_queue_empty_active(&cli_queues[1]));
+    CHECK(notifications[CLIENT_CH + 2] == 1);
+    CHECK(net_queue_size(local_queue.free) == local_free - 1);
+
+    // The buffer goes back to the TX virtualiser rather than to the driver
+    client_free(2, buffer.io_or_offset);
+    CHECK(net_queue_size(local_queue.free) == local_free);
+    CHECK(net_queue_size(drv_queue.free) == drv_free);
+
+    TEST_PASS("virt_rx switched unicast frame");
+}
+
+static void test_switch_broadcast(void)
+{
+    uint32_t local_free = net_queue_size(local_queue.free);
+
+    // The sender does not receive its own broadcast back
+    net_buff_desc_t buffer = tx_virt_switch(1, -1);
+    notified(LOCAL_CH);
+    CHECK(net_queue_empty_active(&cli_queues[1]));
+    CHECK(net_queue_size(cli_queues[0].active) == 1);
+    CHECK(net_queue_size(cli_queues[2].active) == 1);
+
+    // The buffer is only returned once every recipient has freed it
+    client_free(0, buffer.io_or_offset);
+    CHECK(net_queue_size(local_queue.free) == local_free - 1);
+    client_free(2, buffer.io_or_offset);
+    CHECK(net_queue_size(local_queue.free) == local_free);
+
+    TEST_PASS("virt_rx switched broadcast frame");
+}
+
+static void test_received_broadcast(void)
+{
+    uint32_t drv_free = net_queue_size(drv_queue.free);
+    uint32_t drv_notifications = notifications[DRIVER_CH];
+    net_request_signal_free(&drv_queue);
+
+    // A broadcast received from the network goes to every client, including one with the source address
+    net_buff_desc_t buffer = driver_receive(1, -1);
+    buffer.io_or_offset -= DATA_PADDR;
+    notified(DRIVER_CH);
+    for (int i = 0; i < NUM_NETWORK_CLIENTS; i++) {
+        CHECK(net_queue_size(cli_queues[i].active) == 1);
+    }
+    for (int i = 0; i < NUM_NETWORK_CLIENTS; i++) {
+        CHECK(net_queue_size(drv_queue.free) == drv_free - 1);
+        client_free(i, buffer.io_or_offset);
+    }
+    CHECK(net_queue_size(drv_queue.free) == drv_free);
+    CHECK(notifications[DRIVER_CH] == drv_notifications + 1);
+
+    TEST_PASS("virt_rx received broadcast frame");
+}
+
+static void test_switch_all(void)
+{
+    uint32_t local_free = net_queue_size(local_queue.free);
+
+    // Cycle every switching buffer through a client several times, as well as receiving from the driver
+    for (int i = 0; i < 4 * NET_LOCAL_QUEUE_SIZE; i++) {
+        int src = i % NUM_NETWORK_CLIENTS;
+        int dest = (i + 1) % NUM_NETWORK_CLIENTS;
+        net_buff_desc_t switched = tx_virt_switch(src, dest);
+        net_buff_desc_t received = driver_receive(src, dest);
+        received.io_or_offset -= DATA_PADDR;
+        notified(LOCAL_CH);
+        // Frames from the driver are delivered ahead of switched frames in the same burst
+        client_free(dest, received.io_or_offset);
+        client_free(dest, switched.io_or_offset);
+    }
+    CHECK(net_queue_size(local_queue.free) == local_free);
+    CHECK(net_queue_size(drv_queue.free) == NET_RX_QUEUE_SIZE_DRIV - 1);
+    CHECK(stats_region[NET_STATS_VIRT_RX].drops[NET_STATS_DROP_NO_MATCH] == 0);
+
+    TEST_PASS("virt_rx cycling switched and received buffers");
+}
+
+int main(void)
+{
+    setup();
+    test_switch_unicast();
+    test_switch_broadcast();
+    test_received_broadcast();
+    test_switch_all();
+
+    return 0;
+}
@@ -0,0 +1,636 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Stress test of the sDDF queues. For each queue type a producer and a
+ * consumer run on their own threads, standing in for protection domains on
+ * different cores, and pass ITERATIONS entries through the queues as fast as
+ * they can. The consumer checks that every entry arrives once, in order and
+ * with the data the producer wrote, including data written outside the queue
+ * before the entry was enqueued.
+ *
+ * Where a queue has signalling flags, a side that finds the queue empty (or
+ * full) requests a signal and waits for it as a protection domain would. A
+ * wakeup lost between the two sides leaves one waiting for good, so a wait
+ * that times out fails the test.
+ *
+ * Build with SANITIZE=thread to have ThreadSanitizer check for data races.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sddf/blk/queue.h>
+#include <sddf/i2c/queue.h>
+#include <sddf/network/capture.h>
+#include <sddf/network/queue.h>
+#include <sddf/serial/queue.h>
+#include <sddf/sound/queue.h>
+#include "test.h"
+
+#define ITERATIONS (1 << 20)
+
+/* Seconds to wait for a signal before taking it as lost */
+#define WAKEUP_TIMEOUT 10
+
+/* Maximum number of entries enqueued or dequeued at once */
+#define BURST 8
+
+/* Binary notification, as delivered to a protection domain */
+typedef struct notification {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool signalled;
+} notification_t;
+
+#define NOTIFICATION_INIT { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false }
+
+static void notify(notification_t *ntfn)
+{
+    pthread_mutex_lock(&ntfn->lock);
+    ntfn->signalled = true;
+    pthread_cond_signal(&ntfn->cond);
+    pthread_mutex_unlock(&ntfn->lock);
+}
+
+static void wait_notification(notification_t *ntfn, const char *who)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += WAKEUP_TIMEOUT;
+
+    pthread_mutex_lock(&ntfn->lock);
+    while (!ntfn->signalled) {
+        if (pthread_cond_timedwait(&ntfn->cond, &ntfn->lock, &deadline) == ETIMEDOUT) {
+            fprintf(stderr, "%s: lost wakeup\n", who);
+            exit(1);
+        }
+    }
+    ntfn->signalled = false;
+    pthread_mutex_unlock(&ntfn->lock);
+}
+
+/* Wait for the other side to make progress on a queue without signalling */
+static void poll_wait(void)
+{
+    sched_yield();
+}
+
+static void run(const char *name, void *(*producer)(void *), void *(*consumer)(void *))
+{
+    pthread_t threads[2];
+    CHECK(!pthread_create(&threads[0], NULL, producer, NULL));
+    CHECK(!pthread_create(&threads[1], NULL, consumer, NULL));
+    CHECK(!pthread_join(threads[0], NULL));
+    CHECK(!pthread_join(threads[1], NULL));
+    TEST_PASS(name);
+}
+
+/*
+ * Network: buffers circulate between a driver, which takes free buffers and
+ * returns them filled in bursts, and a client, which returns them to the free
+ * queue once it has checked their data.
+ */
+
+#define NET_QUEUE_SIZE 512
+
+static net_queue_handle_t net_h;
+static uint64_t net_data[NET_QUEUE_SIZE];
+static notification_t net_drv_ntfn = NOTIFICATION_INIT;
+static notification_t net_cli_ntfn = NOTIFICATION_INIT;
+
+static void *net_driver(void *arg)
+{
+    uint64_t seq = 0;
+    while (seq < ITERATIONS) {
+        net_buff_desc_t buffers[BURST];
+        uint32_t count = 0;
+        while (count < BURST && seq + count < ITERATIONS && !net_dequeue_free(&net_h, &buffers[count])) {
+            uint64_t idx = buffers[count].io_or_offset / NET_BUFFER_SIZE;
+            CHECK(idx < NET_QUEUE_SIZE);
+            net_data[idx] = seq + count;
+            buffers[count].len = (seq + count) % NET_BUFFER_SIZE;
+            count++;
+        }
+
+        if (count == 0) {
+            net_request_signal_free(&net_h);
+            if (!net_queue_empty_free(&net_h)) {
+                net_cancel_signal_free(&net_h);
+                continue;
+            }
+            wait_notification(&net_drv_ntfn, "net driver");
+            continue;
+        }
+
+        CHECK(!net_enqueue_active_burst(&net_h, buffers, count));
+        seq += count;
+        if (net_require_signal_active(&net_h)) {
+            net_cancel_signal_active(&net_h);
+            notify(&net_cli_ntfn);
+        }
+    }
+
+    return NULL;
+}
+
+static void *net_client(void *arg)
+{
+    uint64_t seq = 0;
+    while (seq < ITERATIONS) {
+        net_buff_desc_t buffer;
+        if (net_dequeue_active(&net_h, &buffer)) {
+            net_request_signal_active(&net_h);
+            if (!net_queue_empty_active(&net_h)) {
+                net_cancel_signal_active(&net_h);
+                continue;
+            }
+            wait_notification(&net_cli_ntfn, "net client");
+            continue;
+        }
+
+        uint64_t idx = buffer.io_or_offset / NET_BUFFER_SIZE;
+        CHECK(idx < NET_QUEUE_SIZE);
+        CHECK(net_data[idx] == seq);
+        CHECK(buffer.len == seq % NET_BUFFER_SIZE);
+        seq++;
+
+        net_buff_reset(&buffer);
+        CHECK(!net_enqueue_free(&net_h, buffer));
+        if (net_require_signal_free(&net_h)) {
+            net_cancel_signal_free(&net_h);
+            notify(&net_drv_ntfn);
+        }
+    }
+
+    return NULL;
+}
+
+static void test_net(void)
+{
+    net_queue_t *free_queue = calloc(1, sizeof(net_queue_t) + NET_QUEUE_SIZE * sizeof(net_buff_desc_t));
+    net_queue_t *active_queue = calloc(1, sizeof(net_queue_t) + NET_QUEUE_SIZE * sizeof(net_buff_desc_t));
+    CHECK(free_queue && active_queue);
+    // Start the indices close to wrapping around
+    free_queue->head = free_queue->tail = UINT16_MAX - NET_QUEUE_SIZE / 2;
+    active_queue->head = active_queue->tail = UINT16_MAX - NET_QUEUE_SIZE / 2;
+    net_queue_init(&net_h, free_queue, active_queue, NET_QUEUE_SIZE);
+    net_buffers_init(&net_h, 0);
+    CHECK(net_queue_full_free(&net_h));
+
+    run("net", net_driver, net_client);
+
+    free(free_queue);
+    free(active_queue);
+}
+
+/*
+ * Serial: a stream of characters, with the producer waiting for a signal when
+ * the queue is full and the consumer when it is empty.
+ */
+
+#define SERIAL_QUEUE_SIZE 256
+
+static serial_queue_handle_t serial_h;
+static notification_t serial_prod_ntfn = NOTIFICATION_INIT;
+static notification_t serial_cons_ntfn = NOTIFICATION_INIT;
+
+static char serial_char(uint64_t seq)
+{
+    return (char)(seq % 251);
+}
+
+static void *serial_producer(void *arg)
+{
+    uint64_t seq = 0;
+    while (seq < ITERATIONS) {
+        uint32_t local_tail = serial_h.queue->tail;
+        uint32_t count = 0;
+        while (count < BURST && seq < ITERATIONS && !serial_enqueue(&serial_h, &local_tail, serial_char(seq))) {
+            count++;
+            seq++;
+        }
+
+        if (count == 0) {
+            serial_request_producer_signal(&serial_h);
+            if (!serial_queue_full(&serial_h, serial_h.queue->tail)) {
+                serial_cancel_producer_signal(&serial_h);
+                continue;
+            }
+            wait_notification(&serial_prod_ntfn, "serial producer");
+            continue;
+        }
+
+        serial_update_visible_tail(&serial_h, local_tail);
+        if (serial_require_consumer_signal(&serial_h)) {
+            serial_cancel_consumer_signal(&serial_h);
+            notify(&serial_cons_ntfn);
+        }
+    }
+
+    return NULL;
+}
+
+static void *serial_consumer(void *arg)
+{
+    uint64_t seq = 0;
+    while (seq < ITERATIONS) {
+        uint32_t local_head = serial_h.queue->head;
+        uint32_t count = 0;
+        char c;
+        while (count < BURST && !serial_dequeue(&serial_h, &local_head, &c)) {
+            CHECK(c == serial_char(seq));
+            count++;
+            seq++;
+        }
+
+        if (count == 0) {
+            serial_request_consumer_signal(&serial_h);
+            if (!serial_queue_empty(&serial_h, serial_h.queue->head)) {
+                serial_cancel_consumer_signal(&serial_h);
+                continue;
+            }
+            wait_notification(&serial_cons_ntfn, "serial consumer");
+            continue;
+        }
+
+        serial_update_visible_head(&serial_h, local_head);
+        if (serial_require_producer_signal(&serial_h)) {
+            serial_cancel_producer_signal(&serial_h);
+            notify(&serial_prod_ntfn);
+        }
+    }
+
+    return NULL;
+}
+
+static void test_serial(void)
+{
+    serial_queue_t *queue = calloc(1, sizeof(serial_queue_t));
+    char *data = calloc(1, SERIAL_QUEUE_SIZE);
+    CHECK(queue && data);
+    queue->head = queue->tail = UINT32_MAX - SERIAL_QUEUE_SIZE / 2;
+    serial_queue_init(&serial_h, queue, SERIAL_QUEUE_SIZE, data);
+
+    run("serial", serial_producer, serial_consumer);
+
+    free(queue);
+    free(data);
+}
+
+/*
+ * Block: a client keeps the request queue as full as it can and a device
+ * answers each request, so both directions are loaded at once.
+ */
+
+#define BLK_QUEUE_SIZE 128
+
+static blk_queue_handle_t blk_h;
+
+static void *blk_client(void *arg)
+{
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    while (received < ITERATIONS) {
+        bool progress = false;
+        while (sent < ITERATIONS && sent - received < BLK_QUEUE_SIZE - 1
+               && !blk_enqueue_req(&blk_h, sent % 4, sent * 3, (uint32_t)sent, (uint16_t)sent, (uint32_t)sent)) {
+            sent++;
+            progress = true;
+        }
+
+        blk_resp_status_t status;
+        uint16_t success_count;
+        uint32_t id;
+        while (!blk_dequeue_resp(&blk_h, &status, &success_count, &id)) {
+            CHECK(id == (uint32_t)received);
+            CHECK(status == received % 2);
+            CHECK(success_count == (uint16_t)received);
+            received++;
+            progress = true;
+        }
+
+        if (!progress) {
+            poll_wait();
+        }
+    }
+
+    return NULL;
+}
+
+static void *blk_device(void *arg)
+{
+    uint64_t seq = 0;
+    while (seq < ITERATIONS) {
+        blk_req_code_t code;
+        uintptr_t io_or_offset;
+        uint32_t block_number;
+        uint16_t count;
+        uint32_t id;
+        if (blk_queue_full_resp(&blk_h) || blk_dequeue_req(&blk_h, &code, &io_or_offset, &block_number, &count, &id)) {
+            poll_wait();
+            continue;
+        }
+
+        CHECK(code == seq % 4);
+        CHECK(io_or_offset == seq * 3);
+        CHECK(block_number == (uint32_t)seq);
+        CHECK(count == (uint16_t)seq);
+        CHECK(id == (uint32_t)seq);
+        CHECK(!blk_enqueue_resp(&blk_h, seq % 2, count, id));
+        seq++;
+    }
+
+    return NULL;
+}
+
+static void test_blk(void)
+{
+    blk_req_queue_t *req = calloc(1, sizeof(blk_req_queue_t) + BLK_QUEUE_SIZE * sizeof(blk_req_t));
+    blk_resp_queue_t *resp = calloc(1, sizeof(blk_resp_queue_t) + BLK_QUEUE_SIZE * sizeof(blk_resp_t));
+    CHECK(req && resp);
+    req->head = req->tail = resp->head = resp->tail = UINT32_MAX - BLK_QUEUE_SIZE / 2;
+    blk_queue_init(&blk_h, req, resp, BLK_QUEUE_SIZE);
+
+    run("blk", blk_client, blk_device);
+
+    free(req);
+    free(resp);
+}
+
+/* I2C: as for block, with the fixed size I2C queues */
+
+static i2c_queue_handle_t i2c_h;
+
+static void *i2c_client(void *arg)
+{
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    while (received < ITERATIONS) {
+        bool progress = false;
+        while (sent < ITERATIONS && sent - received < NUM_QUEUE_ENTRIES - 1
+               && !i2c_enqueue_request(i2c_h, sent % 128, sent, sent % I2C_MAX_DATA_SIZE)) {
+            sent++;
+            progress = true;
+        }
+
+        size_t bus_address;
+        size_t offset;
+        unsigned int len;
+        while (!i2c_dequeue_response(i2c_h, &bus_address, &offset, &len)) {
+            CHECK(bus_address == received % 128);
+            CHECK(offset == received);
+            CHECK(len == received % I2C_MAX_DATA_SIZE);
+            received++;
+            progress = true;
+        }
+
+        if (!progress) {
+            poll_wait();
+        }
+    }
+
+    return NULL;
+}
+
+static void *i2c_device(void *arg)
+{
+    uint64_t seq = 0;
+    while (seq < ITERATIONS) {
+        size_t bus_address;
+        size_t offset;
+        unsigned int len;
+        if (i2c_queue_full(i2c_h.response) || i2c_dequeue_request(i2c_h, &bus_address, &offset, &len)) {
+            poll_wait();
+            continue;
+        }
+
+        CHECK(bus_address == seq % 128);
+        CHECK(offset == seq);
+        CHECK(len == seq % I2C_MAX_DATA_SIZE);
+        CHECK(!i2c_enqueue_response(i2c_h, bus_address, offset, len));
+        seq++;
+    }
+
+    return NULL;
+}
+
+static void test_i2c(void)
+{
+    i2c_queue_t *request = calloc(1, sizeof(i2c_queue_t));
+    i2c_queue_t *response = calloc(1, sizeof(i2c_queue_t));
+    CHECK(request && response);
+    i2c_h = i2c_queue_init(request, response);
+
+    run("i2c", i2c_client, i2c_device);
+
+    free(request);
+    free(response);
+}
+
+/* Sound: PCM buffers are sent and returned, with a command after every PCM_PER_CMD buffers */
+
+#define PCM_PER_CMD 16
+
+static sound_queues_t sound_qs;
+
+static void *sound_client(void *arg)
+{
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t cmds_received = 0;
+    while (received < ITERATIONS) {
+        bool progress = false;
+        while (sent < ITERATIONS && sent - received < SOUND_PCM_QUEUE_SIZE) {
+            if (sent % PCM_PER_CMD == 0) {
+                sound_cmd_t cmd = { .code = SOUND_CMD_START, .cookie = (uint32_t)sent, .stream_id = 1 };
+                if (sound_enqueue_cmd(&sound_qs.cmd_req, &cmd)) {
+                    break;
+                }
+            }
+            sound_pcm_t pcm = { .cookie = (uint32_t)sent, .stream_id = 1, .io_or_offset = sent * SOUND_PCM_BUFFER_SIZE,
+                                .len = sent % SOUND_PCM_BUFFER_SIZE
+                              };
+            // The command for this buffer was enqueued, the PCM queue has room as fewer than its size are out
+            CHECK(!sound_enqueue_pcm(&sound_qs.pcm_req, &pcm));
+            sent++;
+            progress = true;
+        }
+
+        sound_pcm_t pcm;
+        while (!sound_dequeue_pcm(&sound_qs.pcm_res, &pcm)) {
+            CHECK(pcm.cookie == (uint32_t)received);
+            CHECK(pcm.io_or_offset == received * SOUND_PCM_BUFFER_SIZE);
+            CHECK(pcm.len == received % SOUND_PCM_BUFFER_SIZE);
+            received++;
+            progress = true;
+        }
+        sound_cmd_t cmd;
+        while (!sound_dequeue_cmd(&sound_qs.cmd_res, &cmd)) {
+            CHECK(cmd.cookie == (uint32_t)(cmds_received * PCM_PER_CMD));
+            CHECK(cmd.status == SOUND_S_OK);
+            cmds_received++;
+            progress = true;
+        }
+
+        if (!progress) {
+            poll_wait();
+        }
+    }
+
+    return NULL;
+}
+
+/* Respond to the next command, if there is one and room for its response */
+static bool sound_driver_cmd(uint64_t *cmds)
+{
+    sound_cmd_t cmd;
+    if (sound_cmd_queue_full(&sound_qs.cmd_res) || sound_dequeue_cmd(&sound_qs.cmd_req, &cmd)) {
+        return false;
+    }
+
+    CHECK(cmd.code == SOUND_CMD_START);
+    CHECK(cmd.cookie == (uint32_t)(*cmds * PCM_PER_CMD));
+    cmd.status = SOUND_S_OK;
+    CHECK(!sound_enqueue_cmd(&sound_qs.cmd_res, &cmd));
+    (*cmds)++;
+
+    return true;
+}
+
+static void *sound_driver(void *arg)
+{
+    uint64_t seq = 0;
+    uint64_t cmds = 0;
+    while (seq < ITERATIONS) {
+        bool progress = false;
+        while (sound_driver_cmd(&cmds)) {
+            progress = true;
+        }
+
+        sound_pcm_t pcm;
+        while (!sound_pcm_queue_full(&sound_qs.pcm_res) && !sound_dequeue_pcm(&sound_qs.pcm_req, &pcm)) {
+            CHECK(pcm.cookie == (uint32_t)seq);
+            CHECK(pcm.io_or_offset == seq * SOUND_PCM_BUFFER_SIZE);
+            CHECK(pcm.len == seq % SOUND_PCM_BUFFER_SIZE);
+            // The command was enqueued before the buffer, so it must be visible once the buffer is
+            if (seq % PCM_PER_CMD == 0) {
+                CHECK(cmds * PCM_PER_CMD > seq || sound_driver_cmd(&cmds));
+                CHECK(cmds * PCM_PER_CMD > seq);
+            }
+            CHECK(!sound_enqueue_pcm(&sound_qs.pcm_res, &pcm));
+            seq++;
+            progress = true;
+        }
+
+        if (!progress) {
+            poll_wait();
+        }
+    }
+
+    return NULL;
+}
+
+static void test_sound(void)
+{
+    sound_cmd_queue_t *cmd_req = calloc(1, sizeof(sound_cmd_queue_t) + SOUND_CMD_QUEUE_SIZE * sizeof(sound_cmd_t));
+    sound_cmd_queue_t *cmd_res = calloc(1, sizeof(sound_cmd_queue_t) + SOUND_CMD_QUEUE_SIZE * sizeof(sound_cmd_t));
+    sound_pcm_queue_t *pcm_req = calloc(1, sizeof(sound_pcm_queue_t) + SOUND_PCM_QUEUE_SIZE * sizeof(sound_pcm_t));
+    sound_pcm_queue_t *pcm_res = calloc(1, sizeof(sound_pcm_queue_t) + SOUND_PCM_QUEUE_SIZE * sizeof(sound_pcm_t));
+    CHECK(cmd_req && cmd_res && pcm_req && pcm_res);
+    sound_queues_init(&sound_qs, cmd_req, cmd_res, pcm_res, pcm_req, SOUND_CMD_QUEUE_SIZE, SOUND_PCM_QUEUE_SIZE);
+    sound_queues_init_buffers(&sound_qs);
+
+    run("sound", sound_client, sound_driver);
+
+    free(cmd_req);
+    free(cmd_res);
+    free(pcm_req);
+    free(pcm_res);
+}
+
+/*
+ * Capture: the virtualiser mirrors records without ever waiting, dropping
+ * them when the ring is full, and the capture component must see the records
+ * that were not dropped in order.
+ */
+
+#define CAPTURE_RING_SIZE 64
+
+static net_capture_handle_t capture_h;
+static notification_t capture_ntfn = NOTIFICATION_INIT;
+static bool capture_done;
+
+static void *capture_virt(void *arg)
+{
+    for (uint64_t seq = 0; seq < ITERATIONS; seq++) {
+        if (!net_capture_mirror(&capture_h, seq % 2, 0, seq, (uint16_t)seq) && net_capture_require_signal(&capture_h)) {
+            net_capture_cancel_signal(&capture_h);
+            notify(&capture_ntfn);
+        }
+    }
+    __atomic_store_n(&capture_done, true, __ATOMIC_RELEASE);
+    notify(&capture_ntfn);
+
+    return NULL;
+}
+
+static void *capture_component(void *arg)
+{
+    uint64_t received = 0;
+    uint64_t last = 0;
+    while (true) {
+        net_capture_record_t record;
+        if (net_capture_dequeue(&capture_h, &record)) {
+            if (__atomic_load_n(&capture_done, __ATOMIC_ACQUIRE) && net_capture_empty(&capture_h)) {
+                break;
+            }
+            net_capture_request_signal(&capture_h);
+            if (!net_capture_empty(&capture_h) || __atomic_load_n(&capture_done, __ATOMIC_ACQUIRE)) {
+                net_capture_cancel_signal(&capture_h);
+                continue;
+            }
+            wait_notification(&capture_ntfn, "capture component");
+            continue;
+        }
+
+        CHECK(received == 0 || record.offset > last);
+        CHECK(record.dir == record.offset % 2);
+        CHECK(record.len == (uint16_t)record.offset);
+        last = record.offset;
+        received++;
+    }
+
+    // The virtualiser is the only writer of the dropped count, and has finished
+    CHECK(received + capture_h.ring->dropped == ITERATIONS);
+
+    return NULL;
+}
+
+static void test_capture(void)
+{
+    net_capture_ring_t *ring = calloc(1, sizeof(net_capture_ring_t) + CAPTURE_RING_SIZE * sizeof(net_capture_record_t));
+    CHECK(ring);
+    ring->enabled = true;
+    net_capture_init(&capture_h, ring, CAPTURE_RING_SIZE);
+
+    run("capture", capture_virt, capture_component);
+
+    free(ring);
+}
+
+int main(void)
+{
+    test_net();
+    test_serial();
+    test_blk();
+    test_i2c();
+    test_sound();
+    test_capture();
+
+    return 0;
+}
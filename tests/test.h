@@ -0,0 +1,20 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Fail the test unless expr holds, whether or not assertions are enabled */
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define TEST_PASS(name) printf("%s: ok\n", name)
@@ -4,118 +4,196 @@
  */
 
 #include <stdint.h>
-#include <sddf/util/bitarray.h>
 #include <sddf/util/fsmalloc.h>
 #include <sddf/util/util.h>
 
 /**
- * Convert a bit position to the address of the corresponding data cell.
+ * Convert a cell index to the address of the corresponding data cell.
  *
- * @param bitpos bit position of the data cell
+ * @param idx index of the data cell
  * @return address of the data cell
  */
-static inline uintptr_t bitpos_to_addr(fsmalloc_t *fsmalloc, uint64_t bitpos)
+static inline uintptr_t idx_to_addr(fsmalloc_t *fsmalloc, uint64_t idx)
 {
-    return fsmalloc->base_addr + (uintptr_t)(bitpos * fsmalloc->cell_size);
+    return fsmalloc->base_addr + (uintptr_t)(idx * fsmalloc->cell_size);
 }
 
 /**
- * Convert an address to the bit position of the corresponding data cell.
+ * Convert an address to the index of the corresponding data cell.
  *
  * @param addr address of the data cell
- * @return bit position of the data cell
+ * @return index of the data cell
  */
-static inline uint64_t addr_to_bitpos(fsmalloc_t *fsmalloc, uintptr_t addr)
+static inline uint64_t addr_to_idx(fsmalloc_t *fsmalloc, uintptr_t addr)
 {
     return (uint64_t)(addr - fsmalloc->base_addr) / fsmalloc->cell_size;
 }
 
 /**
- * Check if count number of cells will overflow the end of the data region.
+ * Get the order of the smallest run that holds count cells.
  *
- * @param count number of cells to check
- * @return true if count number of cells will overflow the end of the data region, false otherwise
+ * @param count number of cells, at least 1
+ * @return log2 of count rounded up
  */
-static inline bool fsmalloc_overflow(fsmalloc_t *fsmalloc, uint64_t count)
+static inline uint32_t count_to_order(uint64_t count)
 {
-    return (fsmalloc->avail_bitpos + count > fsmalloc->num_cells);
+    return count <= 1 ? 0 : 64 - __builtin_clzll(count - 1);
 }
 
-bool fsmalloc_full(fsmalloc_t *fsmalloc, uint64_t count)
+static void push_run(fsmalloc_t *fsmalloc, uint32_t idx, uint32_t order)
 {
-    if (count > fsmalloc->num_cells) {
-        return true;
+    fsmalloc_cell_t *cell = &fsmalloc->cells[idx];
+    cell->order = order;
+    cell->prev = FSMALLOC_NONE;
+    cell->next = fsmalloc->free_lists[order];
+    if (cell->next != FSMALLOC_NONE) {
+        fsmalloc->cells[cell->next].prev = idx;
     }
+    fsmalloc->free_lists[order] = idx;
+    fsmalloc->nonempty |= 1u << order;
+    fsmalloc->free_runs++;
+}
 
-    if (count == 0) {
-        return false;
+static void remove_run(fsmalloc_t *fsmalloc, uint32_t idx)
+{
+    fsmalloc_cell_t *cell = &fsmalloc->cells[idx];
+    uint32_t order = cell->order;
+    if (cell->prev != FSMALLOC_NONE) {
+        fsmalloc->cells[cell->prev].next = cell->next;
+    } else {
+        fsmalloc->free_lists[order] = cell->next;
+        if (cell->next == FSMALLOC_NONE) {
+            fsmalloc->nonempty &= ~(1u << order);
+        }
+    }
+    if (cell->next != FSMALLOC_NONE) {
+        fsmalloc->cells[cell->next].prev = cell->prev;
     }
+    cell->order = FSMALLOC_NONE;
+    fsmalloc->free_runs--;
+}
 
-    unsigned int start_bitpos = fsmalloc->avail_bitpos;
-    if (fsmalloc_overflow(fsmalloc, count)) {
-        start_bitpos = 0;
+/**
+ * Free a run of cells aligned to its size, merging it with its buddy for as
+ * long as the buddy is free.
+ */
+static void free_run(fsmalloc_t *fsmalloc, uint32_t idx, uint32_t order)
+{
+    while (order + 1 < FSMALLOC_NUM_ORDERS) {
+        uint32_t buddy = idx ^ (1u << order);
+        if (buddy + (1ull << order) > fsmalloc->num_cells || fsmalloc->cells[buddy].order != order) {
+            break;
+        }
+        remove_run(fsmalloc, buddy);
+        idx = MIN(idx, buddy);
+        order++;
     }
+    push_run(fsmalloc, idx, order);
+}
 
-    // Create a bit mask with count many 1's
-    bitarray_t bitarr_mask;
-    word_t words[roundup_bits2words64(count)];
-    bitarray_init(&bitarr_mask, words, roundup_bits2words64(count));
-    bitarray_set_region(&bitarr_mask, 0, count);
+/**
+ * Free a range of cells, split into the largest runs aligned to their size.
+ */
+static void free_range(fsmalloc_t *fsmalloc, uint64_t idx, uint64_t count)
+{
+    while (count != 0) {
+        uint32_t order = idx == 0 ? FSMALLOC_NUM_ORDERS - 1 : MIN(__builtin_ctzll(idx), FSMALLOC_NUM_ORDERS - 1);
+        while ((1ull << order) > count) {
+            order--;
+        }
+        free_run(fsmalloc, idx, order);
+        idx += 1ull << order;
+        count -= 1ull << order;
+    }
+}
 
-    if (bitarray_cmp_region(fsmalloc->avail_bitarr, start_bitpos, &bitarr_mask, 0, count)) {
+bool fsmalloc_full(fsmalloc_t *fsmalloc, uint64_t count)
+{
+    if (count == 0) {
         return false;
     }
 
-    return true;
+    uint32_t order = count_to_order(count);
+    if (order >= FSMALLOC_NUM_ORDERS) {
+        return true;
+    }
+
+    return (fsmalloc->nonempty >> order) == 0;
 }
 
 void fsmalloc_free(fsmalloc_t *fsmalloc, uintptr_t addr, uint64_t count)
 {
-    unsigned int start_bitpos = addr_to_bitpos(fsmalloc, addr);
+    uint64_t idx = addr_to_idx(fsmalloc, addr);
 
     // Assert here in case we try to free cells that overflow the data region
-    assert(start_bitpos + count <= fsmalloc->num_cells);
+    assert(idx + count <= fsmalloc->num_cells);
 
-    // Set the next count many bits as available
-    bitarray_set_region(fsmalloc->avail_bitarr, start_bitpos, count);
+    free_range(fsmalloc, idx, count);
+    fsmalloc->free_cells += count;
 }
 
 int fsmalloc_alloc(fsmalloc_t *fsmalloc, uintptr_t *addr, uint64_t count)
 {
+    if (count == 0) {
+        *addr = fsmalloc->base_addr;
+        return 0;
+    }
+
     if (fsmalloc_full(fsmalloc, count)) {
+        if (count <= fsmalloc->free_cells) {
+            fsmalloc->failed_allocs++;
+        }
         return -1;
     }
 
-    if (fsmalloc_overflow(fsmalloc, count)) {
-        fsmalloc->avail_bitpos = 0;
+    // Take the smallest free run that fits, splitting off and freeing its upper halves
+    uint32_t order = count_to_order(count);
+    uint32_t run_order = __builtin_ctz(fsmalloc->nonempty >> order) + order;
+    uint32_t idx = fsmalloc->free_lists[run_order];
+    remove_run(fsmalloc, idx);
+    while (run_order > order) {
+        run_order--;
+        push_run(fsmalloc, idx + (1u << run_order), run_order);
     }
 
-    *addr = bitpos_to_addr(fsmalloc, fsmalloc->avail_bitpos);
+    // Return the cells of the run beyond count
+    free_range(fsmalloc, idx + count, (1ull << order) - count);
 
-    // Set the next count many bits as unavailable
-    bitarray_clear_region(fsmalloc->avail_bitarr, fsmalloc->avail_bitpos, count);
-
-    // Update the bitpos
-    uint64_t new_bitpos = fsmalloc->avail_bitpos + count;
-    if (new_bitpos == fsmalloc->num_cells) {
-        new_bitpos = 0;
-    }
-    fsmalloc->avail_bitpos = new_bitpos;
+    fsmalloc->free_cells -= count;
+    *addr = idx_to_addr(fsmalloc, idx);
 
     return 0;
 }
 
+void fsmalloc_stats(fsmalloc_t *fsmalloc, fsmalloc_stats_t *stats)
+{
+    stats->free_cells = fsmalloc->free_cells;
+    stats->free_runs = fsmalloc->free_runs;
+    stats->largest_alloc = fsmalloc->nonempty == 0 ? 0 : 1ull << (31 - __builtin_clz(fsmalloc->nonempty));
+    stats->failed_allocs = fsmalloc->failed_allocs;
+}
+
 void fsmalloc_init(fsmalloc_t *fsmalloc, uintptr_t base_addr, uint64_t cell_size, uint64_t num_cells,
-                   bitarray_t *bitarr, word_t *words, word_index_t num_words)
+                   fsmalloc_cell_t *cells)
 {
-    bitarray_init(bitarr, words, num_words);
+    assert(num_cells < FSMALLOC_NONE);
 
-    fsmalloc->avail_bitpos = 0;
-    fsmalloc->avail_bitarr = bitarr;
+    fsmalloc->cells = cells;
+    fsmalloc->nonempty = 0;
     fsmalloc->base_addr = base_addr;
     fsmalloc->cell_size = cell_size;
     fsmalloc->num_cells = num_cells;
+    fsmalloc->free_cells = num_cells;
+    fsmalloc->free_runs = 0;
+    fsmalloc->failed_allocs = 0;
 
-    /* Set all available bits to 1 to indicate all cells are available */
-    bitarray_set_region(bitarr, 0, num_cells);
-}
\ No newline at end of file
+    for (uint32_t i = 0; i < FSMALLOC_NUM_ORDERS; i++) {
+        fsmalloc->free_lists[i] = FSMALLOC_NONE;
+    }
+    for (uint64_t i = 0; i < num_cells; i++) {
+        cells[i].order = FSMALLOC_NONE;
+    }
+
+    /* Make all cells available, in the largest runs that fit */
+    free_range(fsmalloc, 0, num_cells);
+}